@@ -1,28 +1,415 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <modbus/modbus.h>
+#include "rtu-line.h"
 #ifndef WIN32
 #include <unistd.h>
-#include <errno.h>
-#define Sleep(x) usleep(x*1000)
+#include <time.h>
+#else
+#include <windows.h>
+#endif
+
+// Simulate logger behaviour querying multiple slaves on a cyclic basis. By default it
+// does what the logger does (4 reads from each of slaves 1-10 in turn, 200ms apart with
+// 6s between slaves) but it can also be used as a general Modbus RTU load generator,
+// to see how the broadcast app, the emulator etc. cope with far more traffic than the
+// real logger produces. Settings are given as key=value after the device:
+//
+//   rate=5              requests per second (0 = as fast as the bus allows)
+//   pacing=closed       closed: wait 1/rate after each response before the next request
+//                       open: send at fixed intervals regardless of how long each takes
+//   burst=4             requests in each burst...
+//   burst_gap=6000      ...followed by this many ms of silence
+//   slaves=1-10         slaves to send to, with an optional weight (eg. 1:8,2-10)
+//   functions=4         functions 3, 4, 6 or 16 with an optional weight (eg. 4:9,3)
+//   addresses=35000,36000,2999,33000   registers to use, with an optional weight
+//   count=1             registers per request
+//   write_value=0       what's written by function 6 & 16 (careful on a real inverter)
+//   pick=sequential     sequential: a burst to each slave in turn, cycling through the
+//                       functions & addresses. random: each picked by weight
+//   timeout=5000        response timeout in ms
+//   duration=0          stop after this many seconds (0 = carry on)
+//   requests=0          stop after this many requests (0 = carry on)
+//   report=10           seconds between progress reports
+//   debug=0             libmodbus debug output
+//   serial=9600,8N1     line settings, <baud>[,<data bits><parity><stop bits>]
+//
+// On exit (or Ctrl-C) it reports the latency histogram & timeouts, overall and per slave
+
+#define MAX_ENTRIES 64
+#define HISTOGRAM_MS 10000    // latencies held to the ms up to this, anything longer in the last
+
+typedef struct {
+  uint32_t Value;
+  uint32_t Weight;
+} WeightedEntry_t;
+
+typedef struct {
+  WeightedEntry_t Entries[MAX_ENTRIES];
+  uint32_t Count;
+  uint32_t TotalWeight;
+  uint32_t Next;              // for picking them in turn
+} WeightedList_t;
+
+typedef struct {
+  uint64_t Requests;
+  uint64_t Ok;
+  uint64_t Exceptions;
+  uint64_t TimedOut;
+  uint64_t Errors;            // anything else, bad CRC etc.
+  uint64_t TotalLatency;      // us, of those answered (including exceptions)
+  uint32_t MaxLatency;        // us
+} Counters_t;
+
+typedef struct {
+  RtuLine_t Line;
+  double Rate;
+  bool OpenLoop;
+  bool Random;
+  uint32_t Burst;
+  uint32_t BurstGap;          // ms
+  WeightedList_t Slaves;
+  WeightedList_t Functions;
+  WeightedList_t Addresses;
+  uint32_t Count;
+  uint16_t WriteValue;
+  uint32_t Timeout;           // ms
+  uint32_t Duration;          // s
+  uint64_t MaxRequests;
+  uint32_t ReportInterval;    // s
+  bool Debug;
+} Load_t;
+
+static volatile sig_atomic_t Stop = 0;
+static Counters_t Totals;
+static Counters_t SlaveCounters[256];
+static uint32_t Histogram[HISTOGRAM_MS + 1];
+static uint64_t Behind = 0u;  // open loop requests sent late as the bus couldn't keep up
+static uint64_t MaxLag = 0u;  // us
+
+static void StopHandler(int Signal)
+{
+  Stop = 1;
+}
+
+static uint64_t NowUs(void)
+{
+#ifndef WIN32
+  struct timespec Now;
+
+  clock_gettime(CLOCK_MONOTONIC, &Now);
+  return (uint64_t)Now.tv_sec * 1000000u + Now.tv_nsec / 1000u;
+#else
+  LARGE_INTEGER Count, Frequency;
+
+  QueryPerformanceCounter(&Count);
+  QueryPerformanceFrequency(&Frequency);
+  return (uint64_t)(Count.QuadPart / (double)Frequency.QuadPart * 1e6);
 #endif
+}
+
+static void SleepUs(uint64_t Us)
+{
+#ifndef WIN32
+  while (Us && !Stop)
+  {
+    uint64_t Chunk = Us > 100000u ? 100000u : Us;
+
+    usleep((useconds_t)Chunk);
+    Us -= Chunk;
+  }
+#else
+  Sleep((DWORD)(Us / 1000u));
+#endif
+}
+
+// fetch a key=value setting from the command line
+static const char *GetSetting(int argc, char *argv[], const char *Key, const char *Default)
+{
+  size_t Len = strlen(Key);
+
+  for (int i = 2; i < argc; i++)
+  {
+    if (!strncmp(argv[i], Key, Len) && argv[i][Len] == '=')
+      return argv[i] + Len + 1;
+  }
+  return Default;
+}
+
+// a comma separated list of values or ranges (first-last), each with an optional :weight
+static bool ParseWeightedList(const char *Text, WeightedList_t *List)
+{
+  char *End;
+
+  memset(List, 0, sizeof(*List));
+  while (*Text)
+  {
+    uint32_t First = strtoul(Text, &End, 0);
+    uint32_t Last = First;
+    uint32_t Weight = 1u;
+
+    if (End == Text)
+      return false;
+    if (*End == '-')
+      Last = strtoul(End + 1, &End, 0);
+    if (*End == ':')
+      Weight = strtoul(End + 1, &End, 0);
+    if ((*End && *End != ',') || Last < First || !Weight)
+      return false;
+    for (uint32_t Value = First; Value <= Last; Value++)
+    {
+      if (List->Count == MAX_ENTRIES)
+        return false;
+      List->Entries[List->Count].Value = Value;
+      List->Entries[List->Count].Weight = Weight;
+      List->Count++;
+      List->TotalWeight += Weight;
+    }
+    Text = *End ? End + 1 : End;
+  }
+  return List->Count > 0u;
+}
+
+static uint32_t Pick(WeightedList_t *List, bool Random)
+{
+  uint32_t Value;
+
+  if (Random)
+  {
+    uint32_t Choice = (uint32_t)rand() % List->TotalWeight;
+    uint32_t i;
+
+    for (i = 0; Choice >= List->Entries[i].Weight; i++)
+      Choice -= List->Entries[i].Weight;
+    return List->Entries[i].Value;
+  }
+  Value = List->Entries[List->Next].Value;
+  List->Next = (List->Next + 1u) % List->Count;
+  return Value;
+}
+
+static bool LoadSettings(int argc, char *argv[], Load_t *Load)
+{
+  const char *Pacing = GetSetting(argc, argv, "pacing", "closed");
+  const char *Order = GetSetting(argc, argv, "pick", "sequential");
+
+  Load->Rate = strtod(GetSetting(argc, argv, "rate", "5"), NULL);
+  Load->OpenLoop = !strcmp(Pacing, "open");
+  Load->Random = !strcmp(Order, "random");
+  Load->Burst = strtoul(GetSetting(argc, argv, "burst", "4"), NULL, 0);
+  Load->BurstGap = strtoul(GetSetting(argc, argv, "burst_gap", "6000"), NULL, 0);
+  Load->Count = strtoul(GetSetting(argc, argv, "count", "1"), NULL, 0);
+  Load->WriteValue = (uint16_t)strtoul(GetSetting(argc, argv, "write_value", "0"), NULL, 0);
+  Load->Timeout = strtoul(GetSetting(argc, argv, "timeout", "5000"), NULL, 0);
+  Load->Duration = strtoul(GetSetting(argc, argv, "duration", "0"), NULL, 0);
+  Load->MaxRequests = strtoull(GetSetting(argc, argv, "requests", "0"), NULL, 0);
+  Load->ReportInterval = strtoul(GetSetting(argc, argv, "report", "10"), NULL, 0);
+  Load->Debug = strtoul(GetSetting(argc, argv, "debug", "0"), NULL, 0) ? true : false;
+
+  if (!RtuLineParse(GetSetting(argc, argv, "serial", RTU_LINE_DEFAULT), &Load->Line))
+  {
+    printf("serial should be <baud>[,<data bits><parity><stop bits>], eg. 9600,8N1\n");
+    return false;
+  }
+
+  if ((strcmp(Pacing, "open") && strcmp(Pacing, "closed")) || (strcmp(Order, "random") && strcmp(Order, "sequential")))
+  {
+    printf("pacing should be open or closed, pick should be sequential or random\n");
+    return false;
+  }
+  if (!ParseWeightedList(GetSetting(argc, argv, "slaves", "1-10"), &Load->Slaves) ||
+      !ParseWeightedList(GetSetting(argc, argv, "functions", "4"), &Load->Functions) ||
+      !ParseWeightedList(GetSetting(argc, argv, "addresses", "35000,36000,2999,33000"), &Load->Addresses))
+  {
+    printf("slaves, functions and addresses should be lists of value[-last][:weight]\n");
+    return false;
+  }
+  for (uint32_t i = 0; i < Load->Functions.Count; i++)
+  {
+    uint32_t Function = Load->Functions.Entries[i].Value;
+
+    if (Function != 3u && Function != 4u && Function != 6u && Function != 16u)
+    {
+      printf("Unsupported function %u, only 3, 4, 6 and 16 can be generated\n", Function);
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < Load->Slaves.Count; i++)
+  {
+    if (Load->Slaves.Entries[i].Value < 1u || Load->Slaves.Entries[i].Value > 247u)
+    {
+      printf("Slaves should be between 1 and 247\n");
+      return false;
+    }
+  }
+  if (Load->Count < 1u || Load->Count > 123u)
+  {
+    printf("count should be between 1 and 123\n");
+    return false;
+  }
+  if (!Load->Burst)
+    Load->Burst = 1u;
+  return true;
+}
+
+// a Modbus exception still means the slave answered
+static bool Answered(int Error)
+{
+  return !Error || (Error >= EMBXILFUN && Error <= EMBXGTAR);
+}
+
+// issue a single request, returning 0 or the error if it failed & how long it took in us
+static int Transact(modbus_t *Ctx, const Load_t *Load, uint32_t Function, uint32_t Address, uint64_t *Latency)
+{
+  uint16_t Values[MODBUS_MAX_READ_REGISTERS];
+  uint64_t Start = NowUs();
+  int Rc = -1;
+
+  switch (Function)
+  {
+    case 3:
+      Rc = modbus_read_registers(Ctx, Address, Load->Count, Values);
+      break;
+
+    case 4:
+      Rc = modbus_read_input_registers(Ctx, Address, Load->Count, Values);
+      break;
+
+    case 6:
+      Rc = modbus_write_register(Ctx, Address, Load->WriteValue);
+      break;
+
+    case 16:
+      for (uint32_t i = 0; i < Load->Count; i++)
+        Values[i] = Load->WriteValue;
+      Rc = modbus_write_registers(Ctx, Address, Load->Count, Values);
+      break;
+  }
+  *Latency = NowUs() - Start;
+  return (Rc < 0) ? errno : 0;
+}
+
+static void Record(uint8_t Slave, uint64_t Latency, int Error)
+{
+  Counters_t *Counters[] = { &Totals, &SlaveCounters[Slave] };
+  uint64_t Ms = Latency / 1000u;
+
+  if (Answered(Error))
+    Histogram[Ms < HISTOGRAM_MS ? Ms : HISTOGRAM_MS]++;
+
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    Counters[i]->Requests++;
+    if (Answered(Error))
+    {
+      if (Error)
+        Counters[i]->Exceptions++;
+      else
+        Counters[i]->Ok++;
+      Counters[i]->TotalLatency += Latency;
+      if (Latency > Counters[i]->MaxLatency)
+        Counters[i]->MaxLatency = (uint32_t)Latency;
+    }
+    else if (Error == ETIMEDOUT)
+      Counters[i]->TimedOut++;
+    else
+      Counters[i]->Errors++;
+  }
+}
+
+// the latency (in ms) 'Fraction' of the way through those answered
+static uint32_t Percentile(double Fraction)
+{
+  uint64_t Total = 0u, Target, Count = 0u;
+
+  for (uint32_t i = 0; i <= HISTOGRAM_MS; i++)
+    Total += Histogram[i];
+  if (!Total)
+    return 0u;
+  Target = (uint64_t)(Fraction * Total + 0.5);
+  if (!Target)
+    Target = 1u;
+  for (uint32_t i = 0; i <= HISTOGRAM_MS; i++)
+  {
+    Count += Histogram[i];
+    if (Count >= Target)
+      return i;
+  }
+  return HISTOGRAM_MS;
+}
+
+static void Report(uint64_t Elapsed)
+{
+  double Seconds = Elapsed / 1e6;
+
+  printf("%.0fs: %llu requests (%.1f/s), %llu ok, %llu exceptions, %llu timed out, %llu errors, "
+         "latency p50 %ums p90 %ums p99 %ums max %ums, %llu behind schedule\n",
+         Seconds, (unsigned long long)Totals.Requests, Seconds > 0.0 ? Totals.Requests / Seconds : 0.0,
+         (unsigned long long)Totals.Ok, (unsigned long long)Totals.Exceptions,
+         (unsigned long long)Totals.TimedOut, (unsigned long long)Totals.Errors,
+         Percentile(0.5), Percentile(0.9), Percentile(0.99), Totals.MaxLatency / 1000u,
+         (unsigned long long)Behind);
+}
 
-// Simulate logger behaviour querying multiple slaves on a cyclic basis
+static void FinalReport(uint64_t Elapsed)
+{
+  static const uint32_t Buckets[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, HISTOGRAM_MS };
+  uint32_t From = 0u;
+
+  printf("\n");
+  Report(Elapsed);
+  if (Behind)
+    printf("Up to %llums behind schedule\n", (unsigned long long)(MaxLag / 1000u));
 
-static void TransactSlave(modbus_t *Ctx);
+  printf("\nLatency (ms)   Responses\n");
+  for (uint32_t b = 0; b < sizeof(Buckets) / sizeof(Buckets[0]); b++)
+  {
+    uint64_t Count = 0u;
+
+    for (uint32_t i = From; i < Buckets[b]; i++)
+      Count += Histogram[i];
+    printf("%5u - %5u   %llu (%.1f%%)\n", From, Buckets[b] - 1u, (unsigned long long)Count,
+           (Totals.Ok + Totals.Exceptions) ? Count * 100.0 / (Totals.Ok + Totals.Exceptions) : 0.0);
+    From = Buckets[b];
+  }
+  printf("%5u+          %llu\n", HISTOGRAM_MS, (unsigned long long)Histogram[HISTOGRAM_MS]);
+
+  printf("\nSlave   Requests         Ok  Exceptions  Timed out    Errors  Mean (ms)  Max (ms)\n");
+  for (uint32_t Slave = 0; Slave < 256; Slave++)
+  {
+    const Counters_t *Counters = &SlaveCounters[Slave];
+
+    if (!Counters->Requests)
+      continue;
+    printf("%5u %10llu %10llu  %10llu %10llu %9llu  %9.1f %9u\n", Slave, (unsigned long long)Counters->Requests,
+           (unsigned long long)Counters->Ok, (unsigned long long)Counters->Exceptions,
+           (unsigned long long)Counters->TimedOut, (unsigned long long)Counters->Errors,
+           (Counters->Ok + Counters->Exceptions) ? Counters->TotalLatency / 1000.0 / (Counters->Ok + Counters->Exceptions) : 0.0,
+           Counters->MaxLatency / 1000u);
+  }
+}
 
 int main(int argc, char *argv[])
 {
-  const uint32_t MaxSlaves = 10;
-  const uint32_t InterSlaveDelay = 6000;  // 6s between each slave requests
+  Load_t Load;
+  uint64_t Start, Next, LastReport, Interval;
+  uint32_t InBurst = 0u;
+  uint8_t Slave = 0u;
 
   if (argc < 2)
   {
-    printf("Usage: logger-multislave <device>\n");
+    printf("Usage: logger-multislave <device> [setting=value...]\n");
     return -1;
   }
+  if (!LoadSettings(argc, argv, &Load))
+    return -1;
 
-  modbus_t *Ctx = modbus_new_rtu(argv[1], 9600, 'N', 8, 1);
+  modbus_t *Ctx = modbus_new_rtu(argv[1], Load.Line.Baud, Load.Line.Parity, Load.Line.DataBits, Load.Line.StopBits);
 
   if (!Ctx)
   {
@@ -37,52 +424,80 @@ int main(int argc, char *argv[])
     return -1;
   }
 
-  modbus_set_response_timeout(Ctx, 5, 0);
-  modbus_set_debug(Ctx, 1);
+  modbus_set_response_timeout(Ctx, Load.Timeout / 1000u, (Load.Timeout % 1000u) * 1000u);
+  modbus_set_debug(Ctx, Load.Debug ? 1 : 0);
+
+  signal(SIGINT, StopHandler);
+  signal(SIGTERM, StopHandler);
 
-  while (1)
+  printf("%s loop at %.1f requests/s, bursts of %u with %ums between, %u slaves, %u functions, %u addresses, %s\n",
+         Load.OpenLoop ? "Open" : "Closed", Load.Rate, Load.Burst, Load.BurstGap, Load.Slaves.Count,
+         Load.Functions.Count, Load.Addresses.Count, Load.Random ? "picked at random" : "in turn");
+
+  Interval = Load.Rate > 0.0 ? (uint64_t)(1e6 / Load.Rate) : 0u;
+  Start = Next = LastReport = NowUs();
+  while (!Stop)
   {
-    for (uint32_t Slave = 1; Slave <= MaxSlaves; Slave++)
+    uint64_t Now = NowUs();
+    uint32_t Function, Address;
+    uint64_t Latency;
+    int Error;
+
+    if ((Load.Duration && Now - Start >= Load.Duration * 1000000ull) ||
+        (Load.MaxRequests && Totals.Requests >= Load.MaxRequests))
+      break;
+
+    // open loop, requests go out when they're due no matter how long the last one
+    // took. If the bus can't keep up, they go straight out & the lag is recorded
+    if (Load.OpenLoop)
     {
-      if (modbus_set_slave(Ctx, Slave) == -1)
-      {
-        printf("Error setting slave %u: %s\n", Slave, modbus_strerror(errno));
-      }
-      else
+      if (Now < Next)
+        SleepUs(Next - Now);
+      else if (Now - Next > 1000u)
       {
-        printf("\nTransact Slave %u\n", Slave);
-        TransactSlave(Ctx);
+        Behind++;
+        if (Now - Next > MaxLag)
+          MaxLag = Now - Next;
       }
-      Sleep(InterSlaveDelay);
+      if (Stop)
+        break;
     }
-  }
 
-  modbus_close(Ctx);
-  modbus_free(Ctx);
+    // in turn, each burst goes to the next slave as the logger does
+    if (Load.Random)
+      Slave = (uint8_t)Pick(&Load.Slaves, true);
+    else if (!InBurst)
+      Slave = (uint8_t)Pick(&Load.Slaves, false);
+    Function = Pick(&Load.Functions, Load.Random);
+    Address = Pick(&Load.Addresses, Load.Random);
 
-  return 0;
-}
+    modbus_set_slave(Ctx, Slave);
+    Error = Transact(Ctx, &Load, Function, Address, &Latency);
+    // interrupted rather than failed
+    if (Stop)
+      break;
+    Record(Slave, Latency, Error);
+    if (Error && Load.Debug)
+      printf("Slave %u function %u address %u: %s\n", Slave, Function, Address, modbus_strerror(Error));
 
-static void TransactSlave(modbus_t *Ctx)
-{
-  int Rc;
-  const int RegCount = 4;
-  int Registers[] = { 35000, 36000, 2999, 33000 } ;
-  uint16_t RegValue;
+    InBurst = (InBurst + 1u) % Load.Burst;
+    if (Load.OpenLoop)
+      Next += Interval + (InBurst ? 0u : Load.BurstGap * 1000ull);
+    else
+      SleepUs(Interval + (InBurst ? 0u : Load.BurstGap * 1000ull));
 
-  for (int i = 0; i < RegCount; i++)
-  {
-    printf("Read register %d\n", Registers[i]);
-    Rc = modbus_read_input_registers(Ctx, Registers[i], sizeof(uint16_t), &RegValue);
-    if (Rc == sizeof(uint16_t))
+    Now = NowUs();
+    if (Load.ReportInterval && Now - LastReport >= Load.ReportInterval * 1000000ull)
     {
-      printf("Reg Value: %hx\n", RegValue);
+      Report(Now - Start);
+      LastReport = Now;
     }
-    else
-      printf("modbus_read_input_registers: %s\n", modbus_strerror(errno));
-
-    // allow time for the transceivers to switch before sending next request
-    Sleep(200) ;
   }
-}
 
+  FinalReport(NowUs() - Start);
+
+  modbus_close(Ctx);
+  modbus_free(Ctx);
+
+  return 0;
+}
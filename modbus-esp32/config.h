@@ -10,9 +10,18 @@
 #define RXD2 16
 #define TXD2 17
 
+// modbus serial line, <baud>[,<data bits><parity><stop bits>]
+#define MODBUS_SERIAL "9600,8N1"
+
 // transmit/receive enable pin
 #define RS485_DIR 4
 
+// read back what's sent & send it again (up to ECHO_RETRIES times) if it collided
+// with the logger. Needs the receiver left enabled whilst transmitting, ie. RE tied
+// low rather than to RS485_DIR
+#define ECHO_CHECK 0
+#define ECHO_RETRIES 2
+
 // modbus slave ID
 #define MODBUS_SLAVE_ID 1
 
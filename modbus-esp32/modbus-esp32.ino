@@ -8,7 +8,8 @@
 #include <lwip/sockets.h>
 #include <lwip/sys.h>
 #include <lwip/netdb.h>
-#include <CRC16.h>
+#include "modbus-rtu.h"
+#include "rtu-line.h"
 
 // Module: ESP32-WROOM-DA Module
 
@@ -38,13 +39,135 @@ static ModbusMaster ModbusInst;
 // UDP broadcast stuff
 static int sFd = -1 ;
 static struct sockaddr_in BroadcastAddr ; 
+// the modbus serial line, from MODBUS_SERIAL
+static RtuLine_t Line ;
+
+// what's been read back, see ECHO_CHECK
+typedef struct {
+  uint32_t Checks ;
+  uint32_t Collisions ;  // came back different
+  uint32_t Missing ;     // didn't come back at all
+  uint32_t Retries ;
+} EchoStats_t ;
+static EchoStats_t EchoStats ;
+// the request ModbusMaster is sending, for ModbusPostTransmit to check the echo against
+static uint8_t EchoFrame[8] ;
+static uint32_t EchoLen = 0u ;
+static bool EchoCollided = false ;
+
+// the time taken by 'Chars' characters on the line in ms, rounded up. The delays here
+// were worked out at 9600 baud so are given in characters, to scale with the line speed
+static uint32_t LineDelay(uint32_t Chars)
+{
+  return (RtuLineChars(&Line, Chars) + 999u) / 1000u ;
+}
+
+// the Serial2 config matching the line settings
+static uint32_t LineConfig(const RtuLine_t *Line)
+{
+  static const uint32_t Configs[4][3][2] = {
+    { { SERIAL_5N1, SERIAL_5N2 }, { SERIAL_5E1, SERIAL_5E2 }, { SERIAL_5O1, SERIAL_5O2 } },
+    { { SERIAL_6N1, SERIAL_6N2 }, { SERIAL_6E1, SERIAL_6E2 }, { SERIAL_6O1, SERIAL_6O2 } },
+    { { SERIAL_7N1, SERIAL_7N2 }, { SERIAL_7E1, SERIAL_7E2 }, { SERIAL_7O1, SERIAL_7O2 } },
+    { { SERIAL_8N1, SERIAL_8N2 }, { SERIAL_8E1, SERIAL_8E2 }, { SERIAL_8O1, SERIAL_8O2 } }
+  } ;
+  uint32_t Parity = Line->Parity == 'E' ? 1u : (Line->Parity == 'O' ? 2u : 0u) ;
+
+  return Configs[Line->DataBits - 5u][Parity][Line->StopBits - 1u] ;
+}
+
+// read back the 'Len' bytes just sent. Returns false if they came back different, in
+// which case they collided with something. Nothing coming back at all is just counted,
+// that's the receiver being disabled whilst transmitting
+static bool CheckEcho(const uint8_t *Sent, uint32_t Len)
+{
+  uint8_t Echo[8] ;
+  uint32_t Got = 0u ;
+  const unsigned long TimeOut = LineDelay(4u) + 2u ;
+  unsigned long Start = millis() ;
+
+  if (Len > sizeof(Echo))
+    Len = sizeof(Echo) ;
+  while (Got < Len && millis() - Start <= TimeOut)
+  {
+    if (Serial2.available())
+      Echo[Got++] = Serial2.read() ;
+  }
+
+  EchoStats.Checks++ ;
+  if (!Got)
+  {
+    EchoStats.Missing++ ;
+    return true ;
+  }
+  if (Got < Len || memcmp(Echo, Sent, Len))
+  {
+    EchoStats.Collisions++ ;
+    return false ;
+  }
+  return true ;
+}
+
+// wait for whoever we collided with to finish, then a random bit more so we don't
+// both go again at the same time
+static void CollisionBackoff(void)
+{
+  unsigned long Quiet = millis() ;
+
+  while (millis() - Quiet < LineDelay(4u))
+  {
+    if (Serial2.available())
+    {
+      Serial2.read() ;
+      Quiet = millis() ;
+    }
+  }
+  delay(random(LineDelay(40u) + 1u)) ;
+}
+
+// is the line quiet right now? Anything heard is left to be read
+static bool LineIdle(void)
+{
+  unsigned long Start = millis() ;
+
+  while (millis() - Start < LineDelay(4u))
+  {
+    if (Serial2.available())
+      return false ;
+  }
+  return true ;
+}
+
+// read input registers from the inverter, with ECHO_CHECK sending the request again
+// should it collide with the logger
+static uint8_t ReadInputRegisters(uint16_t Address, uint16_t Count)
+{
+  uint8_t Rc ;
+
+#if ECHO_CHECK
+  EchoLen = RtuReadRequest(EchoFrame, MODBUS_SLAVE_ID, MODBUS_RTU_READ_INPUT, Address, Count) ;
+  for (uint32_t Attempt = 0u; ; Attempt++)
+  {
+    EchoCollided = false ;
+    Rc = ModbusInst.readInputRegisters(Address, Count) ;
+    if (Rc == ModbusInst.ku8MBSuccess || !EchoCollided || Attempt >= ECHO_RETRIES)
+      break ;
+    EchoStats.Retries++ ;
+    CollisionBackoff() ;
+  }
+  EchoLen = 0u ;
+#else
+  Rc = ModbusInst.readInputRegisters(Address, Count) ;
+#endif
+  return Rc ;
+}
 
 // read the required registers from modbus
 static bool ModBusReadSolisRegisters( ModbusSolisRegister_t *ModbusSolisRegisters,unsigned long &Elapsed)
 {
   uint8_t Rc ;
   bool Ret = true ;
-  const uint32_t TransactDelay = 80u ; // delay between each register request
+  const uint32_t TransactDelay = LineDelay(80u) ; // delay between each register request, 80ms at 9600
   unsigned long StartTransact = millis() ;
 
   memset(ModbusSolisRegisters,0,sizeof(ModbusSolisRegister_t)) ;
@@ -56,7 +179,7 @@ static bool ModBusReadSolisRegisters( ModbusSolisRegister_t *ModbusSolisRegister
   // 33139: Battery capacity SOC
   // 33147: House load power
   // 33149:33150: Battery power
-  Rc = ModbusInst.readInputRegisters(33135,16) ;
+  Rc = ReadInputRegisters(33135,16) ;
   if ( Rc == ModbusInst.ku8MBSuccess)
   {
     ModbusSolisRegisters->batteryCapacitySoc = ModbusInst.getResponseBuffer(4) ; // 33139
@@ -82,7 +205,7 @@ static bool ModBusReadSolisRegisters( ModbusSolisRegister_t *ModbusSolisRegister
   if ( Ret )
   {
     // 33057:33058: Current Generation
-    Rc = ModbusInst.readInputRegisters(33057,2) ;
+    Rc = ReadInputRegisters(33057,2) ;
     if ( Rc == ModbusInst.ku8MBSuccess)
     {
       uint32_t Generation = (ModbusInst.getResponseBuffer(0) << 16) + ModbusInst.getResponseBuffer(1);   // expressed in watts
@@ -100,7 +223,7 @@ static bool ModBusReadSolisRegisters( ModbusSolisRegister_t *ModbusSolisRegister
   if ( Ret )
   {
     // 33263:33264: Meter total active power
-    Rc = ModbusInst.readInputRegisters(33263,2) ;
+    Rc = ReadInputRegisters(33263,2) ;
     if ( Rc == ModbusInst.ku8MBSuccess)
     {
       int32_t ActivePower = (ModbusInst.getResponseBuffer(0) << 16) + ModbusInst.getResponseBuffer(1) ;
@@ -121,7 +244,7 @@ static bool ModBusReadSolisRegisters( ModbusSolisRegister_t *ModbusSolisRegister
 
     // 33029-33030: Inverter total power generation
     // 33035:       Intverter power generation today
-    Rc = ModbusInst.readInputRegisters(33029, NoRegisters);
+    Rc = ReadInputRegisters(33029, NoRegisters);
     if (Rc == ModbusInst.ku8MBSuccess)
     {
       // expressed in kWh
@@ -146,7 +269,7 @@ static bool ModBusReadSolisRegisters( ModbusSolisRegister_t *ModbusSolisRegister
     // 33165:33166 - Battery discharge total
     // 33169:33170 - Grid power imported total
     // 33173:33174 - Power exported from grid total
-    Rc = ModbusInst.readInputRegisters(33161, NoRegisters);
+    Rc = ReadInputRegisters(33161, NoRegisters);
     if (Rc == ModbusInst.ku8MBSuccess)
     {
       // expressed in 1kWh intervals
@@ -297,6 +420,24 @@ static char *GenerateJson(const ModbusSolisRegister_t *ModbusSolisRegisters, uin
   if (Node)
     cJSON_AddItemToObject(SolarJson, "loggerFail", Node);
 
+#if ECHO_CHECK
+  // likewise, how often we've collided with the logger
+  cJSON *Collisions = cJSON_CreateObject();
+  if (Collisions)
+  {
+    const char *Names[] = { "retries", "echoChecks", "echoCollisions", "echoMissing" };
+    const uint32_t Counts[] = { EchoStats.Retries, EchoStats.Checks, EchoStats.Collisions, EchoStats.Missing };
+
+    for (size_t i = 0; i < sizeof(Counts) / sizeof(Counts[0]); i++)
+    {
+      Node = cJSON_CreateNumber(Counts[i]);
+      if (Node)
+        cJSON_AddItemToObject(Collisions, Names[i], Node);
+    }
+    cJSON_AddItemToObject(SolarJson, "collisions", Collisions);
+  }
+#endif
+
   // generate return string
   Ret = cJSON_Print(SolarJson);
   cJSON_Delete(SolarJson);
@@ -315,6 +456,11 @@ static void GetNtpTime(void)
 // modbus callbacks invoked before and after transmission
 static void ModbusPreTransmit(void)
 {
+#if ECHO_CHECK
+  // anything already waiting isn't ours, so mustn't be mistaken for the echo
+  while (Serial2.available())
+    Serial2.read() ;
+#endif
   // enable the transmitter
   digitalWrite(RS485_DIR, HIGH);
 }
@@ -323,90 +469,107 @@ static void ModbusPostTransmit(void)
 {
   // disable the transmitter (in the process, re-enable the receiver)
   digitalWrite(RS485_DIR, LOW);
+#if ECHO_CHECK
+  // ModbusMaster waits for it all to go before calling us
+  if (EchoLen)
+    EchoCollided = !CheckEcho(EchoFrame, EchoLen) ;
+#endif
 }
 
-// decode Modbus request and if not intended for our slave, respond with something
-// that will (hopefully) persuade the logger to stop querying it
-static int DecodeAndRespondToSlave(uint8_t *Buffer, uint32_t BufSz, uint8_t SlaveId)
+// the logger's traffic, decoded as it arrives
+static RtuParser_t LoggerParser ;
+// the last slave a request was seen for, or -1
+static int LoggerReqSlave = -1 ;
+
+// a frame's been decoded, if it's a request not intended for our slave, respond
+// with something that will (hopefully) persuade the logger to stop querying it
+static void RespondToSlave(const RtuFrame_t *Frame, void *User)
 {
-  const uint32_t MinMsgLen = 8;
-  uint8_t ReqSlave;
-  uint8_t FCodeReadInput = 4;
-  uint16_t Crc;
-  uint16_t Register;
-  uint32_t MsgStart = 0 ;
-
-  // discard any null bytes at the start of the message    
-  while(BufSz)
-  {
-    if ( !Buffer[MsgStart] )
-    {
-      BufSz-- ;
-      MsgStart++ ;
-    }
-    else
-      break ;
-  }
-  
-  // messages we're expecting should all be single register read requests, 8 bytes long
-  if (BufSz < MinMsgLen)
-  {
-    Serial.println("Message too short for a read input register function");
-    return -1;
-  }
+  const uint8_t SlaveId = 1u ;
+  const uint8_t ExceptionIllegalData = 0x02;
+#if ECHO_CHECK
+  // the logger waits ~3s for a slave, only answer again well inside that
+  const unsigned long RetryWindow = 1000u ;
+  unsigned long Received = millis() ;
+#endif
+  uint8_t ResponseBuf[5];
+
+  if (Frame->Response)
+    return ;
+
   // check slave not us
-  ReqSlave = Buffer[MsgStart];
-  if (ReqSlave == SlaveId)
+  LoggerReqSlave = Frame->Slave ;
+  if (Frame->Slave == SlaveId)
   {
     Serial.println("Message is for local inverter, ignoring");
-    return SlaveId;
+    return ;
   }
 
   // check this is a read register request
-  if (Buffer[MsgStart+1] != FCodeReadInput)
+  if (Frame->Function != MODBUS_RTU_READ_INPUT)
   {
     Serial.println("Not a read input registers function, ignoring");
-    return -1;
+    return ;
   }
 
-  // compute then verify the CRC
-  CRC16 ModBusCrc(CRC16_ARC_POLYNOME,CRC16_CCITT_FALSE_INITIAL,CRC16_XOR_OUT,CRC16_ARC_REV_IN,CRC16_ARC_REV_OUT);
+  Serial.printf("Message for slave: %u, register: %u\n", Frame->Slave, Frame->Address);
 
-  ModBusCrc.add(&Buffer[MsgStart], MinMsgLen - sizeof(uint16_t));
+  // initial attempt: respond with an illegal address exception
+  RtuException(ResponseBuf, Frame->Slave, Frame->Function, ExceptionIllegalData) ;
 
-  Crc = (Buffer[MsgStart+7] << 8) + Buffer[MsgStart+6];
-  if (ModBusCrc.calc() != Crc)
+  for (uint32_t Attempt = 0u; ; Attempt++)
   {
-    Serial.printf("CRC Incorrect, should be %x\n", ModBusCrc.calc());
-    return -1;
+    delay(LineDelay(80u)) ;
+    ModbusPreTransmit() ;
+    Serial2.write(ResponseBuf, sizeof(ResponseBuf)) ;
+    Serial2.flush(true) ;
+    ModbusPostTransmit() ;
+#if ECHO_CHECK
+    // if it collided the logger won't have got it, so go again whilst it's still waiting
+    // - but only if the line's quiet, anything heard is most likely the logger moving on
+    // & needs reading & answering rather than throwing away
+    if (CheckEcho(ResponseBuf, sizeof(ResponseBuf)) || Attempt >= ECHO_RETRIES ||
+        millis() - Received >= RetryWindow || !LineIdle())
+      break ;
+    EchoStats.Retries++ ;
+#else
+    break ;
+#endif
   }
+}
 
-  // extract the register
-  Register = (Buffer[MsgStart+2] << 8) + Buffer[MsgStart+3];
+// decode whatever's been read from the logger, answering any requests for other slaves.
+// Messages can be split across reads, the parser picks up where it left off. Returns
+// the last slave a request was seen for, or -1 if there wasn't one
+static int DecodeAndRespondToSlave(uint8_t *Buffer, uint32_t BufSz)
+{
+  LoggerReqSlave = -1 ;
+  RtuParse(&LoggerParser, Buffer, BufSz, millis()) ;
+  return LoggerReqSlave ;
+}
 
-  Serial.printf("Message for slave: %u, register: %u\n", ReqSlave, Register);
+// wait for up to 'Ms' for the logger, rather than blocking in delay() & leaving it to
+// time out on any polls of the other slaves. Returns true as soon as anything's heard,
+// having answered it
+static bool ListenFor(unsigned long Ms)
+{
+  uint8_t ScratchBuf[64] ;
+  unsigned long Start = millis() ;
 
-  // got what we need, now generate the response...
-  uint8_t ResponseBuf[5];
-  const uint8_t ExceptionIllegalData = 0x02;
+  while (millis() - Start < Ms)
+  {
+    size_t Available = Serial2.available() ;
 
-  // initial attempt: respond with an illegal address exception
-  ResponseBuf[0] = ReqSlave;
-  ResponseBuf[1] = FCodeReadInput | 0x80;
-  ResponseBuf[2] = ExceptionIllegalData;
-
-  ModBusCrc.restart();
-  ModBusCrc.add(ResponseBuf, 3);
-  ResponseBuf[3] = ModBusCrc.calc() & 0xff;
-  ResponseBuf[4] = ModBusCrc.calc() >> 8 ;
-
-  delay(80) ;
-  ModbusPreTransmit() ;
-  Serial2.write(ResponseBuf, sizeof(ResponseBuf)) ;
-  Serial2.flush(true) ;
-  ModbusPostTransmit() ;
-
-  return ReqSlave;
+    if (Available)
+    {
+      size_t BytesRead = Serial2.read(ScratchBuf, Available < sizeof(ScratchBuf) ? Available : sizeof(ScratchBuf)) ;
+
+      DecodeAndRespondToSlave(ScratchBuf, BytesRead) ;
+      return true ;
+    }
+    delay(1) ;
+  }
+  return false ;
 }
 
 static uint32_t CheckWifiConnection(void)
@@ -453,11 +616,16 @@ void setup()
   digitalWrite(RS485_DIR, LOW);
 
   // modbus serial
-  Serial2.begin(9600, SERIAL_8N1, RXD2, TXD2);
-  // set rx timeout to ~100ms
+  if (!RtuLineParse(MODBUS_SERIAL, &Line))
+  {
+    Serial.println("Bad MODBUS_SERIAL setting, using " RTU_LINE_DEFAULT);
+    RtuLineParse(RTU_LINE_DEFAULT, &Line);
+  }
+  Serial2.begin(Line.Baud, LineConfig(&Line), RXD2, TXD2);
+  // set rx timeout to ~100 characters (100ms at 9600)
   // This *should* ensure every read call gives us a single Modbus request
   // and possibly the response although we don't really care about those
-  Serial2.setTimeout(100) ;
+  Serial2.setTimeout(LineDelay(96u)) ;
 
   ModbusInst.begin(MODBUS_SLAVE_ID,Serial2);
   // setup the callbacks for enabling/disabling the transceivers
@@ -519,6 +687,8 @@ void loop()
 
       Serial.println("Sync with logger...");
       InitTime = millis() ;
+      // start afresh, anything left over from last time is long gone
+      RtuParserInit(&LoggerParser, 1u, 247u, RespondToSlave, nullptr) ;
       SolisState = SYNC_LOGGER ;
       break ;
 
@@ -554,7 +724,7 @@ void loop()
       BytesRead = Serial2.readBytes(ScratchBuf,sizeof(ScratchBuf)) ;
       if ( BytesRead )
       {
-        int ReqSlave = DecodeAndRespondToSlave(ScratchBuf, BytesRead, 1u);
+        int ReqSlave = DecodeAndRespondToSlave(ScratchBuf, BytesRead);
         if ( ReqSlave == 10 )
           Slave10Tx = true ;
         else if ( ReqSlave == 2 ) // if there are multiple polls this cycle, make sure we reset the Tx flag
@@ -682,9 +852,17 @@ void loop()
           TimeToNextPoll = 0u; 
       }
 
-      // dont't delay on final cycle
+      // dont't delay on final cycle. Whilst waiting, the logger's answered as usual &
+      // if it's heard, that's the start of it's next burst so follow it from there
       if ( TimeToNextPoll) 
-        delay(PollDelay);
+      {
+        if ( ListenFor(PollDelay) )
+        {
+          Serial.println("Detected serial traffic, forcing resync") ;
+          SyncStart = millis() ;
+          SolisState = CONSUME_LOGGER ;
+        }
+      }
       else
         SolisState = SYNC_INIT ; // back to sync with logger
       break ;
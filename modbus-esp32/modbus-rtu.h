@@ -0,0 +1 @@
+../modbus-rtu/modbus-rtu.h
\ No newline at end of file
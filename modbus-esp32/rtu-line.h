@@ -0,0 +1 @@
+../modbus-rtu/rtu-line.h
\ No newline at end of file
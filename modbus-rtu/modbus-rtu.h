@@ -0,0 +1,459 @@
+#ifndef MODBUS_RTU_H
+#define MODBUS_RTU_H
+
+//
+// Incremental Modbus RTU frame parser, shared by the sniffer, modbus-solis-broadcast
+// and the ESP32 sketch (which needs a copy of, or link to, this file alongside it)
+//
+// Bytes are pushed in as they arrive, in whatever size chunks the serial port
+// happens to hand over, and each complete frame with a valid CRC is passed to the
+// handler. There's no blocking, no allocation and the frame is handed over in place
+// - the pointers in it refer to the parser's own buffer so are only valid for the
+// duration of the call.
+//
+// Only the functions the logger & inverter actually use are understood: 3 & 4 (read
+// holding/input registers), 6 (write single register), 16 (write multiple registers)
+// and exception responses to any of them. Anything that doesn't make a frame is
+// skipped a byte at a time until one does, which is how it copes with the spurious
+// characters that get injected into the stream. Whether a frame is a request or a
+// response is worked out from it's length - a read response always has an odd
+// length, a read request is 8 bytes, and the reverse for a multiple register write.
+// A write single register response is an echo of the request, so is only recognised
+// as such if it immediately follows that request.
+//
+// The CRC is accumulated as each byte is added, so checking whether the bytes so far
+// make a frame is a single comparison (the CRC of a frame including it's own CRC
+// is always zero).
+//
+// Example:
+//
+//   static void Handler(const RtuFrame_t *Frame, void *User)
+//   {
+//     if (Frame->Response && Frame->Function == MODBUS_RTU_READ_INPUT)
+//       for (uint32_t i = 0; i < Frame->Count; i++)
+//         ... RtuWord(Frame, i)
+//   }
+//
+//   RtuParser_t Parser;
+//
+//   RtuParserInit(&Parser, 1, 10, Handler, nullptr);
+//   while ((Len = read(Fd, Buf, sizeof(Buf))) > 0)
+//     RtuParse(&Parser, Buf, Len, Now);
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#define MODBUS_RTU_MAX_FRAME 256u
+#define MODBUS_RTU_READ_HOLDING 3u
+#define MODBUS_RTU_READ_INPUT 4u
+#define MODBUS_RTU_WRITE_SINGLE 6u
+#define MODBUS_RTU_WRITE_MULTIPLE 16u
+#define MODBUS_RTU_EXCEPTION 0x80u
+
+// a validated frame
+typedef struct {
+  uint64_t Offset;        // in the stream, of the slave address
+  uint64_t Time;          // as passed in with the bytes that completed the frame
+  uint32_t Skipped;       // bytes discarded since the previous frame
+  const uint8_t *Raw;     // the whole frame, including the CRC
+  uint16_t Length;
+  bool Response;
+  uint8_t Slave;
+  uint8_t Function;       // without the exception bit
+  uint8_t Exception;      // non zero for an exception response
+  uint16_t Address;       // not known for a read response, it's in the request
+  uint16_t Count;         // registers requested, returned or written
+  const uint8_t *Data;    // register values (big endian), as read or written
+  uint8_t ByteCount;
+} RtuFrame_t;
+
+typedef void (*RtuFrameHandler_t)(const RtuFrame_t *Frame, void *User);
+
+typedef struct {
+  uint64_t Frames;
+  uint64_t Requests;
+  uint64_t Responses;
+  uint64_t Exceptions;
+  uint64_t Skipped;       // bytes that weren't part of any frame
+  uint64_t Gaps;          // partial frames abandoned due to a gap in the traffic
+} RtuParserStats_t;
+
+typedef struct {
+  uint8_t Buf[MODBUS_RTU_MAX_FRAME];
+  uint32_t Len;           // bytes in the buffer
+  uint32_t Checked;       // of which have been looked at, and are in the CRC
+  uint16_t Crc;
+  uint8_t FirstSlave;
+  uint8_t LastSlave;
+  uint64_t Position;      // stream offset of Buf[0]
+  uint32_t Skipped;
+  uint64_t Time;
+  uint64_t GapTime;       // 0 to never abandon a partial frame
+  uint32_t Fallback;      // length of a frame found, while looking for a longer one
+  uint8_t LastWrite[8];   // the last write single register request, to spot the echo
+  bool LastWasWrite;
+  RtuFrameHandler_t Handler;
+  void *User;
+  RtuParserStats_t Stats;
+} RtuParser_t;
+
+static const uint16_t RtuCrcTable[256] = {
+  0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
+  0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
+  0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
+  0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
+  0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
+  0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
+  0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
+  0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
+  0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
+  0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
+  0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
+  0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
+  0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
+  0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
+  0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
+  0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
+  0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
+  0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
+  0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
+  0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
+  0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
+  0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
+  0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
+  0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
+  0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
+  0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
+  0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
+  0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
+  0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
+  0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
+  0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
+  0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040 };
+
+static inline uint16_t RtuCrcUpdate(uint16_t Crc, uint8_t Byte)
+{
+  return (Crc >> 8) ^ RtuCrcTable[(Crc ^ Byte) & 0xffu];
+}
+
+static inline uint16_t RtuCrc(const uint8_t *Data, uint32_t Len)
+{
+  uint16_t Crc = 0xffffu;
+
+  while (Len--)
+    Crc = RtuCrcUpdate(Crc, *Data++);
+  return Crc;
+}
+
+// append the CRC to a frame of 'Len' bytes, returns the new length
+static inline uint32_t RtuAddCrc(uint8_t *Frame, uint32_t Len)
+{
+  uint16_t Crc = RtuCrc(Frame, Len);
+
+  Frame[Len] = Crc & 0xffu;
+  Frame[Len + 1] = Crc >> 8;
+  return Len + 2u;
+}
+
+// build an exception response, 'Buf' needs to be at least 5 bytes. Returns the length
+static inline uint32_t RtuException(uint8_t *Buf, uint8_t Slave, uint8_t Function, uint8_t Code)
+{
+  Buf[0] = Slave;
+  Buf[1] = Function | MODBUS_RTU_EXCEPTION;
+  Buf[2] = Code;
+  return RtuAddCrc(Buf, 3u);
+}
+
+// build a read registers request (function 3 or 4), 'Buf' needs to be at least 8 bytes.
+// Returns the length
+static inline uint32_t RtuReadRequest(uint8_t *Buf, uint8_t Slave, uint8_t Function, uint16_t Address, uint16_t Count)
+{
+  Buf[0] = Slave;
+  Buf[1] = Function;
+  Buf[2] = Address >> 8;
+  Buf[3] = Address & 0xffu;
+  Buf[4] = Count >> 8;
+  Buf[5] = Count & 0xffu;
+  return RtuAddCrc(Buf, 6u);
+}
+
+// a register value out of a frame
+static inline uint16_t RtuWord(const RtuFrame_t *Frame, uint32_t Index)
+{
+  return (uint16_t)((Frame->Data[Index * 2u] << 8) | Frame->Data[Index * 2u + 1u]);
+}
+
+// only frames for slaves in the range given are looked for, the narrower
+// the range the less likely noise is to be mistaken for a frame
+static inline void RtuParserInit(RtuParser_t *Parser, uint8_t FirstSlave, uint8_t LastSlave, RtuFrameHandler_t Handler, void *User)
+{
+  memset(Parser, 0, sizeof(*Parser));
+  Parser->Crc = 0xffffu;
+  Parser->FirstSlave = FirstSlave ? FirstSlave : 1u;
+  Parser->LastSlave = LastSlave;
+  Parser->Handler = Handler;
+  Parser->User = User;
+}
+
+// a partial frame is thrown away if nothing more arrives for this long (in whatever
+// units the times are given in). Only makes sense if the times are accurate
+static inline void RtuParserSetGap(RtuParser_t *Parser, uint64_t GapTime)
+{
+  Parser->GapTime = GapTime;
+}
+
+// the register count, in the same place in all the fixed length frames, is within
+// what the function allows. Makes it far less likely a longer frame is mistaken for
+// a shorter one, should the CRC happen to match part way through
+static inline bool RtuValidCount(const uint8_t *Buf, uint32_t Max)
+{
+  uint32_t Count = (Buf[4] << 8) | Buf[5];
+
+  return Count && Count <= Max;
+}
+
+// is there a frame in the bytes checked so far? Returns it's length, 0 if more
+// bytes are needed to tell or -1 if there can't be a frame starting at Buf[0]. A
+// shorter frame that might turn out to be the start of a longer one is left in
+// Fallback, to be used if the longer one doesn't materialise
+static inline int RtuCheck(RtuParser_t *Parser)
+{
+  const uint8_t *Buf = Parser->Buf;
+  uint32_t Len = Parser->Checked;
+  uint32_t Function, Longest;
+  bool Complete = (Parser->Crc == 0u);
+
+  if (Buf[0] < Parser->FirstSlave || Buf[0] > Parser->LastSlave)
+    return -1;
+  if (Len < 2u)
+    return 0;
+
+  Function = Buf[1];
+  if (Function & MODBUS_RTU_EXCEPTION)
+  {
+    Function &= ~MODBUS_RTU_EXCEPTION;
+    if (Function != MODBUS_RTU_READ_HOLDING && Function != MODBUS_RTU_READ_INPUT &&
+        Function != MODBUS_RTU_WRITE_SINGLE && Function != MODBUS_RTU_WRITE_MULTIPLE)
+      return -1;
+    // the standard codes only go up to 0x0b
+    if (Len >= 3u && (Buf[2] == 0u || Buf[2] > 0x0bu))
+      return -1;
+    if (Len < 5u)
+      return 0;
+    return Complete ? 5 : -1;
+  }
+
+  switch (Function)
+  {
+    case MODBUS_RTU_READ_HOLDING:
+    case MODBUS_RTU_READ_INPUT:
+
+      // a request is 8 bytes (for up to 125 registers), a response 5 plus the
+      // (even) byte count
+      if (Len == 8u && Complete && RtuValidCount(Buf, 125u))
+        return 8;
+      Longest = 8u;
+      if (Len >= 3u && Buf[2] && !(Buf[2] & 1u) && Buf[2] <= 250u)
+      {
+        Longest = 5u + Buf[2];
+        if (Len == Longest && Complete)
+          return Len;
+        if (Longest < 8u)
+          Longest = 8u;
+      }
+      return Len >= Longest ? -1 : 0;
+
+    case MODBUS_RTU_WRITE_SINGLE:
+
+      if (Len < 8u)
+        return 0;
+      return Complete ? 8 : -1;
+
+    case MODBUS_RTU_WRITE_MULTIPLE:
+
+      // a response is 8 bytes, a request 9 plus the byte count (for up to 123 registers)
+      if (Len < 7u)
+        return 0;
+      Longest = 9u + Buf[6];
+      if (Buf[6] != ((Buf[4] << 8) | Buf[5]) * 2u || !Buf[6] || Buf[6] > 246u)
+        Longest = 8u;
+      if (Len == 8u && Complete && RtuValidCount(Buf, 123u))
+      {
+        // it looks like the start of a request as well, so see if it makes one
+        // before settling on it being a response
+        if (Longest == 8u)
+          return 8;
+        Parser->Fallback = 8u;
+      }
+      if (Len == Longest && Longest > 8u && Complete)
+        return Len;
+      return Len >= Longest ? -1 : 0;
+  }
+  return -1;
+}
+
+// fill in the frame from the first 'Len' bytes of the buffer & pass it on
+static inline void RtuEmit(RtuParser_t *Parser, uint32_t Len)
+{
+  const uint8_t *Buf = Parser->Buf;
+  RtuFrame_t Frame;
+
+  memset(&Frame, 0, sizeof(Frame));
+  Frame.Offset = Parser->Position;
+  Frame.Time = Parser->Time;
+  Frame.Skipped = Parser->Skipped;
+  Frame.Raw = Buf;
+  Frame.Length = (uint16_t)Len;
+  Frame.Slave = Buf[0];
+  Frame.Function = Buf[1] & ~MODBUS_RTU_EXCEPTION;
+
+  if (Buf[1] & MODBUS_RTU_EXCEPTION)
+  {
+    Frame.Response = true;
+    Frame.Exception = Buf[2];
+  }
+  else
+  {
+    switch (Frame.Function)
+    {
+      case MODBUS_RTU_READ_HOLDING:
+      case MODBUS_RTU_READ_INPUT:
+
+        if (Len == 8u)
+          Frame.Count = (Buf[4] << 8) | Buf[5];
+        else
+        {
+          Frame.Response = true;
+          Frame.ByteCount = Buf[2];
+          Frame.Count = Buf[2] / 2u;
+          Frame.Data = &Buf[3];
+        }
+        break;
+
+      case MODBUS_RTU_WRITE_SINGLE:
+
+        Frame.Response = Parser->LastWasWrite && !memcmp(Parser->LastWrite, Buf, 8u);
+        Frame.Count = 1u;
+        Frame.ByteCount = 2u;
+        Frame.Data = &Buf[4];
+        break;
+
+      case MODBUS_RTU_WRITE_MULTIPLE:
+
+        Frame.Count = (Buf[4] << 8) | Buf[5];
+        if (Len == 8u)
+          Frame.Response = true;
+        else
+        {
+          Frame.ByteCount = Buf[6];
+          Frame.Data = &Buf[7];
+        }
+        break;
+    }
+    if (!Frame.Response || (Frame.Function != MODBUS_RTU_READ_HOLDING && Frame.Function != MODBUS_RTU_READ_INPUT))
+      Frame.Address = (Buf[2] << 8) | Buf[3];
+  }
+
+  // only a request immediately followed by it's echo counts as a write & it's response
+  Parser->LastWasWrite = (Frame.Function == MODBUS_RTU_WRITE_SINGLE && !Frame.Response && !Frame.Exception);
+  if (Parser->LastWasWrite)
+    memcpy(Parser->LastWrite, Buf, 8u);
+
+  Parser->Stats.Frames++;
+  if (Frame.Exception)
+    Parser->Stats.Exceptions++;
+  else if (Frame.Response)
+    Parser->Stats.Responses++;
+  else
+    Parser->Stats.Requests++;
+
+  if (Parser->Handler)
+    Parser->Handler(&Frame, Parser->User);
+}
+
+// drop the first 'Count' bytes of the buffer, anything left over will be looked at again
+static inline void RtuDiscard(RtuParser_t *Parser, uint32_t Count)
+{
+  Parser->Len -= Count;
+  memmove(Parser->Buf, &Parser->Buf[Count], Parser->Len);
+  Parser->Position += Count;
+  Parser->Checked = 0u;
+  Parser->Fallback = 0u;
+  Parser->Crc = 0xffffu;
+}
+
+// look at whatever in the buffer hasn't been yet, normally just the byte that's been
+// added, but after a byte's been discarded the remainder all needs looking at again
+static inline void RtuScan(RtuParser_t *Parser)
+{
+  while (Parser->Checked < Parser->Len)
+  {
+    int Rc;
+
+    Parser->Crc = RtuCrcUpdate(Parser->Crc, Parser->Buf[Parser->Checked++]);
+    Rc = RtuCheck(Parser);
+    if (Rc < 0 && Parser->Fallback)
+      Rc = (int)Parser->Fallback;
+    if (Rc > 0)
+    {
+      RtuEmit(Parser, (uint32_t)Rc);
+      Parser->Skipped = 0u;
+      RtuDiscard(Parser, (uint32_t)Rc);
+    }
+    else if (Rc < 0)
+    {
+      Parser->Skipped++;
+      Parser->Stats.Skipped++;
+      RtuDiscard(Parser, 1u);
+    }
+  }
+}
+
+// the traffic has stopped, so whatever's been collected isn't going to be added to.
+// Anything held back in case it was the start of a longer frame goes out as it is,
+// otherwise the first byte is dropped & the rest looked at again - a stray byte
+// ahead of a frame can look like the start of a longer one, which would otherwise
+// take the real one with it
+static inline void RtuParserFlush(RtuParser_t *Parser)
+{
+  bool Gap = false;
+
+  while (Parser->Len)
+  {
+    if (Parser->Fallback)
+    {
+      RtuEmit(Parser, Parser->Fallback);
+      Parser->Skipped = 0u;
+      RtuDiscard(Parser, Parser->Fallback);
+    }
+    else
+    {
+      Parser->Skipped++;
+      Parser->Stats.Skipped++;
+      RtuDiscard(Parser, 1u);
+      Gap = true;
+    }
+    RtuScan(Parser);
+  }
+  if (Gap)
+    Parser->Stats.Gaps++;
+}
+
+// push in the next chunk of bytes, any frames they complete are passed to the handler
+// before this returns. 'Time' is whenever the caller wants it to be, the frames just
+// carry it through
+static inline void RtuParse(RtuParser_t *Parser, const uint8_t *Data, uint32_t Count, uint64_t Time)
+{
+  if (Parser->GapTime && Parser->Len && Time - Parser->Time > Parser->GapTime)
+    RtuParserFlush(Parser);
+  Parser->Time = Time;
+
+  while (Count--)
+  {
+    Parser->Buf[Parser->Len++] = *Data++;
+    RtuScan(Parser);
+  }
+}
+
+#endif
@@ -0,0 +1,296 @@
+//
+// Fuzz test & benchmark for the frame parser in modbus-rtu.h
+//
+//   rtu-fuzz fuzz [streams=2000] [seed=1]
+//   rtu-fuzz bench [megabytes=64]
+//
+// The fuzz test builds streams of random (but valid) frames of every kind the parser
+// understands, with bursts of random noise between some of them, then feeds each one
+// in randomly sized chunks & checks every frame comes back out exactly as it was sent,
+// from where it was in the stream. Occasionally (1 in 65536 or so) the start of a frame,
+// or noise along with it, makes a shorter frame with a good CRC & takes the real one
+// with it, so a handful of misses are allowed for, but anything more fails. It then
+// feeds in random bytes & reports how many frames were 'found' in them.
+//
+// The benchmark times how fast clean traffic, much like the logger's, is parsed.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include "modbus-rtu.h"
+
+typedef struct {
+  uint64_t Offset;
+  std::vector<uint8_t> Bytes;
+} FuzzFrame_t;
+
+static std::mt19937 Random;
+
+static uint32_t RandomRange(uint32_t First, uint32_t Last)
+{
+  return std::uniform_int_distribution<uint32_t>(First, Last)(Random);
+}
+
+// one of each of the frames the logger & inverter exchange, picked at random. Returns
+// the length, 'Buf' needs to be at least MODBUS_RTU_MAX_FRAME bytes. A write single
+// register request is always followed by it's echo, so two frames come back in one
+static uint32_t RandomFrame(uint8_t *Buf, uint8_t FirstSlave, uint8_t LastSlave, uint32_t *Second)
+{
+  uint8_t Slave = (uint8_t)RandomRange(FirstSlave, LastSlave);
+  uint8_t Function = RandomRange(0, 1) ? MODBUS_RTU_READ_INPUT : MODBUS_RTU_READ_HOLDING;
+  uint32_t Count, Len = 0u;
+
+  *Second = 0u;
+  switch (RandomRange(0, 5))
+  {
+    case 0:  // read request
+      return RtuReadRequest(Buf, Slave, Function, (uint16_t)RandomRange(0, 0xffff), (uint16_t)RandomRange(1, 125));
+
+    case 1:  // read response
+      Count = RandomRange(1, 125);
+      Buf[Len++] = Slave;
+      Buf[Len++] = Function;
+      Buf[Len++] = (uint8_t)(Count * 2u);
+      for (uint32_t i = 0; i < Count * 2u; i++)
+        Buf[Len++] = (uint8_t)RandomRange(0, 0xff);
+      return RtuAddCrc(Buf, Len);
+
+    case 2:  // write single register & it's echo
+      Buf[Len++] = Slave;
+      Buf[Len++] = MODBUS_RTU_WRITE_SINGLE;
+      for (uint32_t i = 0; i < 4u; i++)
+        Buf[Len++] = (uint8_t)RandomRange(0, 0xff);
+      Len = RtuAddCrc(Buf, Len);
+      memcpy(&Buf[Len], Buf, Len);
+      *Second = Len;
+      return Len;
+
+    case 3:  // write multiple registers request
+      Count = RandomRange(1, 123);
+      Buf[Len++] = Slave;
+      Buf[Len++] = MODBUS_RTU_WRITE_MULTIPLE;
+      Buf[Len++] = (uint8_t)RandomRange(0, 0xff);
+      Buf[Len++] = (uint8_t)RandomRange(0, 0xff);
+      Buf[Len++] = (uint8_t)(Count >> 8);
+      Buf[Len++] = (uint8_t)Count;
+      Buf[Len++] = (uint8_t)(Count * 2u);
+      for (uint32_t i = 0; i < Count * 2u; i++)
+        Buf[Len++] = (uint8_t)RandomRange(0, 0xff);
+      return RtuAddCrc(Buf, Len);
+
+    case 4:  // write multiple registers response
+      Count = RandomRange(1, 123);
+      Buf[Len++] = Slave;
+      Buf[Len++] = MODBUS_RTU_WRITE_MULTIPLE;
+      Buf[Len++] = (uint8_t)RandomRange(0, 0xff);
+      Buf[Len++] = (uint8_t)RandomRange(0, 0xff);
+      Buf[Len++] = (uint8_t)(Count >> 8);
+      Buf[Len++] = (uint8_t)Count;
+      return RtuAddCrc(Buf, Len);
+
+    default:  // exception
+      return RtuException(Buf, Slave, RandomRange(0, 1) ? Function : MODBUS_RTU_WRITE_MULTIPLE,
+                          (uint8_t)RandomRange(1, 0x0b));
+  }
+}
+
+// add a frame to the stream, remembering where it went
+static void AddFrame(std::vector<uint8_t> &Stream, std::vector<FuzzFrame_t> &Frames, const uint8_t *Buf, uint32_t Len)
+{
+  FuzzFrame_t Frame;
+
+  Frame.Offset = Stream.size();
+  Frame.Bytes.assign(Buf, Buf + Len);
+  Frames.push_back(Frame);
+  Stream.insert(Stream.end(), Buf, Buf + Len);
+}
+
+static void CollectFrame(const RtuFrame_t *Frame, void *User)
+{
+  std::vector<FuzzFrame_t> *Found = (std::vector<FuzzFrame_t>*)User;
+  FuzzFrame_t Copy;
+
+  Copy.Offset = Frame->Offset;
+  Copy.Bytes.assign(Frame->Raw, Frame->Raw + Frame->Length);
+  Found->push_back(Copy);
+}
+
+// feed the stream through the parser in random sized chunks
+static void ParseChunked(RtuParser_t *Parser, const std::vector<uint8_t> &Stream)
+{
+  size_t Pos = 0;
+  uint64_t Time = 0u;
+
+  while (Pos < Stream.size())
+  {
+    uint32_t Chunk = RandomRange(1, RandomRange(0, 3) ? 16 : 300);
+
+    if (Chunk > Stream.size() - Pos)
+      Chunk = (uint32_t)(Stream.size() - Pos);
+    RtuParse(Parser, &Stream[Pos], Chunk, Time++);
+    Pos += Chunk;
+  }
+  RtuParserFlush(Parser);
+}
+
+static bool Fuzz(uint32_t Streams)
+{
+  uint64_t Sent = 0u, Missed = 0u, Spurious = 0u, NoiseBytes = 0u, RandomFrames = 0u;
+  const uint64_t RandomBytes = 16u * 1024u * 1024u;
+  uint8_t Buf[MODBUS_RTU_MAX_FRAME * 2u];
+
+  for (uint32_t s = 0; s < Streams; s++)
+  {
+    std::vector<uint8_t> Stream;
+    std::vector<FuzzFrame_t> Frames, Found;
+    uint32_t FrameCount = RandomRange(1, 100);
+    bool Noisy = s & 1u;  // every other stream is clean
+    RtuParser_t Parser;
+    size_t Next = 0;
+
+    for (uint32_t f = 0; f < FrameCount; f++)
+    {
+      uint32_t Second, Len = RandomFrame(Buf, 1u, 10u, &Second);
+
+      AddFrame(Stream, Frames, Buf, Len);
+      if (Second)
+        AddFrame(Stream, Frames, &Buf[Len], Second);
+
+      // a few stray bytes, much like the transceivers switching over
+      if (Noisy && RandomRange(0, 3) == 0)
+      {
+        uint32_t Noise = RandomRange(1, 8);
+
+        for (uint32_t i = 0; i < Noise; i++)
+          Stream.push_back((uint8_t)RandomRange(0, 0xff));
+        NoiseBytes += Noise;
+      }
+    }
+
+    RtuParserInit(&Parser, 1u, 10u, CollectFrame, &Found);
+    ParseChunked(&Parser, Stream);
+
+    // both lists are in stream order, so walk them together
+    for (auto &Frame : Frames)
+    {
+      while (Next < Found.size() && Found[Next].Offset < Frame.Offset)
+      {
+        Spurious++;
+        Next++;
+      }
+      if (Next < Found.size() && Found[Next].Offset == Frame.Offset && Found[Next].Bytes == Frame.Bytes)
+        Next++;
+      else
+      {
+        Missed++;
+        printf("Stream %u (%s): %u byte frame at offset %llu wasn't found\n", s, Noisy ? "noisy" : "clean",
+               (uint32_t)Frame.Bytes.size(), (unsigned long long)Frame.Offset);
+      }
+    }
+    Spurious += Found.size() - Next;
+    Sent += Frames.size();
+  }
+
+  printf("%u streams, %llu frames sent with %llu bytes of noise: %llu missed, %llu spurious\n", Streams,
+         (unsigned long long)Sent, (unsigned long long)NoiseBytes, (unsigned long long)Missed,
+         (unsigned long long)Spurious);
+
+  // nothing but noise
+  {
+    std::vector<uint8_t> Stream(RandomBytes);
+    std::vector<FuzzFrame_t> Found;
+    RtuParser_t Parser;
+
+    for (auto &Byte : Stream)
+      Byte = (uint8_t)RandomRange(0, 0xff);
+    RtuParserInit(&Parser, 1u, 10u, CollectFrame, &Found);
+    ParseChunked(&Parser, Stream);
+    RandomFrames = Found.size();
+    printf("%lluMB of random bytes: %llu frames found, %llu bytes skipped\n",
+           (unsigned long long)(RandomBytes / (1024u * 1024u)), (unsigned long long)RandomFrames,
+           (unsigned long long)Parser.Stats.Skipped);
+  }
+
+  // a frame is lost for each false one noise makes, so they go hand in hand
+  if (Missed * 1000u > Sent || Spurious * 1000u > Sent)
+  {
+    printf("FAILED: more than 1 in 1000 frames missed or made up\n");
+    return false;
+  }
+  printf("Passed\n");
+  return true;
+}
+
+static void CountFrame(const RtuFrame_t *Frame, void *User)
+{
+  (*(uint64_t*)User) += Frame->Length;
+}
+
+static bool Bench(uint32_t Megabytes)
+{
+  using namespace std::chrono;
+  std::vector<uint8_t> Stream;
+  uint8_t Buf[MODBUS_RTU_MAX_FRAME];
+  uint64_t Bytes = 0u;
+  RtuParser_t Parser;
+  double Seconds;
+
+  // the logger's poll of the inverter & the response, then the other slaves timing out
+  while (Stream.size() < 1024u * 1024u)
+  {
+    uint32_t Len = RtuReadRequest(Buf, 1u, MODBUS_RTU_READ_INPUT, 33000u, 40u);
+
+    Stream.insert(Stream.end(), Buf, Buf + Len);
+    Len = 0u;
+    Buf[Len++] = 1u;
+    Buf[Len++] = MODBUS_RTU_READ_INPUT;
+    Buf[Len++] = 80u;
+    for (uint32_t i = 0; i < 80u; i++)
+      Buf[Len++] = (uint8_t)RandomRange(0, 0xff);
+    Len = RtuAddCrc(Buf, Len);
+    Stream.insert(Stream.end(), Buf, Buf + Len);
+    for (uint8_t Slave = 2u; Slave <= 10u; Slave++)
+    {
+      Len = RtuReadRequest(Buf, Slave, MODBUS_RTU_READ_INPUT, 33000u, 40u);
+      Stream.insert(Stream.end(), Buf, Buf + Len);
+    }
+  }
+
+  RtuParserInit(&Parser, 1u, 10u, CountFrame, &Bytes);
+  steady_clock::time_point Start = steady_clock::now();
+  for (uint32_t m = 0; m < Megabytes; m++)
+  {
+    // in the sort of chunks a serial port hands over
+    for (size_t Pos = 0; Pos < Stream.size(); Pos += 32u)
+      RtuParse(&Parser, &Stream[Pos], (uint32_t)std::min<size_t>(32u, Stream.size() - Pos), 0u);
+  }
+  RtuParserFlush(&Parser);
+  Seconds = duration<double>(steady_clock::now() - Start).count();
+
+  printf("Parsed %uMB of clean traffic in %.3fs: %.1fMB/s, %.1fM frames/s (%llu bytes in frames, %llu skipped)\n",
+         Megabytes, Seconds, Megabytes / Seconds, Parser.Stats.Frames / Seconds / 1e6,
+         (unsigned long long)Bytes, (unsigned long long)Parser.Stats.Skipped);
+  return Parser.Stats.Skipped == 0u;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc > 1 && !strcmp(argv[1], "fuzz"))
+  {
+    Random.seed(argc > 3 ? strtoul(argv[3], NULL, 0) : 1u);
+    return Fuzz(argc > 2 ? strtoul(argv[2], NULL, 0) : 2000u) ? 0 : 1;
+  }
+  if (argc > 1 && !strcmp(argv[1], "bench"))
+  {
+    Random.seed(1u);
+    return Bench(argc > 2 ? strtoul(argv[2], NULL, 0) : 64u) ? 0 : 1;
+  }
+  printf("Usage: rtu-fuzz fuzz [streams=2000] [seed=1]\n       rtu-fuzz bench [megabytes=64]\n");
+  return -1;
+}
@@ -0,0 +1,88 @@
+#ifndef RTU_LINE_H
+#define RTU_LINE_H
+
+//
+// Serial line settings & the Modbus RTU timing that follows from them, shared by
+// all the tools (the ESP32 sketch needs a copy of, or link to, this file alongside it)
+//
+// Everything on the bus is paced in characters rather than milliseconds - a frame
+// ends after 3.5 characters of silence, characters within a frame are no more than
+// 1.5 apart, and the turnarounds & timeouts used by the tools were worked out at
+// 9600 baud so are expressed as a number of characters. Run the bus faster and
+// they all shrink in proportion.
+//
+// Settings are given as "<baud>[,<data bits><parity><stop bits>]", such as "9600",
+// "9600,8N1" or "19200,8E1"
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#define RTU_LINE_DEFAULT "9600,8N1"
+
+typedef struct {
+  uint32_t Baud;
+  uint8_t DataBits;
+  char Parity;        // 'N', 'E' or 'O'
+  uint8_t StopBits;
+} RtuLine_t;
+
+static inline bool RtuLineParse(const char *Text, RtuLine_t *Line)
+{
+  char *End;
+
+  Line->Baud = strtoul(Text, &End, 10);
+  Line->DataBits = 8u;
+  Line->Parity = 'N';
+  Line->StopBits = 1u;
+  if (End == Text || !Line->Baud)
+    return false;
+  if (!*End)
+    return true;
+  if (*End != ',' || End[1] < '5' || End[1] > '8' || !End[2] || !End[3] || End[4])
+    return false;
+  Line->DataBits = End[1] - '0';
+  Line->Parity = End[2];
+  if (Line->Parity >= 'a')
+    Line->Parity -= 'a' - 'A';
+  if (Line->Parity != 'N' && Line->Parity != 'E' && Line->Parity != 'O')
+    return false;
+  Line->StopBits = End[3] - '0';
+  return Line->StopBits == 1u || Line->StopBits == 2u;
+}
+
+// bits on the wire for each character, including the start bit
+static inline uint32_t RtuLineBits(const RtuLine_t *Line)
+{
+  return 1u + Line->DataBits + (Line->Parity != 'N' ? 1u : 0u) + Line->StopBits;
+}
+
+// us taken by 'Count' characters, rounded up
+static inline uint32_t RtuLineChars(const RtuLine_t *Line, uint32_t Count)
+{
+  return (uint32_t)(((uint64_t)Count * RtuLineBits(Line) * 1000000u + Line->Baud - 1u) / Line->Baud);
+}
+
+// the silence (in us) that ends a frame. Above 19200 the spec fixes it rather than
+// let it shrink to something no UART could time
+static inline uint32_t RtuLineFrameGap(const RtuLine_t *Line)
+{
+  return Line->Baud > 19200u ? 1750u : (RtuLineChars(Line, 7u) + 1u) / 2u;
+}
+
+// the longest gap (in us) allowed between characters within a frame
+static inline uint32_t RtuLineCharGap(const RtuLine_t *Line)
+{
+  return Line->Baud > 19200u ? 750u : (RtuLineChars(Line, 3u) + 1u) / 2u;
+}
+
+// how long (in us) to wait for a response to begin, from the point the request is
+// handed to the serial port. That's the time to send it plus however long the slave
+// takes to act on it, which doesn't depend on the line speed
+static inline uint32_t RtuLineResponseTimeout(const RtuLine_t *Line, uint32_t RequestBytes, uint32_t ProcessingUs)
+{
+  return RtuLineChars(Line, RequestBytes) + RtuLineFrameGap(Line) + ProcessingUs;
+}
+
+#endif
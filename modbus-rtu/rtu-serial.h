@@ -0,0 +1,297 @@
+#ifndef RTU_SERIAL_H
+#define RTU_SERIAL_H
+
+//
+// Configuring a serial port for Modbus RTU, so the tools don't depend on it having
+// been set up by hand beforehand. On Linux that's raw mode - no line editing, echo,
+// translation of CR/LF or flow control, which would otherwise mangle the binary
+// frames - at the given speed, parity & stop bits. On Windows it's the equivalent
+// DCB settings.
+//
+// On Linux it can also cut the time it takes what's been received to reach us,
+// which matters when answering the logger. USB adapters (FTDI especially) hold on
+// to a partial buffer for their latency timer, 16ms by default, before passing it
+// on, whilst ASYNC_LOW_LATENCY stops the driver deferring received data. The
+// spurious characters seen as the transceivers switch over are really breaks &
+// framing errors, which in raw mode arrive as NUL bytes indistinguishable from real
+// data. Instead they're marked (PARMRK) so they can be stripped out again, and
+// counted, before they get anywhere near the frame parser. The driver's own error
+// counts are available as well.
+//
+
+#include "rtu-line.h"
+#include <stdio.h>
+#ifndef WIN32
+#include <termios.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#else
+#include <windows.h>
+#endif
+
+// what RtuSerialTune managed to change
+typedef struct {
+  bool LowLatency;      // the driver accepted ASYNC_LOW_LATENCY
+  int LatencyBefore;    // adapter's latency timer (ms) as it was, -1 if it doesn't have one
+  int LatencyAfter;     // ...and as it is now
+  bool Marking;         // errors are marked rather than delivered as NULs
+} RtuSerialSetup_t;
+
+// errors counted by the driver
+typedef struct {
+  uint32_t Frame;
+  uint32_t Overrun;     // the UART's FIFO overflowed
+  uint32_t Parity;
+  uint32_t Break;
+  uint32_t BufOverrun;  // the tty buffer overflowed
+} RtuSerialCounts_t;
+
+// state for stripping error marks back out of the received stream
+typedef struct {
+  uint8_t State;        // how far into a mark we are
+  uint64_t Breaks;
+  uint64_t Errors;      // characters received with a framing or parity error
+} RtuSerialUnmark_t;
+
+#ifndef WIN32
+static inline speed_t RtuSerialSpeed(uint32_t Baud)
+{
+  switch (Baud)
+  {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+  }
+  return B0;
+}
+
+// put the port into raw mode with the given line settings. VMIN/VTIME are left for
+// the caller to set up as it needs
+static inline bool RtuSerialConfigure(int Fd, const RtuLine_t *Line)
+{
+  struct termios Termios;
+  speed_t Speed = RtuSerialSpeed(Line->Baud);
+  static const tcflag_t DataBits[] = { CS5, CS6, CS7, CS8 };
+
+  if (Speed == B0)
+  {
+    printf("Unsupported baud rate: %u\n", Line->Baud);
+    return false;
+  }
+  if (tcgetattr(Fd, &Termios) < 0)
+  {
+    perror("Failed to get terminal settings");
+    return false;
+  }
+
+  cfmakeraw(&Termios);
+  cfsetispeed(&Termios, Speed);
+  cfsetospeed(&Termios, Speed);
+  Termios.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+  Termios.c_cflag |= DataBits[Line->DataBits - 5u] | CLOCAL | CREAD;
+  if (Line->Parity != 'N')
+    Termios.c_cflag |= PARENB | (Line->Parity == 'O' ? PARODD : 0);
+  if (Line->StopBits == 2u)
+    Termios.c_cflag |= CSTOPB;
+  Termios.c_iflag &= ~(IXON | IXOFF | IXANY);
+
+  if (tcsetattr(Fd, TCSANOW, &Termios) < 0)
+  {
+    perror("Failed to set terminal settings");
+    return false;
+  }
+  return true;
+}
+// the adapter's latency timer, from sysfs (only some USB adapters have one). Device
+// may well be a link, eg. /dev/serial/by-id/..., so work back to the tty's name first
+static inline bool RtuSerialLatencyPath(const char *Device, char *Path, size_t PathSz)
+{
+  char Real[PATH_MAX];
+  const char *Name;
+
+  if (!realpath(Device, Real))
+    return false;
+  Name = strrchr(Real, '/');
+  snprintf(Path, PathSz, "/sys/class/tty/%s/device/latency_timer", Name ? Name + 1 : Real);
+  return true;
+}
+
+static inline int RtuSerialReadLatency(const char *Path)
+{
+  FILE *Fp = fopen(Path, "r");
+  int Latency = -1;
+
+  if (!Fp)
+    return -1;
+  if (fscanf(Fp, "%d", &Latency) != 1)
+    Latency = -1;
+  fclose(Fp);
+  return Latency;
+}
+
+// cut the receive latency as far as the driver/adapter allow & mark errors in the
+// stream. Call after RtuSerialConfigure. None of it is essential (a pty or plain UART
+// won't support some of it & setting the latency timer needs write access to sysfs)
+// so what it couldn't do is just reported in Setup
+static inline void RtuSerialTune(int Fd, const char *Device, RtuSerialSetup_t *Setup)
+{
+  struct serial_struct Serial;
+  struct termios Termios;
+  char Path[PATH_MAX + 64];
+
+  memset(Setup, 0, sizeof(*Setup));
+  Setup->LatencyBefore = Setup->LatencyAfter = -1;
+  if (RtuSerialLatencyPath(Device, Path, sizeof(Path)))
+    Setup->LatencyBefore = RtuSerialReadLatency(Path);
+
+  if (ioctl(Fd, TIOCGSERIAL, &Serial) == 0)
+  {
+    Serial.flags |= ASYNC_LOW_LATENCY;
+    Setup->LowLatency = ioctl(Fd, TIOCSSERIAL, &Serial) == 0;
+  }
+
+  // some drivers (ftdi_sio) drop the latency timer themselves for ASYNC_LOW_LATENCY
+  if (Setup->LatencyBefore > 1)
+  {
+    FILE *Fp = fopen(Path, "w");
+
+    if (Fp)
+    {
+      fprintf(Fp, "1\n");
+      fclose(Fp);
+    }
+  }
+  if (Setup->LatencyBefore >= 0)
+    Setup->LatencyAfter = RtuSerialReadLatency(Path);
+
+  // a break comes through as 0xff 0x00 0x00, a character with an error as 0xff 0x00
+  // <char> and a real 0xff as 0xff 0xff. Linux only marks framing errors with INPCK
+  // set, so it's needed even without parity (where there's nothing else for it to check)
+  if (tcgetattr(Fd, &Termios) == 0)
+  {
+    Termios.c_iflag &= ~(IGNBRK | BRKINT | IGNPAR | ISTRIP);
+    Termios.c_iflag |= PARMRK | INPCK;
+    Setup->Marking = tcsetattr(Fd, TCSANOW, &Termios) == 0;
+  }
+}
+
+// how much sooner (in us) received data now reaches us, per read
+static inline uint32_t RtuSerialSaving(const RtuSerialSetup_t *Setup)
+{
+  if (Setup->LatencyBefore > Setup->LatencyAfter && Setup->LatencyAfter >= 0)
+    return (Setup->LatencyBefore - Setup->LatencyAfter) * 1000u;
+  return 0u;
+}
+
+static inline void RtuSerialPrintSetup(const char *Device, const RtuSerialSetup_t *Setup, const RtuLine_t *Line)
+{
+  printf("%s: low latency %s, errors %s", Device, Setup->LowLatency ? "on" : "not supported",
+         Setup->Marking ? "marked" : "not marked (will appear as NULs)");
+  if (Setup->LatencyBefore < 0)
+    printf(", no adapter latency timer\n");
+  else if (Setup->LatencyAfter == Setup->LatencyBefore && Setup->LatencyBefore > 1)
+    printf(", adapter latency timer %dms (couldn't change it, try as root)\n", Setup->LatencyBefore);
+  else
+    printf(", adapter latency timer %dms -> %dms\n", Setup->LatencyBefore, Setup->LatencyAfter);
+  if (RtuSerialSaving(Setup))
+    printf("%s: each turnaround is up to %.1fms quicker, compared to a frame gap of %.1fms\n", Device,
+           RtuSerialSaving(Setup) / 1000.0, RtuLineFrameGap(Line) / 1000.0);
+}
+
+static inline bool RtuSerialGetCounts(int Fd, RtuSerialCounts_t *Counts)
+{
+  struct serial_icounter_struct Icount;
+
+  memset(Counts, 0, sizeof(*Counts));
+  if (ioctl(Fd, TIOCGICOUNT, &Icount) < 0)
+    return false;
+  Counts->Frame = Icount.frame;
+  Counts->Overrun = Icount.overrun;
+  Counts->Parity = Icount.parity;
+  Counts->Break = Icount.brk;
+  Counts->BufOverrun = Icount.buf_overrun;
+  return true;
+}
+#else
+static inline void RtuSerialConfigure(DCB *Dcb, const RtuLine_t *Line)
+{
+  Dcb->BaudRate = Line->Baud;
+  Dcb->ByteSize = Line->DataBits;
+  Dcb->StopBits = Line->StopBits == 2u ? TWOSTOPBITS : ONESTOPBIT;
+  Dcb->Parity = Line->Parity == 'E' ? EVENPARITY : (Line->Parity == 'O' ? ODDPARITY : NOPARITY);
+  Dcb->fParity = Line->Parity != 'N';
+}
+#endif
+
+// add on what's been counted between Start & End, the driver's counts are only
+// reliable whilst the port stays open so they're accumulated a session at a time
+static inline void RtuSerialAddCounts(RtuSerialCounts_t *Total, const RtuSerialCounts_t *Start, const RtuSerialCounts_t *End)
+{
+  Total->Frame += End->Frame - Start->Frame;
+  Total->Overrun += End->Overrun - Start->Overrun;
+  Total->Parity += End->Parity - Start->Parity;
+  Total->Break += End->Break - Start->Break;
+  Total->BufOverrun += End->BufOverrun - Start->BufOverrun;
+}
+
+// strip the error marking back out of Len bytes received, in place, dropping the
+// breaks & damaged characters (and counting them) so they never reach the frame
+// parser. A mark can be split across reads. Only for use when marking is actually
+// on (RtuSerialSetup_t.Marking), otherwise real data gets taken for marks.
+// Returns the number of bytes left
+static inline uint32_t RtuSerialUnmark(RtuSerialUnmark_t *Unmark, uint8_t *Buf, uint32_t Len)
+{
+  uint32_t Out = 0u;
+
+  for (uint32_t i = 0; i < Len; i++)
+  {
+    uint8_t Byte = Buf[i];
+
+    switch (Unmark->State)
+    {
+      case 0:
+        if (Byte == 0xffu)
+          Unmark->State = 1u;
+        else
+          Buf[Out++] = Byte;
+        break;
+      case 1:
+        if (!Byte)
+        {
+          Unmark->State = 2u;
+          break;
+        }
+        // an escaped 0xff. With marking on, anything else after a 0xff can't happen
+        // so the 0xff is taken as damaged - writing it out along with this byte could
+        // land ahead of what's still to be read, when the 0xff ended the last read
+        if (Byte == 0xffu)
+          Buf[Out++] = 0xffu;
+        else
+        {
+          Unmark->Errors++;
+          Buf[Out++] = Byte;
+        }
+        Unmark->State = 0u;
+        break;
+      default:
+        if (Byte)
+          Unmark->Errors++;
+        else
+          Unmark->Breaks++;
+        Unmark->State = 0u;
+        break;
+    }
+  }
+  return Out;
+}
+
+#endif
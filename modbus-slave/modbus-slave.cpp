@@ -14,20 +14,25 @@
 #include "registers.h"
 #include "read_transact.h"
 #include "write_transact.h"
+#include "personality.h"
+#include "rtu-serial.h"
 #include <boost/chrono/chrono.hpp>
 #include <boost/date_time.hpp>
 #include <modbus/modbus.h>
 #include <iostream>
 #include <inttypes.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
 
 // modebus-slave. This is designed to loosely emulate the behaviour of the Solis inverter
 // when connected to the wifi logger
 //
 
-static int32_t ModBusHandleResponse(const char *Device, uint8_t Slave, modbus_mapping_t *ModBusMapping, uint32_t LoggerInterval = 60u)
+static int32_t ModBusHandleResponse(const char *Device, const RtuLine_t *Line, uint8_t Slave, modbus_mapping_t *ModBusMapping, uint32_t LoggerInterval = 60000u)
 {
   using namespace boost::chrono;
-  modbus_t *Ctx = modbus_new_rtu(Device, 9600, 'N', 8, 1);
+  modbus_t *Ctx = modbus_new_rtu(Device, Line->Baud, Line->Parity, Line->DataBits, Line->StopBits);
   uint8_t *Request;
   int Rc;
   uint32_t Timeout = LoggerInterval;
@@ -55,8 +60,9 @@ static int32_t ModBusHandleResponse(const char *Device, uint8_t Slave, modbus_ma
   // by default (if RTS mode is unset), there is no delay, which is fine for RS232 but not for
   // 485 where we need to allow time for the transceivers to turn off/on
   // Based on traffic from modbus-sniffer, the Solis inverter typically takes anywhere 
-  // between ~35ms to 100ms to respond so we err on the conversative side here
-  if ( modbus_rtu_set_rts_delay(Ctx, 30*1000 ) == 0 )
+  // between ~35ms to 100ms to respond so we err on the conversative side here, 30ms
+  // at 9600 baud or about 30 characters
+  if ( modbus_rtu_set_rts_delay(Ctx, RtuLineChars(Line, 30u) ) == 0 )
     printf( "RTS delay: %d\n", modbus_rtu_get_rts_delay(Ctx)) ;
   else
   {
@@ -77,8 +83,9 @@ static int32_t ModBusHandleResponse(const char *Device, uint8_t Slave, modbus_ma
 
   // 40ms is also a bit trial/error based on the behaviour of the ESP32, which has an 80ms delay.
   // dropping it further can result in timeouts being triggered mid transaction - all of which may be
-  // due to the accuracy of the timers used by each device
-  if ( modbus_set_byte_timeout ( Ctx, 0, 40*1000 ) == 0 )
+  // due to the accuracy of the timers used by each device. As with the RTS delay it's in
+  // characters so it scales with the line speed
+  if ( modbus_set_byte_timeout ( Ctx, 0, RtuLineChars(Line, 40u) ) == 0 )
   {
     if ( modbus_get_byte_timeout ( Ctx, &Sec, &uSec ) == 0 )
       printf( "Byte timeout: %u:%u\n", Sec, uSec ) ;
@@ -114,19 +121,20 @@ static int32_t ModBusHandleResponse(const char *Device, uint8_t Slave, modbus_ma
 
   steady_clock::time_point TransactTime(steady_clock::now());
 
-  // continue to service requests until it's time to simulate the next logger transaction - every 60s
+  // continue to service requests until it's time to simulate the next logger transaction,
+  // 'LoggerInterval' ms from now
   while (Poll)
   {
     steady_clock::time_point Now(steady_clock::now());
 
-    uint32_t Elapsed = (uint32_t)(duration_cast<seconds>(Now - TransactTime).count());
+    uint32_t Elapsed = (uint32_t)(duration_cast<milliseconds>(Now - TransactTime).count());
 
     // adjust timeout accordingly
     if (Elapsed < LoggerInterval)
     {
       Timeout = LoggerInterval - Elapsed;
-      modbus_set_indication_timeout(Ctx, Timeout, 0);
-      printf("Set timeout to %u\n", Timeout);
+      modbus_set_indication_timeout(Ctx, Timeout / 1000u, (Timeout % 1000u) * 1000u);
+      printf("Set timeout to %u.%03u\n", Timeout / 1000u, Timeout % 1000u);
 
       do
       {
@@ -161,7 +169,7 @@ static int32_t ModBusHandleResponse(const char *Device, uint8_t Slave, modbus_ma
 
 #ifdef WIN32
 
-static HANDLE OpenW32Serial(const char *Device, int Flags)
+static HANDLE OpenW32Serial(const char *Device, const RtuLine_t *Line, int Flags)
 {
   DWORD CommFlags = 0;
 
@@ -184,10 +192,7 @@ static HANDLE OpenW32Serial(const char *Device, int Flags)
     CloseHandle(hComm);
     return INVALID_HANDLE_VALUE;
   }
-  Dcb.BaudRate = CBR_9600;
-  Dcb.ByteSize = 8;
-  Dcb.StopBits = ONESTOPBIT;
-  Dcb.Parity = NOPARITY;
+  RtuSerialConfigure(&Dcb, Line);
   Dcb.fBinary = TRUE;
   Dcb.fOutxCtsFlow = FALSE;
   Dcb.fOutxDsrFlow = FALSE;
@@ -206,9 +211,9 @@ static HANDLE OpenW32Serial(const char *Device, int Flags)
   return hComm;
 }
 
-static int OpenW32SerialAsFd(const char *Device, int Flags)
+static int OpenW32SerialAsFd(const char *Device, const RtuLine_t *Line, int Flags)
 {
-  HANDLE hComm = OpenW32Serial(Device, Flags);
+  HANDLE hComm = OpenW32Serial(Device, Line, Flags);
   if (hComm != INVALID_HANDLE_VALUE)
     return _open_osfhandle((intptr_t)hComm, Flags);
   else
@@ -217,34 +222,41 @@ static int OpenW32SerialAsFd(const char *Device, int Flags)
 
 #endif
 
-static void TransactSlave(modbus_t *Ctx)
+static void TransactSlave(modbus_t *Ctx, const Personality_t *Personality)
 {
   int Rc;
-  const int RegCount = 4;
-  int Registers[] = { 35000, 36000, 2999, 33000 };
   uint16_t RegValue;
 
-  // logger has a 3 second timeout on each request (except the final one)
-  modbus_set_response_timeout(Ctx, 3, 0);
-
-  for (int i = 0; i < RegCount; i++)
+  for (uint32_t i = 0; i < Personality->SlaveRegisterCount; i++)
   {
-    printf("Read register %d\n", Registers[i]);
-    Rc = modbus_read_input_registers(Ctx, Registers[i], sizeof(uint16_t), &RegValue);
+    // the logger has a timeout on each request, normally shorter on the final one
+    uint32_t Timeout = (i == Personality->SlaveRegisterCount - 1u) ? Personality->SlaveFinalTimeout : Personality->SlaveTimeout;
+
+    modbus_set_response_timeout(Ctx, Timeout / 1000u, (Timeout % 1000u) * 1000u);
+    printf("Read register %u\n", Personality->SlaveRegisters[i]);
+    Rc = modbus_read_input_registers(Ctx, Personality->SlaveRegisters[i], sizeof(uint16_t), &RegValue);
     if (Rc == sizeof(uint16_t))
     {
       printf("Reg Value: %hx\n", RegValue);
     }
     else
       printf("modbus_read_input_registers: %s\n", modbus_strerror(errno));
-
-    if (i == (RegCount-1))
-      modbus_set_response_timeout(Ctx, 1, 0); // set to 1s timeout on final tx, the 3s inter-slave delay then results in a 4s timeout if nothing responds
   }
 }
 
-// simulate a wifi logger transaction, this just dumps out representative, fixed data
-static bool SimulateBusTransaction(const char *Device, uint32_t &Elapsed)
+// 'Elapsed' is in ms
+static void PrintElapsed(const boost::posix_time::ptime &StartTime, uint32_t &Elapsed)
+{
+  boost::posix_time::ptime EndTime(boost::posix_time::microsec_clock::local_time());
+  boost::posix_time::time_duration ElapsedTime = EndTime - StartTime;
+
+  Elapsed = (uint32_t)ElapsedTime.total_milliseconds();
+  printf("Elapsed: %02" PRId64 ":%02" PRId64 ".%03" PRId64"\n", (int64_t)ElapsedTime.minutes(), (int64_t)ElapsedTime.seconds(),
+         (int64_t)(ElapsedTime.total_milliseconds() % 1000));
+}
+
+// the logger's register reads from slave 1, this just dumps out representative, fixed data
+static bool SimulateBurst(const char *Device, const Personality_t *Personality)
 {
   int Fd ;
   bool Status = true;
@@ -252,7 +264,7 @@ static bool SimulateBusTransaction(const char *Device, uint32_t &Elapsed)
 #ifndef WIN32
   Fd = open(Device, O_WRONLY);
 #else
-  Fd = OpenW32SerialAsFd(Device, O_WRONLY );
+  Fd = OpenW32SerialAsFd(Device, &Personality->Line, O_WRONLY );
 #endif
 
   if (Fd < 0)
@@ -260,20 +272,22 @@ static bool SimulateBusTransaction(const char *Device, uint32_t &Elapsed)
     perror("Failed to open input");
     return false;
   }
+#ifndef WIN32
+  if (!RtuSerialConfigure(Fd, &Personality->Line))
+  {
+    close(Fd);
+    return false;
+  }
+#endif
 
-  boost::posix_time::ptime RequestTime(boost::posix_time::second_clock::local_time());
-  std::cout << std::endl << "Simulated logger transact at " << boost::posix_time::to_simple_string(RequestTime) << "..." << std::endl;
-
-  // Primarily this is about simulating the timing behaviour. There are 13 distinct
-  // Modbus transactions performed occurring at anywhere from 136ms thru 242ms apart
+  // Primarily this is about simulating the timing behaviour. For firmware 13230 there are
+  // 13 distinct Modbus transactions performed occurring at anywhere from 136ms thru 242ms apart
   // overall the time taken is around 7s
-  const uint32_t TransactCount = 22u ;
-  const uint32_t TransactSize = __read_transact_bin_len / TransactCount ;
+  const uint32_t TransactSize = __read_transact_bin_len / Personality->BurstChunks ;
   uint8_t *Ptr = __read_transact_bin ;
-  const uint32_t TransactDelay = 800 ; 
 
   printf("Performing logger read register transactions\n");
-  for(uint32_t i=0 ; i < TransactCount ; i++ )
+  for(uint32_t i=0 ; i < Personality->BurstChunks ; i++ )
   {
     if (write(Fd, Ptr, TransactSize) < 0)
     {
@@ -281,29 +295,36 @@ static bool SimulateBusTransaction(const char *Device, uint32_t &Elapsed)
       Status = false;
     }
     Ptr+=TransactSize ;
-    Sleep(TransactDelay) ;
+    Sleep(Personality->BurstInterval) ;
   }
 
   close(Fd);
+  return Status;
+}
 
-  if (!Status)
-    return false;
-
-  // should be about 8s elapsed
+// poll the other slaves in turn, giving up after MaxSlaves of them
+static bool SimulateSlavePoll(const char *Device, const Personality_t *Personality, uint32_t MaxSlaves)
+{
+  std::vector<uint8_t> Slaves;
 
+  for (uint32_t Slave = Personality->SlaveFirst; Slave <= Personality->SlaveLast; Slave++)
+    Slaves.push_back((uint8_t)Slave);
+  if (Personality->SlaveOrder == SlaveOrderDescending)
+    std::reverse(Slaves.begin(), Slaves.end());
+  else if (Personality->SlaveOrder == SlaveOrderRandom)
   {
-    boost::posix_time::ptime EndTime(boost::posix_time::second_clock::local_time());
-    boost::posix_time::time_duration ElapsedTime = EndTime - RequestTime;
-    Elapsed = ElapsedTime.total_seconds();
-    printf("Elapsed: %02" PRId64 ":%02" PRId64 ".%03" PRId64"\n", ElapsedTime.minutes(), ElapsedTime.seconds(), ElapsedTime.fractional_seconds());
+    for (size_t i = Slaves.size(); i > 1; i--)
+      std::swap(Slaves[i - 1], Slaves[rand() % i]);
   }
+  if (Slaves.size() > MaxSlaves)
+  {
+    printf("Logger giving up after %u slaves\n", MaxSlaves);
+    Slaves.resize(MaxSlaves);
+  }
+  if (Slaves.empty())
+    return true;
 
-
-  // setup for starting to poll slaves
-  const uint32_t MaxSlaves = 10;
-  const uint32_t InterSlaveDelay = 3000;  // there is always a 3s delay between each set of slave transactions
-
-  modbus_t *Ctx = modbus_new_rtu(Device, 9600, 'N', 8, 1);
+  modbus_t *Ctx = modbus_new_rtu(Device, Personality->Line.Baud, Personality->Line.Parity, Personality->Line.DataBits, Personality->Line.StopBits);
 
   if (!Ctx)
   {
@@ -320,7 +341,7 @@ static bool SimulateBusTransaction(const char *Device, uint32_t &Elapsed)
   modbus_set_debug(Ctx, 1);
 
   // transact the slaves
-  for (uint32_t Slave = 2; Slave <= MaxSlaves; Slave++)
+  for (uint8_t Slave : Slaves)
   {
     if (modbus_set_slave(Ctx, Slave) == -1)
     {
@@ -329,21 +350,33 @@ static bool SimulateBusTransaction(const char *Device, uint32_t &Elapsed)
     else
     {
       printf("\nTransact Slave %u\n", Slave);
-      TransactSlave(Ctx);
+      TransactSlave(Ctx, Personality);
     }
-    Sleep(InterSlaveDelay);
+    Sleep(Personality->InterSlaveDelay);
   }
   modbus_close(Ctx);
   modbus_free(Ctx);
+  return true;
+}
 
-  boost::posix_time::ptime EndTime(boost::posix_time::second_clock::local_time());
-  boost::posix_time::time_duration ElapsedTime = EndTime - RequestTime ;
+// simulate a wifi logger transaction, the burst of reads and polling the other slaves
+// in whichever order the firmware does them. During a reset storm, the polling is cut short
+static bool SimulateBusTransaction(const char *Device, const Personality_t *Personality, bool Storm, uint32_t &Elapsed)
+{
+  uint32_t MaxSlaves = Storm ? Personality->StormSlaves : 256u;
+  bool Status;
 
-  // for non-responsive slaves, this should be ~2min, 5 seconds
-  // for responsive slaves, should be ~40s
-  Elapsed = ElapsedTime.total_seconds() ;
-  printf("Elapsed: %02" PRId64 ":%02" PRId64 ".%03" PRId64"\n", ElapsedTime.minutes(), ElapsedTime.seconds(), ElapsedTime.fractional_seconds());
+  boost::posix_time::ptime RequestTime(boost::posix_time::microsec_clock::local_time());
+  std::cout << std::endl << "Simulated logger transact at " << boost::posix_time::to_simple_string(RequestTime) << (Storm ? " (reset storm)..." : "...") << std::endl;
 
+  if (Personality->SlavesFirst)
+    Status = SimulateSlavePoll(Device, Personality, MaxSlaves) && SimulateBurst(Device, Personality);
+  else
+    Status = SimulateBurst(Device, Personality) && SimulateSlavePoll(Device, Personality, MaxSlaves);
+
+  // for firmware 13230 and non-responsive slaves, this should be ~2min, 5 seconds
+  // for responsive slaves, should be ~40s
+  PrintElapsed(RequestTime, Elapsed);
   return Status;
 }
 
@@ -357,10 +390,13 @@ int main(int argc, char *argv[])
   uint16_t *RegPtr = (uint16_t*)registers_bin;
   bool SimulateLogger = true;
   uint32_t Elapsed = 0 ;
+  Personality_t Personality ;
+  uint32_t Cycle = 0 ;
+  uint32_t Storm = 0 ;
 
   if (argc < 2)
   {
-    printf("Usage: modbus-slave <input> [slave address=1] [simulate-datalogger=1]\n");
+    printf("Usage: modbus-slave <input> [slave address=1] [simulate-datalogger=1] [logger profile]\n");
     return -1;
   }
 
@@ -370,6 +406,14 @@ int main(int argc, char *argv[])
   if (argc > 3)
     SimulateLogger = strtoul(argv[3], NULL, 0) ? true : false;
 
+  // how the simulated logger behaves, firmware 13230 unless told otherwise
+  PersonalityDefault(&Personality);
+  if (argc > 4 && !PersonalityLoad(argv[4], &Personality))
+    return -1;
+  if (SimulateLogger)
+    PersonalityPrint(&Personality);
+  srand((unsigned)time(NULL));
+
   ModBusMapping = modbus_mapping_new_start_address(0, 0, 0, 0, 0, 0, 33000, 300);
   if (!ModBusMapping)
   {
@@ -395,10 +439,32 @@ int main(int argc, char *argv[])
   // start the run
   while (Rc>=0)
   {
+    uint32_t Period = Personality.CyclePeriod * 1000u ;  // ms
+
     if (SimulateLogger)
-      SimulateBusTransaction(argv[1],Elapsed);
-    // each logger cycle is performed every 5 minutes so we have whatever is left to issue requests
-    Rc = ModBusHandleResponse(argv[1], Slave, ModBusMapping,300-Elapsed);
+    {
+      // every so often the logger resets, followed by a run of short cycles
+      if (Personality.ResetInterval && Cycle && (Cycle % Personality.ResetInterval) == 0)
+      {
+        printf("Simulating logger reset\n");
+        Storm = Personality.StormCycles ;
+      }
+      Cycle++ ;
+      SimulateBusTransaction(argv[1], &Personality, Storm > 0, Elapsed);
+      if (Storm)
+      {
+        Period = Personality.StormPeriod * 1000u ;
+        Storm-- ;
+      }
+      else if (Personality.CycleJitter)
+      {
+        // either side of the period, but a cycle can't start before the last one did
+        int64_t Jitter = (int64_t)(rand() % (2u * Personality.CycleJitter + 1u)) - Personality.CycleJitter ;
+        Period = (uint32_t)std::max<int64_t>((int64_t)Period + Jitter, 0) ;
+      }
+    }
+    // we have whatever is left of the logger cycle to issue requests
+    Rc = ModBusHandleResponse(argv[1], &Personality.Line, Slave, ModBusMapping, Period > Elapsed ? Period - Elapsed : 0u);
   }
 
   modbus_mapping_free(ModBusMapping);
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "personality.h"
+
+static const char *OrderNames[] = { "ascending", "descending", "random" };
+
+void PersonalityDefault(Personality_t *Personality)
+{
+  static const uint32_t Registers[] = { 35000, 36000, 2999, 33000 };
+
+  memset(Personality, 0, sizeof(*Personality));
+  RtuLineParse(RTU_LINE_DEFAULT, &Personality->Line);
+  Personality->CyclePeriod = 300u;
+  Personality->BurstChunks = 22u;
+  Personality->BurstInterval = 800u;
+  Personality->SlaveFirst = 2u;
+  Personality->SlaveLast = 10u;
+  Personality->SlaveOrder = SlaveOrderAscending;
+  memcpy(Personality->SlaveRegisters, Registers, sizeof(Registers));
+  Personality->SlaveRegisterCount = sizeof(Registers) / sizeof(Registers[0]);
+  // logger has a 3 second timeout on each request except the final one, which
+  // with the 3s inter-slave delay works out as a 4s gap if nothing responds
+  Personality->SlaveTimeout = 3000u;
+  Personality->SlaveFinalTimeout = 1000u;
+  Personality->InterSlaveDelay = 3000u;
+  Personality->StormCycles = 4u;
+  Personality->StormPeriod = 60u;
+  Personality->StormSlaves = 2u;
+}
+
+// strip leading/trailing whitespace in place
+static char *Trim(char *Str)
+{
+  char *End;
+
+  while (*Str == ' ' || *Str == '\t')
+    Str++;
+  End = Str + strlen(Str);
+  while (End > Str && (End[-1] == ' ' || End[-1] == '\t' || End[-1] == '\r' || End[-1] == '\n'))
+    *--End = '\0';
+  return Str;
+}
+
+static bool SetValue(Personality_t *Personality, const char *Key, const char *Value)
+{
+  uint32_t Number = strtoul(Value, NULL, 0);
+
+  if (!strcmp(Key, "serial"))
+    return RtuLineParse(Value, &Personality->Line);
+  else if (!strcmp(Key, "cycle_period"))
+    Personality->CyclePeriod = Number;
+  else if (!strcmp(Key, "cycle_jitter"))
+    Personality->CycleJitter = Number;
+  else if (!strcmp(Key, "burst_chunks"))
+    Personality->BurstChunks = Number ? Number : 1u;
+  else if (!strcmp(Key, "burst_interval"))
+    Personality->BurstInterval = Number;
+  else if (!strcmp(Key, "slaves_first"))
+    Personality->SlavesFirst = Number ? true : false;
+  else if (!strcmp(Key, "slave_first"))
+    Personality->SlaveFirst = (uint8_t)Number;
+  else if (!strcmp(Key, "slave_last"))
+    Personality->SlaveLast = (uint8_t)Number;
+  else if (!strcmp(Key, "slave_order"))
+  {
+    uint32_t i;
+
+    for (i = 0; i < sizeof(OrderNames) / sizeof(OrderNames[0]); i++)
+    {
+      if (!strcmp(Value, OrderNames[i]))
+        break;
+    }
+    if (i == sizeof(OrderNames) / sizeof(OrderNames[0]))
+      return false;
+    Personality->SlaveOrder = (SlaveOrder_t)i;
+  }
+  else if (!strcmp(Key, "slave_registers"))
+  {
+    uint32_t Registers[PersonalityMaxRegisters];
+    uint32_t Count = 0u;
+    const char *Ptr = Value;
+    char *End;
+
+    // all or nothing, so a bad list leaves the defaults alone
+    while (*Ptr)
+    {
+      if (Count == PersonalityMaxRegisters)
+      {
+        printf("slave_registers: no more than %u registers\n", PersonalityMaxRegisters);
+        return false;
+      }
+      Registers[Count++] = strtoul(Ptr, &End, 0);
+      if (End == Ptr || (*End && *End != ','))
+        return false;
+      Ptr = *End ? End + 1 : End;
+    }
+    memcpy(Personality->SlaveRegisters, Registers, Count * sizeof(Registers[0]));
+    Personality->SlaveRegisterCount = Count;
+  }
+  else if (!strcmp(Key, "slave_timeout"))
+    Personality->SlaveTimeout = Number;
+  else if (!strcmp(Key, "slave_final_timeout"))
+    Personality->SlaveFinalTimeout = Number;
+  else if (!strcmp(Key, "inter_slave_delay"))
+    Personality->InterSlaveDelay = Number;
+  else if (!strcmp(Key, "reset_interval"))
+    Personality->ResetInterval = Number;
+  else if (!strcmp(Key, "storm_cycles"))
+    Personality->StormCycles = Number;
+  else if (!strcmp(Key, "storm_period"))
+    Personality->StormPeriod = Number;
+  else if (!strcmp(Key, "storm_slaves"))
+    Personality->StormSlaves = Number;
+  else
+    return false;
+  return true;
+}
+
+bool PersonalityLoad(const char *Path, Personality_t *Personality)
+{
+  FILE *Fp = fopen(Path, "rt");
+  char Line[512];
+  uint32_t LineNo = 0;
+
+  if (!Fp)
+  {
+    perror("Failed to open logger profile");
+    return false;
+  }
+
+  while (fgets(Line, sizeof(Line), Fp))
+  {
+    char *Comment = strchr(Line, '#');
+    char *Key, *Value;
+    char *Sep;
+
+    LineNo++;
+    if (Comment)
+      *Comment = '\0';
+    Key = Trim(Line);
+    if (!*Key)
+      continue;
+
+    Sep = strchr(Key, '=');
+    if (!Sep)
+    {
+      printf("%s:%u: expected key=value, ignoring\n", Path, LineNo);
+      continue;
+    }
+    *Sep = '\0';
+    Value = Trim(Sep + 1);
+    Key = Trim(Key);
+    if (!SetValue(Personality, Key, Value))
+      printf("%s:%u: unknown setting or bad value '%s', ignoring\n", Path, LineNo, Key);
+  }
+  fclose(Fp);
+
+  if (Personality->SlaveLast < Personality->SlaveFirst)
+    Personality->SlaveLast = Personality->SlaveFirst;
+  if (!Personality->CyclePeriod)
+    Personality->CyclePeriod = 1u;
+  return true;
+}
+
+void PersonalityPrint(const Personality_t *Personality)
+{
+  printf("Serial line: %u,%u%c%u\n", Personality->Line.Baud, Personality->Line.DataBits,
+         Personality->Line.Parity, Personality->Line.StopBits);
+  printf("Logger cycle: %us (+/- %ums), burst of %u chunks %ums apart, slaves polled %s\n",
+         Personality->CyclePeriod, Personality->CycleJitter, Personality->BurstChunks,
+         Personality->BurstInterval, Personality->SlavesFirst ? "first" : "after");
+  printf("Slaves %u-%u (%s), %u reads each with a %ums timeout (%ums on the last), %ums between slaves\n",
+         Personality->SlaveFirst, Personality->SlaveLast, OrderNames[Personality->SlaveOrder],
+         Personality->SlaveRegisterCount, Personality->SlaveTimeout, Personality->SlaveFinalTimeout,
+         Personality->InterSlaveDelay);
+  if (Personality->ResetInterval)
+    printf("Resets every %u cycles, followed by %u cycles %us apart polling %u slaves\n",
+           Personality->ResetInterval, Personality->StormCycles, Personality->StormPeriod, Personality->StormSlaves);
+  else
+    printf("No resets\n");
+}
@@ -0,0 +1,67 @@
+#ifndef PERSONALITY_H
+#define PERSONALITY_H
+
+#include <stdint.h>
+#include "rtu-line.h"
+
+//
+// How the simulated wifi logger behaves. Different logger firmware polls the
+// inverter in quite different ways (compare data/13230_traffic.ods with
+// data/10154_traffic.ods) so rather than hard coding the behaviour of one of them,
+// it's loaded from a file of 'key=value' lines (anything after a '#' ignored).
+// Anything not in the file keeps the firmware 13230 behaviour.
+//
+// Each cycle consists of a burst of register reads from slave 1 (replayed from
+// read_transact.h) and a phase where the other slaves are polled, each in turn,
+// with a few reads that (normally) go unanswered. Every so often the logger
+// resets, after which it runs a storm of short cycles where the slave polling is
+// cut short, as seen in data/logger-reset.ods
+//
+
+static const uint32_t PersonalityMaxRegisters = 8u;
+
+typedef enum {
+  SlaveOrderAscending,
+  SlaveOrderDescending,
+  SlaveOrderRandom
+} SlaveOrder_t;
+
+typedef struct {
+  // the serial line, which sets the pace of everything on it
+  RtuLine_t Line;
+
+  // the cycle
+  uint32_t CyclePeriod;       // s, from the start of one cycle to the next
+  uint32_t CycleJitter;       // ms, random variation either side of the period
+
+  // the burst of reads from slave 1
+  uint32_t BurstChunks;       // the captured burst is written out in this many pieces
+  uint32_t BurstInterval;     // ms between each
+  bool SlavesFirst;           // poll the other slaves before the burst rather than after
+
+  // polling the other slaves
+  uint8_t SlaveFirst;
+  uint8_t SlaveLast;
+  SlaveOrder_t SlaveOrder;
+  uint32_t SlaveRegisters[PersonalityMaxRegisters];
+  uint32_t SlaveRegisterCount;
+  uint32_t SlaveTimeout;      // ms, for each read
+  uint32_t SlaveFinalTimeout; // ms, for the last read of each slave
+  uint32_t InterSlaveDelay;   // ms, between one slave and the next
+
+  // resets
+  uint32_t ResetInterval;     // cycles between resets, 0 = never
+  uint32_t StormCycles;       // short cycles following a reset
+  uint32_t StormPeriod;       // s, between those cycles
+  uint32_t StormSlaves;       // slaves polled in each before it gives up
+} Personality_t;
+
+// fill in the firmware 13230 behaviour
+void PersonalityDefault(Personality_t *Personality);
+
+// load a profile over the top of whatever's already there
+bool PersonalityLoad(const char *Path, Personality_t *Personality);
+
+void PersonalityPrint(const Personality_t *Personality);
+
+#endif
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef WIN32
+#include <io.h>
+#pragma warning(disable : 4996)
+#else
+#include <unistd.h>
+#include <poll.h>
+#endif
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <boost/date_time/c_local_time_adjustor.hpp>
+#include "capture.h"
+
+// both sizes must be a power of 2. At 9600 baud the byte ring holds the best part
+// of 20 minutes of traffic, the chunk ring allows for every read returning a single byte
+static const size_t RingSize = 1u << 20;
+static const size_t ChunkCount = 1u << 16;
+
+// a single read from the port, in the order they arrived
+typedef struct {
+  uint64_t End;    // offset in the stream just beyond the last byte of this chunk
+  boost::posix_time::ptime Time;  // UTC
+} CaptureChunk_t;
+
+struct Capture {
+  int Fd;
+  bool Live;
+  std::vector<uint8_t> Ring;
+  std::vector<CaptureChunk_t> Chunks;
+  std::thread Thread;
+
+  // the only state shared between the two threads, each side only ever writes it's own
+  alignas(64) std::atomic<uint64_t> Head;      // chunks made available by the capture thread
+  alignas(64) std::atomic<uint64_t> Tail;      // chunks finished with by the reader
+  std::atomic<uint64_t> Consumed;              // bytes finished with by the reader
+  std::atomic<bool> Ended;
+  std::atomic<bool> Interrupted;
+
+  // so the reader can sleep when there's nothing to do, the capture thread only
+  // takes the lock to wake it if it's actually waiting
+  std::atomic<bool> Waiting;
+  std::mutex WakeLock;
+  std::condition_variable Wake;
+
+  // capture thread only
+  uint64_t Produced;
+
+  // reader only
+  uint64_t ReadPos;
+  boost::posix_time::ptime LastTime;
+  uint64_t ReportedDropped;
+
+  std::atomic<uint64_t> Bytes;
+  std::atomic<uint64_t> Dropped;
+  std::atomic<uint64_t> Reads;
+  std::atomic<uint64_t> MaxDepth;
+  std::atomic<uint64_t> MaxChunks;
+};
+
+static void WakeReader(Capture_t *Capture)
+{
+  if (Capture->Waiting.load())
+  {
+    std::lock_guard<std::mutex> Lock(Capture->WakeLock);
+    Capture->Wake.notify_one();
+  }
+}
+
+static void CaptureLoop(Capture_t *Capture)
+{
+  uint8_t Scratch[256];
+
+  while (!Capture->Interrupted.load(std::memory_order_relaxed))
+  {
+    uint64_t Head = Capture->Head.load(std::memory_order_relaxed);
+    uint64_t Depth = Capture->Produced - Capture->Consumed.load(std::memory_order_acquire);
+    uint64_t Chunks = Head - Capture->Tail.load(std::memory_order_acquire);
+    size_t Space = RingSize - Depth;
+    size_t Offset = Capture->Produced & (RingSize - 1u);
+    uint8_t *Dest;
+    int Rc;
+
+#ifndef WIN32
+    // wake up every so often to check if we've been told to stop
+    struct pollfd Pfd = { Capture->Fd, POLLIN, 0 };
+
+    Rc = poll(&Pfd, 1, 100);
+    if (Rc < 0 && errno != EINTR)
+    {
+      perror("capture poll");
+      break;
+    }
+    if (Rc <= 0)
+      continue;
+#endif
+
+    if (!Space || Chunks >= ChunkCount)
+    {
+      if (!Capture->Live)
+      {
+        // reading a file, nothing's lost by waiting for the reader to catch up
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        continue;
+      }
+      // the port still needs emptying, but there's nowhere to put it
+      Rc = read(Capture->Fd, Scratch, sizeof(Scratch));
+      if (Rc > 0)
+        Capture->Dropped.fetch_add(Rc, std::memory_order_relaxed);
+    }
+    else
+    {
+      // straight into the ring, up to where it wraps
+      Dest = &Capture->Ring[Offset];
+      if (Space > RingSize - Offset)
+        Space = RingSize - Offset;
+      Rc = read(Capture->Fd, Dest, Space);
+      if (Rc > 0)
+      {
+        CaptureChunk_t *Chunk = &Capture->Chunks[Head & (ChunkCount - 1u)];
+
+        Chunk->Time = boost::posix_time::microsec_clock::universal_time();
+        Capture->Produced += Rc;
+        Chunk->End = Capture->Produced;
+        Capture->Head.store(Head + 1u, std::memory_order_release);
+        WakeReader(Capture);
+
+        Capture->Bytes.fetch_add(Rc, std::memory_order_relaxed);
+        Capture->Reads.fetch_add(1u, std::memory_order_relaxed);
+        if (Depth + Rc > Capture->MaxDepth.load(std::memory_order_relaxed))
+          Capture->MaxDepth.store(Depth + Rc, std::memory_order_relaxed);
+        if (Chunks + 1u > Capture->MaxChunks.load(std::memory_order_relaxed))
+          Capture->MaxChunks.store(Chunks + 1u, std::memory_order_relaxed);
+      }
+    }
+
+    if (Rc < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      perror("capture read");
+      break;
+    }
+    if (!Rc)  // end of file
+      break;
+  }
+
+  Capture->Ended.store(true);
+  WakeReader(Capture);
+}
+
+Capture_t *CaptureStart(int Fd, bool Live)
+{
+  Capture_t *Capture = new Capture_t;
+
+  Capture->Fd = Fd;
+  Capture->Live = Live;
+  Capture->Ring.resize(RingSize);
+  Capture->Chunks.resize(ChunkCount);
+  Capture->Head = 0u;
+  Capture->Tail = 0u;
+  Capture->Consumed = 0u;
+  Capture->Ended = false;
+  Capture->Interrupted = false;
+  Capture->Waiting = false;
+  Capture->Produced = 0u;
+  Capture->ReadPos = 0u;
+  Capture->ReportedDropped = 0u;
+  Capture->Bytes = 0u;
+  Capture->Dropped = 0u;
+  Capture->Reads = 0u;
+  Capture->MaxDepth = 0u;
+  Capture->MaxChunks = 0u;
+
+  Capture->Thread = std::thread(CaptureLoop, Capture);
+  return Capture;
+}
+
+int CaptureRead(Capture_t *Capture, void *Buf, size_t Count, int TimeOut)
+{
+  uint64_t Tail = Capture->Tail.load(std::memory_order_relaxed);
+  const CaptureChunk_t *Chunk;
+  uint8_t *Ptr = (uint8_t*)Buf;
+  size_t Offset, Len, First;
+  uint64_t Dropped;
+
+  if (!Count)
+    return 0;
+
+  // nothing there, wait for the capture thread
+  while (Tail == Capture->Head.load(std::memory_order_acquire))
+  {
+    std::unique_lock<std::mutex> Lock(Capture->WakeLock);
+    bool Ended;
+
+    Capture->Waiting.store(true);
+    // having said we're waiting, check again so a wake up can't be missed
+    Ended = Capture->Ended.load();
+    if (Tail == Capture->Head.load(std::memory_order_acquire))
+    {
+      if (Ended)
+      {
+        Capture->Waiting.store(false);
+        return -1;
+      }
+      // the timeout is only a backstop for the wait itself, it's not relied on
+      if (Capture->Wake.wait_for(Lock, std::chrono::milliseconds(TimeOut < 0 ? 100 : TimeOut)) ==
+            std::cv_status::timeout && TimeOut >= 0 && Tail == Capture->Head.load(std::memory_order_acquire))
+      {
+        Capture->Waiting.store(false);
+        return 0;
+      }
+    }
+    Capture->Waiting.store(false);
+  }
+
+  // the decode can't keep up, let it be known
+  Dropped = Capture->Dropped.load(std::memory_order_relaxed);
+  if (Dropped != Capture->ReportedDropped)
+  {
+    printf("Capture buffer full, %llu bytes dropped so far\n", (unsigned long long)Dropped);
+    Capture->ReportedDropped = Dropped;
+  }
+
+  // from the oldest chunk, which may wrap round the end of the ring
+  Chunk = &Capture->Chunks[Tail & (ChunkCount - 1u)];
+  Len = Chunk->End - Capture->ReadPos;
+  if (Len > Count)
+    Len = Count;
+  Offset = Capture->ReadPos & (RingSize - 1u);
+  First = (Len > RingSize - Offset) ? RingSize - Offset : Len;
+  memcpy(Ptr, &Capture->Ring[Offset], First);
+  if (Len > First)
+    memcpy(Ptr + First, &Capture->Ring[0], Len - First);
+  Capture->LastTime = Chunk->Time;
+
+  Capture->ReadPos += Len;
+  if (Capture->ReadPos == Chunk->End)
+    Capture->Tail.store(Tail + 1u, std::memory_order_release);
+  Capture->Consumed.store(Capture->ReadPos, std::memory_order_release);
+  return (int)Len;
+}
+
+boost::posix_time::ptime CaptureTime(Capture_t *Capture)
+{
+  if (Capture->LastTime.is_special())
+    return Capture->LastTime;
+  return boost::date_time::c_local_adjustor<boost::posix_time::ptime>::utc_to_local(Capture->LastTime);
+}
+
+boost::posix_time::ptime CaptureTimeUtc(Capture_t *Capture)
+{
+  return Capture->LastTime;
+}
+
+CaptureStats_t CaptureGetStats(Capture_t *Capture)
+{
+  CaptureStats_t Stats;
+
+  Stats.Bytes = Capture->Bytes.load();
+  Stats.Dropped = Capture->Dropped.load();
+  Stats.Reads = Capture->Reads.load();
+  Stats.MaxDepth = Capture->MaxDepth.load();
+  Stats.MaxChunks = Capture->MaxChunks.load();
+  return Stats;
+}
+
+void CaptureInterrupt(Capture_t *Capture)
+{
+  if (Capture)
+    Capture->Interrupted.store(true);
+}
+
+void CaptureStop(Capture_t *Capture)
+{
+  if (!Capture)
+    return;
+  Capture->Interrupted.store(true);
+#ifdef WIN32
+  // there's no way of breaking out of a blocked read on a live port
+  if (!Capture->Ended.load())
+  {
+    Capture->Thread.detach();
+    return;
+  }
+#endif
+  if (Capture->Thread.joinable())
+    Capture->Thread.join();
+  delete Capture;
+}
@@ -0,0 +1,50 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+//
+// Capture of the raw serial stream on it's own thread. All it does is read
+// whatever's arrived, timestamp it and put it in a lock free ring buffer, so
+// however long the decode & output take (eg. over a slow SSH session), the
+// serial port is still being emptied as fast as the data arrives.
+//
+// For a live port, should the decoding fall so far behind that the ring fills,
+// data is dropped (and counted) rather than holding up the capture. Reading from
+// a file, the capture waits for the decoding instead
+//
+
+typedef struct Capture Capture_t;
+
+typedef struct {
+  uint64_t Bytes;       // captured & queued
+  uint64_t Dropped;     // lost because the ring was full
+  uint64_t Reads;       // chunks read from the port
+  uint64_t MaxDepth;    // most bytes waiting to be decoded at once
+  uint64_t MaxChunks;   // most chunks waiting to be decoded at once
+} CaptureStats_t;
+
+// start capturing from an open file descriptor
+Capture_t *CaptureStart(int Fd, bool Live);
+
+// fetch up to Count bytes, waiting up to TimeOut ms (or indefinitely if negative)
+// for some to arrive. Returns the number fetched, 0 on timeout or -1 once the
+// input has ended & everything captured has been read
+int CaptureRead(Capture_t *Capture, void *Buf, size_t Count, int TimeOut = -1);
+
+// when the last byte fetched was captured, as local time or UTC
+boost::posix_time::ptime CaptureTime(Capture_t *Capture);
+boost::posix_time::ptime CaptureTimeUtc(Capture_t *Capture);
+
+CaptureStats_t CaptureGetStats(Capture_t *Capture);
+
+// end the capture early, this is safe to call from a signal handler. Anything
+// already captured can still be read
+void CaptureInterrupt(Capture_t *Capture);
+
+// stop capturing (if it hasn't already finished) & tidy up
+void CaptureStop(Capture_t *Capture);
+
+#endif
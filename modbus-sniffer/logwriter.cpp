@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#ifndef WIN32
+#include <spawn.h>
+#include <sys/wait.h>
+#endif
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include "logwriter.h"
+
+// once this much is waiting, don't hang around for the flush interval
+static const size_t BatchSize = 64u * 1024u;
+// and beyond this, the disk isn't keeping up so start dropping
+static const size_t MaxPending = 4u * 1024u * 1024u;
+
+struct LogWriter {
+  std::string Extension;
+  std::string Header;
+  bool LineBased;
+  LogWriterConfig_t Config;
+
+  std::mutex Lock;
+  std::condition_variable Signal;
+  std::thread Thread;
+  bool Shutdown;
+
+  // filled in by whoever's logging, under the lock
+  std::vector<char> Pending;
+  std::vector<std::pair<size_t, time_t>> Rotations;  // offsets into Pending at which a new file starts
+  uint64_t Position;     // into the current file, including what's still pending
+  time_t FileStart;
+  bool AtLineStart;
+  LogWriterStats_t Stats;
+
+  // only touched by the writer thread, once it's started
+  FILE *Fp;
+  std::string FileName;
+  std::string LastBase;
+  uint32_t NameCount;
+};
+
+#ifndef WIN32
+// gzip a finished file, this runs on the writer thread so it's not holding anything up
+static void CompressFile(const std::string &Name)
+{
+  const char *Args[] = { "gzip", "-f", Name.c_str(), nullptr };
+  pid_t Pid;
+  int Status;
+
+  if (posix_spawnp(&Pid, "gzip", nullptr, nullptr, (char* const*)Args, nullptr) != 0)
+  {
+    perror("gzip");
+    return;
+  }
+  if (waitpid(Pid, &Status, 0) < 0 || !WIFEXITED(Status) || WEXITSTATUS(Status))
+    printf("Failed to compress %s\n", Name.c_str());
+}
+#else
+static void CompressFile(const std::string &Name)
+{
+}
+#endif
+
+// open the next file, named after the time it was started
+static bool OpenFile(LogWriter_t *Log, time_t Start)
+{
+  char Base[64];
+
+  strftime(Base, sizeof(Base), "%Y-%m-%d_%H-%M-%S", localtime(&Start));
+  // more than one a second, tack a count on the end
+  if (Log->LastBase == Base)
+    Log->FileName = Log->LastBase + "_" + std::to_string(++Log->NameCount) + Log->Extension;
+  else
+  {
+    Log->LastBase = Base;
+    Log->NameCount = 0u;
+    Log->FileName = Log->LastBase + Log->Extension;
+  }
+
+  Log->Fp = fopen(Log->FileName.c_str(), Log->LineBased ? "wt" : "wb");
+  if (!Log->Fp)
+  {
+    printf("Failed to create log file: %s\n", Log->FileName.c_str());
+    return false;
+  }
+  return true;
+}
+
+static void RotateFile(LogWriter_t *Log, time_t Start)
+{
+  std::string Finished = Log->FileName;
+
+  if (Log->Fp)
+    fclose(Log->Fp);
+  Log->Fp = nullptr;
+  if (OpenFile(Log, Start))
+    printf("Log continuing in: %s\n", Log->FileName.c_str());
+  if (Log->Config.Compress)
+    CompressFile(Finished);
+}
+
+static void WriterLoop(LogWriter_t *Log)
+{
+  std::vector<char> Batch;
+  std::vector<std::pair<size_t, time_t>> Rotations;
+  bool Done = false;
+
+  while (!Done)
+  {
+    {
+      std::unique_lock<std::mutex> Lock(Log->Lock);
+
+      Log->Signal.wait_for(Lock, std::chrono::milliseconds(Log->Config.FlushInterval),
+                           [Log] { return Log->Shutdown || Log->Pending.size() >= BatchSize; });
+      Batch.swap(Log->Pending);
+      Rotations.swap(Log->Rotations);
+      Done = Log->Shutdown;
+    }
+
+    if (!Batch.empty() || !Rotations.empty())
+    {
+      size_t Start = 0;
+
+      for (auto &Rotation : Rotations)
+      {
+        if (Log->Fp && Rotation.first > Start)
+          fwrite(&Batch[Start], 1, Rotation.first - Start, Log->Fp);
+        Start = Rotation.first;
+        RotateFile(Log, Rotation.second);
+      }
+      if (Log->Fp && Batch.size() > Start)
+        fwrite(&Batch[Start], 1, Batch.size() - Start, Log->Fp);
+      if (Log->Fp)
+        fflush(Log->Fp);
+
+      {
+        std::lock_guard<std::mutex> Lock(Log->Lock);
+
+        Log->Stats.Bytes += Batch.size();
+        Log->Stats.Batches++;
+      }
+      Batch.clear();
+      Rotations.clear();
+    }
+  }
+}
+
+LogWriter_t *LogWriterCreate(const char *Description, const char *Extension, const char *Header,
+                             bool LineBased, const LogWriterConfig_t *Config)
+{
+  LogWriter_t *Log = new LogWriter_t;
+
+  Log->Extension = Extension;
+  Log->Header = Header ? Header : "";
+  Log->LineBased = LineBased;
+  Log->Config = *Config;
+  if (!Log->Config.FlushInterval)
+    Log->Config.FlushInterval = 1000u;
+  Log->Shutdown = false;
+  Log->Position = 0u;
+  Log->FileStart = time(NULL);
+  Log->AtLineStart = true;
+  memset(&Log->Stats, 0, sizeof(Log->Stats));
+  Log->Fp = nullptr;
+  Log->NameCount = 0u;
+
+#ifdef WIN32
+  if (Log->Config.Compress)
+  {
+    printf("Log compression not supported on this platform\n");
+    Log->Config.Compress = false;
+  }
+#endif
+
+  // open the first one here so any problem can be reported straight away
+  if (!OpenFile(Log, Log->FileStart))
+  {
+    delete Log;
+    return nullptr;
+  }
+  printf("Writing %s to: %s\n", Description, Log->FileName.c_str());
+  LogWrite(Log, Log->Header.data(), Log->Header.size());
+
+  Log->Thread = std::thread(WriterLoop, Log);
+  return Log;
+}
+
+void LogWrite(LogWriter_t *Log, const void *Data, size_t Len)
+{
+  std::lock_guard<std::mutex> Lock(Log->Lock);
+  const char *Bytes = (const char*)Data;
+
+  if (!Len)
+    return;
+
+  if (Log->Pending.size() + Len > MaxPending)
+  {
+    Log->Stats.Dropped += Len;
+    return;
+  }
+
+  // time for a new file? Text logs only move on at the end of a line
+  if ((!Log->LineBased || Log->AtLineStart) && Log->Position > Log->Header.size())
+  {
+    time_t Now = time(NULL);
+
+    if ((Log->Config.RotateSize && Log->Position >= Log->Config.RotateSize) ||
+        (Log->Config.RotateInterval && Now - Log->FileStart >= (time_t)Log->Config.RotateInterval))
+    {
+      Log->Rotations.push_back(std::make_pair(Log->Pending.size(), Now));
+      Log->Stats.Rotations++;
+      Log->Pending.insert(Log->Pending.end(), Log->Header.begin(), Log->Header.end());
+      Log->Position = Log->Header.size();
+      Log->FileStart = Now;
+    }
+  }
+
+  Log->Pending.insert(Log->Pending.end(), Bytes, Bytes + Len);
+  Log->Position += Len;
+  Log->AtLineStart = Bytes[Len - 1] == '\n';
+  if (Log->Pending.size() > Log->Stats.MaxPending)
+    Log->Stats.MaxPending = Log->Pending.size();
+  if (Log->Pending.size() >= BatchSize)
+    Log->Signal.notify_one();
+}
+
+void LogPrintf(LogWriter_t *Log, const char *Format, ...)
+{
+  char Line[512];
+  va_list Args;
+  int Len;
+
+  va_start(Args, Format);
+  Len = vsnprintf(Line, sizeof(Line), Format, Args);
+  va_end(Args);
+  if (Len > 0)
+    LogWrite(Log, Line, (size_t)Len < sizeof(Line) ? Len : sizeof(Line) - 1u);
+}
+
+uint64_t LogPosition(LogWriter_t *Log)
+{
+  std::lock_guard<std::mutex> Lock(Log->Lock);
+
+  return Log->Position;
+}
+
+LogWriterStats_t LogWriterGetStats(LogWriter_t *Log)
+{
+  std::lock_guard<std::mutex> Lock(Log->Lock);
+
+  return Log->Stats;
+}
+
+void LogWriterClose(LogWriter_t *Log)
+{
+  LogWriterStats_t Stats;
+
+  if (!Log)
+    return;
+
+  {
+    std::lock_guard<std::mutex> Lock(Log->Lock);
+    Log->Shutdown = true;
+  }
+  Log->Signal.notify_one();
+  if (Log->Thread.joinable())
+    Log->Thread.join();
+  if (Log->Fp)
+    fclose(Log->Fp);
+
+  Stats = Log->Stats;
+  printf("%s: %llu bytes in %u writes, %u new files, %llu bytes dropped, at most %zu bytes buffered\n",
+         Log->FileName.c_str(), (unsigned long long)Stats.Bytes, Stats.Batches, Stats.Rotations,
+         (unsigned long long)Stats.Dropped, Stats.MaxPending);
+  delete Log;
+}
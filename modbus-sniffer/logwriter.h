@@ -0,0 +1,52 @@
+#ifndef LOGWRITER_H
+#define LOGWRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+//
+// Background writer for the CSV and binary logs. Writes are appended to an
+// in-memory buffer which a separate thread writes out in batches, so decoding
+// the live stream never waits on the disk. Should the disk fall that far behind
+// that the buffer fills, data is dropped (and counted) rather than stalling.
+//
+// Files are named after the time they were started, optionally starting a new one
+// once they reach a given size and/or age, with the old one then compressed
+//
+
+typedef struct {
+  uint64_t RotateSize;      // start a new file once it reaches this many bytes (0 = never)
+  uint32_t RotateInterval;  // start a new file after this many seconds (0 = never)
+  bool Compress;            // gzip each file once it's been finished with
+  uint32_t FlushInterval;   // longest (ms) anything is held in memory before being written
+} LogWriterConfig_t;
+
+typedef struct {
+  uint64_t Bytes;       // written to disk
+  uint64_t Dropped;     // lost because the buffer was full
+  uint32_t Batches;     // number of writes
+  uint32_t Rotations;   // files started, after the first
+  size_t MaxPending;    // most held in memory at once
+} LogWriterStats_t;
+
+typedef struct LogWriter LogWriter_t;
+
+// start a log, Extension determines the file type (".csv" etc.). For line based (text)
+// logs, a new file is only started at the end of a line and starts with the Header
+LogWriter_t *LogWriterCreate(const char *Description, const char *Extension, const char *Header,
+                             bool LineBased, const LogWriterConfig_t *Config);
+
+// queue data to be written, never blocks on the disk
+void LogWrite(LogWriter_t *Log, const void *Data, size_t Len);
+void LogPrintf(LogWriter_t *Log, const char *Format, ...);
+
+// how far into the current file the next byte written will be
+uint64_t LogPosition(LogWriter_t *Log);
+
+LogWriterStats_t LogWriterGetStats(LogWriter_t *Log);
+
+// write out anything outstanding & close the file
+void LogWriterClose(LogWriter_t *Log);
+
+#endif
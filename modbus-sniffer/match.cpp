@@ -0,0 +1,106 @@
+#include <string.h>
+#include <bitset>
+#include "match.h"
+
+struct Matcher {
+  uint64_t TimeOut;
+  MatchTimeoutHandler_t Handler;
+  void *User;
+  std::bitset<256> Expected;    // none set = all of them
+  MatchRequest_t Pending;
+  bool Outstanding;
+  MatchRequest_t Matched;       // handed back from MatchResponse
+  MatchStats_t Stats;
+};
+
+Matcher_t *MatcherCreate(uint64_t TimeOut, MatchTimeoutHandler_t Handler, void *User)
+{
+  Matcher_t *Matcher = new Matcher_t;
+
+  Matcher->TimeOut = TimeOut;
+  Matcher->Handler = Handler;
+  Matcher->User = User;
+  Matcher->Outstanding = false;
+  memset(&Matcher->Stats, 0, sizeof(Matcher->Stats));
+  return Matcher;
+}
+
+void MatcherExpect(Matcher_t *Matcher, uint8_t Slave)
+{
+  Matcher->Expected.set(Slave);
+}
+
+// nothing's coming for whatever's outstanding
+static void GiveUp(Matcher_t *Matcher)
+{
+  if (!Matcher->Outstanding)
+    return;
+  Matcher->Outstanding = false;
+  if (Matcher->Pending.Expected)
+    Matcher->Stats.TimedOut++;
+  else
+    Matcher->Stats.Unanswered++;
+  if (Matcher->Handler)
+    Matcher->Handler(&Matcher->Pending, Matcher->User);
+}
+
+void MatchRequest(Matcher_t *Matcher, const RtuFrame_t *Frame)
+{
+  GiveUp(Matcher);
+
+  Matcher->Stats.Requests++;
+  Matcher->Pending.Slave = Frame->Slave;
+  Matcher->Pending.Function = Frame->Function;
+  Matcher->Pending.Address = Frame->Address;
+  Matcher->Pending.Count = Frame->Count;
+  Matcher->Pending.Time = Frame->Time;
+  Matcher->Pending.Expected = Matcher->Expected.none() || Matcher->Expected.test(Frame->Slave);
+  Matcher->Outstanding = true;
+}
+
+const MatchRequest_t *MatchResponse(Matcher_t *Matcher, const RtuFrame_t *Frame, uint64_t &Latency)
+{
+  const MatchRequest_t *Pending = &Matcher->Pending;
+
+  Latency = 0u;
+  if (!Matcher->Outstanding || Pending->Slave != Frame->Slave || Pending->Function != Frame->Function ||
+      (!Frame->Exception && Frame->Function != MODBUS_RTU_WRITE_SINGLE &&
+       Frame->Function != MODBUS_RTU_WRITE_MULTIPLE && Frame->Count != Pending->Count))
+  {
+    Matcher->Stats.Unmatched++;
+    return nullptr;
+  }
+
+  // the times come from the capture, so can't go backwards, but be on the safe side
+  Latency = Frame->Time > Pending->Time ? Frame->Time - Pending->Time : 0u;
+  if (Latency > Matcher->TimeOut)
+  {
+    Matcher->Stats.Late++;
+    GiveUp(Matcher);
+    return nullptr;
+  }
+
+  Matcher->Outstanding = false;
+  Matcher->Stats.Answered++;
+  if (Frame->Exception)
+    Matcher->Stats.Exceptions++;
+  if (Latency > Matcher->Stats.MaxLatency)
+    Matcher->Stats.MaxLatency = Latency;
+  Matcher->Matched = *Pending;
+  return &Matcher->Matched;
+}
+
+void MatchFlush(Matcher_t *Matcher)
+{
+  GiveUp(Matcher);
+}
+
+MatchStats_t MatcherGetStats(Matcher_t *Matcher)
+{
+  return Matcher->Stats;
+}
+
+void MatcherDestroy(Matcher_t *Matcher)
+{
+  delete Matcher;
+}
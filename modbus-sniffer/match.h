@@ -0,0 +1,67 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stdint.h>
+#include "modbus-rtu.h"
+
+//
+// Pairs up requests & responses as the parser hands them over. Each frame has
+// already been classified on it's own (by length & CRC), so a missing or damaged
+// response just leaves a request unanswered rather than throwing the rest of the
+// decode out.
+//
+// The bus is half duplex with only one transaction in progress at a time, so when
+// the next request comes along, whatever was outstanding is never going to get a
+// response and is counted as having timed out. A response only matches if it's
+// from the same slave, for the same function (and for a read, the number of
+// registers asked for) & arrives within the timeout
+//
+
+typedef struct Matcher Matcher_t;
+
+// a request waiting for a response
+typedef struct {
+  uint8_t Slave;
+  uint8_t Function;
+  uint16_t Address;
+  uint16_t Count;
+  uint64_t Time;        // us
+  bool Expected;        // whether a response was expected
+} MatchRequest_t;
+
+typedef struct {
+  uint64_t Requests;
+  uint64_t Answered;    // including those answered with an exception
+  uint64_t Exceptions;
+  uint64_t TimedOut;    // a response was expected but never came
+  uint64_t Unanswered;  // no response, but then none was expected
+  uint64_t Unmatched;   // responses with no request to go with them
+  uint64_t Late;        // responses that turned up after the timeout
+  uint64_t MaxLatency;  // us
+} MatchStats_t;
+
+// called for each request given up on
+typedef void (*MatchTimeoutHandler_t)(const MatchRequest_t *Request, void *User);
+
+// TimeOut is in us. Until told otherwise, a response is expected from every slave
+Matcher_t *MatcherCreate(uint64_t TimeOut, MatchTimeoutHandler_t Handler, void *User);
+
+// only these slaves are expected to respond, requests to any others going
+// unanswered are counted separately
+void MatcherExpect(Matcher_t *Matcher, uint8_t Slave);
+
+// a request's been seen, anything still outstanding is given up on
+void MatchRequest(Matcher_t *Matcher, const RtuFrame_t *Frame);
+
+// a response's been seen, returns the request it answers (and how long it took)
+// or nullptr if there isn't one
+const MatchRequest_t *MatchResponse(Matcher_t *Matcher, const RtuFrame_t *Frame, uint64_t &Latency);
+
+// the traffic has ended, give up on anything outstanding
+void MatchFlush(Matcher_t *Matcher);
+
+MatchStats_t MatcherGetStats(Matcher_t *Matcher);
+
+void MatcherDestroy(Matcher_t *Matcher);
+
+#endif
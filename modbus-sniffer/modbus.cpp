@@ -1,6 +1,9 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <stdarg.h>
 #ifdef WIN32
 #include <io.h>
 #pragma warning(disable : 4996)
@@ -9,13 +12,25 @@
 #include <sys/select.h>
 #include <sys/stat.h>
 #endif
-#include <boost/crc.hpp>
 #include <boost/date_time.hpp>
 #include <boost/date_time/date_facet.hpp>
 #include <stdlib.h>
 #include <vector>
+#include <map>
+#include <string>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include "logwriter.h"
+#include "capture.h"
+#include "output.h"
+#include "modbus-rtu.h"
+#include "rtu-line.h"
+#ifndef WIN32
+#include "rtu-serial.h"
+#endif
+#include "match.h"
+#include "profile.h"
 
 // App designed to sniff, decode and optionally capture
 // the modbus data sent between a Solis inverter
@@ -44,378 +59,79 @@ static const char *CmdLookup[] = {
   "Write Multiple Registers",
   "Report Server ID" };
 
-static FILE *CsvLog ;
-static FILE *BinLog ;
+static LogWriter_t *CsvLog ;
+static LogWriter_t *BinLog ;
 static bool RestrictToSlave = true;
+// false when writing records for other tools, which then have stdout to themselves
+static bool TextOutput = true;
+// working out the logger's timing as the frames go by
+static bool Profiling = false;
 
-static int32_t Read(int Fd, void *Buf, size_t Count)
-{
-  uint8_t *Ptr = (uint8_t*)Buf ;
-  size_t Rc ;
-  size_t TotalCount = 0 ;
-  
-  while(Count)
-  {
-    // on a serial device, 'read' can return early yielding
-    // less data than requested so keep going until we get it all
-    Rc = read(Fd, Ptr, Count);
-    if ( Rc < 0 )
-      return Rc ;
-    else if ( !Rc )
-      return TotalCount ;
-    if ( BinLog )
-      fwrite(Ptr,1,Rc,BinLog) ;
-    Count-=Rc ;
-    Ptr+=Rc ;
-    TotalCount+=Rc ;
-  }
-  return TotalCount ;
-}
+// optional settings, given as key=value anywhere after the input
+static std::map<std::string, std::string> Options;
 
-// Try and locate start of next message by looking for a sequence matching a slave id
-// and a valid function. This is needed due to the spurious characters that get injected
-// into the serial stream
-static bool ReadMessageHeader(int Fd, uint8_t &Slave, uint8_t &Function)
-{
-  uint8_t Buf;
-  uint32_t Skipped = 0;
-  uint8_t Cmd ;
-  bool SyncToHeader = false;
+// where the serial data is coming from
+static Capture_t *ActiveCapture ;
 
-  while (Read(Fd, &Buf, sizeof(Buf)) == sizeof(Buf))
-  {
-    // The behaviour depends on whether we're only decoding for a single slave (as specified on the command line)
-    // or allowing for the full supported range.
-    // The former is liable to be more accurate in terms of matching every transaction since there the allowable
-    // range of recognized sequences will be more smaller.
-    // In the latter, in an effort to improve accuracy, the range of slaves AND recognized commands is 
-    // constrained to only those that the logger is expected to generate
-    if (RestrictToSlave)
-    {
-      if (Slave == Buf)
-      {
-        if (Read(Fd, &Buf, sizeof(Buf)) == sizeof(Buf))
-        {
-          // an error response from the inverter sets the top bit in the function code
-          if ((Buf & 0x7f) < CmdCount)
-          {
-            Function = Buf;
-            SyncToHeader = true;
-          }
-        }
-        else
-        {
-          printf("Failed to locate start of a request/response\n");
-          return false;
-        }
-      }
-    }
-    else
-    {
-      // the logger supports up to 10 slaves, so restrict expected range
-      if (Buf >= 0x01 && Buf <= 0xA)
-      {
-        Slave = Buf;
-        if (Read(Fd, &Buf, sizeof(Buf)) == sizeof(Buf))
-        {
-          // an error response from the inverter sets the top bit in the function code
-          Cmd = Buf & 0x7f;
-          // logger only issues these command types
-          if (Cmd == 0x3 || Cmd == 0x04 || Cmd == 0x06 || Cmd == 0x10)
-          {
-            Function = Buf;
-            SyncToHeader = true;
-          }
-        }
-        else
-        {
-          printf("Failed to locate start of a request/response\n");
-          return false;
-        }
-      }
-    } // restrict to a single slave
+#ifndef WIN32
+// set on Ctrl-C etc. so the logs get written out before exiting
+static volatile sig_atomic_t Stop = 0;
 
-    if (SyncToHeader)
-    {
-      printf("Skipped %u bytes in stream looking for next header\n",Skipped);
-      return true;
-    }
-    Skipped++;
-  }
-  printf("Failed to locate start of a request/response\n");
-  return false;
+static void StopHandler(int Signal)
+{
+  Stop = 1;
+  CaptureInterrupt(ActiveCapture);
 }
+#else
+static const bool Stop = false;
+#endif
 
-// process a command request
-static bool ProcessRequest(int Fd, uint8_t &Slave, uint8_t &Function,bool &Valid,std::vector<uint16_t> &ResponseData)
+// fetch a numeric setting, sizes can be given with a k/M/G suffix
+static uint64_t GetOption(const char *Key, uint64_t Default)
 {
-  using namespace boost::posix_time;
-  uint8_t Request[256];
-  uint8_t Len, ByteCount;
-  static ptime LastRequestTime ;
-  
-  Valid = false;
-  ResponseData.clear();
-
-  if ( BinLog )
-    printf("BinLog Position: %08lx\n", ftell(BinLog)) ;
-    
-  if (ReadMessageHeader(Fd,Slave,Function) )
+  auto It = Options.find(Key);
+  uint64_t Value;
+  char *End;
+
+  if (It == Options.end())
+    return Default;
+  Value = strtoull(It->second.c_str(), &End, 0);
+  switch (*End)
   {
-    // compute the expected length based on the function
-    switch (Function)
-    {
-      case 1:
-      case 2:
-      case 3:
-      case 4:
-      case 5:
-      case 6:
-
-        Len = 6;
-        break;
-
-      case 0xF:
-      case 0x10:
-        Len = 5;  // enough to read up to & including the byte count
-        break;
-
-      default:
-
-        Len = 0;
-        break;
-    }
-
-    ptime TimeStamp(microsec_clock::local_time());
-
-    std::cout << std::endl << "Request... " << to_simple_string(TimeStamp) ;
-    // report intervals between requests
-    if ( LastRequestTime != not_a_date_time )
-    {
-      auto Delta = TimeStamp - LastRequestTime ;
-      std::cout << " (delta since previous: " << Delta.total_seconds() << "." << Delta.fractional_seconds() << "s)" ;
-    }
-    std::cout << std::endl ;
-    LastRequestTime = TimeStamp ;
-     
-    if ( CsvLog )
-    {
-      fprintf(CsvLog,"%s,%u,%u",to_simple_string(TimeStamp).c_str(),Slave,Function);
-      fflush(CsvLog);
-    }
-    printf("Slave: %u\n", Slave);
-    printf("Function: ");
-    if (Function < CmdCount)
-      printf("%s", CmdLookup[Function]);
-    else
-      printf("Unknown");
-    printf(" (%u)\n", Function);
-
-    if (Len)
-    {
-      // read remainder of the request
-      if (Read(Fd, Request, Len) == Len)
-      {
-        uint16_t Crc = (Request[5] << 8) + Request[4];
-        auto ModBusCrc = boost::crc_optimal<16, 0x8005, 0xFFFF, 0, true, true> {};
-        uint16_t Address;
-
-        ModBusCrc.process_byte(Slave);
-        ModBusCrc.process_byte(Function);
-
-        Address = (Request[0] << 8) + Request[1];
-
-        printf("Address: %u\n", Address);
-        if ( CsvLog )
-          fprintf(CsvLog,",%u\n",Address);
-          
-        // make the address the first entry in the response buffer
-        ResponseData.push_back(Address);
-
-        ModBusCrc.process_bytes(Request, 4);
-
-        switch (Function)
-        {
-        case 1:
-
-          printf("Quantity of Coils: %u\n", (Request[2] << 8) + Request[3]);
-          break;
-
-        case 2:
-
-          printf("Quantity of Inputs: %u\n", (Request[2] << 8) + Request[3]);
-          break;
-
-        case 3:
-        case 4:
-
-          printf("Quantity of Registers: %u\n", (Request[2] << 8) + Request[3]);
-          break;
-
-        case 5:
-        case 6:
-
-          printf("Write Data: %u\n", (Request[2] << 8) + Request[3]);
-          break;
-
-        case 15:
-        case 16:
-
-          if ( Function == 15 )
-            printf("Quantity of coils: %u\n", (Request[2] << 8) + Request[3]);
-          else
-            printf("Quantity of Registers: %u\n", (Request[2] << 8) + Request[3]);
-
-          ByteCount = Request[4];
-          printf("Byte Count: %u\n", ByteCount);
-          Len = ByteCount + sizeof(uint16_t);
-          if (Read(Fd, Request, Len) == Len)
-          {
-            for (auto i = 0u; i < ByteCount; i += 2)
-              printf("Write Data: %u\n", (Request[i] << 8) + Request[i + 1]);
-
-            Crc = (Request[Len - 1] << 8) + Request[Len - 2];
-            ModBusCrc.process_byte(ByteCount);
-            ModBusCrc.process_bytes(Request, ByteCount);
-          }
-          else
-          {
-            perror("Failed to read data");
-            return false;
-          }
-          break;
-        }
-        printf("CRC: %x - ", Crc);
-
-        if (ModBusCrc.checksum() == Crc)
-        {
-          printf("Ok\n");
-          Valid = true;
-        }
-        else
-          printf("Incorrect, should be %x\n", ModBusCrc.checksum());
-        return true;
-      }
-      else
-        perror("Failed to read data");
-    }
-    else
-    {
-      printf("Length is unknown\n");
-      return true ;
-    }
+    case 'k':
+    case 'K':
+      Value <<= 10;
+      break;
+    case 'm':
+    case 'M':
+      Value <<= 20;
+      break;
+    case 'g':
+    case 'G':
+      Value <<= 30;
+      break;
   }
-  else
-    printf("Unrecognized command, cannot parse message\n");
-
-  return false;
+  return Value;
 }
 
-// process response packet
-static bool ProcessResponse(int Fd,uint8_t Slave,uint8_t &Function,bool &Valid,std::vector<uint16_t> &ResponseData,bool Verbose=false)
+// fetch a string setting
+static const char *GetOptionString(const char *Key, const char *Default)
 {
-  using namespace boost::posix_time;
-  uint8_t Len, ByteCount;
-  uint8_t Response[256];
-
-  Valid = false;
-
-  if (ReadMessageHeader(Fd, Slave, Function) &&
-      (Read(Fd, &ByteCount, sizeof(ByteCount)) == 1))
-  {
-    ptime TimeStamp(microsec_clock::local_time());
-
-    std::cout << std::endl << "Response... " << to_simple_string(TimeStamp) << std::endl;
-
-    printf("Slave: %u\n", Slave);
-
-    // an error response from the inverter sets the top bit in the function code
-    if (Function & 0x80)
-    {
-      uint8_t ErrorCode = ByteCount;
-      uint16_t Crc;
-      auto ModBusCrc = boost::crc_optimal<16, 0x8005, 0xFFFF, 0, true, true> {};
-
-      ModBusCrc.process_byte(Slave);
-      ModBusCrc.process_byte(Function);
-      ModBusCrc.process_byte(ErrorCode);
-
-      Function &= 0x7f;
-      printf("Error on function: ");
-      if (Function < CmdCount)
-        printf("%s", CmdLookup[Function]);
-      else
-        printf("Unknown");
-      printf(" (%u)\n", Function);
-
-      printf("Error code: %u\n", ErrorCode);
-      if (Read(Fd, &Crc, sizeof(Crc)) == sizeof(Crc))
-      {
-        printf("CRC: %x - ", Crc);
-        if (ModBusCrc.checksum() == Crc)
-        {
-          printf("Ok\n");
-          Valid = true;
-        }
-        else
-          printf("Incorrect, should be %x\n", ModBusCrc.checksum());
-        return true;
-      }
-      else
-        perror("Failed to read data");
-      return false;
-    }
+  auto It = Options.find(Key);
 
-    printf("Function: ");
-    if (Function < CmdCount)
-      printf("%s",CmdLookup[Function]);
-    else
-      printf("Unknown");
-    printf(" (%u)\n", Function);
-    printf("Byte Count: %u\n", ByteCount);
-
-    // total length to read, including the CRC
-    Len = ByteCount+sizeof(uint16_t);
-    if (Read(Fd, Response, Len) == Len)
-    {
-      uint16_t Crc = (Response[Len-1]<<8) + Response[Len-2];
-      uint16_t Address = 0 ;
-      
-      auto ModBusCrc = boost::crc_optimal<16, 0x8005, 0xFFFF, 0, true, true> {};
-
-      ModBusCrc.process_byte(Slave);
-      ModBusCrc.process_byte(Function);
-      ModBusCrc.process_byte(ByteCount);
+  return (It == Options.end()) ? Default : It->second.c_str();
+}
 
-      // if available, fetch the address from the response buffer
-      if ( !ResponseData.empty() )
-        Address = ResponseData.front() ;
-    
-      for (auto i = 0u; i < ByteCount; i += 2)
-      {
-        uint16_t DataWord = (Response[i] << 8) + Response[i + 1];
-        if ( Verbose )
-          printf("Addr: %04lu => %04x\n", Address+i/sizeof(uint16_t), DataWord);
-        ResponseData.push_back(DataWord);
-      }
-      printf("CRC: %x - ", Crc);
+// the running commentary on each frame, not wanted (or paid for) when writing records
+static void Print(const char *Format, ...)
+{
+  va_list Args;
 
-      ModBusCrc.process_bytes(Response, ByteCount);
-      if (ModBusCrc.checksum() == Crc)
-      {
-        Valid = true;
-        printf("Ok\n");
-      }
-      else
-        printf("Incorrect, should be %x\n", ModBusCrc.checksum());
-      return true;
-    }
-    else
-      perror("Failed to read data");
-  }
-  else
-    perror("Failed to read data");
-  return false;
+  if (!TextOutput)
+    return;
+  va_start(Args, Format);
+  vprintf(Format, Args);
+  va_end(Args);
 }
 
 #define YELLOW  "\033[33m"
@@ -586,26 +302,216 @@ static void DecodeResponseData(uint8_t Function, std::vector<uint16_t>ResponseDa
   printf(WHITE) ;
 }
 
+// what's needed to make sense of each frame as it's decoded
+typedef struct {
+  bool Verbose;
+  bool AllSlavesRespond;
+  uint64_t StreamPos;       // bytes passed to the parser so far
+  boost::posix_time::ptime LastRequestTime;
+  Matcher_t *Matcher;       // pairs up requests & responses
+} Sniffer_t;
+
+static const char *FunctionName(uint8_t Function)
+{
+  return Function < CmdCount ? CmdLookup[Function] : "Unknown";
+}
+
+// a request that never got a response
+static void HandleTimeout(const MatchRequest_t *Request, void *User)
+{
+  if (Request->Expected)
+    Print("\nNo response from slave %u to %s (%u)\n", Request->Slave, FunctionName(Request->Function), Request->Function);
+}
+
+// a frame's been decoded, print/log/output it
+static void HandleFrame(const RtuFrame_t *Rtu, void *User)
+{
+  using namespace boost::posix_time;
+  Sniffer_t *Sniffer = (Sniffer_t*)User;
+  // when it arrived, rather than when we got round to it
+  ptime TimeStamp(CaptureTime(ActiveCapture));
+  uint16_t Crc = (Rtu->Raw[Rtu->Length - 1] << 8) + Rtu->Raw[Rtu->Length - 2];
+  const MatchRequest_t *Request = nullptr;
+  uint64_t Latency = 0u;
+  OutputFrame_t Frame;
+
+  Frame.Time = CaptureTimeUtc(ActiveCapture);
+  Frame.Response = Rtu->Response;
+  Frame.Slave = Rtu->Slave;
+  Frame.Function = Rtu->Function;
+  Frame.Exception = Rtu->Exception;
+  Frame.Address = Rtu->Address;
+  Frame.Count = Rtu->Count;
+  Frame.WordCount = std::min(Rtu->ByteCount / 2u, OutputMaxWords);
+  for (uint32_t i = 0; i < Frame.WordCount; i++)
+    Frame.Words[i] = RtuWord(Rtu, i);
+  Frame.CrcOk = true;
+  Frame.Skipped = Rtu->Skipped;
+
+  if (!Rtu->Response)
+  {
+    MatchRequest(Sniffer->Matcher, Rtu);
+    if (CsvLog)
+      LogPrintf(CsvLog, "%s,%u,%u,%u\n", to_simple_string(TimeStamp).c_str(), Rtu->Slave, Rtu->Function, Rtu->Address);
+  }
+  else
+  {
+    // the address of a read comes from whatever the request asked for
+    Request = MatchResponse(Sniffer->Matcher, Rtu, Latency);
+    if (Request)
+      Frame.Address = Request->Address;
+  }
+  OutputFrame(&Frame);
+  if (Profiling)
+    ProfileFrame(&Frame);
+
+  if (!TextOutput)
+  {
+    if (!Rtu->Response)
+      Sniffer->LastRequestTime = TimeStamp;
+    return;
+  }
+
+  // the binary log holds everything read so far, so work back from the end of it
+  if (BinLog && !Rtu->Response && LogPosition(BinLog) >= Sniffer->StreamPos - Rtu->Offset)
+    Print("BinLog Position: %08llx\n", (unsigned long long)(LogPosition(BinLog) - (Sniffer->StreamPos - Rtu->Offset)));
+  if (Rtu->Skipped)
+    Print("Skipped %u bytes in stream looking for next header\n", Rtu->Skipped);
+
+  if (!Rtu->Response)
+  {
+    std::cout << std::endl << "Request... " << to_simple_string(TimeStamp) ;
+    // report intervals between requests
+    if ( Sniffer->LastRequestTime != not_a_date_time )
+    {
+      auto Delta = TimeStamp - Sniffer->LastRequestTime ;
+      std::cout << " (delta since previous: " << Delta.total_seconds() << "." << Delta.fractional_seconds() << "s)" ;
+    }
+    std::cout << std::endl ;
+    Sniffer->LastRequestTime = TimeStamp ;
+  }
+  else
+  {
+    std::cout << std::endl << "Response... " << to_simple_string(TimeStamp) ;
+    if (Request)
+      std::cout << " (after " << Latency / 1000u << "ms)" ;
+    else
+      std::cout << " (no matching request)" ;
+    std::cout << std::endl ;
+  }
+
+  Print("Slave: %u\n", Rtu->Slave);
+  if (Rtu->Exception)
+  {
+    Print("Error on function: %s (%u)\n", FunctionName(Rtu->Function), Rtu->Function);
+    Print("Error code: %u\n", Rtu->Exception);
+  }
+  else
+  {
+    Print("Function: %s (%u)\n", FunctionName(Rtu->Function), Rtu->Function);
+    switch (Rtu->Function)
+    {
+      case MODBUS_RTU_READ_HOLDING:
+      case MODBUS_RTU_READ_INPUT:
+
+        if (!Rtu->Response)
+        {
+          Print("Address: %u\n", Rtu->Address);
+          Print("Quantity of Registers: %u\n", Rtu->Count);
+        }
+        else
+        {
+          Print("Byte Count: %u\n", Rtu->ByteCount);
+          if (Sniffer->Verbose)
+          {
+            for (uint32_t i = 0; i < Rtu->Count; i++)
+              Print("Addr: %04lu => %04x\n", (unsigned long)(Frame.Address + i), RtuWord(Rtu, i));
+          }
+        }
+        break;
+
+      case MODBUS_RTU_WRITE_SINGLE:
+
+        Print("Address: %u\n", Rtu->Address);
+        Print("Write Data: %u\n", RtuWord(Rtu, 0));
+        break;
+
+      case MODBUS_RTU_WRITE_MULTIPLE:
+
+        Print("Address: %u\n", Rtu->Address);
+        Print("Quantity of Registers: %u\n", Rtu->Count);
+        if (!Rtu->Response)
+        {
+          Print("Byte Count: %u\n", Rtu->ByteCount);
+          for (uint32_t i = 0; i < Rtu->Count; i++)
+            Print("Write Data: %u\n", RtuWord(Rtu, i));
+        }
+        break;
+    }
+  }
+  // the parser only hands over frames with a valid CRC
+  Print("CRC: %x - Ok\n", Crc);
+
+  // only decode a response to the request we saw
+  if (Request && !Rtu->Exception && Rtu->Count)
+  {
+    std::vector<uint16_t> ResponseData;
+
+    ResponseData.push_back(Frame.Address);
+    for (uint32_t i = 0; i < Rtu->Count; i++)
+      ResponseData.push_back(RtuWord(Rtu, i));
+    DecodeResponseData(Rtu->Function, ResponseData);
+  }
+}
+
 int main(int argc, char *argv[])
 {
   using namespace boost::posix_time ;
   int Fd ;
   uint8_t Slave = 1u;
-  uint8_t Function;
-  bool Valid;
-  bool Verbose = false;
-  std::vector<uint16_t> ResponseData;
-  ptime Now(second_clock::local_time()) ;
   bool IsLive = false ;
-  bool DecodeError = false ;
-  bool AllSlavesRespond = false ;
-  
+  LogWriterConfig_t LogConfig ;
+  Sniffer_t Sniffer ;
+  RtuLine_t Line ;
+#ifndef WIN32
+  RtuSerialSetup_t Setup = { false, -1, -1, false } ;
+  RtuSerialCounts_t CountsStart, CountsEnd ;
+  RtuSerialUnmark_t Unmark = { 0u, 0u, 0u } ;
+  bool Counting = false ;
+#endif
+  RtuParser_t Parser ;
+  RtuParserStats_t ParserStats ;
+  uint8_t Buf[256] ;
+  int Rc ;
+  int Positional = 1 ;
+
+  // pull out any key=value settings, leaving the rest where they were
+  for (int i = 1; i < argc; i++)
+  {
+    const char *Equals = strchr(argv[i], '=');
+
+    if (i > 1 && Equals)
+      Options[std::string(argv[i], Equals - argv[i])] = Equals + 1;
+    else
+      argv[Positional++] = argv[i];
+  }
+  argc = Positional;
+
   // the slave is needed to allow us to try and sync up with the incoming data
   if ( argc < 2 )
   {
-    printf( "Usage: modbus <input> [slave address=1] [csvlog=0] [verbose=0] [binlog=0] [restrict slave=1] [all-slaves-respond=0]\n");
+    printf( "Usage: modbus <input> [slave address=1] [csvlog=0] [verbose=0] [binlog=0] [restrict slave=1] [all-slaves-respond=0] [setting=value...]\n");
     return -1 ;
   }
+
+  // optionally, one record per frame on stdout for other tools to pick up. This
+  // comes before anything else is printed, which from here on goes to stderr so
+  // the records have stdout to themselves
+  if ( !OutputInit(GetOptionString("output", "text"), GetOptionString("filter_slave", ""),
+                   GetOptionString("filter_function", ""), GetOptionString("filter_address", "")) )
+    return -1 ;
+  TextOutput = (OutputGetFormat() == OutputText);
+
   if ( !strcmp(argv[1],"-") )
     Fd = 0 ; // stdin
   else	
@@ -640,51 +546,93 @@ int main(int argc, char *argv[])
   if ( argc > 2)
     Slave = strtoul(argv[2], NULL, 0);
 
+  // the line settings, applied to the port when live & used for the frame timing
+  if ( !RtuLineParse(GetOptionString("serial", RTU_LINE_DEFAULT), &Line) )
+  {
+    printf("Serial settings should be <baud>[,<data bits><parity><stop bits>], eg. 9600,8N1\n");
+    return -1 ;
+  }
+#ifndef WIN32
+  if ( IsLive )
+  {
+    if ( !RtuSerialConfigure(Fd, &Line) )
+      return -1 ;
+    // cut the time for what's received to reach us & have breaks/framing errors
+    // marked in the stream rather than arriving as NULs
+    RtuSerialTune(Fd, argv[1], &Setup) ;
+    RtuSerialPrintSetup(argv[1], &Setup, &Line) ;
+    Counting = RtuSerialGetCounts(Fd, &CountsStart) ;
+  }
+#endif
+
+  Sniffer.Verbose = false ;
+  Sniffer.AllSlavesRespond = false ;
+  Sniffer.StreamPos = 0u ;
   if ( argc > 4 )
   {
     if ( strtoul(argv[4],NULL,0) )
-      Verbose = true ;
+      Sniffer.Verbose = true ;
   }
-  
-  time_facet *Facet(new time_facet("%Y-%m-%d_%H-%M-%S")) ;
-  std::stringstream LogName ;
 
-  LogName.imbue(std::locale(LogName.getloc(), Facet));
+  // the bursts of polling from the logger are separated by at least this much silence
+  if ( Options.count("profile") )
+    Profiling = ProfileInit(GetOptionString("profile", ""), GetOption("burst_gap", 20000) * 1000u);
+
+  // the logs are written out in the background, optionally starting a new file
+  // every so often so they don't grow forever
+  LogConfig.RotateSize = GetOption("rotate_size", 0);
+  LogConfig.RotateInterval = GetOption("rotate_interval", 0);
+  LogConfig.Compress = GetOption("compress", 0) ? true : false;
+  LogConfig.FlushInterval = GetOption("flush_interval", 1000);
 
   // create the CSV logfile if requested
   if ( argc > 3 && strtoul(argv[3],NULL,0) )
   {
-    LogName << Now << ".csv" ;
-  
-    CsvLog = fopen(LogName.str().c_str(),"wt");
+    CsvLog = LogWriterCreate("CSV", ".csv", "TimeStamp,Slave,Function,Address\n", true, &LogConfig);
     if ( !CsvLog )
-    {
-      std::cout << "Failed to create csv file: " << LogName.str() << std::endl ;
       return -1 ;
-    }
-    else
-    {
-      std::cout << "Writing CSV to: " << LogName.str() << std::endl ;
-      fputs("TimeStamp,Slave,Function,Address\n",CsvLog);
-    } 
   }
   
   // create the binlog if requested
   if ( argc > 5 && strtoul(argv[5],NULL,0) )
   {
-  	 LogName.str("");
-    LogName << Now << ".bin" ;
-  
-    BinLog = fopen(LogName.str().c_str(),"wb");
+    BinLog = LogWriterCreate("binary", ".bin", nullptr, false, &LogConfig);
     if ( !BinLog )
-    {
-      std::cout << "Failed to create bin file: " << LogName.str() << std::endl ;
       return -1 ;
-    }
-    else
+  }
+
+#ifndef WIN32
+  // without SA_RESTART, so a blocked read gives up straight away
+  struct sigaction StopAction ;
+
+  memset(&StopAction, 0, sizeof(StopAction));
+  StopAction.sa_handler = StopHandler;
+  sigaction(SIGINT, &StopAction, NULL);
+  sigaction(SIGTERM, &StopAction, NULL);
+#endif
+
+  // re-reading records written earlier with output=binary, already decoded & with
+  // their original timestamps so there's nothing to capture or parse
+  if ( !strcmp(GetOptionString("input", "raw"), "records") )
+  {
+    FILE *Records = fdopen(Fd, "rb");
+    OutputFrame_t Frame;
+    uint64_t Count = 0u;
+
+    while ( Records && !Stop && OutputReadRecord(Records, &Frame) )
     {
-      std::cout << "Writing binary to: " << LogName.str() << std::endl ;
-    } 
+      Count++;
+      OutputFrame(&Frame);
+      if ( Profiling )
+        ProfileFrame(&Frame);
+    }
+    printf("Read %llu records\n", (unsigned long long)Count);
+    if ( Profiling )
+      ProfileWrite();
+    OutputFlush();
+    if ( Records )
+      fclose(Records);
+    return 0 ;
   }
 
   // attempt to decode for all valid slaves (rather than just that specified)
@@ -697,68 +645,110 @@ int main(int argc, char *argv[])
     // useful if running a broadcast app in tandem since it will simulate this
     if ( argc > 7 && strtoul(argv[7], NULL, 0))
     {
-      AllSlavesRespond = true ;
+      Sniffer.AllSlavesRespond = true ;
       std::cout << "Will expect a response for all slaves" << std::endl;
     }
   }
 
-  // start processing traffic
-  while (!DecodeError)
+  // the serial port is read on it's own thread, leaving this one to decode & print
+  ActiveCapture = CaptureStart(Fd, IsLive);
+
+  // a response normally follows within 100ms or so, the logger gives up after 3s
+  Sniffer.Matcher = MatcherCreate(GetOption("response_timeout", 3000) * 1000u, HandleTimeout, &Sniffer);
+  if ( !Sniffer.AllSlavesRespond )
+    MatcherExpect(Sniffer.Matcher, Slave);
+
+  // the slaves to look for frames from, restricting it to just the one makes it
+  // less likely that noise gets mistaken for a frame. The logger supports up to 10
+  RtuParserInit(&Parser, RestrictToSlave ? Slave : 1u, RestrictToSlave ? Slave : 10u, HandleFrame, &Sniffer);
+  // on a live port, a partial frame followed by ~100 characters (100ms at 9600) of nothing
+  // is never going to be completed. USB adapters hold on to what they've received for
+  // their latency timer before passing it on though, so don't go below that (allowing
+  // for the default 16ms if we don't know what it is)
+  if ( IsLive )
   {
-     uint8_t MsgSlave = Slave ;
-      
-  	 DecodeError = !ProcessRequest(Fd, MsgSlave, Function, Valid, ResponseData) ;
-
-  	 if ( !DecodeError && (AllSlavesRespond || (MsgSlave == Slave)))
-  	 {
-    	  DecodeError = !ProcessResponse(Fd, Slave, Function,Valid,ResponseData,Verbose) ;
-    	  if ( !DecodeError && Valid )
-	        DecodeResponseData(Function, ResponseData);
-  	 }
+    uint32_t MinGap = 20000u ;
+
 #ifndef WIN32
-	 // if we get a decode error, try and resync the stream. In effect this
-	 // just waits for at least a 10s gap in the serial stream before continuing
-	 if ( DecodeError && IsLive )
-	 {
-	 	fd_set FdSet ;
-		struct timeval TimeOut ;
-		bool NextPacket = false ;
-		int Rc ;
-		uint8_t ScratchBuf[256] ;
-					
-		FD_ZERO(&FdSet);
-		FD_SET(Fd,&FdSet) ;
-
-      printf( "Decode error, attempting to re-sync\n") ;
-		while(!NextPacket)
-		{
-			TimeOut.tv_sec = 10 ;
-			TimeOut.tv_usec = 0 ;
-			// poll for data
-			Rc = select(Fd+1,&FdSet,NULL,NULL,&TimeOut);
-			if ( Rc == 0 )
-			{
-				// on timeout, return to main loop
-				NextPacket = true ;
-				DecodeError = false ;
-			}
-			else if ( Rc < 0)
-				break ;
-			else // data still pending, read and discard it
-			{
-				Rc = read(Fd,ScratchBuf,sizeof(ScratchBuf) ) ;
-				if ( Rc > 0 && BinLog )
-					fwrite(ScratchBuf,1,Rc,BinLog) ;
-			}
-		}		
-	 }
+    if ( Setup.LatencyAfter >= 0 )
+      MinGap = Setup.LatencyAfter * 1000u + 4000u ;
 #endif
+    RtuParserSetGap(&Parser, std::max(RtuLineChars(&Line, 96u), MinGap));
+  }
+
+  // start processing traffic, in whatever size chunks it was captured in. Frames are
+  // picked out as they complete, anything that doesn't make one is skipped over
+  while ( !Stop && (Rc = CaptureRead(ActiveCapture, Buf, sizeof(Buf))) >= 0 )
+  {
+#ifndef WIN32
+    // strip out (& count) any breaks or characters received with errors, providing
+    // they're being marked - otherwise a 0xff 0x00 is just data
+    if ( IsLive && Setup.Marking )
+      Rc = RtuSerialUnmark(&Unmark, Buf, Rc) ;
+#endif
+    if ( BinLog )
+      LogWrite(BinLog, Buf, Rc) ;
+    Sniffer.StreamPos += Rc ;
+    RtuParse(&Parser, Buf, Rc, (CaptureTimeUtc(ActiveCapture) - ptime(boost::gregorian::date(1970, 1, 1))).total_microseconds()) ;
+
+    // when live, whoever's on the other end of the pipe wants it now
+    if ( IsLive )
+      OutputFlush();
+  }
+  RtuParserFlush(&Parser);
+  MatchFlush(Sniffer.Matcher);
+  if ( Profiling )
+    ProfileWrite();
+
+  ParserStats = Parser.Stats;
+  printf("Decoded %llu frames (%llu requests, %llu responses, %llu exceptions), %llu bytes skipped\n",
+         (unsigned long long)ParserStats.Frames, (unsigned long long)ParserStats.Requests,
+         (unsigned long long)ParserStats.Responses, (unsigned long long)ParserStats.Exceptions,
+         (unsigned long long)ParserStats.Skipped);
+
+  MatchStats_t MatchStats = MatcherGetStats(Sniffer.Matcher);
+
+  printf("%llu requests: %llu answered (%llu with an exception, slowest after %llums), %llu timed out, %llu unanswered as expected\n",
+         (unsigned long long)MatchStats.Requests, (unsigned long long)MatchStats.Answered,
+         (unsigned long long)MatchStats.Exceptions, (unsigned long long)(MatchStats.MaxLatency / 1000u),
+         (unsigned long long)MatchStats.TimedOut, (unsigned long long)MatchStats.Unanswered);
+  printf("%llu responses without a matching request, %llu too late to match\n",
+         (unsigned long long)MatchStats.Unmatched, (unsigned long long)MatchStats.Late);
+  MatcherDestroy(Sniffer.Matcher);
+  CaptureStats_t CaptureStats = CaptureGetStats(ActiveCapture);
+
+  printf("Captured %llu bytes in %llu reads, %llu bytes dropped, at most %llu bytes (%llu reads) waiting to be decoded\n",
+         (unsigned long long)CaptureStats.Bytes, (unsigned long long)CaptureStats.Reads,
+         (unsigned long long)CaptureStats.Dropped, (unsigned long long)CaptureStats.MaxDepth,
+         (unsigned long long)CaptureStats.MaxChunks);
+#ifndef WIN32
+  if ( IsLive )
+  {
+    printf("Stripped %llu breaks and %llu characters with framing/parity errors from the stream\n",
+           (unsigned long long)Unmark.Breaks, (unsigned long long)Unmark.Errors) ;
+    if ( Counting && RtuSerialGetCounts(Fd, &CountsEnd) )
+    {
+      RtuSerialCounts_t Counts ;
+
+      memset(&Counts, 0, sizeof(Counts)) ;
+      RtuSerialAddCounts(&Counts, &CountsStart, &CountsEnd) ;
+      printf("Driver counted %u framing errors, %u overruns (%u buffer), %u parity errors, %u breaks\n",
+             Counts.Frame, Counts.Overrun, Counts.BufOverrun, Counts.Parity, Counts.Break) ;
+    }
+  }
+#endif
+  CaptureStop(ActiveCapture);
+  ActiveCapture = nullptr;
+  if ( !TextOutput )
+  {
+    uint64_t Written, Filtered;
+
+    OutputFlush();
+    OutputStats(Written, Filtered);
+    printf("Wrote %llu records, %llu filtered out\n", (unsigned long long)Written, (unsigned long long)Filtered);
   }
-  
   close(Fd);
-  if (CsvLog)
-    fclose(CsvLog);
-  if(BinLog)
-    fclose(BinLog);
+  LogWriterClose(CsvLog);
+  LogWriterClose(BinLog);
   return 0 ;
 }
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#pragma warning(disable : 4996)
+#define dup _dup
+#define dup2 _dup2
+#define fdopen _fdopen
+#else
+#include <unistd.h>
+#endif
+#include <bitset>
+#include "output.h"
+
+static OutputFormat_t Format = OutputText;
+static FILE *Records;
+static std::bitset<256> SlaveFilter;      // none set = everything
+static std::bitset<256> FunctionFilter;
+static uint32_t FirstAddress = 0u;
+static uint32_t LastAddress = 0xffffu;
+static uint64_t Written = 0u;
+static uint64_t Filtered = 0u;
+static const boost::posix_time::ptime Epoch(boost::gregorian::date(1970, 1, 1));
+
+// a comma separated list of numbers
+static bool ParseList(const char *List, std::bitset<256> &Set)
+{
+  char *End;
+
+  while (List && *List)
+  {
+    unsigned long Value = strtoul(List, &End, 0);
+
+    if (End == List || Value > 255u || (*End && *End != ','))
+      return false;
+    Set.set(Value);
+    List = *End ? End + 1 : End;
+  }
+  return true;
+}
+
+bool OutputInit(const char *Name, const char *Slaves, const char *Functions, const char *Addresses)
+{
+  if (!strcmp(Name, "text"))
+    Format = OutputText;
+  else if (!strcmp(Name, "json"))
+    Format = OutputJson;
+  else if (!strcmp(Name, "binary"))
+    Format = OutputBinary;
+  else
+  {
+    printf("Unknown output format: %s (text, json or binary)\n", Name);
+    return false;
+  }
+
+  if (!ParseList(Slaves, SlaveFilter) || !ParseList(Functions, FunctionFilter))
+  {
+    printf("Slave and function filters should be comma separated lists of numbers\n");
+    return false;
+  }
+  if (Addresses && *Addresses)
+  {
+    char *End;
+
+    FirstAddress = strtoul(Addresses, &End, 0);
+    LastAddress = (*End == '-') ? strtoul(End + 1, &End, 0) : FirstAddress;
+    if (*End || LastAddress < FirstAddress)
+    {
+      printf("Address filter should be a range, first-last\n");
+      return false;
+    }
+  }
+
+  if (Format == OutputText)
+    return true;
+
+  // the records have stdout to themselves, anything else printed goes to stderr
+  fflush(stdout);
+  Records = fdopen(dup(fileno(stdout)), "wb");
+  if (!Records)
+  {
+    perror("Failed to set up output");
+    return false;
+  }
+  dup2(fileno(stderr), fileno(stdout));
+#ifdef WIN32
+  _setmode(fileno(Records), _O_BINARY);
+#endif
+  setvbuf(Records, NULL, _IOFBF, 64 * 1024);
+  return true;
+}
+
+OutputFormat_t OutputGetFormat(void)
+{
+  return Format;
+}
+
+// decimal, without going anywhere near printf
+static char *PutUint(char *Ptr, uint64_t Value)
+{
+  char Digits[20];
+  int Count = 0;
+
+  do
+  {
+    Digits[Count++] = '0' + (Value % 10u);
+    Value /= 10u;
+  } while (Value);
+  while (Count)
+    *Ptr++ = Digits[--Count];
+  return Ptr;
+}
+
+static char *PutString(char *Ptr, const char *String)
+{
+  size_t Len = strlen(String);
+
+  memcpy(Ptr, String, Len);
+  return Ptr + Len;
+}
+
+static char *PutLe(char *Ptr, uint64_t Value, int Bytes)
+{
+  while (Bytes--)
+  {
+    *Ptr++ = (char)(Value & 0xffu);
+    Value >>= 8;
+  }
+  return Ptr;
+}
+
+void OutputFrame(const OutputFrame_t *Frame)
+{
+  // worst case is a JSON record with every field at it's longest: 147 characters for
+  // the rest (a 20 digit time, an exception, "false" & a 10 digit skipped count) and
+  // up to 6 for each word with it's comma
+  char Record[160 + OutputMaxWords * 6];
+  char *Ptr = Record;
+  uint64_t Time;
+  uint32_t Last;
+
+  if (Format == OutputText)
+    return;
+
+  // cheapest first, before any formatting
+  Last = Frame->Address + (Frame->Count ? Frame->Count - 1u : 0u);
+  if ((SlaveFilter.any() && !SlaveFilter.test(Frame->Slave)) ||
+      (FunctionFilter.any() && !FunctionFilter.test(Frame->Function)) ||
+      Last < FirstAddress || Frame->Address > LastAddress)
+  {
+    Filtered++;
+    return;
+  }
+
+  Time = Frame->Time.is_special() ? 0u : (Frame->Time - Epoch).total_microseconds();
+  if (Format == OutputJson)
+  {
+    Ptr = PutString(Ptr, "{\"t\":");
+    Ptr = PutUint(Ptr, Time);
+    Ptr = PutString(Ptr, Frame->Response ? ",\"dir\":\"rsp\",\"slave\":" : ",\"dir\":\"req\",\"slave\":");
+    Ptr = PutUint(Ptr, Frame->Slave);
+    Ptr = PutString(Ptr, ",\"fn\":");
+    Ptr = PutUint(Ptr, Frame->Function);
+    if (Frame->Exception)
+    {
+      Ptr = PutString(Ptr, ",\"exception\":");
+      Ptr = PutUint(Ptr, Frame->Exception);
+    }
+    Ptr = PutString(Ptr, ",\"addr\":");
+    Ptr = PutUint(Ptr, Frame->Address);
+    Ptr = PutString(Ptr, ",\"count\":");
+    Ptr = PutUint(Ptr, Frame->Count);
+    Ptr = PutString(Ptr, ",\"words\":[");
+    for (uint32_t i = 0; i < Frame->WordCount && i < OutputMaxWords; i++)
+    {
+      if (i)
+        *Ptr++ = ',';
+      Ptr = PutUint(Ptr, Frame->Words[i]);
+    }
+    Ptr = PutString(Ptr, Frame->CrcOk ? "],\"crc\":true,\"skipped\":" : "],\"crc\":false,\"skipped\":");
+    Ptr = PutUint(Ptr, Frame->Skipped);
+    Ptr = PutString(Ptr, "}\n");
+  }
+  else
+  {
+    uint16_t Words = Frame->WordCount < OutputMaxWords ? Frame->WordCount : OutputMaxWords;
+
+    Ptr = PutLe(Ptr, 22u + Words * 2u, 2);
+    Ptr = PutLe(Ptr, Time, 8);
+    *Ptr++ = (Frame->Response ? 1 : 0) | (Frame->CrcOk ? 2 : 0) | (Frame->Exception ? 4 : 0);
+    *Ptr++ = Frame->Slave;
+    *Ptr++ = Frame->Function;
+    *Ptr++ = Frame->Exception;
+    Ptr = PutLe(Ptr, Frame->Address, 2);
+    Ptr = PutLe(Ptr, Frame->Count, 2);
+    Ptr = PutLe(Ptr, Frame->Skipped, 4);
+    Ptr = PutLe(Ptr, Words, 2);
+    for (uint32_t i = 0; i < Words; i++)
+      Ptr = PutLe(Ptr, Frame->Words[i], 2);
+  }
+
+  fwrite(Record, 1, Ptr - Record, Records);
+  Written++;
+}
+
+static uint64_t GetLe(const uint8_t *Ptr, int Bytes)
+{
+  uint64_t Value = 0u;
+
+  while (Bytes--)
+    Value = (Value << 8) | Ptr[Bytes];
+  return Value;
+}
+
+bool OutputReadRecord(FILE *File, OutputFrame_t *Frame)
+{
+  uint8_t Record[22u + OutputMaxWords * 2u];
+  uint16_t Length;
+
+  if (fread(Record, 1, 2, File) != 2u)
+    return false;
+  Length = (uint16_t)GetLe(Record, 2);
+  if (Length < 22u || Length > sizeof(Record) || fread(Record, 1, Length, File) != Length)
+    return false;
+
+  Frame->Time = Epoch + boost::posix_time::microseconds(GetLe(Record, 8));
+  Frame->Response = (Record[8] & 1) ? true : false;
+  Frame->CrcOk = (Record[8] & 2) ? true : false;
+  Frame->Slave = Record[9];
+  Frame->Function = Record[10];
+  Frame->Exception = Record[11];
+  Frame->Address = (uint16_t)GetLe(Record + 12, 2);
+  Frame->Count = (uint16_t)GetLe(Record + 14, 2);
+  Frame->Skipped = (uint32_t)GetLe(Record + 16, 4);
+  Frame->WordCount = (uint16_t)GetLe(Record + 20, 2);
+  if (Frame->WordCount > OutputMaxWords || Length != 22u + Frame->WordCount * 2u)
+    return false;
+  for (uint32_t i = 0; i < Frame->WordCount; i++)
+    Frame->Words[i] = (uint16_t)GetLe(Record + 22 + i * 2, 2);
+  return true;
+}
+
+void OutputFlush(void)
+{
+  if (Records)
+    fflush(Records);
+}
+
+void OutputStats(uint64_t &WrittenCount, uint64_t &FilteredCount)
+{
+  WrittenCount = Written;
+  FilteredCount = Filtered;
+}
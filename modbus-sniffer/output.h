@@ -0,0 +1,80 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+//
+// Machine readable output, one record per frame, for piping into other tools
+// rather than picking through the text by hand. Either:
+//
+// JSON lines, one object per line:
+//
+//   {"t":<us since 1970 UTC>,"dir":"req"|"rsp","slave":n,"fn":n,"addr":n,"count":n,
+//    "words":[...],"crc":true|false,"skipped":n}
+//
+//   with "exception":n added to an exception response (fn then being without the
+//   error bit). For a response, addr is taken from the request it answers
+//
+// or binary records, all values little endian:
+//
+//   uint16 length of the rest of the record
+//   uint64 time (us since 1970 UTC)
+//   uint8  flags - bit 0: response, bit 1: CRC ok, bit 2: exception
+//   uint8  slave
+//   uint8  function (without the error bit)
+//   uint8  exception code (0 if none)
+//   uint16 address
+//   uint16 count
+//   uint32 bytes skipped looking for the frame
+//   uint16 number of words, followed by the words themselves
+//
+// Frames can be filtered by slave, function and address range before anything is
+// formatted, so the unwanted ones cost next to nothing
+//
+
+typedef enum {
+  OutputText,     // the original free form text
+  OutputJson,
+  OutputBinary
+} OutputFormat_t;
+
+// the most a read can return. Anything longer isn't valid Modbus & is cut short
+static const uint32_t OutputMaxWords = 125u;
+
+// a single decoded frame
+typedef struct {
+  boost::posix_time::ptime Time;  // UTC
+  bool Response;
+  uint8_t Slave;
+  uint8_t Function;   // without the error bit
+  uint8_t Exception;  // non zero for an exception response
+  uint16_t Address;
+  uint16_t Count;     // registers (or coils) requested, or returned
+  uint16_t WordCount;
+  uint16_t Words[OutputMaxWords];
+  bool CrcOk;
+  uint32_t Skipped;   // bytes skipped before the frame was found
+} OutputFrame_t;
+
+// set up the output format & filters, from the settings given. The filters are
+// comma separated lists of slaves and functions and an address range (first-last)
+bool OutputInit(const char *Format, const char *Slaves, const char *Functions, const char *Addresses);
+
+OutputFormat_t OutputGetFormat(void);
+
+// write out a frame, if it gets past the filters
+void OutputFrame(const OutputFrame_t *Frame);
+
+// push out anything buffered
+void OutputFlush(void);
+
+// read back a binary record, as written above. Returns false at the end of the
+// file or if what's there isn't a record
+bool OutputReadRecord(FILE *File, OutputFrame_t *Frame);
+
+// frames written & filtered out
+void OutputStats(uint64_t &Written, uint64_t &Filtered);
+
+#endif
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include "profile.h"
+
+// the frames seen in a burst for one slave
+typedef struct {
+  uint32_t Requests;
+  uint32_t Responses;
+  uint64_t First;       // us, of the first & last request
+  uint64_t Last;
+} SlavePhase_t;
+
+typedef struct {
+  uint64_t Start;       // us since 1970
+  uint64_t End;
+  uint32_t Frames;
+  uint32_t Requests;
+  uint32_t Responses;
+  std::map<uint8_t, SlavePhase_t> Slaves;
+} Burst_t;
+
+// how far a cycle can stray from the usual period before it's considered abnormal
+static const double CycleTolerance = 0.2;
+
+// the upper bound (in s) of each bucket of the idle window histogram, the last
+// takes anything longer
+static const double IdleBuckets[] = { 10.0, 30.0, 60.0, 120.0, 180.0, 240.0, 300.0 };
+static const uint32_t IdleBucketCount = sizeof(IdleBuckets) / sizeof(IdleBuckets[0]);
+
+static std::string FileName;
+static uint64_t BurstGap;
+static std::vector<Burst_t> Bursts;
+static bool InBurst = false;
+static uint64_t Frames = 0u;
+static const boost::posix_time::ptime Epoch(boost::gregorian::date(1970, 1, 1));
+
+bool ProfileInit(const char *Name, uint64_t Gap)
+{
+  FileName = Name;
+  BurstGap = Gap;
+  printf("Writing logger profile to: %s\n", Name);
+  return true;
+}
+
+void ProfileFrame(const OutputFrame_t *Frame)
+{
+  uint64_t Time = Frame->Time.is_special() ? 0u : (Frame->Time - Epoch).total_microseconds();
+  Burst_t *Burst;
+
+  Frames++;
+
+  // a long enough gap, so that's the end of the last burst
+  if (InBurst && Time > Bursts.back().End + BurstGap)
+  {
+    InBurst = false;
+    ProfileWrite();
+  }
+  if (!InBurst)
+  {
+    Bursts.push_back(Burst_t());
+    Bursts.back().Start = Time;
+    Bursts.back().Frames = Bursts.back().Requests = Bursts.back().Responses = 0u;
+    InBurst = true;
+  }
+
+  Burst = &Bursts.back();
+  Burst->End = Time;
+  Burst->Frames++;
+
+  auto It = Burst->Slaves.find(Frame->Slave);
+  if (It == Burst->Slaves.end())
+  {
+    SlavePhase_t Phase = { 0u, 0u, Time, Time };
+
+    It = Burst->Slaves.insert(std::make_pair(Frame->Slave, Phase)).first;
+  }
+  if (Frame->Response)
+  {
+    Burst->Responses++;
+    It->second.Responses++;
+  }
+  else
+  {
+    Burst->Requests++;
+    if (!It->second.Requests)
+      It->second.First = Time;
+    It->second.Requests++;
+    It->second.Last = Time;
+  }
+}
+
+// the value at 'Fraction' of the way through, 0.5 being the median
+static double Percentile(std::vector<double> Values, double Fraction)
+{
+  size_t Index;
+
+  if (Values.empty())
+    return 0.0;
+  std::sort(Values.begin(), Values.end());
+  Index = (size_t)(Fraction * (Values.size() - 1) + 0.5);
+  return Values[Index];
+}
+
+static void WriteSpread(FILE *File, const char *Name, const std::vector<double> &Values, const char *Suffix)
+{
+  fprintf(File, "\"%s\":{\"min\":%.3f,\"median\":%.3f,\"max\":%.3f}%s", Name, Percentile(Values, 0.0),
+          Percentile(Values, 0.5), Percentile(Values, 1.0), Suffix);
+}
+
+bool ProfileWrite(void)
+{
+  std::string TmpName = FileName + ".tmp";
+  std::vector<double> Periods, Normal, Durations, Requests, Idle;
+  std::vector<bool> Abnormal;
+  double Median, Mean = 0.0, Jitter = 0.0;
+  std::map<size_t, uint32_t> SlaveCounts;
+  size_t UsualSlaves = 0u;
+  uint32_t UsualCount = 0u;
+  FILE *File;
+
+  if (FileName.empty())
+    return false;
+  File = fopen(TmpName.c_str(), "w");
+  if (!File)
+  {
+    perror("Failed to write profile");
+    return false;
+  }
+
+  // a burst that polls as many slaves as most of them do is considered complete. Not
+  // the most in any one burst, as a single noise frame would add a 'slave' & make every
+  // other burst look short. On a tie, the larger count wins
+  for (auto &Burst : Bursts)
+    SlaveCounts[Burst.Slaves.size()]++;
+  for (auto &It : SlaveCounts)
+  {
+    if (It.second >= UsualCount)
+    {
+      UsualSlaves = It.first;
+      UsualCount = It.second;
+    }
+  }
+
+  for (size_t i = 0; i < Bursts.size(); i++)
+  {
+    Durations.push_back((Bursts[i].End - Bursts[i].Start) * 1e-6);
+    Requests.push_back(Bursts[i].Requests);
+    if (i)
+    {
+      Periods.push_back((Bursts[i].Start - Bursts[i - 1].Start) * 1e-6);
+      Idle.push_back((Bursts[i].Start - Bursts[i - 1].End) * 1e-6);
+    }
+  }
+
+  // the cycle, ignoring those disrupted by resets
+  Median = Percentile(Periods, 0.5);
+  for (double Period : Periods)
+  {
+    if (fabs(Period - Median) <= Median * CycleTolerance)
+      Normal.push_back(Period);
+  }
+  for (double Period : Normal)
+    Mean += Period;
+  if (!Normal.empty())
+    Mean /= Normal.size();
+  for (double Period : Normal)
+    Jitter += (Period - Mean) * (Period - Mean);
+  if (!Normal.empty())
+    Jitter = sqrt(Jitter / Normal.size());
+
+  for (size_t i = 0; i < Bursts.size(); i++)
+  {
+    bool Early = i && fabs(Periods[i - 1] - Median) > Median * CycleTolerance;
+
+    Abnormal.push_back(Early || Bursts[i].Slaves.size() < UsualSlaves);
+  }
+
+  fprintf(File, "{\"frames\":%llu,\"bursts\":%u,\"burst_gap_s\":%.3f,",
+          (unsigned long long)Frames, (unsigned)Bursts.size(), BurstGap * 1e-6);
+  if (!Bursts.empty())
+    fprintf(File, "\"first\":%llu,\"last\":%llu,", (unsigned long long)Bursts.front().Start,
+            (unsigned long long)Bursts.back().End);
+
+  fprintf(File, "\"cycle\":{\"period_s\":%.3f,\"mean_s\":%.3f,\"jitter_s\":%.3f,\"min_s\":%.3f,\"max_s\":%.3f,"
+          "\"samples\":%u,\"abnormal\":%u},",
+          Median, Mean, Jitter, Percentile(Normal, 0.0), Percentile(Normal, 1.0), (unsigned)Normal.size(),
+          (unsigned)(Periods.size() - Normal.size()));
+
+  fprintf(File, "\"burst\":{");
+  WriteSpread(File, "duration_s", Durations, ",");
+  WriteSpread(File, "requests", Requests, ",");
+  fprintf(File, "\"slaves\":%u},", (unsigned)UsualSlaves);
+
+  // for each slave, when & how it's polled within a burst
+  std::map<uint8_t, bool> Seen;
+
+  for (auto &Burst : Bursts)
+    for (auto &It : Burst.Slaves)
+      Seen[It.first] = true;
+
+  fprintf(File, "\"slaves\":[");
+  for (auto SeenIt = Seen.begin(); SeenIt != Seen.end(); ++SeenIt)
+  {
+    std::vector<double> Starts, Lengths, Intervals;
+    uint64_t SlaveRequests = 0u, SlaveResponses = 0u;
+    uint32_t Polled = 0u;
+
+    for (auto &Burst : Bursts)
+    {
+      auto It = Burst.Slaves.find(SeenIt->first);
+
+      if (It == Burst.Slaves.end() || !It->second.Requests)
+        continue;
+      Polled++;
+      SlaveRequests += It->second.Requests;
+      SlaveResponses += It->second.Responses;
+      Starts.push_back((It->second.First - Burst.Start) * 1e-6);
+      Lengths.push_back((It->second.Last - It->second.First) * 1e-6);
+      if (It->second.Requests > 1u)
+        Intervals.push_back((It->second.Last - It->second.First) * 1e-6 / (It->second.Requests - 1u));
+    }
+    fprintf(File, "%s{\"slave\":%u,\"bursts\":%u,\"requests_per_burst\":%.2f,\"response_rate\":%.3f,",
+            SeenIt == Seen.begin() ? "" : ",", SeenIt->first, Polled,
+            Polled ? (double)SlaveRequests / Polled : 0.0,
+            SlaveRequests ? (double)SlaveResponses / SlaveRequests : 0.0);
+    WriteSpread(File, "start_s", Starts, ",");
+    WriteSpread(File, "duration_s", Lengths, ",");
+    WriteSpread(File, "request_interval_s", Intervals, "}");
+  }
+  fprintf(File, "],");
+
+  // runs of abnormal bursts are taken to be the logger resetting
+  fprintf(File, "\"resets\":[");
+  for (size_t i = 0, Count = 0; i < Bursts.size(); i++)
+  {
+    size_t Last = i;
+
+    if (!Abnormal[i])
+      continue;
+    while (Last + 1 < Bursts.size() && Abnormal[Last + 1])
+      Last++;
+    fprintf(File, "%s{\"start\":%llu,\"duration_s\":%.3f,\"bursts\":%u}", Count++ ? "," : "",
+            (unsigned long long)Bursts[i].Start, (Bursts[Last].End - Bursts[i].Start) * 1e-6, (unsigned)(Last - i + 1));
+    i = Last;
+  }
+  fprintf(File, "],");
+
+  // when there's nothing from the logger, so when the bus is free for anyone else
+  fprintf(File, "\"idle\":{\"min_s\":%.3f,\"p10_s\":%.3f,\"median_s\":%.3f,\"p90_s\":%.3f,\"max_s\":%.3f,\"histogram\":[",
+          Percentile(Idle, 0.0), Percentile(Idle, 0.1), Percentile(Idle, 0.5), Percentile(Idle, 0.9), Percentile(Idle, 1.0));
+  for (uint32_t Bucket = 0; Bucket <= IdleBucketCount; Bucket++)
+  {
+    double From = Bucket ? IdleBuckets[Bucket - 1] : 0.0;
+    uint32_t Count = 0u;
+
+    for (double Window : Idle)
+    {
+      if (Window >= From && (Bucket == IdleBucketCount || Window < IdleBuckets[Bucket]))
+        Count++;
+    }
+    if (Bucket < IdleBucketCount)
+      fprintf(File, "%s{\"from_s\":%.0f,\"to_s\":%.0f,\"count\":%u}", Bucket ? "," : "", From, IdleBuckets[Bucket], Count);
+    else
+      fprintf(File, ",{\"from_s\":%.0f,\"count\":%u}", From, Count);
+  }
+  fprintf(File, "]},");
+
+  // and the bursts themselves, for anything not covered above
+  fprintf(File, "\"burst_list\":[");
+  for (size_t i = 0; i < Bursts.size(); i++)
+  {
+    fprintf(File, "%s{\"start\":%llu,\"duration_s\":%.3f,\"requests\":%u,\"responses\":%u,\"abnormal\":%s,\"slaves\":[",
+            i ? "," : "", (unsigned long long)Bursts[i].Start, (Bursts[i].End - Bursts[i].Start) * 1e-6,
+            Bursts[i].Requests, Bursts[i].Responses, Abnormal[i] ? "true" : "false");
+    for (auto It = Bursts[i].Slaves.begin(); It != Bursts[i].Slaves.end(); ++It)
+      fprintf(File, "%s%u", It == Bursts[i].Slaves.begin() ? "" : ",", It->first);
+    fprintf(File, "]}");
+  }
+  fprintf(File, "]}\n");
+
+  if (fclose(File) != 0 || rename(TmpName.c_str(), FileName.c_str()) != 0)
+  {
+    perror("Failed to write profile");
+    return false;
+  }
+  return true;
+}
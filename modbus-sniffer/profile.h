@@ -0,0 +1,36 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include "output.h"
+
+//
+// Works out the logger's timing from the traffic, so the figures the broadcast app
+// relies on (5 minute cycle, ~55s of polling, 3s slave timeouts, the resets etc.)
+// can be measured for a given site & firmware rather than picked out of a spreadsheet.
+//
+// Frames are grouped into bursts, separated by at least 'BurstGap' of silence. From
+// those it derives:
+//
+//   - the cycle period (between the start of each burst) & it's jitter
+//   - how long the bursts last & how many requests they contain
+//   - for each slave, when in the burst it's polled, for how long, how often & how
+//     many of those requests are answered
+//   - reset events, runs of bursts that come too early, too late or don't poll all
+//     the slaves seen in a normal cycle
+//   - the distribution of the idle windows between bursts
+//
+// which are written out as JSON. The timing is only meaningful for live traffic or a
+// replay of records (output=binary) that were captured live
+//
+
+// start profiling, writing the results to 'FileName'. BurstGap is in us
+bool ProfileInit(const char *FileName, uint64_t BurstGap);
+
+// a frame's been seen, in time order
+void ProfileFrame(const OutputFrame_t *Frame);
+
+// write out the profile as it stands, also done each time a burst completes
+bool ProfileWrite(void);
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifndef WIN32
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+#include <random>
+#include <boost/chrono/chrono.hpp>
+#include "carrier.h"
+#include "rtu-serial.h"
+#include "config.h"
+
+// the most we ever send is an 8 byte request
+static const uint32_t MaxEcho = 16u;
+
+void CarrierInit(Carrier_t *Carrier, const RtuLine_t *Line)
+{
+  memset(Carrier, 0, sizeof(Carrier_t));
+  Carrier->Enabled = ConfigGetBool("listen_before_talk", true);
+  // never less than the 3.5 characters that end a frame
+  Carrier->IdleUs = RtuLineChars(Line, ConfigGetUint("lbt_idle", 4));
+  if (Carrier->IdleUs < RtuLineFrameGap(Line))
+    Carrier->IdleUs = RtuLineFrameGap(Line);
+  Carrier->BackoffUs = ConfigGetUint("lbt_backoff", 50) * 1000u;
+  Carrier->MaxBackoffUs = ConfigGetUint("lbt_backoff_max", 1000) * 1000u;
+  Carrier->MaxWaitUs = ConfigGetUint("lbt_max_wait", 3000) * 1000u;
+  Carrier->MaxRetries = ConfigGetUint("lbt_retries", 2);
+  Carrier->EchoCheck = ConfigGetBool("echo_check", false);
+  // the last of it plus a USB adapter's latency
+  Carrier->EchoTimeoutUs = RtuLineChars(Line, 4u) + 20000u;
+  if (!Carrier->BackoffUs)
+    Carrier->BackoffUs = Carrier->IdleUs;
+  if (Carrier->MaxBackoffUs < Carrier->BackoffUs)
+    Carrier->MaxBackoffUs = Carrier->BackoffUs;
+}
+
+#ifndef WIN32
+
+static uint64_t NowUs(void)
+{
+  using namespace boost::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// has anything arrived within 'Us', false if the line stayed quiet
+static bool Heard(int Fd, uint32_t Us)
+{
+  struct pollfd Pfd = { Fd, POLLIN, 0 };
+  struct timespec TimeOut = { (time_t)(Us / 1000000u), (long)(Us % 1000000u) * 1000 };
+  int Rc;
+
+  do
+    Rc = ppoll(&Pfd, 1, &TimeOut, NULL);
+  while (Rc < 0 && errno == EINTR);
+  if (Rc < 0)
+    perror("carrier poll");
+  return Rc > 0;
+}
+
+bool CarrierSense(Carrier_t *Carrier, int Fd, Responder_t *Yield)
+{
+  // each bus has it's own thread, so it's own generator. Seeded differently so
+  // two buses backing off from the same thing don't do it in step
+  static thread_local std::minstd_rand Random((uint32_t)NowUs());
+  uint64_t Start;
+  uint32_t Backoff = Carrier->BackoffUs;
+
+  if (!Carrier->Enabled)
+    return true;
+
+  Start = NowUs();
+  while (Heard(Fd, Carrier->IdleUs))
+  {
+    uint32_t Delay;
+
+    // someone else is talking, what we've heard is no use to us
+    if (!Yield)
+      tcflush(Fd, TCIFLUSH);
+    Carrier->Stats.Deferrals++;
+    if (NowUs() - Start >= Carrier->MaxWaitUs)
+    {
+      Carrier->Stats.GaveUp++;
+      return false;
+    }
+
+    // somewhere between half & one and a half times the backoff
+    Delay = Backoff / 2u + Random() % (Backoff + 1u);
+    if (Yield)
+      ResponderRelease(Yield);
+    usleep(Delay);
+    if (Yield)
+      ResponderAcquire(Yield);
+    Carrier->Stats.BackoffUs += Delay;
+    Backoff = Backoff * 2u > Carrier->MaxBackoffUs ? Carrier->MaxBackoffUs : Backoff * 2u;
+  }
+  Carrier->Stats.Requests++;
+  return true;
+}
+
+bool CarrierIdle(Carrier_t *Carrier, int Fd)
+{
+  return !Heard(Fd, Carrier->IdleUs);
+}
+
+bool CarrierCollided(Carrier_t *Carrier, int Fd, Responder_t *Yield)
+{
+  if (!Carrier->Enabled || !Heard(Fd, Carrier->IdleUs))
+    return false;
+  if (!Yield)
+    tcflush(Fd, TCIFLUSH);
+  Carrier->Stats.Collisions++;
+  return true;
+}
+
+bool CarrierEcho(Carrier_t *Carrier, int Fd, const uint8_t *Sent, uint32_t Len, bool Marked)
+{
+  uint8_t Echo[MaxEcho * 3u];
+  uint32_t Got = 0u;
+  RtuSerialUnmark_t Unmark = { 0u, 0u, 0u };
+
+  if (!Carrier->EchoCheck)
+    return true;
+  if (Len > MaxEcho)
+    Len = MaxEcho;
+
+  // anything marked takes up to 3 bytes, so read until there's enough once unmarked
+  while (Got < Len && Heard(Fd, Carrier->EchoTimeoutUs))
+  {
+    int Rc = read(Fd, &Echo[Got], (Marked ? sizeof(Echo) : Len) - Got);
+
+    if (Rc < 0 && errno != EAGAIN && errno != EINTR)
+    {
+      perror("echo read");
+      break;
+    }
+    if (Rc > 0)
+      Got += Marked ? RtuSerialUnmark(&Unmark, &Echo[Got], Rc) : (uint32_t)Rc;
+    if (Unmark.Breaks || Unmark.Errors)
+      break;
+  }
+
+  Carrier->Stats.EchoChecks++;
+  if (!Got && !Unmark.Breaks && !Unmark.Errors)
+  {
+    Carrier->Stats.EchoMissing++;
+    return true;
+  }
+  if (Got < Len || memcmp(Echo, Sent, Len) || Unmark.Breaks || Unmark.Errors)
+  {
+    Carrier->Stats.EchoCollisions++;
+    return false;
+  }
+  return true;
+}
+
+#else
+
+// no way of telling from the handle libmodbus gives us
+bool CarrierSense(Carrier_t *Carrier, int Fd, Responder_t *Yield)
+{
+  return true;
+}
+
+bool CarrierIdle(Carrier_t *Carrier, int Fd)
+{
+  return true;
+}
+
+bool CarrierCollided(Carrier_t *Carrier, int Fd, Responder_t *Yield)
+{
+  return false;
+}
+
+bool CarrierEcho(Carrier_t *Carrier, int Fd, const uint8_t *Sent, uint32_t Len, bool Marked)
+{
+  return true;
+}
+
+#endif
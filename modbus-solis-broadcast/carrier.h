@@ -0,0 +1,75 @@
+#ifndef CARRIER_H
+#define CARRIER_H
+
+#include <stdint.h>
+#include "rtu-line.h"
+#include "responder.h"
+
+//
+// Listen before talk. Solis Cloud control commands make the logger transact
+// whenever it likes, outside of it's normal cycle, so before each request to the
+// inverter the line is checked to have been quiet for at least 3.5 characters
+// (the gap that ends a frame, so nothing can be part way through). If it isn't,
+// whatever's been heard is thrown away and the request put off for a random,
+// growing backoff rather than talking over the logger. Should a request fail with
+// the logger heard straight afterwards, that's counted as a collision & the request
+// tried again.
+//
+// The wait for the line to be idle replaces the inter-frame gap that has to be left
+// between requests anyway, so when the bus is quiet it costs nothing extra.
+//
+// Optionally (echo_check) what's sent can also be read back & compared, for where
+// the transceiver's receiver is left enabled whilst transmitting (or the adapter
+// echoes). A frame that comes back different collided with someone else, so is
+// sent again whilst there's still time. No echo at all is just counted, since
+// that's the hardware not echoing rather than a collision.
+//
+
+typedef struct {
+  uint32_t Requests;    // sensed & found idle
+  uint32_t Deferrals;   // times the line was busy & a request put off
+  uint32_t Collisions;  // requests which failed with someone else talking
+  uint32_t Retries;     // requests sent again after a collision
+  uint32_t GaveUp;      // requests abandoned as the line never went quiet
+  uint64_t BackoffUs;   // total time spent backing off
+  uint32_t EchoChecks;  // frames sent & read back
+  uint32_t EchoCollisions;  // ...which came back different
+  uint32_t EchoMissing; // ...which didn't come back at all
+} CarrierStats_t;
+
+typedef struct {
+  bool Enabled;
+  uint32_t IdleUs;        // silence needed before talking
+  uint32_t BackoffUs;     // first backoff, doubling each time the line is still busy
+  uint32_t MaxBackoffUs;
+  uint32_t MaxWaitUs;     // give up on a request after this long without the line going quiet
+  uint32_t MaxRetries;    // after a collision
+  bool EchoCheck;         // read back what's sent
+  uint32_t EchoTimeoutUs; // how long to wait for the echo, once it's all been sent
+  CarrierStats_t Stats;
+} Carrier_t;
+
+// pick up the settings, the timing is in terms of the line's character time
+void CarrierInit(Carrier_t *Carrier, const RtuLine_t *Line);
+
+// wait for the line to be idle, backing off whilst it's busy. Returns false if it
+// never went quiet, in which case the request shouldn't be sent. If 'Yield' is
+// given (& acquired by the caller) the port's handed back to it whilst backing off,
+// to deal with what's been heard, rather than that being thrown away
+bool CarrierSense(Carrier_t *Carrier, int Fd, Responder_t *Yield);
+
+// is the line quiet right now, ie. nothing heard for the idle time? Never waits for
+// it to go quiet nor throws away what's been heard
+bool CarrierIdle(Carrier_t *Carrier, int Fd);
+
+// after a request has failed, check whether anyone else is talking. If so it's
+// counted as a collision (& what's been heard thrown away, unless it's to be left
+// for 'Yield') & true returned
+bool CarrierCollided(Carrier_t *Carrier, int Fd, Responder_t *Yield);
+
+// read back the 'Len' bytes just sent, once they've all gone. Returns false if they
+// came back different, true if they were intact or echo checking is off. 'Marked'
+// is set if the port has errors marked (see RtuSerialTune)
+bool CarrierEcho(Carrier_t *Carrier, int Fd, const uint8_t *Sent, uint32_t Len, bool Marked);
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <map>
+#include "config.h"
+
+static std::map<std::string, std::string> Settings;
+
+// strip leading/trailing whitespace in place
+static char *Trim(char *Str)
+{
+  char *End;
+
+  while (*Str == ' ' || *Str == '\t')
+    Str++;
+  End = Str + strlen(Str);
+  while (End > Str && (End[-1] == ' ' || End[-1] == '\t' || End[-1] == '\r' || End[-1] == '\n'))
+    *--End = '\0';
+  return Str;
+}
+
+bool ConfigLoad(const char *Path)
+{
+  FILE *Fp = fopen(Path, "rt");
+  char Line[512];
+  uint32_t LineNo = 0;
+
+  if (!Fp)
+  {
+    perror("Failed to open config file");
+    return false;
+  }
+
+  while (fgets(Line, sizeof(Line), Fp))
+  {
+    char *Comment = strchr(Line, '#');
+    char *Key, *Value;
+    char *Sep;
+
+    LineNo++;
+    if (Comment)
+      *Comment = '\0';
+    Key = Trim(Line);
+    if (!*Key)
+      continue;
+
+    Sep = strchr(Key, '=');
+    if (!Sep)
+    {
+      printf("%s:%u: expected key=value, ignoring\n", Path, LineNo);
+      continue;
+    }
+    *Sep = '\0';
+    Value = Trim(Sep + 1);
+    Key = Trim(Key);
+    Settings[Key] = Value;
+  }
+  fclose(Fp);
+  return true;
+}
+
+const char *ConfigGetString(const char *Key, const char *Default)
+{
+  auto It = Settings.find(Key);
+
+  if (It == Settings.end())
+    return Default;
+  return It->second.c_str();
+}
+
+uint32_t ConfigGetUint(const char *Key, uint32_t Default)
+{
+  const char *Value = ConfigGetString(Key, nullptr);
+
+  return Value ? strtoul(Value, NULL, 0) : Default;
+}
+
+double ConfigGetDouble(const char *Key, double Default)
+{
+  const char *Value = ConfigGetString(Key, nullptr);
+
+  return Value ? strtod(Value, NULL) : Default;
+}
+
+bool ConfigGetBool(const char *Key, bool Default)
+{
+  const char *Value = ConfigGetString(Key, nullptr);
+
+  if (!Value)
+    return Default;
+  return strtoul(Value, NULL, 0) || !strcmp(Value, "true") || !strcmp(Value, "yes");
+}
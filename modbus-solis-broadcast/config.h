@@ -0,0 +1,19 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdint.h>
+
+//
+// Optional settings file, consisting of 'key=value' lines. Blank
+// lines and anything following a '#' are ignored. Anything not
+// present in the file picks up the supplied default
+//
+
+bool ConfigLoad(const char *Path);
+
+const char *ConfigGetString(const char *Key, const char *Default);
+uint32_t ConfigGetUint(const char *Key, uint32_t Default);
+double ConfigGetDouble(const char *Key, double Default);
+bool ConfigGetBool(const char *Key, bool Default);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "delta.h"
+#include "config.h"
+
+// what each bus's receivers were last sent
+typedef struct {
+  bool Valid;
+  ModbusSolisRegister_t Registers;
+  uint32_t LoggerFail;
+  SolisLineErrors_t LineErrors;
+  SolisCollisions_t Collisions;
+  uint64_t LastFull;   // timestamp of the last full update
+} DeltaState_t;
+
+static std::vector<DeltaState_t> States;
+static bool Enabled = false;
+static double PowerDeadband = 0.05;
+static double SocDeadband = 1.0;
+static double EnergyDeadband = 0.0;
+static uint64_t Heartbeat = 300000u;
+static uint32_t Suppressed = 0u;
+
+// has a value moved far enough to be worth sending. A whole deadband counts (so with
+// the default a 1% step in SOC goes out), allowing for the registers' scaling not
+// being exact in binary, but a value which hasn't moved never does
+static bool Changed(double Value, double Last, double Deadband)
+{
+  return Value != Last && fabs(Value - Last) >= Deadband - 1e-6;
+}
+
+bool DeltaInit(uint32_t BusCount)
+{
+  Enabled = ConfigGetBool("publish_delta", false);
+  PowerDeadband = ConfigGetDouble("deadband_power", 0.05);
+  SocDeadband = ConfigGetDouble("deadband_soc", 1.0);
+  EnergyDeadband = ConfigGetDouble("deadband_energy", 0.0);
+  Heartbeat = ConfigGetUint("heartbeat_interval", 300) * 1000u;
+  States.assign(BusCount, DeltaState_t());
+  return Enabled;
+}
+
+uint32_t DeltaFields(const SolisSample_t *Sample)
+{
+  const ModbusSolisRegister_t *Regs = &Sample->Registers;
+  ModbusSolisRegister_t *Last;
+  DeltaState_t *State;
+  uint32_t Fields = 0u;
+
+  if (!Enabled || Sample->BusIndex >= States.size())
+    return SolisFieldAll;
+  State = &States[Sample->BusIndex];
+  Last = &State->Registers;
+
+  // first time or heartbeat due, send the lot
+  if (!State->Valid || Sample->Timestamp < State->LastFull || Sample->Timestamp - State->LastFull >= Heartbeat)
+  {
+    State->Valid = true;
+    State->Registers = *Regs;
+    State->LoggerFail = Sample->LoggerFail;
+    State->LineErrors = Sample->LineErrors;
+    State->Collisions = Sample->Collisions;
+    State->LastFull = Sample->Timestamp;
+    return SolisFieldAll;
+  }
+
+  // only those which have moved beyond their deadband since they were last sent, the
+  // rest are left alone so a slow drift still goes out eventually
+  if (Changed(Regs->batteryCapacitySoc, Last->batteryCapacitySoc, SocDeadband))
+  {
+    Fields |= SolisFieldBatteryCapacitySoc;
+    Last->batteryCapacitySoc = Regs->batteryCapacitySoc;
+  }
+  if (Changed(Regs->batteryPower, Last->batteryPower, PowerDeadband))
+  {
+    Fields |= SolisFieldBatteryPower;
+    Last->batteryPower = Regs->batteryPower;
+  }
+  if (Changed(Regs->pac, Last->pac, PowerDeadband))
+  {
+    Fields |= SolisFieldPac;
+    Last->pac = Regs->pac;
+  }
+  if (Changed(Regs->psum, Last->psum, PowerDeadband))
+  {
+    Fields |= SolisFieldPsum;
+    Last->psum = Regs->psum;
+  }
+  if (Changed(Regs->familyLoadPower, Last->familyLoadPower, PowerDeadband))
+  {
+    Fields |= SolisFieldFamilyLoadPower;
+    Last->familyLoadPower = Regs->familyLoadPower;
+  }
+  if (Changed(Regs->etoday, Last->etoday, EnergyDeadband))
+  {
+    Fields |= SolisFieldEToday;
+    Last->etoday = Regs->etoday;
+  }
+  if (Changed(Regs->batteryTotalChargeEnergy, Last->batteryTotalChargeEnergy, EnergyDeadband))
+  {
+    Fields |= SolisFieldBatteryTotalChargeEnergy;
+    Last->batteryTotalChargeEnergy = Regs->batteryTotalChargeEnergy;
+  }
+  if (Changed(Regs->batteryTotalDischargeEnergy, Last->batteryTotalDischargeEnergy, EnergyDeadband))
+  {
+    Fields |= SolisFieldBatteryTotalDischargeEnergy;
+    Last->batteryTotalDischargeEnergy = Regs->batteryTotalDischargeEnergy;
+  }
+  if (Changed(Regs->gridPurchasedTotalEnergy, Last->gridPurchasedTotalEnergy, EnergyDeadband))
+  {
+    Fields |= SolisFieldGridPurchasedTotalEnergy;
+    Last->gridPurchasedTotalEnergy = Regs->gridPurchasedTotalEnergy;
+  }
+  if (Changed(Regs->gridSellTotalEnergy, Last->gridSellTotalEnergy, EnergyDeadband))
+  {
+    Fields |= SolisFieldGridSellTotalEnergy;
+    Last->gridSellTotalEnergy = Regs->gridSellTotalEnergy;
+  }
+  if (Changed(Regs->eTotal, Last->eTotal, EnergyDeadband))
+  {
+    Fields |= SolisFieldETotal;
+    Last->eTotal = Regs->eTotal;
+  }
+  if (Sample->LoggerFail != State->LoggerFail)
+  {
+    Fields |= SolisFieldLoggerFail;
+    State->LoggerFail = Sample->LoggerFail;
+  }
+  if (memcmp(&Sample->LineErrors, &State->LineErrors, sizeof(SolisLineErrors_t)))
+  {
+    Fields |= SolisFieldLineErrors;
+    State->LineErrors = Sample->LineErrors;
+  }
+  if (memcmp(&Sample->Collisions, &State->Collisions, sizeof(SolisCollisions_t)))
+  {
+    Fields |= SolisFieldCollisions;
+    State->Collisions = Sample->Collisions;
+  }
+
+  if (!Fields)
+  {
+    Suppressed++;
+    if (Verbose)
+      printf("No change beyond deadband, not sending (%u suppressed so far)\n", Suppressed);
+  }
+  return Fields;
+}
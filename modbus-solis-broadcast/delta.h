@@ -0,0 +1,20 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "solis.h"
+
+//
+// Change only publication. When enabled, a sample is only sent if at least one
+// field has moved by at least it's deadband since it was last sent, and then only
+// the fields which have. A full sample goes out periodically regardless, as a
+// heartbeat, so receivers which have missed something can catch up
+//
+
+// read the settings, returns true if change only publication is enabled
+bool DeltaInit(uint32_t BusCount);
+
+// work out which fields need sending for a sample, SolisFieldAll if it's due a full
+// update or 0 if there's nothing worth sending
+uint32_t DeltaFields(const SolisSample_t *Sample);
+
+#endif
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <string.h>
+#include "fanout.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include "solis.h"
+
+// a consumer that falls this far behind is assumed to be stuck & disconnected
+static const size_t MaxPending = 64u * 1024u;
+static const int MaxBacklog = 8;
+
+typedef struct {
+  int Fd;
+  bool Dead;
+  std::string Pending;  // anything that couldn't be written straight away
+} FanoutClient_t;
+
+static std::vector<FanoutClient_t> Clients;
+static std::map<uint32_t, std::string> Latest;  // per bus
+static std::mutex ClientLock;
+static std::thread FanoutThread;
+static int TcpFd = -1;
+static int UnixFd = -1;
+static int WakePipe[2] = { -1, -1 };
+static std::string UnixSocketPath;
+static std::atomic<bool> Shutdown(false);
+static uint32_t Connects = 0u;
+static uint32_t Evictions = 0u;
+
+static void Wake(void)
+{
+  char Ch = 0;
+
+  if (write(WakePipe[1], &Ch, 1) < 0 && errno != EAGAIN)
+    perror("fanout wake");
+}
+
+// write as much as we can without blocking, keeping hold of the rest
+// must be called with the lock held
+static void ClientWrite(FanoutClient_t &Client, const char *Data, size_t Len)
+{
+  if (Client.Dead)
+    return;
+
+  if (Client.Pending.empty())
+  {
+    ssize_t Rc = send(Client.Fd, Data, Len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (Rc < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        Client.Dead = true;
+        return;
+      }
+      Rc = 0;
+    }
+    Data += Rc;
+    Len -= Rc;
+  }
+  if (Len)
+  {
+    if (Client.Pending.size() + Len > MaxPending)
+    {
+      Evictions++;
+      printf("Fanout consumer %d not keeping up, disconnecting\n", Client.Fd);
+      Client.Dead = true;
+      return;
+    }
+    Client.Pending.append(Data, Len);
+  }
+}
+
+// try and flush out anything still pending for a consumer
+static void ClientFlush(FanoutClient_t &Client)
+{
+  std::string Pending;
+
+  Pending.swap(Client.Pending);
+  ClientWrite(Client, Pending.data(), Pending.size());
+}
+
+static int Listen(int Domain, const struct sockaddr *Addr, socklen_t AddrLen)
+{
+  int Fd = socket(Domain, SOCK_STREAM, 0);
+  int Enable = 1;
+
+  if (Fd < 0)
+  {
+    perror("fanout socket");
+    return -1;
+  }
+  if (Domain == AF_INET)
+    setsockopt(Fd, SOL_SOCKET, SO_REUSEADDR, (char*)&Enable, sizeof(Enable));
+  if (bind(Fd, Addr, AddrLen) < 0 || listen(Fd, MaxBacklog) < 0)
+  {
+    perror("fanout bind/listen");
+    close(Fd);
+    return -1;
+  }
+  fcntl(Fd, F_SETFL, O_NONBLOCK);
+  return Fd;
+}
+
+static void Accept(int ListenFd)
+{
+  int Fd = accept(ListenFd, NULL, NULL);
+
+  if (Fd < 0)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      perror("fanout accept");
+    return;
+  }
+  fcntl(Fd, F_SETFL, O_NONBLOCK);
+
+  std::lock_guard<std::mutex> Lock(ClientLock);
+  FanoutClient_t Client;
+
+  Client.Fd = Fd;
+  Client.Dead = false;
+  Clients.push_back(Client);
+  Connects++;
+
+  // bring the new consumer up to date straight away, with every bus
+  for (auto &Bus : Latest)
+    ClientWrite(Clients.back(), Bus.second.data(), Bus.second.size());
+
+  if (Verbose)
+    printf("Fanout consumer %d connected, %u connected\n", Fd, (uint32_t)Clients.size());
+}
+
+static void FanoutLoop(void)
+{
+  std::vector<struct pollfd> PollFds;
+
+  while (!Shutdown)
+  {
+    struct pollfd Pfd;
+
+    PollFds.clear();
+    Pfd.events = POLLIN;
+    Pfd.revents = 0;
+    Pfd.fd = WakePipe[0];
+    PollFds.push_back(Pfd);
+    Pfd.fd = TcpFd;
+    PollFds.push_back(Pfd);
+    Pfd.fd = UnixFd;
+    PollFds.push_back(Pfd);
+
+    {
+      std::lock_guard<std::mutex> Lock(ClientLock);
+
+      // reap any consumers which have gone away
+      for (auto It = Clients.begin(); It != Clients.end(); )
+      {
+        if (It->Dead)
+        {
+          close(It->Fd);
+          It = Clients.erase(It);
+        }
+        else
+          ++It;
+      }
+      for (auto &Client : Clients)
+      {
+        Pfd.fd = Client.Fd;
+        Pfd.events = POLLIN | (Client.Pending.empty() ? 0 : POLLOUT);
+        PollFds.push_back(Pfd);
+      }
+    }
+
+    // negative fds (disabled transports) are ignored by poll
+    if (poll(PollFds.data(), PollFds.size(), -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("fanout poll");
+      break;
+    }
+
+    if (PollFds[0].revents & POLLIN)
+    {
+      char Scratch[64];
+      while (read(WakePipe[0], Scratch, sizeof(Scratch)) > 0)
+        ;
+    }
+    if (PollFds[1].revents & POLLIN)
+      Accept(TcpFd);
+    if (PollFds[2].revents & POLLIN)
+      Accept(UnixFd);
+
+    std::lock_guard<std::mutex> Lock(ClientLock);
+
+    for (size_t i = 3; i < PollFds.size(); i++)
+    {
+      if (!PollFds[i].revents)
+        continue;
+      for (auto &Client : Clients)
+      {
+        if (Client.Fd != PollFds[i].fd || Client.Dead)
+          continue;
+        if (PollFds[i].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+          char Scratch[256];
+          // consumers don't send us anything, so this is most likely them going away
+          ssize_t Rc = recv(Client.Fd, Scratch, sizeof(Scratch), MSG_DONTWAIT);
+          if (Rc == 0 || (Rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+          {
+            if (Verbose)
+              printf("Fanout consumer %d disconnected\n", Client.Fd);
+            Client.Dead = true;
+          }
+        }
+        if ((PollFds[i].revents & POLLOUT) && !Client.Dead)
+          ClientFlush(Client);
+      }
+    }
+  }
+}
+
+bool FanoutInit(uint16_t TcpPort, const char *UnixPath)
+{
+  if (pipe(WakePipe) < 0)
+  {
+    perror("fanout pipe");
+    return false;
+  }
+  fcntl(WakePipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(WakePipe[1], F_SETFL, O_NONBLOCK);
+
+  if (TcpPort)
+  {
+    struct sockaddr_in Addr;
+
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sin_family = AF_INET;
+    Addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    Addr.sin_port = htons(TcpPort);
+    TcpFd = Listen(AF_INET, (struct sockaddr*)&Addr, sizeof(Addr));
+    if (TcpFd < 0)
+      return false;
+    printf("Fanout listening on TCP port %u\n", TcpPort);
+  }
+
+  if (UnixPath && *UnixPath)
+  {
+    struct sockaddr_un Addr;
+
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    strncpy(Addr.sun_path, UnixPath, sizeof(Addr.sun_path) - 1);
+    // remove any stale socket left behind by a previous run
+    unlink(UnixPath);
+    UnixFd = Listen(AF_UNIX, (struct sockaddr*)&Addr, sizeof(Addr));
+    if (UnixFd < 0)
+      return false;
+    UnixSocketPath = UnixPath;
+    printf("Fanout listening on %s\n", UnixPath);
+  }
+
+  Shutdown = false;
+  FanoutThread = std::thread(FanoutLoop);
+  return true;
+}
+
+void FanoutSend(uint32_t Bus, const char *Payload, size_t Len, const char *LatestPayload, size_t LatestLen)
+{
+  bool Pending = false;
+
+  {
+    std::lock_guard<std::mutex> Lock(ClientLock);
+
+    if (LatestPayload)
+      Latest[Bus].assign(LatestPayload, LatestLen);
+    else
+      Latest[Bus].assign(Payload, Len);
+    for (auto &Client : Clients)
+    {
+      ClientWrite(Client, Payload, Len);
+      if (Client.Dead || !Client.Pending.empty())
+        Pending = true;
+    }
+    if (Verbose)
+      printf("Fanout to %u consumers (%u connects, %u evicted)\n", (uint32_t)Clients.size(), Connects, Evictions);
+  }
+
+  // get the server thread to reap or flush as needed
+  if (Pending && FanoutThread.joinable())
+    Wake();
+}
+
+void FanoutShutdown(void)
+{
+  if (!FanoutThread.joinable())
+    return;
+
+  Shutdown = true;
+  Wake();
+  FanoutThread.join();
+
+  for (auto &Client : Clients)
+    close(Client.Fd);
+  Clients.clear();
+  if (TcpFd >= 0)
+    close(TcpFd);
+  if (UnixFd >= 0)
+  {
+    close(UnixFd);
+    unlink(UnixSocketPath.c_str());
+  }
+  close(WakePipe[0]);
+  close(WakePipe[1]);
+  TcpFd = UnixFd = -1;
+}
+
+#else
+
+// not supported under Windows
+bool FanoutInit(uint16_t TcpPort, const char *UnixPath)
+{
+  if (TcpPort || (UnixPath && *UnixPath))
+    printf("Fanout server not supported on this platform\n");
+  return true;
+}
+
+void FanoutSend(uint32_t Bus, const char *Payload, size_t Len, const char *LatestPayload, size_t LatestLen)
+{
+}
+
+void FanoutShutdown(void)
+{
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Local push service. Consumers connect over TCP and/or a Unix domain socket
+// and are sent every sample (one JSON document per line) as soon as it's
+// published. A newly connected consumer is sent the most recent sample from
+// each bus straight away rather than having to wait for the next poll
+//
+
+// start listening, a zero port or null path disables that transport
+bool FanoutInit(uint16_t TcpPort, const char *UnixPath);
+
+// push a (newline terminated) payload from a bus to all connected consumers. 'Latest'
+// is what newly connected consumers get sent for that bus, if it's something other
+// than the payload
+void FanoutSend(uint32_t Bus, const char *Payload, size_t Len, const char *Latest = nullptr, size_t LatestLen = 0);
+
+void FanoutShutdown(void);
+
+#endif
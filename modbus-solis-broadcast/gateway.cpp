@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <string.h>
+#include "gateway.h"
+#include "config.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <modbus/modbus.h>
+#include <thread>
+#include <atomic>
+#include "solis.h"
+
+static std::vector<RegCache_t*> BusCaches;
+static std::vector<struct pollfd> PollFds;  // [0] is the listening socket, the rest are clients
+static std::thread GatewayThread;
+static std::atomic<bool> Shutdown(false);
+static modbus_t *Ctx = nullptr;
+static modbus_mapping_t *Mapping = nullptr;
+static int ListenFd = -1;
+static uint32_t MaxClients = 16u;
+static uint32_t Requests = 0u;
+static uint32_t Exceptions = 0u;
+
+// answer a single request, from the cache
+static void HandleQuery(const uint8_t *Query, int Len)
+{
+  int HeaderLength = modbus_get_header_length(Ctx);
+  uint8_t Unit = Query[HeaderLength - 1];
+  uint8_t Function = Query[HeaderLength];
+  uint16_t Address = (Query[HeaderLength + 1] << 8) | Query[HeaderLength + 2];
+  uint16_t Count = (Query[HeaderLength + 3] << 8) | Query[HeaderLength + 4];
+  uint32_t Bus = (Unit == 0 || Unit == 0xff) ? 0u : Unit - 1u;
+  RegCacheType_t Type;
+  uint16_t *Table, Base;
+  uint16_t Values[MODBUS_MAX_READ_REGISTERS], Ages[MODBUS_MAX_READ_REGISTERS];
+  bool AgeRequest;
+  bool Ok;
+
+  Requests++;
+
+  if (Bus >= BusCaches.size())
+  {
+    modbus_reply_exception(Ctx, Query, MODBUS_EXCEPTION_GATEWAY_PATH);
+    Exceptions++;
+    return;
+  }
+  if (Function == MODBUS_FC_READ_INPUT_REGISTERS)
+  {
+    Type = RegCacheInput;
+    Table = Mapping->tab_input_registers;
+    Base = RegCacheInputBase;
+  }
+  else if (Function == MODBUS_FC_READ_HOLDING_REGISTERS)
+  {
+    Type = RegCacheHolding;
+    Table = Mapping->tab_registers;
+    Base = RegCacheHoldingBase;
+  }
+  else
+  {
+    // read only, and nothing else is of any interest
+    modbus_reply_exception(Ctx, Query, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+    Exceptions++;
+    return;
+  }
+  if (!Count || Count > MODBUS_MAX_READ_REGISTERS)
+  {
+    modbus_reply_exception(Ctx, Query, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+    Exceptions++;
+    return;
+  }
+
+  AgeRequest = (Address >= Base + GatewayAgeOffset);
+  if (AgeRequest)
+    Ok = RegCacheLookup(BusCaches[Bus], Type, Address - GatewayAgeOffset, Count, Values, Ages);
+  else
+    Ok = RegCacheLookup(BusCaches[Bus], Type, Address, Count, Values, nullptr);
+  if (!Ok)
+  {
+    modbus_reply_exception(Ctx, Query, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    Exceptions++;
+    return;
+  }
+
+  // the mapping spans both the registers & their ages, so just fill in the bit being
+  // asked for and let libmodbus build the response
+  memcpy(&Table[Address - Base], AgeRequest ? Ages : Values, Count * sizeof(uint16_t));
+  if (modbus_reply(Ctx, Query, Len, Mapping) < 0 && Verbose)
+    printf("Gateway reply failed: %s\n", modbus_strerror(errno));
+}
+
+static void GatewayLoop(void)
+{
+  uint8_t Query[MODBUS_TCP_MAX_ADU_LENGTH];
+
+  while (!Shutdown)
+  {
+    // wake up once a second to check for shutdown
+    int Rc = poll(PollFds.data(), PollFds.size(), 1000);
+
+    if (Rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("gateway poll");
+      break;
+    }
+
+    // service the existing clients first, any that have gone away are removed
+    for (size_t i = 1; i < PollFds.size(); )
+    {
+      if (PollFds[i].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        modbus_set_socket(Ctx, PollFds[i].fd);
+        Rc = modbus_receive(Ctx, Query);
+        if (Rc > 0)
+          HandleQuery(Query, Rc);
+        else if (Rc < 0)
+        {
+          if (Verbose)
+            printf("Gateway client disconnected\n");
+          close(PollFds[i].fd);
+          PollFds.erase(PollFds.begin() + i);
+          continue;
+        }
+      }
+      i++;
+    }
+
+    if (PollFds[0].revents & POLLIN)
+    {
+      int Fd = accept(ListenFd, NULL, NULL);
+
+      if (Fd < 0)
+        perror("gateway accept");
+      else if (PollFds.size() > MaxClients)
+      {
+        printf("Gateway client limit (%u) reached, refusing connection\n", MaxClients);
+        close(Fd);
+      }
+      else
+      {
+        // don't let a client which has stopped reading hold everyone else up
+        struct timeval SendTimeOut = { 1, 0 };
+        struct pollfd Pfd = { Fd, POLLIN, 0 };
+
+        setsockopt(Fd, SOL_SOCKET, SO_SNDTIMEO, &SendTimeOut, sizeof(SendTimeOut));
+        PollFds.push_back(Pfd);
+        if (Verbose)
+          printf("Gateway client connected, %u in total, %u requests served (%u exceptions)\n",
+                 (uint32_t)PollFds.size() - 1u, Requests, Exceptions);
+      }
+    }
+  }
+}
+
+bool GatewayInit(const std::vector<RegCache_t*> &Caches)
+{
+  uint32_t Port = ConfigGetUint("gateway_port", 0);
+  const char *Address = ConfigGetString("gateway_address", "0.0.0.0");
+  struct pollfd Pfd;
+
+  if (!Port)
+    return true;
+
+  BusCaches = Caches;
+  MaxClients = ConfigGetUint("gateway_max_clients", 16);
+
+  Ctx = modbus_new_tcp(Address, Port);
+  if (!Ctx)
+  {
+    printf("modbus_new_tcp: %s\n", modbus_strerror(errno));
+    return false;
+  }
+  // big enough to hold the registers in the cache along with their ages
+  Mapping = modbus_mapping_new_start_address(0, 0, 0, 0,
+                                             RegCacheHoldingBase, GatewayAgeOffset + RegCacheHoldingCount,
+                                             RegCacheInputBase, GatewayAgeOffset + RegCacheInputCount);
+  if (!Mapping)
+  {
+    printf("modbus_mapping_new: %s\n", modbus_strerror(errno));
+    modbus_free(Ctx);
+    return false;
+  }
+  ListenFd = modbus_tcp_listen(Ctx, MaxClients);
+  if (ListenFd < 0)
+  {
+    printf("Unable to start Modbus TCP gateway on %s:%u: %s\n", Address, Port, modbus_strerror(errno));
+    modbus_mapping_free(Mapping);
+    modbus_free(Ctx);
+    return false;
+  }
+
+  Pfd.fd = ListenFd;
+  Pfd.events = POLLIN;
+  Pfd.revents = 0;
+  PollFds.push_back(Pfd);
+
+  printf("Modbus TCP gateway listening on %s:%u\n", Address, Port);
+  Shutdown = false;
+  GatewayThread = std::thread(GatewayLoop);
+  return true;
+}
+
+void GatewayShutdown(void)
+{
+  if (!Ctx)
+    return;
+
+  Shutdown = true;
+  if (GatewayThread.joinable())
+    GatewayThread.join();
+  for (auto &Pfd : PollFds)
+    close(Pfd.fd);
+  PollFds.clear();
+  modbus_mapping_free(Mapping);
+  modbus_free(Ctx);
+  Mapping = nullptr;
+  Ctx = nullptr;
+  ListenFd = -1;
+}
+
+#else
+
+// not supported under Windows
+bool GatewayInit(const std::vector<RegCache_t*> &Caches)
+{
+  if (ConfigGetUint("gateway_port", 0))
+    printf("Modbus TCP gateway not supported on this platform\n");
+  return true;
+}
+
+void GatewayShutdown(void)
+{
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include <vector>
+#include "regcache.h"
+
+//
+// Modbus TCP server answering register reads from the register cache, so any
+// number of clients can read the inverter data without adding any traffic to
+// the RS485 bus. Only function 3 & 4 reads are supported, anything else gets
+// an exception.
+//
+// The unit id selects the bus (1 for the first, 2 for the second etc., 0 & 255
+// are treated as 1). How old each register is, in seconds, can be read from the
+// same address plus GatewayAgeOffset (eg. input register 39057 holds the age of
+// 33057), 0xffff meaning it's never been read
+//
+
+static const uint16_t GatewayAgeOffset = 6000u;
+
+// start the server (if enabled in the settings) on it's own thread
+bool GatewayInit(const std::vector<RegCache_t*> &Caches);
+
+void GatewayShutdown(void);
+
+#endif
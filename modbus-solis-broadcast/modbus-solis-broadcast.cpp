@@ -23,20 +23,63 @@ typedef int SOCKET;
 #include <iostream>
 #include <sstream>
 #include <cjson/cJSON.h>
-#include <boost/crc.hpp>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "solis.h"
+#include "publish.h"
+#include "config.h"
+#include "gateway.h"
+#include "state.h"
+#include "modbus-rtu.h"
+#include "rtu-line.h"
+#include "rtu-serial.h"
+
+// the serial line settings, shared by all the buses
+static RtuLine_t Line;
+
+// pause for the time taken to send 'Chars' characters at the current line speed
+static void LineDelay(uint32_t Chars)
+{
+#ifndef WIN32
+  usleep(RtuLineChars(&Line, Chars));
+#else
+  Sleep((RtuLineChars(&Line, Chars) + 999u) / 1000u);
+#endif
+}
+
 #ifdef RPI
 #include <wiringPi.h>
 
-// define GPIOs for RS485 control
+// define GPIOs for RS485 control. For echo_check, the receiver needs to stay
+// enabled whilst transmitting so only define RS485_DE
 #define RS485_RE 4
 // only define one if RE & DE are tied together
 //#define RS485_DE 24
+#endif
 
-// RTS handler used to control the RS485 direction GPIO
+#ifndef WIN32
+// the request libmodbus is in the middle of sending, for checking against it's echo
+typedef struct {
+  Carrier_t *Carrier;
+  uint8_t Frame[8];
+  uint32_t Len;
+  bool Collided;
+} EchoRequest_t;
+
+// each bus has it's own thread (& modbus context)
+static thread_local EchoRequest_t *PendingEcho = nullptr;
+
+// RTS handler used to control the RS485 direction GPIO on a Pi and/or read back
+// what's been sent
 static void RTSHandler(modbus_t *Ctx, int On)
 {
   if (On)
   {
+    // anything already waiting isn't ours, so mustn't be mistaken for the echo
+    if (Ctx && PendingEcho)
+      tcflush(modbus_get_socket(Ctx), TCIFLUSH);
+#ifdef RPI
     // disable receiver, enable transmitter
 #ifdef RS485_RE
     digitalWrite(RS485_RE, HIGH);
@@ -44,15 +87,17 @@ static void RTSHandler(modbus_t *Ctx, int On)
 #ifdef RS485_DE
     digitalWrite(RS485_DE, HIGH);
 #endif
-    // allow time for the other end to switch
-    Sleep(10);
+    // allow time for the other end to switch, ~10ms at 9600
+    LineDelay(10);
+#endif
   }
   else
   {
+#ifdef RPI
     if (Ctx)
       tcdrain(modbus_get_socket(Ctx)) ;
     // a delay may/may not be required here
-    Sleep(1);
+    LineDelay(1);
     // restore default receive functionality
 #ifdef RS485_RE
     digitalWrite(RS485_RE, LOW);
@@ -60,6 +105,10 @@ static void RTSHandler(modbus_t *Ctx, int On)
 #ifdef RS485_DE
     digitalWrite(RS485_DE, LOW);
 #endif
+#endif
+    if (Ctx && PendingEcho)
+      PendingEcho->Collided = !CarrierEcho(PendingEcho->Carrier, modbus_get_socket(Ctx), PendingEcho->Frame,
+                                           PendingEcho->Len, false);
   }
 }
 #endif
@@ -71,63 +120,48 @@ static void RTSHandler(modbus_t *Ctx, int On)
 //
 // This is designed to operate in tandem with the existing Wifi logger
 //
-
-// info we're interested in from the inverter - matches JSON names
-// used by the Solis API
-typedef struct {
-  uint16_t batteryCapacitySoc; // (%)
-  double   batteryPower; // (kW)
-  double   pac;    // generation (kW)
-  double   psum;   // grid in/out (kW)
-  double   familyLoadPower; // load (kW)
-  double   etoday;  // generation today (kWh)
-  uint32_t batteryTotalChargeEnergy; // battery total charge (kWh)
-  uint32_t batteryTotalDischargeEnergy;  // battery total discharge (kWh)
-  uint32_t gridPurchasedTotalEnergy; // grid imported total (kWh)
-  uint32_t gridSellTotalEnergy; // grid exported total (kWh)
-  uint32_t eTotal; // solar generation total (kWh)
-} ModbusSolisRegister_t;
+// Multiple RS485 buses (one inverter + logger on each) can be serviced
+// concurrently, each bus runs in it's own thread with it's own logger
+// sync state, all feeding into a single publisher
+//
 
 static const uint32_t LoggerCycleTime = 300u; // 5 minutes
 
-static bool Verbose = false;
+// based on traffic from modbus-sniffer, the inverter takes anywhere between ~35ms and
+// 100ms to start responding, whatever the line speed. Allow for that with some margin
+static const uint32_t InverterProcessingTime = 180000u; // us
+
+// the logger waits ~3s for a slave to answer, but an answer that collided is only sent
+// again well inside that, so it can't turn up once the logger's moved on
+static const uint32_t SlaveRetryWindow = 1000u; // ms
 
-static uint32_t LoggerFail = 0u;
+bool Verbose = false;
 
-// read the required registers from modbus
-static bool ModBusReadSolisRegisters(const char *Device, ModbusSolisRegister_t *ModbusSolisRegisters, 
-                                      uint32_t &Elapsed, uint8_t Slave = 1)
+// for measuring how long it takes to get the first sample out after starting
+static boost::chrono::steady_clock::time_point StartTime;
+
+// open the serial port & get libmodbus ready to talk to the inverter
+static modbus_t *ModBusConnect(const char *Device, uint8_t Slave, bool EchoCheck)
 {
-  using namespace boost::posix_time;
-  modbus_t *Ctx = modbus_new_rtu(Device,9600,'N',8,1) ;
-  uint16_t RegBank[16];
-  int Rc = 0 ;
-  bool Ret = true;
-  ptime RequestStart(microsec_clock::local_time());
+  modbus_t *Ctx = modbus_new_rtu(Device, Line.Baud, Line.Parity, Line.DataBits, Line.StopBits) ;
 
-  if (Verbose)
-    std::cout << std::endl << "Issuing request at " << to_simple_string(RequestStart) << "..." << std::endl;
-  Elapsed = 0u ;
-  
-  memset(ModbusSolisRegisters,0,sizeof(ModbusSolisRegister_t)) ;
-  
   if (!Ctx)
   {
     printf("modbus_new_rtu: %s\n", modbus_strerror(errno));
-    return false;
+    return nullptr;
   }
   if (modbus_connect(Ctx) == -1)
   {
     printf("modbus_connect: %s\n", modbus_strerror(errno));
     modbus_free(Ctx);
-    return false;
+    return nullptr;
   }
   if (modbus_set_slave(Ctx, Slave) == -1)
   {
     printf("modbus_set_slave: %s\n", modbus_strerror(errno));
     modbus_close(Ctx);
     modbus_free(Ctx);
-    return false;
+    return nullptr;
   }
 
 #ifdef WIN32
@@ -135,130 +169,263 @@ static bool ModBusReadSolisRegisters(const char *Device, ModbusSolisRegister_t *
   modbus_set_response_timeout(Ctx, 15, 0);
   modbus_set_debug(Ctx, 1);
 #else
-  modbus_set_response_timeout(Ctx, 0, 200000);
+  // time to send the request plus the inverter's processing, ~200ms at 9600
+  uint32_t ResponseTimeout = RtuLineResponseTimeout(&Line, 8u, InverterProcessingTime);
+
+  modbus_set_response_timeout(Ctx, ResponseTimeout / 1000000u, ResponseTimeout % 1000000u);
 #endif
 
+#ifndef WIN32
 #ifdef RPI
+  bool Rts = true;
+#else
+  // without a GPIO to drive, the RTS callback is only needed to read back the echo
+  bool Rts = EchoCheck;
+#endif
   // enable RS485 mode
-  if (modbus_rtu_set_rts(Ctx, MODBUS_RTU_RTS_UP) < 0)
+  if (Rts && modbus_rtu_set_rts(Ctx, MODBUS_RTU_RTS_UP) < 0)
   {
     printf("modbus_rtu_set_serial_mode: %s\n", modbus_strerror(errno));
+    modbus_close(Ctx);
     modbus_free(Ctx);
-    return false;
+    return nullptr;
   }
   // set the callback used to control the RS485 transceivers
-  if (modbus_rtu_set_custom_rts(Ctx, RTSHandler) < 0)
+  if (Rts && modbus_rtu_set_custom_rts(Ctx, RTSHandler) < 0)
   {
     printf("modbus_rtu_set_serial_mode: %s\n", modbus_strerror(errno));
+    modbus_close(Ctx);
     modbus_free(Ctx);
-    return false;
+    return nullptr;
   }
 #endif
+  return Ctx;
+}
 
-  // most of what we need is in a single grouping
-  // see RS485_MODBUS-Hybrid-BACoghlan-201811228-1854.pdf
-  // These are read in one transaction:
-  // 33135: battery status 0=charge, 1=discharge (battery current direction)
-  // 33139: Battery capacity SOC
-  // 33147: House load power
-  // 33149:33150: Battery power
-  Rc = modbus_read_input_registers(Ctx, 33135, sizeof(RegBank) / sizeof(uint16_t), RegBank);
-  if (Rc == sizeof(RegBank) / sizeof(uint16_t))
-  {
-    ModbusSolisRegisters->batteryCapacitySoc = RegBank[4]; // 33139
-    ModbusSolisRegisters->batteryPower = (RegBank[14] << 16) + RegBank[15];  // 33149:33150
-    // 33135 - battery charge status, 0=charge, 1=discharge
-    if (RegBank[0])
-      ModbusSolisRegisters->batteryPower *= -1;  // if discharging, flip the power
-    ModbusSolisRegisters->batteryPower /= 1000.0; // convert to kW
-    ModbusSolisRegisters->familyLoadPower = (double)RegBank[12] / 1000; // 33147
-  }
-  else
-  {
-    printf("modbus_read_input_registers: %s\n", modbus_strerror(errno));
-    Ret = false;
-  }
+// 33135-33150, read in one transaction:
+// 33135: battery status 0=charge, 1=discharge (battery current direction)
+// 33139: Battery capacity SOC
+// 33147: House load power
+// 33149:33150: Battery power
+static void DecodeBatteryAndLoad(const uint16_t *RegBank, ModbusSolisRegister_t *ModbusSolisRegisters)
+{
+  ModbusSolisRegisters->batteryCapacitySoc = RegBank[4]; // 33139
+  ModbusSolisRegisters->batteryPower = (RegBank[14] << 16) + RegBank[15];  // 33149:33150
+  // 33135 - battery charge status, 0=charge, 1=discharge
+  if (RegBank[0])
+    ModbusSolisRegisters->batteryPower *= -1;  // if discharging, flip the power
+  ModbusSolisRegisters->batteryPower /= 1000.0; // convert to kW
+  ModbusSolisRegisters->familyLoadPower = (double)RegBank[12] / 1000; // 33147
+}
 
-  if (Ret)
-  {
-    // 33057:33058: Current Generation
-    Rc = modbus_read_input_registers(Ctx, 33057, sizeof(uint32_t) / sizeof(uint16_t), RegBank);
-    if (Rc == sizeof(uint32_t) / sizeof(uint16_t))
-    {
-      uint32_t Generation = (RegBank[0] << 16) + RegBank[1];   // expressed in watts
-      ModbusSolisRegisters->pac = (double)Generation / 1000;  // return as kW
-    }
-    else
-    {
-      printf("modbus_read_input_registers: %s\n", modbus_strerror(errno));
-      Ret = false;
-    }
-  }
+// 33057:33058: Current Generation
+static void DecodeGeneration(const uint16_t *RegBank, ModbusSolisRegister_t *ModbusSolisRegisters)
+{
+  uint32_t Generation = (RegBank[0] << 16) + RegBank[1];   // expressed in watts
+  ModbusSolisRegisters->pac = (double)Generation / 1000;  // return as kW
+}
 
-  if (Ret)
-  {
-    // 33263:33264: Meter total active power
-    Rc = modbus_read_input_registers(Ctx, 33263, sizeof(int32_t) / sizeof(uint16_t), RegBank);
-    if (Rc == sizeof(uint32_t) / sizeof(uint16_t))
-    {
-      int32_t ActivePower = MODBUS_GET_INT32_FROM_INT16(RegBank, 0);
-      ModbusSolisRegisters->psum = (double)ActivePower * 0.001;
-    }
-    else
-    {
-      printf("modbus_read_input_registers: %s\n", modbus_strerror(errno));
-      Ret = false;
-    }
-  }
+// 33263:33264: Meter total active power
+static void DecodeMeter(const uint16_t *RegBank, ModbusSolisRegister_t *ModbusSolisRegisters)
+{
+  int32_t ActivePower = MODBUS_GET_INT32_FROM_INT16(RegBank, 0);
+  ModbusSolisRegisters->psum = (double)ActivePower * 0.001;
+}
 
-  if (Ret)
-  {
-    const int NoRegisters = 7;
+// 33035: Inverter power generation today, expressed in 0.1kWh intervals
+static void DecodeToday(const uint16_t *RegBank, ModbusSolisRegister_t *ModbusSolisRegisters)
+{
+  ModbusSolisRegisters->etoday = (float)(RegBank[0])*0.1;
+}
+
+// 33029-33030: Inverter total power generation, expressed in kWh
+static void DecodeGenerationTotal(const uint16_t *RegBank, ModbusSolisRegister_t *ModbusSolisRegisters)
+{
+  ModbusSolisRegisters->eTotal = (RegBank[0] << 16) + RegBank[1];
+}
+
+// 33161:33162 - Battery charge total
+// 33165:33166 - Battery discharge total
+// 33169:33170 - Grid power imported total
+// 33173:33174 - Power exported from grid total
+static void DecodeEnergyTotals(const uint16_t *RegBank, ModbusSolisRegister_t *ModbusSolisRegisters)
+{
+  // expressed in 1kWh intervals
+  ModbusSolisRegisters->batteryTotalChargeEnergy = (RegBank[0] << 16) + RegBank[1];
+  ModbusSolisRegisters->batteryTotalDischargeEnergy = (RegBank[4] << 16) + RegBank[5];
+  ModbusSolisRegisters->gridPurchasedTotalEnergy = (RegBank[8] << 16) + RegBank[9];
+  ModbusSolisRegisters->gridSellTotalEnergy = (RegBank[12] << 16) + RegBank[13];
+}
+
+// 43110: storage control mode, not published but kept in the cache for anyone else wanting it
+static void DecodeStorageMode(const uint16_t *RegBank, ModbusSolisRegister_t *)
+{
+  if (Verbose)
+    printf("Storage control mode: 0x%04x\n", RegBank[0]);
+}
+
+// each group of registers is read in a single transaction, how often is governed by it's
+// maximum age in the cache - the live power readings go every poll, the rest far less often.
+// Should a group fail, it's last known values stand in for it only whilst they're no older
+// than it's fallback age; the live power readings have none by default, as publishing old
+// power values as if they were current is worse than publishing nothing.
+// See RS485_MODBUS-Hybrid-BACoghlan-201811228-1854.pdf
+typedef struct {
+  const char *Name;
+  RegCacheType_t Type;
+  uint16_t Address;
+  uint16_t Count;
+  const char *MaxAgeSetting;  // settings file entry giving the maximum age in seconds
+  uint32_t MaxAge;            // default for the above
+  const char *FallbackSetting;// settings file entry giving the maximum age in seconds to fall back on
+  uint32_t Fallback;          // default for the above
+  bool Required;              // without it, there's nothing worth publishing
+  void (*Decode)(const uint16_t *RegBank, ModbusSolisRegister_t *ModbusSolisRegisters);
+} RegisterGroup_t;
+
+static const RegisterGroup_t RegisterGroups[] = {
+  { "battery/load", RegCacheInput, 33135, 16, "cache_max_age_power", 0, "cache_fallback_power", 0, true, DecodeBatteryAndLoad },
+  { "generation", RegCacheInput, 33057, 2, "cache_max_age_power", 0, "cache_fallback_power", 0, true, DecodeGeneration },
+  { "meter", RegCacheInput, 33263, 2, "cache_max_age_power", 0, "cache_fallback_power", 0, true, DecodeMeter },
+  { "generation today", RegCacheInput, 33035, 1, "cache_max_age_today", 60, "cache_fallback_today", 600, true, DecodeToday },
+  { "generation total", RegCacheInput, 33029, 2, "cache_max_age_totals", 300, "cache_fallback_totals", 3600, true, DecodeGenerationTotal },
+  { "energy totals", RegCacheInput, 33161, 14, "cache_max_age_totals", 300, "cache_fallback_totals", 3600, true, DecodeEnergyTotals },
+  { "storage mode", RegCacheHolding, 43110, 1, "cache_max_age_settings", 3600, "cache_fallback_settings", 86400, false, DecodeStorageMode }
+};
+
+// set how long each group of registers can be served from the cache before
+// going back to the bus for them
+static void ConfigureCache(RegCache_t *Cache)
+{
+  for (auto &Group : RegisterGroups)
+    RegCacheSetMaxAge(Cache, Group.Type, Group.Address, Group.Count,
+                      ConfigGetUint(Group.MaxAgeSetting, Group.MaxAge) * 1000u);
+}
 
-    // 33029-33030: Inverter total power generation
-    // 33035:       Intverter power generation today
-    Rc = modbus_read_input_registers(Ctx, 33029, NoRegisters, RegBank);
-    if (Rc == NoRegisters)
+// read the required registers, via the cache so the bus is only touched for those
+// groups which are due a refresh. Each group stands alone, if one can't be read its
+// last known values are used (within it's fallback age) so a single timeout doesn't
+// lose the whole sample. 'Live' is set if anything at all was read from the bus
+static bool ModBusReadSolisRegisters(SolisBus_t *Bus, ModbusSolisRegister_t *ModbusSolisRegisters, 
+                                      uint32_t &Elapsed, bool &Live)
+{
+  using namespace boost::posix_time;
+  modbus_t *Ctx = nullptr;
+  bool ConnectFailed = false;
+  uint16_t RegBank[16];
+  int Rc = 0 ;
+  bool Ret = true;
+  ptime RequestStart(microsec_clock::local_time());
+
+  // only open the port once there's something which actually needs reading
+  auto Transact = [&](RegCacheType_t Type, uint16_t Address, uint16_t Count, uint16_t *Dest) -> int {
+    if (ConnectFailed)
+      return -1;
+    if (!Ctx && !(Ctx = ModBusConnect(Bus->Device, Bus->SlaveId, Bus->Carrier.EchoCheck)))
     {
-      // expressed in kWh
-      ModbusSolisRegisters->eTotal = (RegBank[0] << 16) + RegBank[1];
-      // expressed in 0.1kWh intervals
-      ModbusSolisRegisters->etoday = (float)(RegBank[6])*0.1;
+      ConnectFailed = true;
+      return -1;
     }
-    else
+#ifndef WIN32
+    // what libmodbus is about to send, for the RTS handler to check it's echo against
+    EchoRequest_t Echo;
+
+    Echo.Carrier = &Bus->Carrier;
+    Echo.Len = RtuReadRequest(Echo.Frame, Bus->SlaveId, Type == RegCacheInput ? 4u : 3u, Address, Count);
+#endif
+    // don't talk over the logger, if it got in first try again once it's finished
+    for (uint32_t Attempt = 0; ; Attempt++)
     {
-      printf("modbus_read_input_registers: %s\n", modbus_strerror(errno));
-      Ret = false;
+      int Rc;
+      bool Collided;
+
+      if (!CarrierSense(&Bus->Carrier, modbus_get_socket(Ctx), Bus->Responder))
+      {
+        errno = EBUSY;
+        return -1;
+      }
+#ifndef WIN32
+      Echo.Collided = false;
+      if (Bus->Carrier.EchoCheck)
+        PendingEcho = &Echo;
+#endif
+      if (Type == RegCacheInput)
+        Rc = modbus_read_input_registers(Ctx, Address, Count, Dest);
+      else
+        Rc = modbus_read_registers(Ctx, Address, Count, Dest);
+#ifndef WIN32
+      PendingEcho = nullptr;
+      // the request was mangled on it's way out so won't have been answered, go
+      // straight round again rather than waiting to hear the logger. Should an
+      // answer have come back regardless, the inverter got it after all
+      Collided = Rc < 0 && Echo.Collided;
+      if (Collided && !Bus->Responder)
+        tcflush(modbus_get_socket(Ctx), TCIFLUSH);
+#else
+      Collided = false;
+#endif
+      if (Rc >= 0 || Attempt >= Bus->Carrier.MaxRetries ||
+          !(Collided || CarrierCollided(&Bus->Carrier, modbus_get_socket(Ctx), Bus->Responder)))
+        return Rc;
+      Bus->Carrier.Stats.Retries++;
     }
-  }
+  };
+  // the background responder is held off whilst the port's ours
+  auto Reader = [&](RegCacheType_t Type, uint16_t Address, uint16_t Count, uint16_t *Dest) -> int {
+    int Rc;
+
+    if (Bus->Responder)
+      ResponderAcquire(Bus->Responder);
+    Rc = Transact(Type, Address, Count, Dest);
+    if (Bus->Responder)
+      ResponderRelease(Bus->Responder);
+    if (Rc >= 0)
+      Live = true;
+    return Rc;
+  };
+
+  if (Verbose)
+    std::cout << std::endl << "Issuing request at " << to_simple_string(RequestStart) << "..." << std::endl;
+  Elapsed = 0u ;
+  Live = false;
+  
+  memset(ModbusSolisRegisters,0,sizeof(ModbusSolisRegister_t)) ;
 
-  if (Ret)
+  for (auto &Group : RegisterGroups)
   {
-    const int NoRegisters = 14;
-
-    // 33161:33162 - Battery charge total
-    // 33165:33166 - Battery discharge total
-    // 33169:33170 - Grid power imported total
-    // 33173:33174 - Power exported from grid total
-    Rc = modbus_read_input_registers(Ctx, 33161, NoRegisters, RegBank);
-    if (Rc == NoRegisters)
-    {
-      // expressed in 1kWh intervals
-      ModbusSolisRegisters->batteryTotalChargeEnergy = (RegBank[0] << 16) + RegBank[1];
-      ModbusSolisRegisters->batteryTotalDischargeEnergy = (RegBank[4] << 16) + RegBank[5];
-      ModbusSolisRegisters->gridPurchasedTotalEnergy = (RegBank[8] << 16) + RegBank[9];
-      ModbusSolisRegisters->gridSellTotalEnergy = (RegBank[12] << 16) + RegBank[13];
-    }
-    else
+    Rc = RegCacheRead(Bus->Cache, Group.Type, Group.Address, Group.Count, RegBank, Reader);
+    if (Rc != Group.Count)
     {
-      printf("modbus_read_input_registers: %s\n", modbus_strerror(errno));
-      Ret = false;
+      uint16_t Age[16];
+      uint16_t Oldest = 0u;
+
+      printf("%s: failed to read %s registers: %s\n", Bus->Device, Group.Name, modbus_strerror(errno));
+      Bus->Stats.GroupFail++;
+
+      // fall back to whatever we had last time, providing there was a last time
+      // & it's recent enough to still stand for the current values
+      RegCacheLookup(Bus->Cache, Group.Type, Group.Address, Group.Count, RegBank, Age);
+      for (uint16_t i = 0; i < Group.Count; i++)
+        Oldest = std::max(Oldest, Age[i]);
+      if (Oldest == RegCacheNeverRead || Oldest > ConfigGetUint(Group.FallbackSetting, Group.Fallback))
+      {
+        if (Verbose && Oldest != RegCacheNeverRead)
+          printf("%s: last %s registers are too old to use (%us)\n", Bus->Device, Group.Name, Oldest);
+        if (Group.Required)
+          Ret = false;
+        continue;
+      }
+      if (Verbose)
+        printf("%s: using %s registers from %us ago\n", Bus->Device, Group.Name, Oldest);
     }
+    Group.Decode(RegBank, ModbusSolisRegisters);
   }
 
-
-  modbus_close(Ctx);
-  modbus_free(Ctx);
+  if (Ctx)
+  {
+    modbus_close(Ctx);
+    modbus_free(Ctx);
+  }
 
   ptime RequestEnd(microsec_clock::local_time());
   time_duration ElapsedTime = RequestEnd - RequestStart;
@@ -267,114 +434,117 @@ static bool ModBusReadSolisRegisters(const char *Device, ModbusSolisRegister_t *
   return Ret;
 }
 
-// decode Modbus request and if not intended for our slave, respond with something
-// that will (hopefully) persuade the logger to stop querying it
-static int DecodeAndRespondToSlave(uint8_t *Buffer, uint32_t BufSz, uint8_t SlaveId, int SerialFd)
+// what's needed to answer the logger's requests to the slaves that aren't there
+typedef struct {
+  uint8_t SlaveId;
+  int SerialFd;
+  int ReqSlave;   // the last slave a request was seen for, or -1
+  bool Slave10Tx; // seen the logger get as far as slave 10 since it last started on slave 2
+  uint32_t Answered;
+  Carrier_t *Carrier;
+  bool Marked;    // errors are marked on SerialFd, see RtuSerialTune
+  Responder_t *Background;  // if we're being called by the background responder
+} SlaveResponder_t;
+
+// a frame's been decoded, if it's a request not intended for our slave, respond
+// with something that will (hopefully) persuade the logger to stop querying it
+static void RespondToSlave(const RtuFrame_t *Frame, void *User)
 {
-  const uint32_t MinMsgLen = 8;
-  uint8_t ReqSlave;
-  uint8_t FCodeReadInput = 4;
-  uint16_t Crc;
-  uint16_t Register;
-  uint32_t MsgStart = 0 ;
-
-  // discard any null bytes at the start of the message    
-  while(BufSz)
-  {
-    if ( !Buffer[MsgStart] )
-    {
-      BufSz-- ;
-      MsgStart++ ;
-    }
-    else
-      break ;
-  }
+  using namespace boost::chrono;
+  SlaveResponder_t *Responder = (SlaveResponder_t*)User;
+  const uint8_t ExceptionIllegalData = 0x02;
+  uint8_t ResponseBuf[5];
+  steady_clock::time_point Received = steady_clock::now();
+
+  if (Verbose && Frame->Skipped)
+    printf("Skipped %u bytes looking for the next message\n", Frame->Skipped);
+  if (Frame->Response)
+    return;
 
-  if ( Verbose )
-  {
-    printf("DecodeAndRespondToSlave - size %u\nMsg: ",BufSz);
-    for(uint32_t i=0 ; i < BufSz ; i++ )
-      printf( "%02x ",Buffer[i]) ;
-    printf("\n") ;
-  }
-  
-  // messages we're expecting should all be single register read requests, 8 bytes long
-  if (BufSz < MinMsgLen)
-  {
-    if (Verbose)
-      printf("Message too short for a read input register function\n");
-    return -1;
-  }
   // check slave not us
-  ReqSlave = Buffer[MsgStart];
-  if (ReqSlave == SlaveId)
+  Responder->ReqSlave = Frame->Slave;
+  if (Frame->Slave == 10)
+    Responder->Slave10Tx = true;
+  else if (Frame->Slave == 2)
+    Responder->Slave10Tx = false;
+  if (Frame->Slave == Responder->SlaveId)
   {
     if (Verbose)
       printf("Message is for local inverter, ignoring\n");
-    return SlaveId;
+    return;
   }
 
   // check this is a read register request
-  if (Buffer[MsgStart+1] != FCodeReadInput)
-  {
-    printf("Not a read input registers function, ignoring\n");
-    return -1;
-  }
-
-  // compute then verify the CRC
-  auto ModBusCrc = boost::crc_optimal<16, 0x8005, 0xFFFF, 0, true, true> {};
-  ModBusCrc.process_bytes(&Buffer[MsgStart], MinMsgLen - sizeof(uint16_t));
-
-  Crc = (Buffer[MsgStart+7] << 8) + Buffer[MsgStart+6];
-  if (ModBusCrc.checksum() != Crc)
+  if (Frame->Function != MODBUS_RTU_READ_INPUT)
   {
     if (Verbose)
-      printf("CRC Incorrect, should be %x\n", ModBusCrc.checksum());
-    return -1;
+      printf("Not a read input registers function, ignoring\n");
+    return;
   }
 
-  // extract the register
-  Register = (Buffer[MsgStart+2] << 8) + Buffer[MsgStart+3];
-
   if (Verbose)
-    printf("Message for slave: %u, register: %u\n", ReqSlave, Register);
-
-  // got what we need, now generate the response...
-  uint8_t ResponseBuf[5];
-  const uint8_t ExceptionIllegalData = 0x02;
+    printf("Message for slave: %u, register: %u\n", Frame->Slave, Frame->Address);
 
   // initial attempt: respond with an illegal address exception
-  ResponseBuf[0] = ReqSlave;
-  ResponseBuf[1] = FCodeReadInput | 0x80;
-  ResponseBuf[2] = ExceptionIllegalData;
-
-  ModBusCrc.reset();
-  ModBusCrc.process_bytes(ResponseBuf, 3);
-  ResponseBuf[3] = ModBusCrc.checksum() & 0xff;
-  ResponseBuf[4] = ModBusCrc.checksum() >> 8 ;
+  RtuException(ResponseBuf, Frame->Slave, Frame->Function, ExceptionIllegalData);
+  Responder->Answered++;
 
+  for (uint32_t Attempt = 0; ; Attempt++)
+  {
 #ifdef RPI
-  RTSHandler(nullptr,1) ;
+    RTSHandler(nullptr,1) ;
 #else
-  Sleep(10);
+    // give the logger time to turn the bus around, ~10ms at 9600
+    LineDelay(10);
 #endif
 
-  if ( write(SerialFd, ResponseBuf, sizeof(ResponseBuf) ) < 0 )
-    printf("Error on serial write\n") ;
+    if ( write(Responder->SerialFd, ResponseBuf, sizeof(ResponseBuf) ) < 0 )
+      printf("Error on serial write\n") ;
 
 #ifndef WIN32
-  // wait for serial data to drain
-  tcdrain(SerialFd);
+    // wait for serial data to drain
+    tcdrain(Responder->SerialFd);
 #endif
 
 #ifdef RPI
-  RTSHandler(nullptr,0) ;
+    RTSHandler(nullptr,0) ;
 #else
-  // a delay may/may not be required here depending on how reliable 'tcdrain' actually is
-  Sleep(30);
+    // a delay may/may not be required here depending on how reliable 'tcdrain' actually is,
+    // ~30ms at 9600
+    LineDelay(30);
 #endif
 
-  return ReqSlave;
+    // if it collided with something the logger won't have got it, so try again whilst
+    // it's still waiting. Only if the line's quiet right now though - anything heard is
+    // most likely the logger moving on, which is left to be read & answered in turn
+    if (CarrierEcho(Responder->Carrier, Responder->SerialFd, ResponseBuf, sizeof(ResponseBuf),
+                    Responder->Background ? ResponderMarked(Responder->Background) : Responder->Marked) ||
+        Attempt >= Responder->Carrier->MaxRetries ||
+        duration_cast<milliseconds>(steady_clock::now() - Received).count() >= SlaveRetryWindow ||
+        !CarrierIdle(Responder->Carrier, Responder->SerialFd))
+      break;
+    Responder->Carrier->Stats.Retries++;
+  }
+}
+
+// decode whatever's been read from the logger, answering any requests for other slaves.
+// Messages can be split across reads, the parser picks up where it left off. Returns
+// the last slave a request was seen for, or -1 if there wasn't one
+static int DecodeAndRespondToSlave(RtuParser_t *Parser, uint8_t *Buffer, uint32_t BufSz)
+{
+  SlaveResponder_t *Responder = (SlaveResponder_t*)Parser->User;
+
+  if ( Verbose )
+  {
+    printf("DecodeAndRespondToSlave - size %u\nMsg: ",BufSz);
+    for(uint32_t i=0 ; i < BufSz ; i++ )
+      printf( "%02x ",Buffer[i]) ;
+    printf("\n") ;
+  }
+
+  Responder->ReqSlave = -1;
+  RtuParse(Parser, Buffer, BufSz, 0u);
+  return Responder->ReqSlave;
 }
 
 #ifdef WIN32
@@ -401,10 +571,7 @@ static HANDLE OpenW32Serial(const char *Device, int Flags)
     CloseHandle(hComm);
     return INVALID_HANDLE_VALUE;
   }
-  Dcb.BaudRate = CBR_9600;
-  Dcb.ByteSize = 8;
-  Dcb.StopBits = ONESTOPBIT;
-  Dcb.Parity = NOPARITY;
+  RtuSerialConfigure(&Dcb, &Line);
   Dcb.fBinary = TRUE;
   Dcb.fOutxCtsFlow = FALSE;
   Dcb.fOutxDsrFlow = FALSE;
@@ -459,9 +626,11 @@ static int OpenW32SerialAsFd(const char *Device, int Flags)
 
 // Sync with the next transfer performed by the datalogger & wait for it to finish
 // Windows version
-static bool SyncWithLogger(const char *Device, uint8_t SlaveId, uint32_t &Elapsed)
+static bool SyncWithLogger(SolisBus_t *Bus, uint32_t &Elapsed)
 {
   using namespace boost::posix_time;
+  const char *Device = Bus->Device;
+  uint8_t SlaveId = Bus->SlaveId;
   HANDLE hComm;
   COMMTIMEOUTS CTimeouts;
   bool BusIdle = false;
@@ -469,6 +638,8 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId, uint32_t &Elapse
   ptime SyncStart(microsec_clock::local_time());
   int BytesRead;
   int SerialFd;
+  SlaveResponder_t Responder;
+  RtuParser_t Parser;
 
   hComm = OpenW32Serial(Device, O_RDWR);
   if (hComm == INVALID_HANDLE_VALUE)
@@ -499,6 +670,14 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId, uint32_t &Elapse
 
   // create an associated file descriptor for parity with Linux version
   SerialFd = _open_osfhandle((intptr_t)hComm, O_RDWR);
+  Responder.SlaveId = SlaveId;
+  Responder.SerialFd = SerialFd;
+  Responder.Slave10Tx = false;
+  Responder.Answered = 0u;
+  Responder.Carrier = &Bus->Carrier;
+  Responder.Marked = false;
+  Responder.Background = nullptr;
+  RtuParserInit(&Parser, 1u, 247u, RespondToSlave, &Responder);
 
   // first, wait for the next burst of traffic from the logger, this normally occurs every five minutes
   BytesRead = _read(SerialFd, ScratchBuf, sizeof(ScratchBuf));
@@ -515,7 +694,7 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId, uint32_t &Elapse
     }
     SyncStart = microsec_clock::local_time();
 
-    DecodeAndRespondToSlave(ScratchBuf, BytesRead, SlaveId, SerialFd);
+    DecodeAndRespondToSlave(&Parser, ScratchBuf, BytesRead);
 
     // wait for ~8s of inactivity
     CTimeouts.ReadTotalTimeoutConstant = 8 * 1000;
@@ -533,7 +712,7 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId, uint32_t &Elapse
       if (!BytesRead)
         BusIdle = true;
       else if ( BytesRead > 0 )
-        DecodeAndRespondToSlave(ScratchBuf, BytesRead, SlaveId, SerialFd);
+        DecodeAndRespondToSlave(&Parser, ScratchBuf, BytesRead);
       else
       {
         printf("Error on read: %d\n", GetLastError());
@@ -546,7 +725,7 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId, uint32_t &Elapse
     if (Verbose)
       printf("Timed out waiting for traffic - going ahead anyway...\n");
     BusIdle = true;
-    LoggerFail++;
+    Bus->Stats.LoggerFail++;
   }
   else
   {
@@ -567,9 +746,11 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId, uint32_t &Elapse
 #else
 // Sync with the next transfer performed by the datalogger & wait for it to finish
 // Linux version
-static bool SyncWithLogger(const char *Device, uint8_t SlaveId,uint32_t &Elapsed)
+static bool SyncWithLogger(SolisBus_t *Bus, uint32_t &Elapsed)
 {
   using namespace boost::posix_time;
+  const char *Device = Bus->Device;
+  uint8_t SlaveId = Bus->SlaveId;
   int Fd;
   fd_set FdSet;
   struct timeval TimeOut;
@@ -579,8 +760,14 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId,uint32_t &Elapsed
   ptime SyncStart(microsec_clock::local_time()) ;
   struct termios Termios ;
   const uint32_t ReadInputRegReqSize = 8 ;
-  static bool FirstRun = true ;
   bool Slave10Tx = false ;
+  bool Traffic = false ;
+  SlaveResponder_t Responder ;
+  RtuParser_t Parser ;
+  RtuSerialSetup_t Setup ;
+  RtuSerialCounts_t CountsStart, CountsEnd ;
+  RtuSerialUnmark_t Unmark = { 0u, 0u, 0u } ;
+  bool Counting ;
   
   Fd = open(Device, O_RDWR);
   if (Fd < 0)
@@ -588,7 +775,28 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId,uint32_t &Elapsed
     perror("Failed to open input");
     return false;
   }
-
+  Responder.SlaveId = SlaveId;
+  Responder.SerialFd = Fd;
+  Responder.Slave10Tx = false;
+  Responder.Answered = 0u;
+  Responder.Carrier = &Bus->Carrier;
+  Responder.Marked = false;
+  Responder.Background = nullptr;
+  RtuParserInit(&Parser, 1u, 247u, RespondToSlave, &Responder);
+
+  // raw mode at the configured speed, rather than relying on it being set up by hand
+  if ( !RtuSerialConfigure(Fd, &Line) )
+  {
+    close(Fd);
+    return false ;
+  }
+  // and get what's received to us as quickly as the adapter allows, with any breaks
+  // & framing errors marked rather than turned into NULs
+  RtuSerialTune(Fd, Device, &Setup);
+  Responder.Marked = Setup.Marking;
+  if ( Bus->FirstRun || Verbose )
+    RtuSerialPrintSetup(Device, &Setup, &Line);
+  Counting = RtuSerialGetCounts(Fd, &CountsStart);
   if ( tcgetattr(Fd,&Termios) < 0 )
   {
     perror("Failed to get terminal settings\n") ;
@@ -598,8 +806,10 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId,uint32_t &Elapsed
   // set the minimum block size for a 'read' call which equates to the
   // size of a single read input registers request
   // 
-  // the additional '2' allows for stray null bytes I get in the serial
-  // stream, if you don't see that, then this can be removed
+  // the additional '2' allows for stray characters I get in the serial
+  // stream as the transceivers switch over (breaks & framing errors, which
+  // are now marked & stripped out again), if you don't see that, then this
+  // can be removed
   Termios.c_cc[VMIN] = ReadInputRegReqSize + 2;
   // set the timeout interval before returning - 200ms which is about
   // the worst case between logger requests
@@ -614,13 +824,13 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId,uint32_t &Elapsed
     return false ;
   }
 
-  if ( FirstRun )
+  if ( Bus->FirstRun )
   {
-    FirstRun = false ;
-    // USB devices don't flush properly so attempt to handle this
-    // by delaying for a short while on first invocation
-    if ( strstr(Device,"USB") )
-      usleep(100*1000);
+    Bus->FirstRun = false ;
+    // an adapter with a latency timer may still be holding on to what it received
+    // before we turned it down, so let that arrive before flushing it away
+    if ( Setup.LatencyBefore > 0 )
+      usleep(Setup.LatencyBefore * 1000u + RtuLineFrameGap(&Line));
     tcflush(Fd,TCIOFLUSH);
   }
   
@@ -640,7 +850,7 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId,uint32_t &Elapsed
     {
       if (Verbose)
         printf("Timed out waiting for traffic - going ahead anyway...\n");
-      LoggerFail++ ;
+      Bus->Stats.LoggerFail++ ;
       break;
     }
     else if (Rc < 0)
@@ -652,6 +862,7 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId,uint32_t &Elapsed
     else  // data is on the bus, that's what we're waiting for
     {
       BusIdle = false;
+      Traffic = true;
 
       if ( Verbose )
       {
@@ -677,9 +888,12 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId,uint32_t &Elapsed
       perror("read");
       break;
     }
-    else if ( Rc > 0 )
+    // without marking, a 0xff 0x00 in the data is just data
+    if ( Rc > 0 && Setup.Marking )
+      Rc = RtuSerialUnmark(&Unmark, ScratchBuf, Rc);
+    if ( Rc > 0 )
     {
-      int ReqSlave = DecodeAndRespondToSlave(ScratchBuf, Rc, SlaveId, Fd);
+      int ReqSlave = DecodeAndRespondToSlave(&Parser, ScratchBuf, Rc);
       if ( ReqSlave == 10 )
         Slave10Tx = true ;
       else if ( ReqSlave == 2 ) // if there are multiple polls this cycle, make sure we reset the Tx flag
@@ -719,244 +933,190 @@ static bool SyncWithLogger(const char *Device, uint8_t SlaveId,uint32_t &Elapsed
   if (Verbose)
     std::cout << "Elapsed: " << ElapsedTime.total_seconds() << "s" << std::endl;
 
-  close(Fd);
-
-  return BusIdle;
-}
-#endif
+  // never seeing slave 10 means the logger's going through it's reset (see above)
+  Bus->LoggerReset = Traffic && BusIdle && !Slave10Tx;
 
-// generate JSON message aligned to Solis API from the register data
-static char *GenerateJson(const ModbusSolisRegister_t *ModbusSolisRegisters)
-{
-  using namespace boost::chrono;
-  cJSON *SolarJson = cJSON_CreateObject();
-  cJSON *Node;
-  cJSON *SolarData;
-  char *Ret;
-  system_clock::time_point Now(system_clock::now());
-  system_clock::duration UnixTime = Now.time_since_epoch();
-  std::stringstream TimeBuf;
-
-  if (!SolarJson)
-    return nullptr ;
-
-  // response code
-  Node = cJSON_CreateString("0");
-  if ( Node )
-    cJSON_AddItemToObject(SolarJson, "code", Node);
-
-  // create the 'data' block
-  SolarData = cJSON_CreateObject();
-  if (SolarData)
+  // what the driver counted whilst we were listening, or if it doesn't count them,
+  // what was marked in the stream
+  if ( Counting && RtuSerialGetCounts(Fd, &CountsEnd) )
+  {
+    RtuSerialCounts_t Counts ;
+
+    memset(&Counts, 0, sizeof(Counts));
+    RtuSerialAddCounts(&Counts, &CountsStart, &CountsEnd);
+    Bus->Stats.LineErrors.Frame += Counts.Frame;
+    Bus->Stats.LineErrors.Overrun += Counts.Overrun + Counts.BufOverrun;
+    Bus->Stats.LineErrors.Parity += Counts.Parity;
+    Bus->Stats.LineErrors.Break += Counts.Break;
+  }
+  else
   {
-    cJSON_AddItemToObject(SolarJson, "data", SolarData);
-
-    // Add in a dummy 'storageBatteryCurrent' entry. This serves two purposes...
-    // Firstly, my ipcam_snap script expects this to be in the data (even though it doesn't use it)
-    // Secondly, James' JSON parser fails to correctly decode the first entry in the packet so we
-    // can't include any data that it needs (& this is one such thing) at the start. 
-    Node = cJSON_CreateNumber(1);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "storageBatteryCurrent", Node);
-
-    // timestamp
-    TimeBuf << duration_cast<milliseconds>(UnixTime).count();
-    Node = cJSON_CreateString(TimeBuf.str().c_str());
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "dataTimestamp", Node);
-
-    // "eToday" = solar energy generated today
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->etoday);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "eToday", Node);
-    Node = cJSON_CreateString("kWh");
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "eTodayStr", Node);
-    // eTotal - total solar generation
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->eTotal);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "eTotal", Node);
-    Node = cJSON_CreateString("kWh");
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "eTotalStr", Node);
-
-    // generation
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->pac);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "pac", Node);
-    Node = cJSON_CreateString("kW");
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "pacStr", Node);
-    // battery capacity
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->batteryCapacitySoc);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "batteryCapacitySoc", Node);
-    // battery power
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->batteryPower);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "batteryPower", Node);
-    Node = cJSON_CreateString("kW");
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "batteryPowerStr", Node);
-
-    // grid in/out
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->psum);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "psum", Node);
-    Node = cJSON_CreateString("kW");
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "psumStr", Node);
-    // load
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->familyLoadPower);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "familyLoadPower", Node);
-    Node = cJSON_CreateString("kW");
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "familyLoadPowerStr", Node);
-
-    // battery charge/discharge
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->batteryTotalChargeEnergy);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "batteryTotalChargeEnergy", Node);
-    Node = cJSON_CreateString("kWh");
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "batteryTotalChargeEnergyStr", Node);
-
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->batteryTotalDischargeEnergy);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "batteryTotalDischargeEnergy", Node);
-    Node = cJSON_CreateString("kWh");
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "batteryTotalDischargeEnergyStr", Node);
-
-    // grid today in/out
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->gridPurchasedTotalEnergy);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "gridPurchasedTotalEnergy", Node);
-    Node = cJSON_CreateString("kWh");
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "gridPurchasedTotalEnergyStr", Node);
-
-    Node = cJSON_CreateNumber(ModbusSolisRegisters->gridSellTotalEnergy);
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "gridSellTotalEnergy", Node);
-    Node = cJSON_CreateString("kWh");
-    if (Node)
-      cJSON_AddItemToObject(SolarData, "gridSellTotalEnergyStr", Node);
+    Bus->Stats.LineErrors.Frame += (uint32_t)Unmark.Errors;
+    Bus->Stats.LineErrors.Break += (uint32_t)Unmark.Breaks;
   }
+  if ( Verbose && (Unmark.Errors || Unmark.Breaks) )
+    printf("%s: stripped %llu breaks & %llu characters with errors from the logger's traffic\n", Device,
+           (unsigned long long)Unmark.Breaks, (unsigned long long)Unmark.Errors);
 
-  // the outer pieces
-  Node = cJSON_CreateString("success");
-  if (Node)
-    cJSON_AddItemToObject(SolarJson, "msg", Node);
-  Node = cJSON_CreateBool(true);
-  if (Node)
-    cJSON_AddItemToObject(SolarJson, "success", Node);
-
-  // this is non-standard but provides an indication of if (and how many times)
-  // the logger has failed
-  Node = cJSON_CreateNumber(LoggerFail);
-  if (Node)
-    cJSON_AddItemToObject(SolarJson, "loggerFail", Node);
-
-  // generate return string
-  Ret = cJSON_Print(SolarJson);
-  cJSON_Delete(SolarJson);
-  return Ret;
+  close(Fd);
+
+  return BusIdle;
 }
+#endif
 
-int main(int argc, char *argv[])
+// as SyncWithLogger, but with the background responder listening to (and answering)
+// the logger, so all that's needed is to watch for when it hears something
+static bool SyncWithResponder(SolisBus_t *Bus, SlaveResponder_t *Answerer, uint32_t &Elapsed)
 {
-  ModbusSolisRegister_t ModbusSolisRegisters;
-  uint8_t SlaveId = 1;
-  const uint32_t PollDelay = 16 * 1000u;  // 16 seconds
-  const uint32_t LoggerCycleTimeMilliseconds = LoggerCycleTime * 1000u;
-  const uint32_t PollThreshold = 5000u;  // 5 seconds
-  uint32_t Elapsed;
-  char *jSon;
-  SOCKET sFd ;
-  int EnBroadcast = 1 ;
-  struct sockaddr_in BroadcastAddr ;
-#ifdef WIN32
-  WORD wVersionRequested;
-  WSADATA wsaData;
-  int Err;
+  using namespace boost::posix_time;
+  ptime SyncStart(microsec_clock::local_time());
+  uint64_t Heard = ResponderHeard(Bus->Responder);
+  uint64_t Now;
+  bool Traffic = false;
+  bool Slave10Tx = false;
+  RtuSerialCounts_t Counts;
 
-  // Win32 socket guff
-  wVersionRequested = MAKEWORD(2, 0);
+  if (Verbose)
+    std::cout << std::endl << "Sync with logger at " << to_simple_string(SyncStart) << "..." << std::endl;
 
-  Err = WSAStartup(wVersionRequested, &wsaData);
-  if (Err != 0)
+  // first, wait for the next burst of traffic from the logger, this normally occurs every five minutes
+  Now = ResponderWait(Bus->Responder, Heard, LoggerCycleTime * 1000u);
+  if (Now == Heard)
   {
-    perror("WSAStartup");
-    return -1;
+    if (Verbose)
+      printf("Timed out waiting for traffic - going ahead anyway...\n");
+    Bus->Stats.LoggerFail++;
   }
-
-  if (LOBYTE(wsaData.wVersion) != 2 ||
-    HIBYTE(wsaData.wVersion) != 0)
+  else
   {
-    printf("Unsupported socket socket lib\n");
-    WSACleanup();
-    return -1;
-  }
+    Traffic = true;
+    if (Verbose)
+    {
+      ptime WaitIdle(microsec_clock::local_time());
 
-#endif
+      std::cout << "Elapsed: " << (WaitIdle - SyncStart).total_seconds() << "s" << std::endl;
+      std::cout << std::endl << "Wait for idle at " << to_simple_string(WaitIdle) << "..." << std::endl;
+    }
+    SyncStart = microsec_clock::local_time();
 
-  if (argc < 2)
-  {
-    printf("Usage: modbus-solis-broadcast <input> [verbose=0] [slaveid=1]\n");
-    return -1;
+    // then for it to go quiet again, for longer if it looks to be going through it's
+    // reset (see SyncWithLogger). Whatever the handler's seen is only safe to look at
+    // with the port held
+    do
+    {
+      Heard = Now;
+      ResponderAcquire(Bus->Responder);
+      Slave10Tx = Answerer->Slave10Tx;
+      ResponderRelease(Bus->Responder);
+      Now = ResponderWait(Bus->Responder, Heard, Slave10Tx ? 8000u : 30000u);
+    }
+    while (Now != Heard);
   }
 
-  if (argc > 2)
-    Verbose = strtoul(argv[2], NULL, 0) ? true : false ;
+  ptime SyncEnd(microsec_clock::local_time());
+  time_duration ElapsedTime = SyncEnd - SyncStart;
+  Elapsed = ElapsedTime.total_milliseconds();
 
-  if (argc > 3)
-    SlaveId = strtoul(argv[3],NULL,0) ;
+  if (Verbose)
+    std::cout << "Elapsed: " << ElapsedTime.total_seconds() << "s" << std::endl;
 
-  // setup broadcast socket for sending out the data to clients
-  sFd = socket(AF_INET,SOCK_DGRAM,0) ;
-  if ( sFd < 0 )
+  Bus->LoggerReset = Traffic && !Slave10Tx;
+
+  // the responder's been counting since it started
+  ResponderLineErrors(Bus->Responder, &Counts);
+  Bus->Stats.LineErrors.Frame = Counts.Frame;
+  Bus->Stats.LineErrors.Overrun = Counts.Overrun + Counts.BufOverrun;
+  Bus->Stats.LineErrors.Parity = Counts.Parity;
+  Bus->Stats.LineErrors.Break = Counts.Break;
+  return true;
+}
+
+// the listen before talk stats, which the background responder updates as well
+static CarrierStats_t GetCarrierStats(SolisBus_t *Bus)
+{
+  CarrierStats_t Stats;
+
+  if (Bus->Responder)
+    ResponderAcquire(Bus->Responder);
+  Stats = Bus->Carrier.Stats;
+  if (Bus->Responder)
+    ResponderRelease(Bus->Responder);
+  return Stats;
+}
+
+// service a single bus - sync with the logger, then poll the inverter for
+// the remainder of the logger cycle. Each bus runs this in it's own thread
+static void BusThread(SolisBus_t *Bus)
+{
+  using namespace boost::chrono;
+  ModbusSolisRegister_t ModbusSolisRegisters;
+  // how long to wait between polls, adjusted after each one depending on how much
+  // the live readings are moving about
+  uint32_t PollDelay = Bus->PollRate.Interval;
+  const uint32_t LoggerCycleTimeMilliseconds = LoggerCycleTime * 1000u;
+  const uint32_t PollThreshold = 5000u;  // 5 seconds
+  uint32_t Elapsed = 0u;
+  uint32_t Resume;
+  bool FirstPublished = false;
+  bool Live;
+  SolisSample_t LastSample;
+  SlaveResponder_t Answerer;
+
+  printf( "Starting poll on %s\n", Bus->Device) ;
+
+  // answer the logger's polls of the other slaves all the time, rather than only
+  // whilst syncing with it
+  if (ConfigGetBool("background_responder", true))
   {
-    perror("socket") ;
-    return -1 ;
+    Bus->Responder = ResponderCreate(Bus->Device, &Line);
+    if (Bus->Responder)
+    {
+      Answerer.SlaveId = Bus->SlaveId;
+      Answerer.SerialFd = ResponderFd(Bus->Responder);
+      Answerer.ReqSlave = -1;
+      Answerer.Slave10Tx = false;
+      Answerer.Answered = 0u;
+      Answerer.Carrier = &Bus->Carrier;
+      Answerer.Marked = false;
+      Answerer.Background = Bus->Responder;
+      ResponderStart(Bus->Responder, RespondToSlave, &Answerer);
+      Bus->FirstRun = false;
+    }
+    else
+      printf("%s: falling back to only answering the logger whilst syncing\n", Bus->Device);
   }
-  if ( setsockopt(sFd, SOL_SOCKET, SO_BROADCAST, (char*)&EnBroadcast, sizeof(EnBroadcast)) < 0 )
+
+  // give consumers something to be going on with whilst we get started
+  if (StateLastSample(Bus->Index, &LastSample))
   {
-    perror("setsockopt - broadcast") ;
-    return -1 ;
+    printf("%s: republishing last sample from %llus ago, flagged as stale\n", Bus->Device,
+           (unsigned long long)(duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count() -
+                                LastSample.Timestamp) / 1000u);
+    LastSample.Stale = true;
+    PublishSample(&LastSample);
   }
-  memset((void*)&BroadcastAddr, 0, sizeof(struct sockaddr_in));
-  BroadcastAddr.sin_family = AF_INET;
-  BroadcastAddr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
-  
-#ifdef RPI
-  // Use BCM addressing for GPIO
-#ifdef PI_MODEL_5 // used as a sense check for older versions of the library
-  wiringPiSetupPinType(WPI_PIN_BCM) ;
-#else
-  wiringPiSetupGpio() ;
-#endif
-  // configure the GPIOs and set for receive only
-#ifdef RS485_RE
-  pinMode(RS485_RE,OUTPUT) ;
-  digitalWrite(RS485_RE,LOW);
-#endif
-#ifdef RS485_DE
-  pinMode(RS485_DE,OUTPUT) ;
-  digitalWrite(RS485_DE,LOW);
-#endif
-#endif
-  
-  printf( "Starting poll\n") ;
+
+  // if we know where the logger is in it's cycle from last time, carry on
+  // polling straight away rather than waiting for it to come round again
+  Resume = StateResume(Bus->Index, LoggerCycleTimeMilliseconds);
+  if (Resume)
+    printf("%s: resuming from saved logger timing, %u seconds till it's next due\n", Bus->Device, Resume/1000u);
 
   // sync to the next access performed by the data logger
-  while (SyncWithLogger(argv[1],SlaveId,Elapsed))
+  while (Resume || (Bus->Responder ? SyncWithResponder(Bus, &Answerer, Elapsed) : SyncWithLogger(Bus,Elapsed)))
   {
     uint32_t TimeToNextPoll;
+    steady_clock::time_point PollStart = steady_clock::now();
+    uint32_t PollOkStart = Bus->Stats.PollOk;
+    uint64_t BusTimeStart = RegCacheGetStats(Bus->Cache).BusTimeUs;
 
     // work out how much time we have till the next logger poll is due
-    if (Elapsed < LoggerCycleTimeMilliseconds)
+    if (Resume)
+    {
+      TimeToNextPoll = Resume;
+      Resume = 0u;
+    }
+    else if (Elapsed < LoggerCycleTimeMilliseconds)
     {
       const uint32_t MinElapsed = 50*1000 ;
       const uint32_t InterruptedMaxTimeToPoll = 150 * 1000;
@@ -967,22 +1127,52 @@ int main(int argc, char *argv[])
       // error, if less than that, then we've only picked up some of it. Worst case (assuming we've
       // just caught the tail end), the next poll will be about 2m55s later so again allowing for 
       // a margin of error, 150s (2.5mins) should be fine
+      Bus->Stats.Syncs++;
       if ( Elapsed < MinElapsed )
         TimeToNextPoll = InterruptedMaxTimeToPoll;
       else
+      {
         TimeToNextPoll = LoggerCycleTimeMilliseconds - Elapsed;
+        // a complete burst, remember it's timing for next time we start
+        StateSetBurst(Bus->Index, Elapsed, Bus->LoggerReset);
+        StateSave();
+      }
     }
     else
+    {
+      Bus->Stats.Syncs++;
       TimeToNextPoll = 1000u;  // if we didn't see any logger traffic, or was longer than expected
                                // just do the one transaction, then resync
+    }
 
     while (TimeToNextPoll)
     {
       if (Verbose)
-        printf("Time to next poll: %u seconds\n", TimeToNextPoll/1000u);
+        printf("%s: time to next poll: %u seconds\n", Bus->Device, TimeToNextPoll/1000u);
 
-      if (ModBusReadSolisRegisters(argv[1], &ModbusSolisRegisters, Elapsed, SlaveId))
+      if (ModBusReadSolisRegisters(Bus, &ModbusSolisRegisters, Elapsed, Live))
       {
+        SolisSample_t Sample;
+        CarrierStats_t CarrierStats;
+        const double Readings[PollRateSignals] = { ModbusSolisRegisters.pac, ModbusSolisRegisters.psum,
+                                                   ModbusSolisRegisters.familyLoadPower };
+
+        // with nothing read from the inverter, it's all come from the cache so only goes
+        // out flagged as stale & says nothing about how much the readings are moving
+        if (Live)
+        {
+          Bus->Stats.PollOk++;
+          PollDelay = PollRateUpdate(&Bus->PollRate, Readings);
+          if (Verbose)
+            printf("%s: volatility: %.3f kW, poll interval: %.1fs\n", Bus->Device, Bus->PollRate.Volatility,
+                   PollDelay / 1000.0);
+        }
+        else
+        {
+          Bus->Stats.PollFail++;
+          printf("%s: nothing read from the inverter, publishing cached values as stale\n", Bus->Device);
+        }
+
         if (Verbose)
         {
           printf("Battery capacity SOC: %u%%\n", ModbusSolisRegisters.batteryCapacitySoc);
@@ -998,25 +1188,39 @@ int main(int argc, char *argv[])
           printf("Inverter total power generation: %u kW\n", ModbusSolisRegisters.eTotal);
         }
 
-        // generate the JSON data, aligned to the Solis API
-        jSon = GenerateJson(&ModbusSolisRegisters);
-        if (jSon)
+        // hand over to the publisher, which takes care of sending it out to clients
+        Sample.Registers = ModbusSolisRegisters;
+        Sample.BusIndex = Bus->Index;
+        Sample.Device = Bus->Device;
+        Sample.LoggerFail = Bus->Stats.LoggerFail;
+        Sample.LineErrors = Bus->Stats.LineErrors;
+        CarrierStats = GetCarrierStats(Bus);
+        Sample.Collisions.Deferrals = CarrierStats.Deferrals;
+        Sample.Collisions.Collisions = CarrierStats.Collisions;
+        Sample.Collisions.Retries = CarrierStats.Retries;
+        Sample.Collisions.GaveUp = CarrierStats.GaveUp;
+        Sample.Collisions.EchoChecks = CarrierStats.EchoChecks;
+        Sample.Collisions.EchoCollisions = CarrierStats.EchoCollisions;
+        Sample.Collisions.EchoMissing = CarrierStats.EchoMissing;
+        Sample.Sequence = 0u;  // assigned by the publisher
+        Sample.Stale = !Live;
+        Sample.Timestamp = boost::chrono::duration_cast<boost::chrono::milliseconds>(
+                             boost::chrono::system_clock::now().time_since_epoch()).count();
+        PublishSample(&Sample);
+        if (Live)
+          StateSetSample(&Sample);
+
+        if (Live && !FirstPublished)
         {
-          if ( Verbose )
-            printf("JSON data: %s:\n", jSon);
-
-          // send out to clients
-          BroadcastAddr.sin_port = htons(52005);
-          if (sendto(sFd, jSon, strlen(jSon), 0, (struct sockaddr*) &BroadcastAddr, sizeof(struct sockaddr_in)) < 0)
-            perror("sendto");
-          free(jSon);
+          FirstPublished = true;
+          printf("%s: first sample published %.1fs after startup\n", Bus->Device,
+                 duration_cast<milliseconds>(steady_clock::now() - StartTime).count() / 1000.0);
         }
-        else
-          printf("Failed to generate JSON data\n");
       }
       else
       {
-        printf("Failed to retrieve modbus data from inverter\n");
+        Bus->Stats.PollFail++;
+        printf("%s: failed to retrieve modbus data from inverter\n", Bus->Device);
       }
 
       // update how much time we have left till the next poll
@@ -1030,14 +1234,26 @@ int main(int argc, char *argv[])
       else
         TimeToNextPoll = 0u; 
 
-      // don't sleep on the last cycle
-      if (TimeToNextPoll)
+      // don't sleep on the last cycle. With the background responder listening, it's
+      // already answering anything the logger starts, so just resync as soon as it does
+      if (TimeToNextPoll && Bus->Responder)
+      {
+        uint64_t Heard = ResponderHeard(Bus->Responder);
+
+        if (ResponderWait(Bus->Responder, Heard, PollDelay) != Heard)
+        {
+          if (Verbose)
+            printf("%s: detected serial data, forcing re-sync\n", Bus->Device);
+          break;
+        }
+      }
+      else if (TimeToNextPoll)
       {
         // open serial port to monitor for traffic while we sleep
 #ifdef WIN32
-        int Fd = OpenW32SerialAsFd(argv[1], O_RDONLY | O_NONBLOCK);
+        int Fd = OpenW32SerialAsFd(Bus->Device, O_RDONLY | O_NONBLOCK);
 #else
-        int Fd = open(argv[1], O_RDONLY | O_NONBLOCK);
+        int Fd = open(Bus->Device, O_RDONLY | O_NONBLOCK);
 #endif
         uint8_t ScratchBuf[256];
         bool ContinuePoll = false;
@@ -1064,7 +1280,7 @@ int main(int argc, char *argv[])
         else if (Rc)
         {
           if (Verbose)
-            printf("Detected serial data, forcing re-sync\n");
+            printf("%s: detected serial data, forcing re-sync\n", Bus->Device);
         }
         else  // on Windows, the byte count comes back as zero rather than an error
           ContinuePoll = true;
@@ -1074,8 +1290,174 @@ int main(int argc, char *argv[])
           break;
       }
     }
+
+    // keep the saved sample reasonably up to date without writing it on every poll
+    StateSave();
+
+    if (Verbose)
+    {
+      RegCacheStats_t CacheStats = RegCacheGetStats(Bus->Cache);
+      CarrierStats_t CarrierStats = GetCarrierStats(Bus);
+      uint32_t Reads = CacheStats.Hits + CacheStats.Misses;
+      double PollTime = duration_cast<microseconds>(steady_clock::now() - PollStart).count() / 1e6;
+
+      printf("%s: syncs: %u, polls ok: %u, polls failed: %u, register groups failed: %u, logger fail: %u\n", Bus->Device,
+             Bus->Stats.Syncs, Bus->Stats.PollOk, Bus->Stats.PollFail, Bus->Stats.GroupFail, Bus->Stats.LoggerFail);
+      printf("%s: line errors: %u framing, %u overrun, %u parity, %u breaks\n", Bus->Device,
+             Bus->Stats.LineErrors.Frame, Bus->Stats.LineErrors.Overrun, Bus->Stats.LineErrors.Parity,
+             Bus->Stats.LineErrors.Break);
+      if (Bus->Carrier.Enabled)
+        printf("%s: listen before talk: %u requests, %u deferred (%.1fs backing off), %u collisions, %u retries, %u gave up\n",
+               Bus->Device, CarrierStats.Requests, CarrierStats.Deferrals, CarrierStats.BackoffUs / 1e6,
+               CarrierStats.Collisions, CarrierStats.Retries, CarrierStats.GaveUp);
+      if (Bus->Carrier.EchoCheck)
+        printf("%s: echo check: %u frames, %u came back different, %u didn't come back\n", Bus->Device,
+               CarrierStats.EchoChecks, CarrierStats.EchoCollisions, CarrierStats.EchoMissing);
+      if (Bus->Responder)
+      {
+        ResponderAcquire(Bus->Responder);
+        printf("%s: background responder: %u polls of the other slaves answered\n", Bus->Device, Answerer.Answered);
+        ResponderRelease(Bus->Responder);
+      }
+      printf("%s: cache hits: %u, misses: %u (%.1f%% hit rate), bus time: %.1fs, saved: %.1fs\n", Bus->Device,
+             CacheStats.Hits, CacheStats.Misses, Reads ? 100.0 * CacheStats.Hits / Reads : 0.0,
+             CacheStats.BusTimeUs / 1e6, CacheStats.SavedUs / 1e6);
+      // how we did in the window between logger cycles
+      if (PollTime > 0.0)
+        printf("%s: %.0f samples/hour, bus occupancy: %.2f%%\n", Bus->Device,
+               (Bus->Stats.PollOk - PollOkStart) * 3600.0 / PollTime,
+               (CacheStats.BusTimeUs - BusTimeStart) / 1e4 / PollTime);
+    }
+  }
+
+  StateSave();
+  ResponderDestroy(Bus->Responder);
+  Bus->Responder = nullptr;
+  printf("Stopped polling on %s\n", Bus->Device);
+}
+
+int main(int argc, char *argv[])
+{
+  uint8_t SlaveId = 1;
+  std::vector<SolisBus_t> Buses;
+  std::vector<std::thread> BusThreads;
+#ifdef WIN32
+  WORD wVersionRequested;
+  WSADATA wsaData;
+  int Err;
+
+  // Win32 socket guff
+  wVersionRequested = MAKEWORD(2, 0);
+
+  Err = WSAStartup(wVersionRequested, &wsaData);
+  if (Err != 0)
+  {
+    perror("WSAStartup");
+    return -1;
+  }
+
+  if (LOBYTE(wsaData.wVersion) != 2 ||
+    HIBYTE(wsaData.wVersion) != 0)
+  {
+    printf("Unsupported socket socket lib\n");
+    WSACleanup();
+    return -1;
+  }
+
+#endif
+
+  StartTime = boost::chrono::steady_clock::now();
+
+  if (argc < 2)
+  {
+    printf("Usage: modbus-solis-broadcast <input>[,<input>...] [verbose=0] [slaveid=1] [config file]\n");
+    return -1;
+  }
+
+  if (argc > 2)
+    Verbose = strtoul(argv[2], NULL, 0) ? true : false ;
+
+  if (argc > 3)
+    SlaveId = strtoul(argv[3],NULL,0) ;
+
+  // optional settings for the various output paths etc.
+  if (argc > 4 && !ConfigLoad(argv[4]))
+    return -1;
+
+  // the line settings, all the bus timing is worked out from these
+  if (!RtuLineParse(ConfigGetString("serial", RTU_LINE_DEFAULT), &Line))
+  {
+    printf("Serial settings should be <baud>[,<data bits><parity><stop bits>], eg. 9600,8N1\n");
+    return -1;
+  }
+
+  // one bus per comma separated device
+  for (char *Device = strtok(argv[1], ","); Device; Device = strtok(NULL, ","))
+  {
+    SolisBus_t Bus;
+
+    memset(&Bus, 0, sizeof(Bus));
+    Bus.Index = Buses.size();
+    Bus.Device = Device;
+    Bus.SlaveId = SlaveId;
+    Bus.FirstRun = true;
+    Bus.Cache = RegCacheCreate();
+    ConfigureCache(Bus.Cache);
+    PollRateInit(&Bus.PollRate);
+    CarrierInit(&Bus.Carrier, &Line);
+    Buses.push_back(Bus);
   }
+  if (Buses.empty())
+  {
+    printf("No input devices specified\n");
+    return -1;
+  }
+
+  // pick up where we left off, if we can
+  if (!StateInit(Buses))
+    return -1;
+
+  // setup the output path shared by all the buses
+  if (!PublishInit(Buses.size()))
+    return -1;
+
+  // and the Modbus TCP gateway, serving from each bus's cache
+  std::vector<RegCache_t*> Caches;
+  for (auto &Bus : Buses)
+    Caches.push_back(Bus.Cache);
+  if (!GatewayInit(Caches))
+    return -1;
+
+#ifdef RPI
+  // Use BCM addressing for GPIO
+#ifdef PI_MODEL_5 // used as a sense check for older versions of the library
+  wiringPiSetupPinType(WPI_PIN_BCM) ;
+#else
+  wiringPiSetupGpio() ;
+#endif
+  // configure the GPIOs and set for receive only
+#ifdef RS485_RE
+  pinMode(RS485_RE,OUTPUT) ;
+  digitalWrite(RS485_RE,LOW);
+#endif
+#ifdef RS485_DE
+  pinMode(RS485_DE,OUTPUT) ;
+  digitalWrite(RS485_DE,LOW);
+#endif
+#endif
+  
+  printf( "Starting poll on %u bus(es)\n", (uint32_t)Buses.size()) ;
+
+  // each bus is serviced independently so a problem with one can't hold up the rest
+  for (auto &Bus : Buses)
+    BusThreads.push_back(std::thread(BusThread, &Bus));
+
+  for (auto &Thread : BusThreads)
+    Thread.join();
 
-  closesocket(sFd);
+  GatewayShutdown();
+  PublishShutdown();
+  for (auto &Bus : Buses)
+    RegCacheDestroy(Bus.Cache);
   return 0;
 }
@@ -0,0 +1,267 @@
+//
+// Test for the MQTT client in mqtt.cpp, against a stub broker on a loopback socket
+//
+//   mqtt-test
+//
+// The client is started with a 2 second keep alive & QoS 1, then the broker checks
+// the CONNECT it's sent & accepts it, checks a sample comes through as a correctly
+// framed PUBLISH, waits for a PINGREQ at the keep alive interval and then drops the
+// connection with a message still unacknowledged. The client should reconnect and
+// send that message again, flagged as a duplicate, then DISCONNECT on shutdown.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "mqtt.h"
+#include "config.h"
+
+bool Verbose = false;
+
+static const uint16_t KeepAlive = 2u;  // seconds
+
+typedef struct {
+  uint8_t Header;
+  std::vector<uint8_t> Body;
+} TestPacket_t;
+
+static uint32_t Failures = 0u;
+
+static void Check(bool Ok, const char *What)
+{
+  printf("%s: %s\n", Ok ? "ok" : "FAILED", What);
+  if (!Ok)
+    Failures++;
+}
+
+static int64_t Millis(void)
+{
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// read exactly 'Len' bytes, giving up at 'Deadline'
+static bool ReadBytes(int Fd, uint8_t *Buf, size_t Len, int64_t Deadline)
+{
+  while (Len)
+  {
+    struct pollfd Pfd = { Fd, POLLIN, 0 };
+    int64_t Left = Deadline - Millis();
+    ssize_t Rc;
+
+    if (Left <= 0 || poll(&Pfd, 1, (int)Left) <= 0)
+      return false;
+    Rc = recv(Fd, Buf, Len, 0);
+    if (Rc <= 0)
+      return false;
+    Buf += Rc;
+    Len -= Rc;
+  }
+  return true;
+}
+
+// the next whole packet from the client, within 'TimeOut' ms
+static bool ReadPacket(int Fd, TestPacket_t *Packet, int TimeOut)
+{
+  int64_t Deadline = Millis() + TimeOut;
+  size_t Remaining = 0u;
+  uint32_t Shift = 0u;
+  uint8_t Byte;
+
+  if (!ReadBytes(Fd, &Packet->Header, 1u, Deadline))
+    return false;
+  do
+  {
+    if (Shift > 21u || !ReadBytes(Fd, &Byte, 1u, Deadline))
+      return false;
+    Remaining |= (Byte & 0x7fu) << Shift;
+    Shift += 7u;
+  } while (Byte & 0x80u);
+  Packet->Body.resize(Remaining);
+  return !Remaining || ReadBytes(Fd, Packet->Body.data(), Remaining, Deadline);
+}
+
+static bool SendBytes(int Fd, const uint8_t *Buf, size_t Len)
+{
+  return send(Fd, Buf, Len, MSG_NOSIGNAL) == (ssize_t)Len;
+}
+
+static std::string GetString(const std::vector<uint8_t> &Body, size_t &Pos)
+{
+  size_t Len;
+  std::string Str;
+
+  if (Pos + 2u > Body.size())
+    return Str;
+  Len = (Body[Pos] << 8) | Body[Pos + 1];
+  Pos += 2u;
+  if (Pos + Len > Body.size())
+    return Str;
+  Str.assign(Body.begin() + Pos, Body.begin() + Pos + Len);
+  Pos += Len;
+  return Str;
+}
+
+static int Accept(int Listener, int TimeOut)
+{
+  struct pollfd Pfd = { Listener, POLLIN, 0 };
+
+  if (poll(&Pfd, 1, TimeOut) <= 0)
+    return -1;
+  return accept(Listener, nullptr, nullptr);
+}
+
+// take the client's CONNECT & accept it
+static bool Connected(int Fd)
+{
+  static const uint8_t ConnAck[] = { 0x20, 0x02, 0x00, 0x00 };
+  TestPacket_t Packet;
+  size_t Pos = 0u;
+
+  if (!ReadPacket(Fd, &Packet, 5000))
+  {
+    Check(false, "CONNECT received");
+    return false;
+  }
+  Check(Packet.Header == 0x10, "CONNECT packet type");
+  Check(GetString(Packet.Body, Pos) == "MQTT", "CONNECT protocol name");
+  Check(Pos + 4u <= Packet.Body.size() && Packet.Body[Pos] == 4u, "CONNECT protocol level 3.1.1");
+  Check(Pos + 4u <= Packet.Body.size() && Packet.Body[Pos + 1] == 0x02u, "CONNECT clean session, no credentials");
+  Check(Pos + 4u <= Packet.Body.size() && ((Packet.Body[Pos + 2] << 8) | Packet.Body[Pos + 3]) == KeepAlive,
+        "CONNECT keep alive");
+  Pos += 4u;
+  Check(GetString(Packet.Body, Pos) == "mqtt-test" && Pos == Packet.Body.size(), "CONNECT client id");
+  return SendBytes(Fd, ConnAck, sizeof(ConnAck));
+}
+
+// check a PUBLISH is framed as expected, returning it's packet id
+static uint16_t Published(const TestPacket_t &Packet, const char *Topic, const char *Payload, bool Dup)
+{
+  size_t Pos = 0u;
+  uint16_t PacketId = 0u;
+  std::string Name;
+
+  Check((Packet.Header & 0xf0u) == 0x30u, "PUBLISH packet type");
+  Check((Packet.Header & 0x06u) == 0x02u, "PUBLISH QoS 1");
+  Check(!(Packet.Header & 0x01u), "PUBLISH not retained");
+  Check(!(Packet.Header & 0x08u) == !Dup, Dup ? "PUBLISH flagged as a duplicate" : "PUBLISH not flagged as a duplicate");
+  Name = GetString(Packet.Body, Pos);
+  Check(Name == Topic, "PUBLISH topic");
+  if (Pos + 2u <= Packet.Body.size())
+    PacketId = (Packet.Body[Pos] << 8) | Packet.Body[Pos + 1];
+  Pos += 2u;
+  Check(PacketId != 0u, "PUBLISH packet id");
+  Check(Pos <= Packet.Body.size() && std::string(Packet.Body.begin() + Pos, Packet.Body.end()) == Payload,
+        "PUBLISH payload");
+  return PacketId;
+}
+
+static void PubAck(int Fd, uint16_t PacketId)
+{
+  uint8_t Ack[] = { 0x40, 0x02, (uint8_t)(PacketId >> 8), (uint8_t)(PacketId & 0xffu) };
+
+  SendBytes(Fd, Ack, sizeof(Ack));
+}
+
+static void PublishPac(double Pac)
+{
+  SolisSample_t Sample;
+
+  memset(&Sample, 0, sizeof(Sample));
+  Sample.Registers.pac = Pac;
+  MqttPublishSample(&Sample, SolisFieldPac);
+}
+
+int main(void)
+{
+  static const uint8_t PingResp[] = { 0xd0, 0x00 };
+  char ConfigPath[] = "/tmp/mqtt-test-XXXXXX";
+  struct sockaddr_in Addr;
+  socklen_t AddrLen = sizeof(Addr);
+  TestPacket_t Packet;
+  int Listener, Fd, ConfigFd;
+  uint16_t PacketId;
+  int64_t Start;
+  FILE *Fp;
+
+  // the stub broker, on whatever port is free
+  Listener = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sin_family = AF_INET;
+  Addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (Listener < 0 || bind(Listener, (struct sockaddr*)&Addr, sizeof(Addr)) < 0 || listen(Listener, 1) < 0 ||
+      getsockname(Listener, (struct sockaddr*)&Addr, &AddrLen) < 0)
+  {
+    perror("mqtt-test broker");
+    return 1;
+  }
+
+  ConfigFd = mkstemp(ConfigPath);
+  if (ConfigFd < 0 || !(Fp = fdopen(ConfigFd, "w")))
+  {
+    perror("mqtt-test config");
+    return 1;
+  }
+  fprintf(Fp, "mqtt_host=127.0.0.1\nmqtt_port=%u\nmqtt_client_id=mqtt-test\nmqtt_keepalive=%u\n"
+          "mqtt_qos=1\nmqtt_discovery=0\n", ntohs(Addr.sin_port), KeepAlive);
+  fclose(Fp);
+  ConfigLoad(ConfigPath);
+  unlink(ConfigPath);
+  if (!MqttInit(1u))
+    return 1;
+
+  // connect & publish
+  Fd = Accept(Listener, 5000);
+  Check(Fd >= 0, "client connected");
+  if (Fd < 0 || !Connected(Fd))
+    return 1;
+  PublishPac(1.5);
+  Check(ReadPacket(Fd, &Packet, 2000), "PUBLISH received");
+  PubAck(Fd, Published(Packet, "solar/pac", "1.5", false));
+
+  // nothing more to send, so it should ping once the keep alive is up (the client
+  // only counts whole seconds, so allow a second either way)
+  Start = Millis();
+  Check(ReadPacket(Fd, &Packet, (KeepAlive + 2) * 1000), "PINGREQ received");
+  Check(Packet.Header == 0xc0u && Packet.Body.empty(), "PINGREQ framing");
+  Check(Millis() - Start >= (KeepAlive - 1) * 1000 && Millis() - Start <= (KeepAlive + 1) * 1000,
+        "PINGREQ at the keep alive interval");
+  SendBytes(Fd, PingResp, sizeof(PingResp));
+
+  // drop the connection without acknowledging the next message
+  PublishPac(2.25);
+  Check(ReadPacket(Fd, &Packet, 2000), "second PUBLISH received");
+  PacketId = Published(Packet, "solar/pac", "2.25", false);
+  close(Fd);
+
+  // the unacknowledged message should go again on the new connection
+  Fd = Accept(Listener, 5000);
+  Check(Fd >= 0, "client reconnected");
+  if (Fd < 0 || !Connected(Fd))
+    return 1;
+  Check(ReadPacket(Fd, &Packet, 2000), "PUBLISH re-sent");
+  Check(Published(Packet, "solar/pac", "2.25", true) == PacketId, "PUBLISH re-sent with the same packet id");
+  PubAck(Fd, PacketId);
+
+  MqttShutdown();
+  Check(ReadPacket(Fd, &Packet, 2000) && Packet.Header == 0xe0u && Packet.Body.empty(), "DISCONNECT on shutdown");
+  close(Fd);
+  close(Listener);
+
+  if (Failures)
+  {
+    printf("FAILED: %u checks\n", Failures);
+    return 1;
+  }
+  printf("Passed\n");
+  return 0;
+}
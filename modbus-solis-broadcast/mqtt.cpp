@@ -0,0 +1,708 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "mqtt.h"
+#include "config.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cjson/cJSON.h>
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <boost/chrono/chrono.hpp>
+
+// MQTT control packet types (upper nibble of the fixed header)
+static const uint8_t MqttConnect = 0x10;
+static const uint8_t MqttConnAck = 0x20;
+static const uint8_t MqttPublish = 0x30;
+static const uint8_t MqttPubAck = 0x40;
+static const uint8_t MqttPingReq = 0xC0;
+static const uint8_t MqttPingResp = 0xD0;
+static const uint8_t MqttDisconnect = 0xE0;
+
+// how many QoS 1 messages can be waiting on an acknowledgement before we stop sending
+static const size_t MaxInFlight = 64u;
+static const uint32_t MaxReconnectDelay = 60u;  // seconds
+static const uint32_t SocketTimeout = 5u;  // seconds
+
+typedef struct {
+  std::string Topic;
+  std::string Payload;
+  bool Retain;
+  uint8_t Qos;
+  uint16_t PacketId;
+} MqttMessage_t;
+
+// HA discovery details, matching those used by mqtt/solar_mqtt_publisher.py
+typedef struct {
+  const char *Field;        // used for both the state & config topics
+  const char *Name;
+  const char *DeviceClass;
+  const char *Unit;
+  const char *StateClass;
+  bool Precision;           // add 'suggested_display_precision'
+  bool UniqueId;            // add 'unique_id'
+} MqttDiscovery_t;
+
+static const MqttDiscovery_t Discovery[] = {
+  { "batteryPower", "Solar battery active power", "power", "kW", "measurement", true, false },
+  { "batteryCapacitySoc", "Solar battery capacity", "battery", "%", nullptr, false, false },
+  { "etoday", "Solar generation today", "energy", "kWh", "total_increasing", true, true },
+  { "etotal", "Solar generation total", "energy", "kWh", "total", true, true },
+  { "familyLoadPower", "House load power", "power", "kW", "measurement", true, false },
+  { "pac", "Solar active power", "power", "kW", "measurement", true, false },
+  { "psum", "Grid active power", "power", "kW", "measurement", true, false },
+  { "batteryTotalChargeEnergy", "Solar battery charge", "energy", "kWh", "total", true, false },
+  { "batteryTotalDischargeEnergy", "Solar battery discharge", "energy", "kWh", "total", true, false },
+  { "gridPurchasedTotalEnergy", "Grid import", "energy", "kWh", "total", true, false },
+  { "gridSellTotalEnergy", "Grid export", "energy", "kWh", "total", true, false },
+  { "solisLoggerFailureCount", "Solis data logger failure count", nullptr, nullptr, "total_increasing", false, false },
+  { "serialFrameErrors", "RS485 framing errors", nullptr, nullptr, "total_increasing", false, false },
+  { "serialOverruns", "RS485 overruns", nullptr, nullptr, "total_increasing", false, false },
+  { "serialParityErrors", "RS485 parity errors", nullptr, nullptr, "total_increasing", false, false },
+  { "serialBreaks", "RS485 breaks", nullptr, nullptr, "total_increasing", false, false },
+  { "busDeferrals", "RS485 requests deferred", nullptr, nullptr, "total_increasing", false, false },
+  { "busCollisions", "RS485 collisions", nullptr, nullptr, "total_increasing", false, false },
+  { "busRetries", "RS485 retries", nullptr, nullptr, "total_increasing", false, false },
+  { "busEchoCollisions", "RS485 echo mismatches", nullptr, nullptr, "total_increasing", false, false },
+};
+
+// last accepted value of each of the cumulative totals, per bus
+typedef struct {
+  uint32_t eTotal;
+  uint32_t batteryTotalChargeEnergy;
+  uint32_t batteryTotalDischargeEnergy;
+  uint32_t gridPurchasedTotalEnergy;
+  uint32_t gridSellTotalEnergy;
+} MqttTotals_t;
+
+static std::string Host;
+static std::string Port;
+static std::string ClientId;
+static std::string Username;
+static std::string Password;
+static std::string TopicBase;
+static std::string DiscoveryPrefix;
+static uint16_t KeepAlive = 60u;
+static uint8_t Qos = 0u;
+static bool PublishDiscovery = true;
+static size_t MaxQueued = 1024u;
+static uint32_t Buses = 1u;
+
+static std::deque<MqttMessage_t> Queue;
+static std::mutex QueueLock;
+static std::vector<MqttTotals_t> Totals;  // only used by the publisher thread
+static std::map<uint16_t, MqttMessage_t> InFlight;  // only used by the MQTT thread
+static std::thread MqttThread;
+static std::atomic<bool> Shutdown(false);
+static int WakePipe[2] = { -1, -1 };
+static int Fd = -1;
+static uint16_t NextPacketId = 1u;
+static std::vector<uint8_t> RxBuf;
+
+// statistics
+static std::atomic<uint32_t> Connects(0u);
+static std::atomic<uint32_t> Published(0u);
+static std::atomic<uint32_t> Acked(0u);
+static std::atomic<uint32_t> Dropped(0u);
+
+static uint32_t Now(void)
+{
+  using namespace boost::chrono;
+  return (uint32_t)duration_cast<seconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void Wake(void)
+{
+  char Ch = 0;
+
+  if (write(WakePipe[1], &Ch, 1) < 0 && errno != EAGAIN)
+    perror("mqtt wake");
+}
+
+// topic base for a given bus, the first uses the same topics as the python script
+static std::string BusTopic(uint32_t BusIndex)
+{
+  if (!BusIndex)
+    return TopicBase;
+  return TopicBase + std::to_string(BusIndex);
+}
+
+static void AppendString(std::vector<uint8_t> &Packet, const std::string &Str)
+{
+  Packet.push_back(Str.size() >> 8);
+  Packet.push_back(Str.size() & 0xff);
+  Packet.insert(Packet.end(), Str.begin(), Str.end());
+}
+
+// prepend the fixed header (type/flags + variable length encoded remaining length)
+static std::vector<uint8_t> MakePacket(uint8_t Header, const std::vector<uint8_t> &Body)
+{
+  std::vector<uint8_t> Packet;
+  size_t Remaining = Body.size();
+
+  Packet.push_back(Header);
+  do
+  {
+    uint8_t Byte = Remaining & 0x7f;
+    Remaining >>= 7;
+    if (Remaining)
+      Byte |= 0x80;
+    Packet.push_back(Byte);
+  } while (Remaining);
+  Packet.insert(Packet.end(), Body.begin(), Body.end());
+  return Packet;
+}
+
+static void CloseConnection(void)
+{
+  if (Fd >= 0)
+    close(Fd);
+  Fd = -1;
+  RxBuf.clear();
+}
+
+static bool SendPacket(const std::vector<uint8_t> &Packet)
+{
+  size_t Sent = 0;
+
+  while (Sent < Packet.size())
+  {
+    ssize_t Rc = send(Fd, Packet.data() + Sent, Packet.size() - Sent, MSG_NOSIGNAL);
+    if (Rc <= 0)
+    {
+      if (Rc < 0 && errno == EINTR)
+        continue;
+      perror("mqtt send");
+      CloseConnection();
+      return false;
+    }
+    Sent += Rc;
+  }
+  return true;
+}
+
+static bool SendPublish(const MqttMessage_t &Msg, bool Dup)
+{
+  std::vector<uint8_t> Body;
+  uint8_t Header = MqttPublish | (Msg.Qos << 1) | (Msg.Retain ? 0x01 : 0x00) | (Dup ? 0x08 : 0x00);
+
+  AppendString(Body, Msg.Topic);
+  if (Msg.Qos)
+  {
+    Body.push_back(Msg.PacketId >> 8);
+    Body.push_back(Msg.PacketId & 0xff);
+  }
+  Body.insert(Body.end(), Msg.Payload.begin(), Msg.Payload.end());
+  return SendPacket(MakePacket(Header, Body));
+}
+
+// queue up a message for the broker, discarding the oldest if we've been disconnected for a while
+static void Enqueue(const std::string &Topic, const std::string &Payload, bool Retain, uint8_t MsgQos)
+{
+  MqttMessage_t Msg;
+
+  Msg.Topic = Topic;
+  Msg.Payload = Payload;
+  Msg.Retain = Retain;
+  Msg.Qos = MsgQos;
+  Msg.PacketId = 0;
+
+  std::lock_guard<std::mutex> Lock(QueueLock);
+  if (Queue.size() >= MaxQueued)
+  {
+    Queue.pop_front();
+    Dropped++;
+  }
+  Queue.push_back(Msg);
+}
+
+// assign a packet id and send, QoS 1 messages are held until acknowledged (so
+// count as published even if the send fails, they'll go again on reconnecting)
+static bool Transmit(MqttMessage_t &Msg)
+{
+  bool Sent;
+
+  if (Msg.Qos)
+  {
+    // 0 isn't a valid packet id
+    do
+    {
+      Msg.PacketId = NextPacketId++;
+    } while (!Msg.PacketId || InFlight.count(Msg.PacketId));
+    InFlight[Msg.PacketId] = Msg;
+  }
+  Sent = SendPublish(Msg, false);
+  if (Sent || Msg.Qos)
+    Published++;
+  return Sent;
+}
+
+static std::string DiscoveryConfig(const MqttDiscovery_t *Entry, uint32_t BusIndex)
+{
+  cJSON *Config = cJSON_CreateObject();
+  std::string StateTopic = BusTopic(BusIndex) + "/" + Entry->Field;
+  std::string Name = Entry->Name;
+  std::string Ret;
+  char *jSon;
+
+  if (!Config)
+    return Ret;
+  if (BusIndex)
+    Name += " " + std::to_string(BusIndex);
+
+  cJSON_AddItemToObject(Config, "name", cJSON_CreateString(Name.c_str()));
+  cJSON_AddItemToObject(Config, "state_topic", cJSON_CreateString(StateTopic.c_str()));
+  if (Entry->DeviceClass)
+    cJSON_AddItemToObject(Config, "device_class", cJSON_CreateString(Entry->DeviceClass));
+  if (Entry->Precision)
+    cJSON_AddItemToObject(Config, "suggested_display_precision", cJSON_CreateNumber(1));
+  cJSON_AddItemToObject(Config, "platform", cJSON_CreateString("sensor"));
+  if (Entry->Unit)
+    cJSON_AddItemToObject(Config, "unit_of_measurement", cJSON_CreateString(Entry->Unit));
+  if (Entry->StateClass)
+    cJSON_AddItemToObject(Config, "state_class", cJSON_CreateString(Entry->StateClass));
+  cJSON_AddItemToObject(Config, "expire_after", cJSON_CreateNumber(900));
+  if (Entry->UniqueId)
+  {
+    std::string UniqueId = BusTopic(BusIndex) + "_" + Entry->Field;
+    cJSON_AddItemToObject(Config, "unique_id", cJSON_CreateString(UniqueId.c_str()));
+  }
+
+  jSon = cJSON_PrintUnformatted(Config);
+  if (jSon)
+  {
+    Ret = jSon;
+    free(jSon);
+  }
+  cJSON_Delete(Config);
+  return Ret;
+}
+
+// (re)publish the retained HA discovery configs, done on every connect
+static bool SendDiscovery(void)
+{
+  for (uint32_t Bus = 0; Bus < Buses; Bus++)
+  {
+    for (auto &Entry : Discovery)
+    {
+      MqttMessage_t Msg;
+
+      Msg.Topic = DiscoveryPrefix + "/sensor/" + BusTopic(Bus) + "/" + Entry.Field + "/config";
+      Msg.Payload = DiscoveryConfig(&Entry, Bus);
+      Msg.Retain = true;
+      Msg.Qos = 1;
+      if (!Transmit(Msg))
+        return false;
+    }
+  }
+  return true;
+}
+
+static bool Connect(void)
+{
+  struct addrinfo Hints, *Result, *Addr;
+  struct timeval TimeOut;
+  std::vector<uint8_t> Body;
+  uint8_t Flags = 0x02;  // clean session
+  uint8_t ConnAck[4];
+  int Enable = 1;
+
+  memset(&Hints, 0, sizeof(Hints));
+  Hints.ai_family = AF_UNSPEC;
+  Hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(Host.c_str(), Port.c_str(), &Hints, &Result) != 0)
+  {
+    printf("Unable to resolve MQTT broker %s\n", Host.c_str());
+    return false;
+  }
+
+  TimeOut.tv_sec = SocketTimeout;
+  TimeOut.tv_usec = 0;
+  for (Addr = Result; Addr; Addr = Addr->ai_next)
+  {
+    Fd = socket(Addr->ai_family, Addr->ai_socktype, Addr->ai_protocol);
+    if (Fd < 0)
+      continue;
+    // bound how long a dead broker can hold us up
+    setsockopt(Fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&TimeOut, sizeof(TimeOut));
+    setsockopt(Fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&TimeOut, sizeof(TimeOut));
+    setsockopt(Fd, IPPROTO_TCP, TCP_NODELAY, (char*)&Enable, sizeof(Enable));
+    if (connect(Fd, Addr->ai_addr, Addr->ai_addrlen) == 0)
+      break;
+    close(Fd);
+    Fd = -1;
+  }
+  freeaddrinfo(Result);
+  if (Fd < 0)
+  {
+    printf("Unable to connect to MQTT broker %s:%s\n", Host.c_str(), Port.c_str());
+    return false;
+  }
+
+  // variable header: protocol name, level (4 = 3.1.1), flags, keep alive
+  AppendString(Body, "MQTT");
+  Body.push_back(4);
+  if (!Username.empty())
+    Flags |= 0x80;
+  if (!Password.empty())
+    Flags |= 0x40;
+  Body.push_back(Flags);
+  Body.push_back(KeepAlive >> 8);
+  Body.push_back(KeepAlive & 0xff);
+  // payload
+  AppendString(Body, ClientId);
+  if (!Username.empty())
+    AppendString(Body, Username);
+  if (!Password.empty())
+    AppendString(Body, Password);
+
+  if (!SendPacket(MakePacket(MqttConnect, Body)))
+    return false;
+
+  // wait for the CONNACK, that's always 4 bytes
+  if (recv(Fd, ConnAck, sizeof(ConnAck), MSG_WAITALL) != sizeof(ConnAck) ||
+      ConnAck[0] != MqttConnAck || ConnAck[1] != 2)
+  {
+    printf("No CONNACK from MQTT broker\n");
+    CloseConnection();
+    return false;
+  }
+  if (ConnAck[3])
+  {
+    printf("MQTT broker refused connection: %u\n", ConnAck[3]);
+    CloseConnection();
+    return false;
+  }
+
+  Connects++;
+  printf("Connected to MQTT broker %s:%s\n", Host.c_str(), Port.c_str());
+  return true;
+}
+
+// process whatever packets have been received, returns false if the connection is lost
+static bool Receive(uint32_t &LastRx)
+{
+  uint8_t Buf[512];
+  ssize_t Rc = recv(Fd, Buf, sizeof(Buf), MSG_DONTWAIT);
+
+  if (Rc == 0 || (Rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    printf("Lost connection to MQTT broker\n");
+    CloseConnection();
+    return false;
+  }
+  if (Rc < 0)
+    return true;
+
+  LastRx = Now();
+  RxBuf.insert(RxBuf.end(), Buf, Buf + Rc);
+
+  // pick out each complete packet
+  for (;;)
+  {
+    size_t Remaining = 0, Pos = 1;
+    uint32_t Shift = 0;
+    bool Complete = false;
+
+    while (Pos < RxBuf.size() && Pos < 5)
+    {
+      Remaining |= (RxBuf[Pos] & 0x7f) << Shift;
+      Shift += 7;
+      if (!(RxBuf[Pos++] & 0x80))
+      {
+        Complete = true;
+        break;
+      }
+    }
+    if (!Complete || RxBuf.size() < Pos + Remaining)
+      break;
+
+    uint8_t Type = RxBuf[0] & 0xf0;
+    if (Type == MqttPubAck && Remaining >= 2)
+    {
+      uint16_t PacketId = (RxBuf[Pos] << 8) + RxBuf[Pos + 1];
+      if (InFlight.erase(PacketId))
+        Acked++;
+    }
+    // PINGRESP just needs to update LastRx, anything else isn't expected so is ignored
+    RxBuf.erase(RxBuf.begin(), RxBuf.begin() + Pos + Remaining);
+  }
+  return true;
+}
+
+static void MqttLoop(void)
+{
+  uint32_t ReconnectDelay = 1u;
+  uint32_t LastTx = 0, LastRx = 0;
+  bool PingOutstanding = false;
+
+  while (!Shutdown)
+  {
+    struct pollfd PollFds[2];
+    int TimeOut;
+
+    if (Fd < 0)
+    {
+      if (!Connect())
+      {
+        // back off, but still wake up promptly on shutdown
+        struct pollfd Pfd = { WakePipe[0], POLLIN, 0 };
+        if (poll(&Pfd, 1, ReconnectDelay * 1000) > 0)
+        {
+          char Scratch[64];
+          while (read(WakePipe[0], Scratch, sizeof(Scratch)) > 0)
+            ;
+        }
+        if (ReconnectDelay < MaxReconnectDelay)
+          ReconnectDelay *= 2;
+        continue;
+      }
+      ReconnectDelay = 1u;
+      LastTx = LastRx = Now();
+      PingOutstanding = false;
+
+      // anything not acknowledged on the previous connection goes again, other than
+      // the discovery configs (the only retained messages) which are about to be re-sent anyway
+      for (auto It = InFlight.begin(); It != InFlight.end(); )
+      {
+        if (It->second.Retain)
+          It = InFlight.erase(It);
+        else if (!SendPublish((It++)->second, true))
+          break;
+      }
+      if (Fd < 0)
+        continue;
+      if (PublishDiscovery && !SendDiscovery())
+        continue;
+    }
+
+    // send as much as the in-flight window allows, without waiting on acknowledgements
+    while (Fd >= 0 && InFlight.size() < MaxInFlight)
+    {
+      MqttMessage_t Msg;
+      {
+        std::lock_guard<std::mutex> Lock(QueueLock);
+        if (Queue.empty())
+          break;
+        Msg = Queue.front();
+        Queue.pop_front();
+      }
+      if (!Transmit(Msg) && !Msg.Qos)
+      {
+        // QoS 0 messages are lost with the connection, put it back for next time
+        std::lock_guard<std::mutex> Lock(QueueLock);
+        Queue.push_front(Msg);
+      }
+      LastTx = Now();
+    }
+    if (Fd < 0)
+      continue;
+
+    // keep alive - ping if we've been quiet, give up if the broker has been. A
+    // keep alive of 0 turns it off altogether
+    if (KeepAlive && Now() - LastTx >= KeepAlive)
+    {
+      if (PingOutstanding && Now() - LastRx >= KeepAlive)
+      {
+        printf("MQTT broker not responding\n");
+        CloseConnection();
+        continue;
+      }
+      if (!SendPacket(MakePacket(MqttPingReq, std::vector<uint8_t>())))
+        continue;
+      PingOutstanding = true;
+      LastTx = Now();
+    }
+
+    PollFds[0].fd = WakePipe[0];
+    PollFds[0].events = POLLIN;
+    PollFds[0].revents = 0;
+    PollFds[1].fd = Fd;
+    PollFds[1].events = POLLIN;
+    PollFds[1].revents = 0;
+    TimeOut = KeepAlive ? KeepAlive * 1000 / 2 : -1;
+    if (poll(PollFds, 2, TimeOut) < 0 && errno != EINTR)
+    {
+      perror("mqtt poll");
+      break;
+    }
+    if (PollFds[0].revents & POLLIN)
+    {
+      char Scratch[64];
+      while (read(WakePipe[0], Scratch, sizeof(Scratch)) > 0)
+        ;
+    }
+    if (PollFds[1].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      if (Receive(LastRx))
+        PingOutstanding = false;
+    }
+  }
+
+  if (Fd >= 0)
+  {
+    SendPacket(MakePacket(MqttDisconnect, std::vector<uint8_t>()));
+    CloseConnection();
+  }
+}
+
+// format a value in the same way the python script does
+static std::string Format(double Value)
+{
+  char Buf[32];
+
+  // adding zero avoids publishing '-0'
+  snprintf(Buf, sizeof(Buf), "%g", Value + 0.0);
+  return Buf;
+}
+
+// cumulative totals should only ever go up, and never by much between readings
+static bool ValidateReading(uint32_t Current, uint32_t &Last)
+{
+  const uint32_t MaxJump = 50u;
+
+  if (Last && (Current < Last || Current - Last > MaxJump))
+    return false;
+  Last = Current;
+  return true;
+}
+
+bool MqttInit(uint32_t BusCount)
+{
+  Host = ConfigGetString("mqtt_host", "");
+  if (Host.empty())
+    return true;
+
+  Port = std::to_string(ConfigGetUint("mqtt_port", 1883));
+  ClientId = ConfigGetString("mqtt_client_id", "modbus-solis-broadcast");
+  Username = ConfigGetString("mqtt_username", "");
+  Password = ConfigGetString("mqtt_password", "");
+  TopicBase = ConfigGetString("mqtt_topic", "solar");
+  DiscoveryPrefix = ConfigGetString("mqtt_discovery_prefix", "homeassistant");
+  PublishDiscovery = ConfigGetBool("mqtt_discovery", true);
+  KeepAlive = ConfigGetUint("mqtt_keepalive", 60);
+  Qos = ConfigGetUint("mqtt_qos", 0) ? 1 : 0;
+  MaxQueued = ConfigGetUint("mqtt_queue", 1024);
+  Buses = BusCount;
+  Totals.assign(BusCount, MqttTotals_t());
+  memset(Totals.data(), 0, Totals.size() * sizeof(MqttTotals_t));
+
+  if (pipe(WakePipe) < 0)
+  {
+    perror("mqtt pipe");
+    return false;
+  }
+  fcntl(WakePipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(WakePipe[1], F_SETFL, O_NONBLOCK);
+
+  Shutdown = false;
+  MqttThread = std::thread(MqttLoop);
+  return true;
+}
+
+void MqttPublishSample(const SolisSample_t *Sample, uint32_t Fields)
+{
+  const ModbusSolisRegister_t *Regs = &Sample->Registers;
+  std::string Base;
+  MqttTotals_t *Last;
+
+  if (!MqttThread.joinable() || Sample->BusIndex >= Totals.size())
+    return;
+  Base = BusTopic(Sample->BusIndex) + "/";
+  Last = &Totals[Sample->BusIndex];
+
+  if (Fields & SolisFieldLoggerFail)
+    Enqueue(Base + "solisLoggerFailureCount", std::to_string(Sample->LoggerFail), false, Qos);
+  if (Fields & SolisFieldLineErrors)
+  {
+    Enqueue(Base + "serialFrameErrors", std::to_string(Sample->LineErrors.Frame), false, Qos);
+    Enqueue(Base + "serialOverruns", std::to_string(Sample->LineErrors.Overrun), false, Qos);
+    Enqueue(Base + "serialParityErrors", std::to_string(Sample->LineErrors.Parity), false, Qos);
+    Enqueue(Base + "serialBreaks", std::to_string(Sample->LineErrors.Break), false, Qos);
+  }
+  if (Fields & SolisFieldCollisions)
+  {
+    Enqueue(Base + "busDeferrals", std::to_string(Sample->Collisions.Deferrals), false, Qos);
+    Enqueue(Base + "busCollisions", std::to_string(Sample->Collisions.Collisions), false, Qos);
+    Enqueue(Base + "busRetries", std::to_string(Sample->Collisions.Retries), false, Qos);
+    Enqueue(Base + "busEchoCollisions", std::to_string(Sample->Collisions.EchoCollisions), false, Qos);
+  }
+  if (Fields & SolisFieldBatteryCapacitySoc)
+    Enqueue(Base + "batteryCapacitySoc", std::to_string(Regs->batteryCapacitySoc), false, Qos);
+  // battery & grid power are flipped to align with HA's convention for grid power
+  if (Fields & SolisFieldBatteryPower)
+    Enqueue(Base + "batteryPower", Format(Regs->batteryPower * -1), false, Qos);
+  if (Fields & SolisFieldPac)
+    Enqueue(Base + "pac", Format(Regs->pac), false, Qos);
+  if (Fields & SolisFieldPsum)
+    Enqueue(Base + "psum", Format(Regs->psum * -1), false, Qos);
+  if (Fields & SolisFieldFamilyLoadPower)
+    Enqueue(Base + "familyLoadPower", Format(Regs->familyLoadPower), false, Qos);
+  if (Fields & SolisFieldEToday)
+    Enqueue(Base + "etoday", Format(round(Regs->etoday * 10.0) / 10.0), false, Qos);
+
+  if ((Fields & SolisFieldBatteryTotalChargeEnergy) &&
+      ValidateReading(Regs->batteryTotalChargeEnergy, Last->batteryTotalChargeEnergy))
+    Enqueue(Base + "batteryTotalChargeEnergy", std::to_string(Regs->batteryTotalChargeEnergy), false, Qos);
+  if ((Fields & SolisFieldBatteryTotalDischargeEnergy) &&
+      ValidateReading(Regs->batteryTotalDischargeEnergy, Last->batteryTotalDischargeEnergy))
+    Enqueue(Base + "batteryTotalDischargeEnergy", std::to_string(Regs->batteryTotalDischargeEnergy), false, Qos);
+  if ((Fields & SolisFieldGridPurchasedTotalEnergy) &&
+      ValidateReading(Regs->gridPurchasedTotalEnergy, Last->gridPurchasedTotalEnergy))
+    Enqueue(Base + "gridPurchasedTotalEnergy", std::to_string(Regs->gridPurchasedTotalEnergy), false, Qos);
+  if ((Fields & SolisFieldGridSellTotalEnergy) &&
+      ValidateReading(Regs->gridSellTotalEnergy, Last->gridSellTotalEnergy))
+    Enqueue(Base + "gridSellTotalEnergy", std::to_string(Regs->gridSellTotalEnergy), false, Qos);
+  if ((Fields & SolisFieldETotal) && ValidateReading(Regs->eTotal, Last->eTotal))
+    Enqueue(Base + "etotal", std::to_string(Regs->eTotal), false, Qos);
+
+  Wake();
+
+  if (Verbose)
+    printf("MQTT: %u connects, %u published, %u acked, %u dropped\n", Connects.load(), Published.load(), Acked.load(), Dropped.load());
+}
+
+void MqttShutdown(void)
+{
+  if (!MqttThread.joinable())
+    return;
+  Shutdown = true;
+  Wake();
+  MqttThread.join();
+  close(WakePipe[0]);
+  close(WakePipe[1]);
+}
+
+#else
+
+// not supported under Windows
+bool MqttInit(uint32_t BusCount)
+{
+  if (*ConfigGetString("mqtt_host", ""))
+    printf("MQTT not supported on this platform\n");
+  return true;
+}
+
+void MqttPublishSample(const SolisSample_t *Sample, uint32_t Fields)
+{
+}
+
+void MqttShutdown(void)
+{
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef MQTT_H
+#define MQTT_H
+
+#include "solis.h"
+
+//
+// Minimal MQTT 3.1.1 client for publishing samples straight to a broker (eg. for
+// Home Assistant), using the same topics and discovery configs as
+// mqtt/solar_mqtt_publisher.py. The connection is managed by it's own thread,
+// messages are queued whilst disconnected and re-sent on reconnection
+//
+
+// read the mqtt_* settings & start the client, does nothing if no broker is configured
+bool MqttInit(uint32_t BusCount);
+
+// convert a sample into individual topics and queue them for the broker, never blocks.
+// 'Fields' restricts it to those topics which have changed
+void MqttPublishSample(const SolisSample_t *Sample, uint32_t Fields = SolisFieldAll);
+
+void MqttShutdown(void);
+
+#endif
@@ -0,0 +1,53 @@
+#include <string.h>
+#include <math.h>
+#include "pollrate.h"
+#include "config.h"
+
+void PollRateInit(PollRate_t *PollRate)
+{
+  memset(PollRate, 0, sizeof(PollRate_t));
+  PollRate->MinInterval = ConfigGetUint("poll_interval_min", 5) * 1000u;
+  PollRate->MaxInterval = ConfigGetUint("poll_interval_max", 30) * 1000u;
+  PollRate->Threshold = ConfigGetDouble("poll_volatility", 0.25);
+  if (PollRate->MaxInterval < PollRate->MinInterval)
+    PollRate->MaxInterval = PollRate->MinInterval;
+  PollRate->Interval = PollRate->MinInterval;
+}
+
+uint32_t PollRateUpdate(PollRate_t *PollRate, const double Readings[PollRateSignals])
+{
+  double Scale;
+
+  for (uint32_t Signal = 0; Signal < PollRateSignals; Signal++)
+    PollRate->History[Signal][PollRate->Next] = Readings[Signal];
+  PollRate->Next = (PollRate->Next + 1u) % PollRateWindow;
+  if (PollRate->Count < PollRateWindow)
+    PollRate->Count++;
+
+  // not enough to go on yet, stay where we are
+  if (PollRate->Count < 2u)
+    return PollRate->Interval;
+
+  // whichever is moving about the most decides it
+  PollRate->Volatility = 0.0;
+  for (uint32_t Signal = 0; Signal < PollRateSignals; Signal++)
+  {
+    double Sum = 0.0, SumSquares = 0.0, Variance;
+
+    for (uint32_t i = 0; i < PollRate->Count; i++)
+    {
+      Sum += PollRate->History[Signal][i];
+      SumSquares += PollRate->History[Signal][i] * PollRate->History[Signal][i];
+    }
+    Variance = (SumSquares - Sum * Sum / PollRate->Count) / PollRate->Count;
+    if (Variance > 0.0 && sqrt(Variance) > PollRate->Volatility)
+      PollRate->Volatility = sqrt(Variance);
+  }
+
+  // scale linearly between the ceiling (steady) and floor (at or above the threshold)
+  Scale = (PollRate->Threshold > 0.0) ? PollRate->Volatility / PollRate->Threshold : 1.0;
+  if (Scale > 1.0)
+    Scale = 1.0;
+  PollRate->Interval = PollRate->MaxInterval - (uint32_t)((PollRate->MaxInterval - PollRate->MinInterval) * Scale);
+  return PollRate->Interval;
+}
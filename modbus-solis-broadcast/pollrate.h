@@ -0,0 +1,33 @@
+#ifndef POLLRATE_H
+#define POLLRATE_H
+
+#include <stdint.h>
+
+//
+// Works out how often to poll the inverter from how much the live readings
+// (generation, grid & load) have been moving about. Whilst they're steady
+// (eg. overnight) there's little point in polling often, whereas under
+// broken cloud they can swing by kilowatts every few seconds
+//
+
+static const uint32_t PollRateSignals = 3u;  // pac, psum, familyLoadPower
+static const uint32_t PollRateWindow = 8u;   // number of readings the variance is taken over
+
+typedef struct {
+  uint32_t MinInterval;    // milliseconds, used once the volatility reaches 'Threshold'
+  uint32_t MaxInterval;    // milliseconds, used whilst everything is perfectly steady
+  double Threshold;        // standard deviation (kW) at which we poll as fast as allowed
+  double History[PollRateSignals][PollRateWindow];
+  uint32_t Count;          // readings in the history, up to PollRateWindow
+  uint32_t Next;           // where the next reading goes
+  double Volatility;       // largest standard deviation of the signals, as of the last update
+  uint32_t Interval;       // current poll interval (milliseconds)
+} PollRate_t;
+
+// pick up the floor/ceiling etc. from the settings, starts off polling as fast as allowed
+void PollRateInit(PollRate_t *PollRate);
+
+// add the latest readings and return the interval to wait before the next poll
+uint32_t PollRateUpdate(PollRate_t *PollRate, const double Readings[PollRateSignals]);
+
+#endif
@@ -0,0 +1,644 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+typedef int SOCKET;
+#define closesocket close
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma warning(disable : 4996)
+#endif
+#include <cjson/cJSON.h>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <boost/chrono/chrono.hpp>
+#include "publish.h"
+#include "config.h"
+#include "fanout.h"
+#include "shm.h"
+#include "mqtt.h"
+#include "solis-pack.h"
+#include "delta.h"
+#include "recovery.h"
+
+// how many samples can be outstanding before we start discarding the oldest
+static const size_t MaxQueueDepth = 32u;
+
+static std::deque<SolisSample_t> SampleQueue;
+static std::mutex QueueLock;
+static std::condition_variable QueueSignal;
+static std::thread PublishThread;
+static bool Shutdown = false;
+static uint32_t Dropped = 0u;
+static uint32_t Buses = 1u;
+// per bus, numbers each document sent
+static std::vector<uint32_t> Sequences;
+
+static const uint16_t BroadcastPort = 52005;
+// largest payload which will fit in a single ethernet frame, anything bigger
+// gets fragmented which the ESP32 displays can't handle
+static const size_t MaxDatagram = 1472u;
+
+// send the UDP payload packed using solis-pack.h rather than as plain JSON
+static bool UdpCompress = false;
+
+// running totals for the packed payload, reported when verbose
+typedef struct {
+  uint32_t Count;
+  uint64_t RawBytes;
+  uint64_t PackedBytes;
+  uint64_t EncodeNs;
+  uint64_t DecodeNs;
+} PackStats_t;
+static PackStats_t PackStats;
+
+static SOCKET sFd = -1;
+// everywhere a UDP datagram gets sent - the broadcast address plus any
+// configured unicast/multicast destinations
+static std::vector<struct sockaddr_in> UdpDestinations;
+
+// generate JSON message aligned to Solis API from the register data, only including
+// the fields asked for. Anything less than the full set is flagged as a delta
+static cJSON *GenerateJson(const SolisSample_t *Sample, uint32_t Fields = SolisFieldAll)
+{
+  const ModbusSolisRegister_t *ModbusSolisRegisters = &Sample->Registers;
+  cJSON *SolarJson = cJSON_CreateObject();
+  cJSON *Node;
+  cJSON *SolarData;
+  std::stringstream TimeBuf;
+
+  if (!SolarJson)
+    return nullptr ;
+
+  // response code
+  Node = cJSON_CreateString("0");
+  if ( Node )
+    cJSON_AddItemToObject(SolarJson, "code", Node);
+
+  // create the 'data' block
+  SolarData = cJSON_CreateObject();
+  if (SolarData)
+  {
+    cJSON_AddItemToObject(SolarJson, "data", SolarData);
+
+    // Add in a dummy 'storageBatteryCurrent' entry. This serves two purposes...
+    // Firstly, my ipcam_snap script expects this to be in the data (even though it doesn't use it)
+    // Secondly, James' JSON parser fails to correctly decode the first entry in the packet so we
+    // can't include any data that it needs (& this is one such thing) at the start.
+    Node = cJSON_CreateNumber(1);
+    if (Node)
+      cJSON_AddItemToObject(SolarData, "storageBatteryCurrent", Node);
+
+    // timestamp
+    TimeBuf << Sample->Timestamp;
+    Node = cJSON_CreateString(TimeBuf.str().c_str());
+    if (Node)
+      cJSON_AddItemToObject(SolarData, "dataTimestamp", Node);
+
+    // "eToday" = solar energy generated today
+    if (Fields & SolisFieldEToday)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->etoday);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "eToday", Node);
+      Node = cJSON_CreateString("kWh");
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "eTodayStr", Node);
+    }
+    // eTotal - total solar generation
+    if (Fields & SolisFieldETotal)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->eTotal);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "eTotal", Node);
+      Node = cJSON_CreateString("kWh");
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "eTotalStr", Node);
+    }
+
+    // generation
+    if (Fields & SolisFieldPac)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->pac);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "pac", Node);
+      Node = cJSON_CreateString("kW");
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "pacStr", Node);
+    }
+    // battery capacity
+    if (Fields & SolisFieldBatteryCapacitySoc)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->batteryCapacitySoc);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "batteryCapacitySoc", Node);
+    }
+    // battery power
+    if (Fields & SolisFieldBatteryPower)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->batteryPower);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "batteryPower", Node);
+      Node = cJSON_CreateString("kW");
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "batteryPowerStr", Node);
+    }
+
+    // grid in/out
+    if (Fields & SolisFieldPsum)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->psum);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "psum", Node);
+      Node = cJSON_CreateString("kW");
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "psumStr", Node);
+    }
+    // load
+    if (Fields & SolisFieldFamilyLoadPower)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->familyLoadPower);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "familyLoadPower", Node);
+      Node = cJSON_CreateString("kW");
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "familyLoadPowerStr", Node);
+    }
+
+    // battery charge/discharge
+    if (Fields & SolisFieldBatteryTotalChargeEnergy)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->batteryTotalChargeEnergy);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "batteryTotalChargeEnergy", Node);
+      Node = cJSON_CreateString("kWh");
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "batteryTotalChargeEnergyStr", Node);
+    }
+
+    if (Fields & SolisFieldBatteryTotalDischargeEnergy)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->batteryTotalDischargeEnergy);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "batteryTotalDischargeEnergy", Node);
+      Node = cJSON_CreateString("kWh");
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "batteryTotalDischargeEnergyStr", Node);
+    }
+
+    // grid today in/out
+    if (Fields & SolisFieldGridPurchasedTotalEnergy)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->gridPurchasedTotalEnergy);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "gridPurchasedTotalEnergy", Node);
+      Node = cJSON_CreateString("kWh");
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "gridPurchasedTotalEnergyStr", Node);
+    }
+
+    if (Fields & SolisFieldGridSellTotalEnergy)
+    {
+      Node = cJSON_CreateNumber(ModbusSolisRegisters->gridSellTotalEnergy);
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "gridSellTotalEnergy", Node);
+      Node = cJSON_CreateString("kWh");
+      if (Node)
+        cJSON_AddItemToObject(SolarData, "gridSellTotalEnergyStr", Node);
+    }
+  }
+
+  // the outer pieces
+  Node = cJSON_CreateString("success");
+  if (Node)
+    cJSON_AddItemToObject(SolarJson, "msg", Node);
+  Node = cJSON_CreateBool(true);
+  if (Node)
+    cJSON_AddItemToObject(SolarJson, "success", Node);
+
+  // this is non-standard but provides an indication of if (and how many times)
+  // the logger has failed
+  if (Fields & SolisFieldLoggerFail)
+  {
+    Node = cJSON_CreateNumber(Sample->LoggerFail);
+    if (Node)
+      cJSON_AddItemToObject(SolarJson, "loggerFail", Node);
+  }
+
+  // likewise, the errors counted on the serial line whilst listening to the logger
+  if (Fields & SolisFieldLineErrors)
+  {
+    cJSON *LineErrors = cJSON_CreateObject();
+    const char *Names[] = { "frame", "overrun", "parity", "break" };
+    const uint32_t Counts[] = { Sample->LineErrors.Frame, Sample->LineErrors.Overrun,
+                                Sample->LineErrors.Parity, Sample->LineErrors.Break };
+
+    if (LineErrors)
+    {
+      for (size_t i = 0; i < sizeof(Counts) / sizeof(Counts[0]); i++)
+      {
+        Node = cJSON_CreateNumber(Counts[i]);
+        if (Node)
+          cJSON_AddItemToObject(LineErrors, Names[i], Node);
+      }
+      cJSON_AddItemToObject(SolarJson, "lineErrors", LineErrors);
+    }
+  }
+
+  // and how often we've had to give way to the logger, or run into it
+  if (Fields & SolisFieldCollisions)
+  {
+    cJSON *Collisions = cJSON_CreateObject();
+    const char *Names[] = { "deferrals", "collisions", "retries", "gaveUp", "echoChecks", "echoCollisions",
+                            "echoMissing" };
+    const uint32_t Counts[] = { Sample->Collisions.Deferrals, Sample->Collisions.Collisions,
+                                Sample->Collisions.Retries, Sample->Collisions.GaveUp,
+                                Sample->Collisions.EchoChecks, Sample->Collisions.EchoCollisions,
+                                Sample->Collisions.EchoMissing };
+
+    if (Collisions)
+    {
+      for (size_t i = 0; i < sizeof(Counts) / sizeof(Counts[0]); i++)
+      {
+        Node = cJSON_CreateNumber(Counts[i]);
+        if (Node)
+          cJSON_AddItemToObject(Collisions, Names[i], Node);
+      }
+      cJSON_AddItemToObject(SolarJson, "collisions", Collisions);
+    }
+  }
+
+  // also non-standard, lets receivers spot anything they've missed. Change only
+  // updates are flagged so they know to merge it with what they already have
+  Node = cJSON_CreateNumber(Sample->Sequence);
+  if (Node)
+    cJSON_AddItemToObject(SolarJson, "seq", Node);
+  if (Fields != SolisFieldAll)
+  {
+    Node = cJSON_CreateBool(true);
+    if (Node)
+      cJSON_AddItemToObject(SolarJson, "delta", Node);
+  }
+  // the last sample from a previous run republished at startup, or one where nothing
+  // could be read from the inverter so it's entirely from the cache
+  if (Sample->Stale)
+  {
+    Node = cJSON_CreateBool(true);
+    if (Node)
+      cJSON_AddItemToObject(SolarJson, "stale", Node);
+  }
+
+  // also non-standard, when serving more than one bus, identify which inverter this came from
+  if (Buses > 1)
+  {
+    Node = cJSON_CreateNumber(Sample->BusIndex);
+    if (Node)
+      cJSON_AddItemToObject(SolarJson, "bus", Node);
+    Node = cJSON_CreateString(Sample->Device);
+    if (Node)
+      cJSON_AddItemToObject(SolarJson, "device", Node);
+  }
+
+  return SolarJson;
+}
+
+// send a sample's datagram to every UDP destination, in a single system call where available
+static void SendUdp(const SolisSample_t *Sample, const char *Data, size_t Len)
+{
+#ifndef WIN32
+  std::vector<struct mmsghdr> Msgs(UdpDestinations.size());
+  struct iovec Iov;
+  size_t Sent = 0;
+
+  Iov.iov_base = (void*)Data;
+  Iov.iov_len = Len;
+  memset(Msgs.data(), 0, Msgs.size() * sizeof(struct mmsghdr));
+  for (size_t i = 0; i < Msgs.size(); i++)
+  {
+    Msgs[i].msg_hdr.msg_name = &UdpDestinations[i];
+    Msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    Msgs[i].msg_hdr.msg_iov = &Iov;
+    Msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  // sendmmsg stops at the first failure, so step over it and carry on with the rest
+  while (Sent < Msgs.size())
+  {
+    int Rc = sendmmsg(sFd, &Msgs[Sent], Msgs.size() - Sent, 0);
+    if (Rc < 0)
+    {
+      perror("sendmmsg");
+      Rc = 1;
+    }
+    Sent += Rc;
+  }
+#else
+  for (auto &Dest : UdpDestinations)
+  {
+    if (sendto(sFd, Data, Len, 0, (struct sockaddr*)&Dest, sizeof(struct sockaddr_in)) < 0)
+      perror("sendto");
+  }
+#endif
+
+  // keep hold of it in case anyone missed it
+  RecoveryAdd(Sample->BusIndex, Sample->Sequence, Data, Len);
+}
+
+// pack the JSON document & send it, falling back to the plain version should
+// it fail to pack for any reason
+static void SendPackedUdp(const SolisSample_t *Sample, const char *Json, size_t Len)
+{
+  using namespace boost::chrono;
+  std::vector<uint8_t> Packed;
+  std::vector<char> Check(Len);
+  high_resolution_clock::time_point Start, Encoded, Decoded;
+  int CheckLen;
+
+  Start = high_resolution_clock::now();
+  if (!SolisPackEncode(Json, (uint32_t)Len, Packed))
+  {
+    printf("JSON data too large to pack (%zu bytes)\n", Len);
+    SendUdp(Sample, Json, Len);
+    return;
+  }
+  Encoded = high_resolution_clock::now();
+  // make sure it comes back out the same, which also tells us what it costs the receiver
+  CheckLen = SolisPackDecode(Packed.data(), (uint32_t)Packed.size(), Check.data(), (uint32_t)Check.size());
+  Decoded = high_resolution_clock::now();
+  if (CheckLen != (int)Len || memcmp(Check.data(), Json, Len) != 0)
+  {
+    printf("Packed JSON data failed to decode, sending it unpacked\n");
+    SendUdp(Sample, Json, Len);
+    return;
+  }
+
+  PackStats.Count++;
+  PackStats.RawBytes += Len;
+  PackStats.PackedBytes += Packed.size();
+  PackStats.EncodeNs += duration_cast<nanoseconds>(Encoded - Start).count();
+  PackStats.DecodeNs += duration_cast<nanoseconds>(Decoded - Encoded).count();
+  if (Verbose)
+  {
+    printf("Packed %zu -> %zu bytes (%.1f%%), encode %.1fus, decode %.1fus\n", Len, Packed.size(),
+           100.0 * Packed.size() / Len, duration_cast<nanoseconds>(Encoded - Start).count() / 1000.0,
+           duration_cast<nanoseconds>(Decoded - Encoded).count() / 1000.0);
+    printf("Packed average over %u samples: %.1f%%, encode %.1fus, decode %.1fus\n", PackStats.Count,
+           100.0 * PackStats.PackedBytes / PackStats.RawBytes, PackStats.EncodeNs / 1000.0 / PackStats.Count,
+           PackStats.DecodeNs / 1000.0 / PackStats.Count);
+  }
+  if (Packed.size() > MaxDatagram)
+    printf("Packed JSON data (%zu bytes) will be fragmented\n", Packed.size());
+
+  SendUdp(Sample, (const char*)Packed.data(), Packed.size());
+}
+
+// send a single sample out to all clients
+static void SendSample(const SolisSample_t *Latest)
+{
+  SolisSample_t Numbered = *Latest;
+  const SolisSample_t *Sample = &Numbered;
+  cJSON *SolarJson;
+  char *jSon;
+  uint32_t Fields;
+
+  // local consumers first, this is by far the cheapest
+  ShmPublish(Sample, Sample->Stale);
+
+  // in change only mode, there may be nothing worth sending
+  // a stale sample always goes out in full and isn't what the changes are measured against
+  Fields = Sample->Stale ? (uint32_t)SolisFieldAll : DeltaFields(Sample);
+  if (!Fields)
+    return;
+  Numbered.Sequence = ++Sequences[Sample->BusIndex];
+
+  // generate the JSON data, aligned to the Solis API
+  SolarJson = GenerateJson(Sample, Fields);
+  if (!SolarJson)
+  {
+    printf("Failed to generate JSON data\n");
+    return;
+  }
+
+  jSon = cJSON_Print(SolarJson);
+  if (jSon)
+  {
+    if ( Verbose )
+      printf("JSON data: %s:\n", jSon);
+
+    // send out to clients
+    if (!UdpCompress)
+    {
+      if (strlen(jSon) > MaxDatagram)
+        printf("JSON data (%zu bytes) will be fragmented\n", strlen(jSon));
+      SendUdp(Sample, jSon, strlen(jSon));
+    }
+    free(jSon);
+  }
+  else
+    printf("Failed to generate JSON data\n");
+
+  // stream consumers get one document per line, it's also what gets packed
+  jSon = cJSON_PrintUnformatted(SolarJson);
+  if (jSon)
+  {
+    std::string Line(jSon);
+
+    if (UdpCompress)
+      SendPackedUdp(Sample, Line.data(), Line.size());
+    Line += '\n';
+    if (Fields == SolisFieldAll)
+      FanoutSend(Sample->BusIndex, Line.data(), Line.size());
+    else
+    {
+      // newly connected consumers need the full picture rather than just what's changed
+      cJSON *FullJson = GenerateJson(Sample);
+      char *Full = FullJson ? cJSON_PrintUnformatted(FullJson) : nullptr;
+      std::string FullLine(Full ? Full : "");
+
+      FullLine += '\n';
+      FanoutSend(Sample->BusIndex, Line.data(), Line.size(), Full ? FullLine.data() : nullptr, FullLine.size());
+      free(Full);
+      cJSON_Delete(FullJson);
+    }
+    free(jSon);
+  }
+  cJSON_Delete(SolarJson);
+
+  // Home Assistant has no notion of stale, so leave it showing whatever it had
+  if (!Sample->Stale)
+    MqttPublishSample(Sample, Fields);
+}
+
+// parse a comma separated list of host:port UDP destinations
+static bool AddUdpDestinations(const char *List)
+{
+  std::string Destinations(List);
+  size_t Start = 0;
+
+  while (Start < Destinations.size())
+  {
+    size_t End = Destinations.find(',', Start);
+    if (End == std::string::npos)
+      End = Destinations.size();
+
+    std::string Entry = Destinations.substr(Start, End - Start);
+    size_t Colon = Entry.rfind(':');
+    std::string Host = Entry.substr(0, Colon);
+    std::string Port = (Colon == std::string::npos) ? std::to_string(BroadcastPort) : Entry.substr(Colon + 1);
+    struct addrinfo Hints, *Result;
+
+    memset(&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_INET;
+    Hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(Host.c_str(), Port.c_str(), &Hints, &Result) != 0)
+    {
+      printf("Unable to resolve UDP destination: %s\n", Entry.c_str());
+      return false;
+    }
+    UdpDestinations.push_back(*(struct sockaddr_in*)Result->ai_addr);
+    freeaddrinfo(Result);
+    printf("Sending UDP to %s\n", Entry.c_str());
+
+    Start = End + 1;
+  }
+  return true;
+}
+
+static void PublishLoop(void)
+{
+  std::unique_lock<std::mutex> Lock(QueueLock);
+
+  while (!Shutdown || !SampleQueue.empty())
+  {
+    if (SampleQueue.empty())
+    {
+      QueueSignal.wait(Lock);
+      continue;
+    }
+    SolisSample_t Sample = SampleQueue.front();
+    SampleQueue.pop_front();
+
+    // don't hold the lock whilst doing the actual work so the
+    // bus threads are never held up by us
+    Lock.unlock();
+    SendSample(&Sample);
+    Lock.lock();
+  }
+}
+
+bool PublishInit(uint32_t BusCount)
+{
+  int EnBroadcast = 1 ;
+  int MulticastTtl = ConfigGetUint("udp_multicast_ttl", 1);
+
+  Buses = BusCount;
+  Sequences.assign(BusCount, 0u);
+  if (DeltaInit(BusCount))
+    printf("Only sending changes, with a full update every %us\n", ConfigGetUint("heartbeat_interval", 300));
+  UdpCompress = ConfigGetBool("udp_compress", false);
+
+  // setup broadcast socket for sending out the data to clients
+  sFd = socket(AF_INET,SOCK_DGRAM,0) ;
+  if ( sFd < 0 )
+  {
+    perror("socket") ;
+    return false ;
+  }
+  if ( setsockopt(sFd, SOL_SOCKET, SO_BROADCAST, (char*)&EnBroadcast, sizeof(EnBroadcast)) < 0 )
+  {
+    perror("setsockopt - broadcast") ;
+    closesocket(sFd);
+    return false ;
+  }
+  if ( setsockopt(sFd, IPPROTO_IP, IP_MULTICAST_TTL, (char*)&MulticastTtl, sizeof(MulticastTtl)) < 0 )
+    perror("setsockopt - multicast ttl") ;
+
+  // the ESP32 displays rely on the broadcast, so that's on unless explicitly disabled
+  if ( ConfigGetBool("udp_broadcast", true) )
+  {
+    struct sockaddr_in BroadcastAddr;
+
+    memset((void*)&BroadcastAddr, 0, sizeof(struct sockaddr_in));
+    BroadcastAddr.sin_family = AF_INET;
+    BroadcastAddr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    BroadcastAddr.sin_port = htons(BroadcastPort);
+    UdpDestinations.push_back(BroadcastAddr);
+  }
+  if ( !AddUdpDestinations(ConfigGetString("udp_destinations", "")) )
+  {
+    closesocket(sFd);
+    return false;
+  }
+
+  if ( !FanoutInit(ConfigGetUint("fanout_port", 0), ConfigGetString("fanout_socket", nullptr)) )
+  {
+    closesocket(sFd);
+    return false;
+  }
+
+  if ( !ShmInit(ConfigGetString("shm_name", nullptr), BusCount) )
+  {
+    closesocket(sFd);
+    return false;
+  }
+
+  if ( !MqttInit(BusCount) )
+  {
+    closesocket(sFd);
+    return false;
+  }
+
+  if ( !RecoveryInit(BusCount) )
+  {
+    closesocket(sFd);
+    return false;
+  }
+
+  Shutdown = false;
+  PublishThread = std::thread(PublishLoop);
+  return true;
+}
+
+void PublishSample(const SolisSample_t *Sample)
+{
+  {
+    std::lock_guard<std::mutex> Lock(QueueLock);
+
+    // if the publisher can't keep up, lose the oldest data rather than the newest
+    if (SampleQueue.size() >= MaxQueueDepth)
+    {
+      SampleQueue.pop_front();
+      Dropped++;
+      printf("Publish queue full, dropped %u samples so far\n", Dropped);
+    }
+    SampleQueue.push_back(*Sample);
+  }
+  QueueSignal.notify_one();
+}
+
+void PublishShutdown(void)
+{
+  {
+    std::lock_guard<std::mutex> Lock(QueueLock);
+    Shutdown = true;
+  }
+  QueueSignal.notify_one();
+  if (PublishThread.joinable())
+    PublishThread.join();
+  FanoutShutdown();
+  ShmShutdown();
+  MqttShutdown();
+  RecoveryShutdown();
+  if (sFd >= 0)
+    closesocket(sFd);
+  sFd = -1;
+}
@@ -0,0 +1,21 @@
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include "solis.h"
+
+//
+// Single output path shared by all the buses. Samples are queued by the
+// bus threads and sent out by a dedicated publisher thread so that a
+// slow/stuck bus can never hold up data from any of the others
+//
+
+// create the output sockets and start the publisher thread
+bool PublishInit(uint32_t BusCount);
+
+// queue a sample for publishing, never blocks
+void PublishSample(const SolisSample_t *Sample);
+
+// flush anything outstanding and stop the publisher thread
+void PublishShutdown(void);
+
+#endif
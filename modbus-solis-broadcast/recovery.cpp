@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "recovery.h"
+#include "config.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include "solis.h"
+
+typedef struct {
+  uint32_t Sequence;
+  std::string Payload;
+} RecoveryEntry_t;
+
+// a network requests are accepted from, both in host order
+typedef struct {
+  uint32_t Address;
+  uint32_t Mask;
+} RecoveryNet_t;
+
+// how much each requester has left to ask for, topped up over time
+typedef struct {
+  double Tokens;
+  std::chrono::steady_clock::time_point Updated;
+} RecoveryBucket_t;
+
+static std::vector<std::deque<RecoveryEntry_t>> History;  // per bus, oldest first
+static std::mutex HistoryLock;
+static std::thread RecoveryThread;
+static std::atomic<bool> Shutdown(false);
+static int Fd = -1;
+static size_t Depth = 256u;
+static uint32_t MaxResend = 64u;
+static uint32_t Requests = 0u;
+static uint32_t Resent = 0u;
+static uint32_t Refused = 0u;
+static std::vector<RecoveryNet_t> Allowed;
+static std::map<uint32_t, RecoveryBucket_t> Buckets;  // only touched by the recovery thread
+static uint32_t Rate = 256u;   // datagrams a minute per requester, also the most in one go
+
+// the replies are far bigger than the requests, so only answer those we know about
+// - anyone on a network we're on, unless given a list - else a spoofed source
+// address would have us sending them to whoever it named
+static bool SourceAllowed(uint32_t Address)
+{
+  for (auto &Net : Allowed)
+  {
+    if ((Address & Net.Mask) == (Net.Address & Net.Mask))
+      return true;
+  }
+  return false;
+}
+
+// take what's needed for a reply from the requester's allowance, false if there
+// isn't enough left
+static bool TakeTokens(uint32_t Address, uint32_t Count)
+{
+  auto Now = std::chrono::steady_clock::now();
+  auto Found = Buckets.find(Address);
+
+  if (Found == Buckets.end())
+  {
+    // forget about anyone who's been quiet long enough to be back to a full allowance
+    if (Buckets.size() >= 1024u)
+    {
+      for (auto Bucket = Buckets.begin(); Bucket != Buckets.end(); )
+      {
+        if (Now - Bucket->second.Updated >= std::chrono::minutes(1))
+          Bucket = Buckets.erase(Bucket);
+        else
+          ++Bucket;
+      }
+      if (Buckets.size() >= 1024u)
+        return false;
+    }
+    Found = Buckets.insert(std::make_pair(Address, RecoveryBucket_t{ (double)Rate, Now })).first;
+  }
+  else
+  {
+    double Seconds = std::chrono::duration<double>(Now - Found->second.Updated).count();
+
+    Found->second.Tokens = std::min((double)Rate, Found->second.Tokens + Seconds * Rate / 60.0);
+    Found->second.Updated = Now;
+  }
+  if (Found->second.Tokens < Count)
+    return false;
+  Found->second.Tokens -= Count;
+  return true;
+}
+
+// parse a comma separated list of addresses & networks (a.b.c.d[/bits])
+static bool ParseAllowed(const char *List)
+{
+  std::string Entries(List);
+  size_t Start = 0;
+
+  while (Start < Entries.size())
+  {
+    size_t End = Entries.find(',', Start);
+    if (End == std::string::npos)
+      End = Entries.size();
+
+    std::string Entry = Entries.substr(Start, End - Start);
+    size_t Slash = Entry.find('/');
+    unsigned long Bits = (Slash == std::string::npos) ? 32u : strtoul(Entry.c_str() + Slash + 1, NULL, 10);
+    struct in_addr Address;
+
+    if (inet_pton(AF_INET, Entry.substr(0, Slash).c_str(), &Address) != 1 || Bits > 32u)
+    {
+      printf("Recovery allow list should be addresses or networks, eg. 192.168.1.0/24: %s\n", Entry.c_str());
+      return false;
+    }
+    Allowed.push_back({ ntohl(Address.s_addr), Bits ? ~0u << (32u - Bits) : 0u });
+
+    Start = End + 1;
+  }
+  return true;
+}
+
+// each network we've an address on, along with loopback
+static bool AllowLocal(void)
+{
+  struct ifaddrs *Interfaces;
+
+  Allowed.push_back({ INADDR_LOOPBACK, 0xff000000u });
+  if (getifaddrs(&Interfaces) < 0)
+  {
+    perror("recovery getifaddrs");
+    return false;
+  }
+  for (struct ifaddrs *Interface = Interfaces; Interface; Interface = Interface->ifa_next)
+  {
+    if (!Interface->ifa_addr || !Interface->ifa_netmask || Interface->ifa_addr->sa_family != AF_INET)
+      continue;
+    Allowed.push_back({ ntohl(((struct sockaddr_in*)Interface->ifa_addr)->sin_addr.s_addr),
+                        ntohl(((struct sockaddr_in*)Interface->ifa_netmask)->sin_addr.s_addr) });
+  }
+  freeifaddrs(Interfaces);
+  return true;
+}
+
+// the unavailable report for part of a request
+static std::string Unavailable(uint32_t Bus, uint32_t First, uint32_t Last)
+{
+  char Report[96];
+
+  snprintf(Report, sizeof(Report), "{\"bus\":%u,\"unavailable\":[%u,%u]}", Bus, First, Last);
+  return Report;
+}
+
+// answer a single request
+static void HandleRequest(const char *Request, const struct sockaddr_in *From)
+{
+  std::vector<std::string> Replies;
+  std::vector<struct mmsghdr> Msgs;
+  std::vector<struct iovec> Iovs;
+  uint32_t Bus, First, Last;
+  uint32_t Oldest = 0, Newest = 0;
+  bool Empty = true;
+  size_t Sent = 0;
+
+  if (!SourceAllowed(ntohl(From->sin_addr.s_addr)))
+  {
+    Refused++;
+    if (Verbose)
+      printf("Ignoring recovery request from %s, not on the allow list\n", inet_ntoa(From->sin_addr));
+    return;
+  }
+  if (sscanf(Request, "resend %u %u %u", &Bus, &First, &Last) != 3 || Last < First)
+  {
+    if (Verbose)
+      printf("Ignoring recovery request from %s: %s\n", inet_ntoa(From->sin_addr), Request);
+    return;
+  }
+  Requests++;
+  if (Last - First >= MaxResend)
+    Last = First + MaxResend - 1u;
+
+  // copy out what we've got so the publisher isn't held up whilst we send
+  {
+    std::lock_guard<std::mutex> Lock(HistoryLock);
+
+    if (Bus < History.size() && !History[Bus].empty())
+    {
+      Empty = false;
+      Oldest = History[Bus].front().Sequence;
+      Newest = History[Bus].back().Sequence;
+      // sequence numbers are consecutive so it's a straight index into the history,
+      // only looking at the part of the request we actually hold
+      if (First <= Newest && Last >= Oldest)
+      {
+        uint32_t Start = std::max(First, Oldest) - Oldest;
+        uint32_t Count = std::min(Last, Newest) - Oldest - Start + 1u;
+
+        for (uint32_t i = 0; i < Count; i++)
+          Replies.push_back(History[Bus][Start + i].Payload);
+      }
+    }
+  }
+
+  // report whatever we don't have either side of what we do, or all of it if none
+  // of it overlaps
+  if (Empty || Last < Oldest || First > Newest)
+    Replies.push_back(Unavailable(Bus, First, Last));
+  else
+  {
+    if (First < Oldest)
+      Replies.push_back(Unavailable(Bus, First, Oldest - 1u));
+    if (Last > Newest)
+      Replies.push_back(Unavailable(Bus, Newest + 1u, Last));
+  }
+
+  if (!TakeTokens(ntohl(From->sin_addr.s_addr), Replies.size()))
+  {
+    Refused++;
+    if (Verbose)
+      printf("Ignoring recovery request from %s, asking for too much too often\n", inet_ntoa(From->sin_addr));
+    return;
+  }
+
+  Msgs.resize(Replies.size());
+  Iovs.resize(Replies.size());
+  memset(Msgs.data(), 0, Msgs.size() * sizeof(struct mmsghdr));
+  for (size_t i = 0; i < Replies.size(); i++)
+  {
+    Iovs[i].iov_base = (void*)Replies[i].data();
+    Iovs[i].iov_len = Replies[i].size();
+    Msgs[i].msg_hdr.msg_name = (void*)From;
+    Msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    Msgs[i].msg_hdr.msg_iov = &Iovs[i];
+    Msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  while (Sent < Msgs.size())
+  {
+    int Rc = sendmmsg(Fd, &Msgs[Sent], Msgs.size() - Sent, 0);
+    if (Rc < 0)
+    {
+      perror("recovery sendmmsg");
+      break;
+    }
+    Sent += Rc;
+  }
+  Resent += Sent;
+
+  if (Verbose)
+    printf("Recovery request from %s for bus %u, %u-%u: sent %u (%u requests, %u resent in total, %u refused)\n",
+           inet_ntoa(From->sin_addr), Bus, First, Last, (uint32_t)Sent, Requests, Resent, Refused);
+}
+
+static void RecoveryLoop(void)
+{
+  char Request[128];
+
+  while (!Shutdown)
+  {
+    // wake up once a second to check for shutdown
+    struct pollfd Pfd = { Fd, POLLIN, 0 };
+    struct sockaddr_in From;
+    socklen_t FromLen = sizeof(From);
+    int Rc = poll(&Pfd, 1, 1000);
+
+    if (Rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("recovery poll");
+      break;
+    }
+    if (!Rc)
+      continue;
+
+    Rc = recvfrom(Fd, Request, sizeof(Request) - 1u, 0, (struct sockaddr*)&From, &FromLen);
+    if (Rc < 0)
+    {
+      perror("recovery recvfrom");
+      continue;
+    }
+    Request[Rc] = '\0';
+    HandleRequest(Request, &From);
+  }
+}
+
+bool RecoveryInit(uint32_t BusCount)
+{
+  uint32_t Port = ConfigGetUint("recovery_port", 0);
+  const char *Allow = ConfigGetString("recovery_allow", "");
+  struct sockaddr_in Addr;
+
+  if (!Port)
+    return true;
+
+  Depth = ConfigGetUint("recovery_depth", 256);
+  MaxResend = ConfigGetUint("recovery_max_resend", 64);
+  if (MaxResend < 1u)
+  {
+    printf("recovery_max_resend needs to be at least 1\n");
+    return false;
+  }
+  Rate = std::max(ConfigGetUint("recovery_rate", 256), MaxResend + 2u);
+  History.resize(BusCount);
+
+  // who's allowed to ask
+  Allowed.clear();
+  if (*Allow ? !ParseAllowed(Allow) : !AllowLocal())
+    return false;
+
+  Fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (Fd < 0)
+  {
+    perror("recovery socket");
+    return false;
+  }
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sin_family = AF_INET;
+  Addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  Addr.sin_port = htons(Port);
+  if (bind(Fd, (struct sockaddr*)&Addr, sizeof(Addr)) < 0)
+  {
+    perror("recovery bind");
+    close(Fd);
+    Fd = -1;
+    return false;
+  }
+
+  printf("Gap recovery on UDP port %u, holding the last %u datagrams per bus, answering %s\n", Port,
+         (uint32_t)Depth, *Allow ? Allow : "the local networks");
+  Shutdown = false;
+  RecoveryThread = std::thread(RecoveryLoop);
+  return true;
+}
+
+void RecoveryAdd(uint32_t Bus, uint32_t Sequence, const char *Payload, size_t Len)
+{
+  std::lock_guard<std::mutex> Lock(HistoryLock);
+
+  if (Fd < 0 || Bus >= History.size())
+    return;
+
+  // should never happen, but the lookup relies on the numbers being consecutive
+  if (!History[Bus].empty() && Sequence != History[Bus].back().Sequence + 1u)
+    History[Bus].clear();
+
+  History[Bus].push_back(RecoveryEntry_t());
+  History[Bus].back().Sequence = Sequence;
+  History[Bus].back().Payload.assign(Payload, Len);
+  while (History[Bus].size() > Depth)
+    History[Bus].pop_front();
+}
+
+void RecoveryShutdown(void)
+{
+  if (Fd < 0)
+    return;
+  Shutdown = true;
+  if (RecoveryThread.joinable())
+    RecoveryThread.join();
+  close(Fd);
+  Fd = -1;
+}
+
+#else
+
+// not supported under Windows
+bool RecoveryInit(uint32_t BusCount)
+{
+  if (ConfigGetUint("recovery_port", 0))
+    printf("Gap recovery not supported on this platform\n");
+  return true;
+}
+
+void RecoveryAdd(uint32_t Bus, uint32_t Sequence, const char *Payload, size_t Len)
+{
+}
+
+void RecoveryShutdown(void)
+{
+}
+
+#endif
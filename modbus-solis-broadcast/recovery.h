@@ -0,0 +1,34 @@
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Gap recovery for the UDP stream. The most recent datagrams sent for each bus
+// are held in memory, keyed by their sequence number, so a receiver which has
+// missed some can ask for them again. Requests are a single unicast datagram to
+// the recovery port consisting of:
+//
+//   resend <bus> <first seq> <last seq>
+//
+// Each of the requested datagrams still held is sent back to the requester, exactly
+// as originally sent. If any of the range is no longer held, that's reported with
+// (once for each end, if it's missing both):
+//
+//   {"bus":<bus>,"unavailable":[<first seq>,<last seq>]}
+//
+// As the replies are far bigger than the request, only requesters on the local
+// networks (or the recovery_allow list) are answered, each limited to recovery_rate
+// datagrams a minute.
+//
+
+// start listening for requests, if enabled in the settings
+bool RecoveryInit(uint32_t BusCount);
+
+// remember a datagram as sent for a bus
+void RecoveryAdd(uint32_t Bus, uint32_t Sequence, const char *Payload, size_t Len);
+
+void RecoveryShutdown(void);
+
+#endif
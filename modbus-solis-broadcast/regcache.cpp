@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <boost/chrono/chrono.hpp>
+#include "regcache.h"
+
+static uint64_t NowMs(void)
+{
+  using namespace boost::chrono;
+  return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+// locate the entries for a range of registers, null if it's not (entirely) covered by the cache
+static RegCacheEntry_t *Lookup(RegCache_t *Cache, RegCacheType_t Type, uint16_t Address, uint16_t Count)
+{
+  RegCacheEntry_t *Entries = (Type == RegCacheInput) ? Cache->Input : Cache->Holding;
+  uint32_t Base = (Type == RegCacheInput) ? RegCacheInputBase : RegCacheHoldingBase;
+  uint32_t Size = (Type == RegCacheInput) ? RegCacheInputCount : RegCacheHoldingCount;
+
+  if (Address < Base || (uint32_t)Address + Count > Base + Size)
+    return nullptr;
+  return &Entries[Address - Base];
+}
+
+RegCache_t *RegCacheCreate(void)
+{
+  RegCache_t *Cache = new RegCache_t;
+
+  memset(Cache->Input, 0, sizeof(Cache->Input));
+  memset(Cache->Holding, 0, sizeof(Cache->Holding));
+  memset(&Cache->Stats, 0, sizeof(Cache->Stats));
+  return Cache;
+}
+
+void RegCacheDestroy(RegCache_t *Cache)
+{
+  delete Cache;
+}
+
+void RegCacheSetMaxAge(RegCache_t *Cache, RegCacheType_t Type, uint16_t Address, uint16_t Count, uint32_t MaxAge)
+{
+  std::lock_guard<std::mutex> Lock(Cache->Lock);
+  RegCacheEntry_t *Entries = Lookup(Cache, Type, Address, Count);
+
+  if (!Entries)
+  {
+    printf("Registers %u-%u are outside the cache\n", Address, Address + Count - 1u);
+    return;
+  }
+  for (uint16_t i = 0; i < Count; i++)
+    Entries[i].MaxAge = MaxAge;
+}
+
+int RegCacheRead(RegCache_t *Cache, RegCacheType_t Type, uint16_t Address, uint16_t Count, uint16_t *Dest,
+                 const RegCacheReader_t &Reader)
+{
+  using namespace boost::chrono;
+  RegCacheEntry_t *Entries;
+  uint64_t Now = NowMs();
+  int First = -1, Last = -1;
+  int Rc;
+
+  {
+    std::lock_guard<std::mutex> Lock(Cache->Lock);
+
+    Entries = Lookup(Cache, Type, Address, Count);
+    if (!Entries)
+      return Reader(Type, Address, Count, Dest);  // not something we cache
+
+    // work out which (if any) need refreshing - if the clock has gone backwards, that's all of them
+    for (int i = 0; i < Count; i++)
+    {
+      const RegCacheEntry_t *Entry = &Entries[i];
+
+      if (!Entry->Timestamp || Now < Entry->Timestamp || Now - Entry->Timestamp > Entry->MaxAge || !Entry->MaxAge)
+      {
+        if (First < 0)
+          First = i;
+        Last = i;
+      }
+      Dest[i] = Entry->Value;
+    }
+
+    if (First < 0)
+    {
+      Cache->Stats.Hits++;
+      if (Cache->Stats.Misses > Cache->Stats.BusFail)
+        Cache->Stats.SavedUs += Cache->Stats.BusTimeUs / (Cache->Stats.Misses - Cache->Stats.BusFail);
+      return Count;
+    }
+    Cache->Stats.Misses++;
+  }
+
+  // only the span covering the stale registers goes out on the bus, and without holding
+  // the lock so anyone else after the cached values isn't held up
+  steady_clock::time_point Start = steady_clock::now();
+  Rc = Reader(Type, Address + First, Last - First + 1, &Dest[First]);
+  uint64_t BusTimeUs = duration_cast<microseconds>(steady_clock::now() - Start).count();
+
+  int SavedErrno = errno;
+  std::lock_guard<std::mutex> Lock(Cache->Lock);
+
+  if (Rc != Last - First + 1)
+  {
+    Cache->Stats.BusFail++;
+    errno = SavedErrno;
+    return -1;
+  }
+  Cache->Stats.BusTimeUs += BusTimeUs;
+  Now = NowMs();
+  for (int i = First; i <= Last; i++)
+  {
+    Entries[i].Value = Dest[i];
+    Entries[i].Timestamp = Now;
+  }
+  return Count;
+}
+
+bool RegCacheLookup(RegCache_t *Cache, RegCacheType_t Type, uint16_t Address, uint16_t Count, uint16_t *Dest,
+                    uint16_t *Age)
+{
+  std::lock_guard<std::mutex> Lock(Cache->Lock);
+  const RegCacheEntry_t *Entries = Lookup(Cache, Type, Address, Count);
+  uint64_t Now = NowMs();
+
+  if (!Entries)
+    return false;
+  for (uint16_t i = 0; i < Count; i++)
+  {
+    Dest[i] = Entries[i].Value;
+    if (Age)
+    {
+      if (!Entries[i].Timestamp)
+        Age[i] = RegCacheNeverRead;
+      else if (Now <= Entries[i].Timestamp)
+        Age[i] = 0;
+      else
+      {
+        uint64_t Seconds = (Now - Entries[i].Timestamp) / 1000u;
+        Age[i] = Seconds < RegCacheNeverRead ? (uint16_t)Seconds : RegCacheNeverRead - 1u;
+      }
+    }
+  }
+  return true;
+}
+
+RegCacheStats_t RegCacheGetStats(RegCache_t *Cache)
+{
+  std::lock_guard<std::mutex> Lock(Cache->Lock);
+
+  return Cache->Stats;
+}
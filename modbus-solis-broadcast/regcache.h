@@ -0,0 +1,72 @@
+#ifndef REGCACHE_H
+#define REGCACHE_H
+
+#include <stdint.h>
+#include <mutex>
+#include <functional>
+
+//
+// Read-through cache of the inverter's registers, one per bus
+//
+// Each register remembers when it was last read from the bus along with how
+// old it's allowed to get, so slowly changing values (eg. the energy totals)
+// only cost bus time once they're due a refresh. Anything which hasn't been
+// given a maximum age is always read from the bus
+//
+
+typedef enum {
+  RegCacheInput,    // function 4
+  RegCacheHolding   // function 3
+} RegCacheType_t;
+
+// address ranges covered by the cache
+static const uint16_t RegCacheInputBase = 33000u;
+static const uint16_t RegCacheInputCount = 301u;    // 33000-33300
+static const uint16_t RegCacheHoldingBase = 43000u;
+static const uint16_t RegCacheHoldingCount = 301u;  // 43000-43300
+
+typedef struct {
+  uint16_t Value;
+  uint64_t Timestamp;  // unix time in milliseconds it was read from the bus, 0 if never
+  uint32_t MaxAge;     // milliseconds
+} RegCacheEntry_t;
+
+typedef struct {
+  uint32_t Hits;        // reads satisfied entirely from the cache
+  uint32_t Misses;      // reads which needed (at least some of) the registers from the bus
+  uint32_t BusFail;     // bus reads which failed
+  uint64_t BusTimeUs;   // time spent on successful bus reads
+  uint64_t SavedUs;     // estimate of the bus time saved by the hits
+} RegCacheStats_t;
+
+typedef struct {
+  std::mutex Lock;
+  RegCacheEntry_t Input[RegCacheInputCount];
+  RegCacheEntry_t Holding[RegCacheHoldingCount];
+  RegCacheStats_t Stats;
+} RegCache_t;
+
+// performs the actual bus read, returns the number of registers read or -1 on error
+typedef std::function<int(RegCacheType_t Type, uint16_t Address, uint16_t Count, uint16_t *Dest)> RegCacheReader_t;
+
+RegCache_t *RegCacheCreate(void);
+void RegCacheDestroy(RegCache_t *Cache);
+
+// set how long (in milliseconds) a range of registers can be served from the cache
+void RegCacheSetMaxAge(RegCache_t *Cache, RegCacheType_t Type, uint16_t Address, uint16_t Count, uint32_t MaxAge);
+
+// read a range of registers, any which are missing or too old are fetched via 'Reader'
+// in a single transaction. Returns the number of registers read or -1 on error
+int RegCacheRead(RegCache_t *Cache, RegCacheType_t Type, uint16_t Address, uint16_t Count, uint16_t *Dest,
+                 const RegCacheReader_t &Reader);
+
+// copy out a range of registers as they currently stand in the cache, without ever
+// touching the bus. 'Age' (optional) receives how long ago each was read in seconds,
+// or RegCacheNeverRead. Returns false if the range isn't covered by the cache
+static const uint16_t RegCacheNeverRead = 0xffffu;
+bool RegCacheLookup(RegCache_t *Cache, RegCacheType_t Type, uint16_t Address, uint16_t Count, uint16_t *Dest,
+                    uint16_t *Age);
+
+RegCacheStats_t RegCacheGetStats(RegCache_t *Cache);
+
+#endif
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+#include <chrono>
+#include <algorithm>
+#include <boost/chrono/chrono.hpp>
+#include "responder.h"
+
+#ifndef WIN32
+
+// how often (ms) the listener checks whether it's being shut down
+static const int ShutdownPoll = 100;
+
+static void ResponderLoop(Responder_t *Responder)
+{
+  using namespace boost::chrono;
+  uint8_t Buf[256];
+
+  while (!Responder->Shutdown)
+  {
+    struct pollfd Pfd = { Responder->Fd, POLLIN, 0 };
+    struct termios Termios;
+    int Rc = poll(&Pfd, 1, ShutdownPoll);
+
+    if (Rc < 0 && errno != EINTR)
+    {
+      perror("responder poll");
+      usleep(ShutdownPoll * 1000);
+      continue;
+    }
+    if (Rc <= 0)
+      continue;
+    if (Pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+    {
+      printf("%s: error on serial port\n", Responder->Device);
+      usleep(ShutdownPoll * 1000);
+      continue;
+    }
+
+    // if the port's been acquired, this waits till it's given back (by which time
+    // whatever was there has most likely been read by libmodbus)
+    std::lock_guard<std::mutex> Guard(Responder->Lock);
+
+    Rc = read(Responder->Fd, Buf, sizeof(Buf));
+    if (Rc < 0)
+    {
+      if (errno != EAGAIN && errno != EINTR)
+        perror("responder read");
+      continue;
+    }
+    if (!Rc)
+      continue;
+
+    // libmodbus sets the port up it's own way whilst it has it open
+    Responder->Marked = tcgetattr(Responder->Fd, &Termios) == 0 && (Termios.c_iflag & PARMRK);
+    if (Responder->Marked)
+      Rc = RtuSerialUnmark(&Responder->Unmark, Buf, Rc);
+    if (Rc > 0)
+      RtuParse(&Responder->Parser, Buf, Rc,
+               duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count());
+    Responder->Heard++;
+    Responder->Signal.notify_all();
+  }
+}
+
+Responder_t *ResponderCreate(const char *Device, const RtuLine_t *Line)
+{
+  Responder_t *Responder;
+  RtuSerialSetup_t Setup;
+  int Fd = open(Device, O_RDWR | O_NONBLOCK);
+
+  if (Fd < 0)
+  {
+    perror("Failed to open input");
+    return nullptr;
+  }
+  // raw mode at the configured speed, with received data reaching us as quickly as
+  // the adapter allows & errors marked rather than turned into NULs
+  if (!RtuSerialConfigure(Fd, Line))
+  {
+    close(Fd);
+    return nullptr;
+  }
+  RtuSerialTune(Fd, Device, &Setup);
+  RtuSerialPrintSetup(Device, &Setup, Line);
+
+  // an adapter with a latency timer may still be holding on to what it received
+  // before we turned it down, so let that arrive before flushing it away
+  if (Setup.LatencyBefore > 0)
+    usleep(Setup.LatencyBefore * 1000u + RtuLineFrameGap(Line));
+  tcflush(Fd, TCIOFLUSH);
+
+  Responder = new Responder_t;
+  Responder->Shutdown = false;
+  Responder->Device = Device;
+  Responder->Fd = Fd;
+  Responder->Marked = Setup.Marking;
+  RtuParserInit(&Responder->Parser, 1u, 247u, nullptr, nullptr);
+  // libmodbus can take the rest of a frame from under us, so a partial one followed by
+  // ~100 characters of nothing is dropped rather than hiding the next requests. As in
+  // the sniffer, not below the adapter's latency timer (or 16ms if it's not known)
+  RtuParserSetGap(&Responder->Parser,
+                  std::max(RtuLineChars(Line, 96u),
+                           Setup.LatencyAfter >= 0 ? Setup.LatencyAfter * 1000u + 4000u : 20000u));
+  memset(&Responder->Unmark, 0, sizeof(Responder->Unmark));
+  Responder->Counting = RtuSerialGetCounts(Fd, &Responder->CountsStart);
+  Responder->Heard = 0u;
+  return Responder;
+}
+
+void ResponderStart(Responder_t *Responder, RtuFrameHandler_t Handler, void *User)
+{
+  Responder->Parser.Handler = Handler;
+  Responder->Parser.User = User;
+  Responder->Thread = std::thread(ResponderLoop, Responder);
+}
+
+void ResponderDestroy(Responder_t *Responder)
+{
+  if (!Responder)
+    return;
+  Responder->Shutdown = true;
+  if (Responder->Thread.joinable())
+    Responder->Thread.join();
+  close(Responder->Fd);
+  delete Responder;
+}
+
+void ResponderLineErrors(Responder_t *Responder, RtuSerialCounts_t *Counts)
+{
+  RtuSerialCounts_t CountsEnd;
+
+  memset(Counts, 0, sizeof(*Counts));
+  if (Responder->Counting && RtuSerialGetCounts(Responder->Fd, &CountsEnd))
+  {
+    RtuSerialAddCounts(Counts, &Responder->CountsStart, &CountsEnd);
+    return;
+  }
+
+  std::lock_guard<std::mutex> Guard(Responder->Lock);
+  Counts->Frame = (uint32_t)Responder->Unmark.Errors;
+  Counts->Break = (uint32_t)Responder->Unmark.Breaks;
+}
+
+#else
+
+// there's no way of getting at the port whilst libmodbus has it open
+Responder_t *ResponderCreate(const char *Device, const RtuLine_t *Line)
+{
+  printf("%s: background responder not supported on Windows\n", Device);
+  return nullptr;
+}
+
+void ResponderDestroy(Responder_t *Responder)
+{
+}
+
+void ResponderStart(Responder_t *Responder, RtuFrameHandler_t Handler, void *User)
+{
+}
+
+void ResponderLineErrors(Responder_t *Responder, RtuSerialCounts_t *Counts)
+{
+  memset(Counts, 0, sizeof(*Counts));
+}
+
+#endif
+
+void ResponderAcquire(Responder_t *Responder)
+{
+  Responder->Lock.lock();
+}
+
+void ResponderRelease(Responder_t *Responder)
+{
+  Responder->Lock.unlock();
+}
+
+uint64_t ResponderHeard(Responder_t *Responder)
+{
+  std::lock_guard<std::mutex> Guard(Responder->Lock);
+  return Responder->Heard;
+}
+
+uint64_t ResponderWait(Responder_t *Responder, uint64_t Heard, uint32_t TimeoutMs)
+{
+  std::unique_lock<std::mutex> Guard(Responder->Lock);
+
+  Responder->Signal.wait_for(Guard, std::chrono::milliseconds(TimeoutMs),
+                             [&]{ return Responder->Heard != Heard; });
+  return Responder->Heard;
+}
+
+int ResponderFd(const Responder_t *Responder)
+{
+  return Responder->Fd;
+}
+
+bool ResponderMarked(const Responder_t *Responder)
+{
+  return Responder->Marked;
+}
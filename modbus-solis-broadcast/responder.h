@@ -0,0 +1,72 @@
+#ifndef RESPONDER_H
+#define RESPONDER_H
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include "modbus-rtu.h"
+#include "rtu-line.h"
+#include "rtu-serial.h"
+
+//
+// Background listener, one per bus. The logger polls slaves 2-10 as well as the
+// inverter & waits out it's full timeout (~3s) on each one that doesn't answer, so
+// they're answered on their behalf to keep it moving. Rather than that only
+// happening whilst we're syncing with the logger, the port is kept open & listened
+// to all the time - whilst we're polling the inverter, sleeping between polls and
+// through the logger's reset, when it goes round the slaves over & over for 15-30
+// minutes. Each frame is handed over as soon as it's complete, so the answer can
+// go out within the normal turnaround.
+//
+// Our own requests to the inverter (made by libmodbus, on it's own handle to the
+// port) take the port with ResponderAcquire for each transaction, which holds off
+// the listener until ResponderRelease. The handler is only ever called from the
+// listener's thread with the port held, so anything it shares with the bus thread
+// can be read safely by acquiring the port.
+//
+
+typedef struct {
+  std::mutex Lock;          // held by the listener whilst it reads & handles, or whoever's acquired the port
+  std::condition_variable Signal;
+  std::thread Thread;
+  std::atomic<bool> Shutdown;
+  const char *Device;
+  int Fd;
+  bool Marked;              // errors are marked, checked on each read as libmodbus changes the settings
+  RtuParser_t Parser;
+  RtuSerialUnmark_t Unmark;
+  bool Counting;            // the driver counts errors
+  RtuSerialCounts_t CountsStart;
+  uint64_t Heard;           // reads that returned something
+} Responder_t;
+
+// open & set up the port. Returns nullptr if it couldn't be opened (or on Windows,
+// where it's not supported)
+Responder_t *ResponderCreate(const char *Device, const RtuLine_t *Line);
+void ResponderDestroy(Responder_t *Responder);
+
+// start listening, each complete frame being passed to 'Handler'
+void ResponderStart(Responder_t *Responder, RtuFrameHandler_t Handler, void *User);
+
+// take the port from, and give it back to, the listener
+void ResponderAcquire(Responder_t *Responder);
+void ResponderRelease(Responder_t *Responder);
+
+// how many times something's been heard so far
+uint64_t ResponderHeard(Responder_t *Responder);
+
+// wait up to 'TimeoutMs' for something to be heard, beyond the 'Heard' count given.
+// Returns the new count, which is unchanged if it stayed quiet
+uint64_t ResponderWait(Responder_t *Responder, uint64_t Heard, uint32_t TimeoutMs);
+
+// the port, for the handler to answer on, & whether errors are being marked on it
+int ResponderFd(const Responder_t *Responder);
+bool ResponderMarked(const Responder_t *Responder);
+
+// errors on the line since it was opened, as counted by the driver or, if it
+// doesn't count them, as marked in what's been heard
+void ResponderLineErrors(Responder_t *Responder, RtuSerialCounts_t *Counts);
+
+#endif
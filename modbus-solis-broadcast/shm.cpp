@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <stddef.h>
+#include "shm.h"
+#include "solis-shm.h"
+
+// the registers are copied straight over, so the reader's copy of the layout has to match
+#define SHM_SAME_FIELD(Field) \
+  static_assert(offsetof(SolisShmRegisters_t, Field) == offsetof(ModbusSolisRegister_t, Field) && \
+                sizeof(SolisShmRegisters_t::Field) == sizeof(ModbusSolisRegister_t::Field), \
+                "solis-shm.h is out of step with ModbusSolisRegister_t: " #Field)
+
+static_assert(sizeof(SolisShmRegisters_t) == sizeof(ModbusSolisRegister_t),
+              "solis-shm.h is out of step with ModbusSolisRegister_t");
+SHM_SAME_FIELD(batteryCapacitySoc);
+SHM_SAME_FIELD(batteryPower);
+SHM_SAME_FIELD(pac);
+SHM_SAME_FIELD(psum);
+SHM_SAME_FIELD(familyLoadPower);
+SHM_SAME_FIELD(etoday);
+SHM_SAME_FIELD(batteryTotalChargeEnergy);
+SHM_SAME_FIELD(batteryTotalDischargeEnergy);
+SHM_SAME_FIELD(gridPurchasedTotalEnergy);
+SHM_SAME_FIELD(gridSellTotalEnergy);
+SHM_SAME_FIELD(eTotal);
+
+#ifndef WIN32
+
+static SolisShm_t *Shm = nullptr;
+static std::string ShmName;
+
+bool ShmInit(const char *Name, uint32_t BusCount)
+{
+  int Fd;
+  void *Addr;
+
+  if (!Name || !*Name)
+    return true;
+
+  if (BusCount > SOLIS_SHM_MAX_BUSES)
+  {
+    printf("Shared memory only supports %u buses, the rest won't be published\n", SOLIS_SHM_MAX_BUSES);
+    BusCount = SOLIS_SHM_MAX_BUSES;
+  }
+
+  Fd = shm_open(Name, O_RDWR | O_CREAT, 0644);
+  if (Fd < 0)
+  {
+    perror("shm_open");
+    return false;
+  }
+  if (ftruncate(Fd, sizeof(SolisShm_t)) < 0)
+  {
+    perror("ftruncate");
+    close(Fd);
+    return false;
+  }
+  Addr = mmap(NULL, sizeof(SolisShm_t), PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+  close(Fd);
+  if (Addr == MAP_FAILED)
+  {
+    perror("mmap");
+    return false;
+  }
+  Shm = (SolisShm_t*)Addr;
+  ShmName = Name;
+
+  // readers check the magic last, so fill everything else in first. The sequence
+  // numbers carry on from any previous run so a waiting reader isn't confused
+  Shm->Version = SOLIS_SHM_VERSION;
+  Shm->SlotSize = sizeof(SolisShmSlot_t);
+  Shm->BusCount = BusCount;
+  for (uint32_t i = 0; i < SOLIS_SHM_MAX_BUSES; i++)
+  {
+    SolisShmSlot_t *Slot = &Shm->Slot[i];
+    uint32_t Sequence = Slot->Sequence.load(std::memory_order_relaxed);
+
+    // if we died mid update, make it consistent again
+    if (Sequence & 1u)
+      Slot->Sequence.store(Sequence + 1u, std::memory_order_release);
+    Slot->BusIndex = i;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  Shm->Magic = SOLIS_SHM_MAGIC;
+
+  printf("Publishing to shared memory %s\n", Name);
+  return true;
+}
+
+void ShmPublish(const SolisSample_t *Sample, bool Stale)
+{
+  SolisShmSlot_t *Slot;
+  uint32_t Sequence;
+
+  if (!Shm || Sample->BusIndex >= Shm->BusCount)
+    return;
+  Slot = &Shm->Slot[Sample->BusIndex];
+
+  // odd sequence tells readers an update is in progress
+  Sequence = Slot->Sequence.load(std::memory_order_relaxed);
+  Slot->Sequence.store(Sequence + 1u, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  Slot->SampleCount++;
+  Slot->Timestamp = Sample->Timestamp;
+  Slot->LoggerFail = Sample->LoggerFail;
+  Slot->Stale = Stale ? 1u : 0u;
+  memcpy(&Slot->Registers, &Sample->Registers, sizeof(SolisShmRegisters_t));
+
+  Slot->Sequence.store(Sequence + 2u, std::memory_order_release);
+
+  // wake anyone blocked waiting for the next sample
+  syscall(SYS_futex, (uint32_t*)&Slot->Sequence, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+void ShmShutdown(void)
+{
+  // the segment is left in place so readers carry on seeing the last sample
+  if (Shm)
+    munmap(Shm, sizeof(SolisShm_t));
+  Shm = nullptr;
+}
+
+#else
+
+// not supported under Windows
+bool ShmInit(const char *Name, uint32_t BusCount)
+{
+  if (Name && *Name)
+    printf("Shared memory not supported on this platform\n");
+  return true;
+}
+
+void ShmPublish(const SolisSample_t *Sample, bool Stale)
+{
+}
+
+void ShmShutdown(void)
+{
+}
+
+#endif
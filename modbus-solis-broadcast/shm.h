@@ -0,0 +1,18 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include "solis.h"
+
+//
+// Writer side of the shared memory snapshot - see solis-shm.h for the layout and reader
+//
+
+// create (or re-use) the named segment, a null/empty name disables it
+bool ShmInit(const char *Name, uint32_t BusCount);
+
+// publish a sample into it's bus slot, must only ever be called from a single thread
+void ShmPublish(const SolisSample_t *Sample, bool Stale = false);
+
+void ShmShutdown(void);
+
+#endif
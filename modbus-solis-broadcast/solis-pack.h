@@ -0,0 +1,208 @@
+#ifndef SOLIS_PACK_H
+#define SOLIS_PACK_H
+
+//
+// Compact encoding of the JSON sent out over UDP, so more fields can be sent
+// without the datagram being fragmented (which the ESP32 IP stack can't cope with)
+//
+// It's a very simple LZ77 scheme where matches can also refer back into a static
+// dictionary, pre-loaded with a typical document. As almost all of the payload is
+// key names & units, which are in the dictionary, it typically shrinks to a fraction
+// of the original size. Decoding needs no memory other than the output buffer and
+// is just a byte copy loop, so it's cheap enough for the ESP32 (or similar) to do.
+//
+// Format:
+//   byte 0    SOLIS_PACK_MAGIC (never a valid first character for JSON)
+//   byte 1    dictionary version
+//   byte 2-3  length of the decoded document, big endian
+//   then a series of tokens, each starting with a control byte:
+//     0x00-0x7f  literal, followed by (control + 1) bytes to copy as is
+//     0x80-0xff  match, (control & 0x7f) + 3 bytes to copy from 'distance' bytes back,
+//                where the 2 byte big endian distance follows the control byte. The
+//                distance can reach back past the start of the output into the dictionary
+//
+// Example:
+//
+//   char Json[SOLIS_PACK_MAX_LENGTH + 1];
+//   int Len = SolisPackDecode(Datagram, DatagramLen, Json, sizeof(Json) - 1);
+//
+//   if (Len >= 0)
+//   {
+//     Json[Len] = '\0';
+//     ...
+//   }
+//   else if (Datagram[0] == '{')
+//     ... plain JSON
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#define SOLIS_PACK_MAGIC 0xd5u
+#define SOLIS_PACK_VERSION 1u
+#define SOLIS_PACK_HEADER 4u
+#define SOLIS_PACK_MIN_MATCH 3u
+#define SOLIS_PACK_MAX_MATCH (SOLIS_PACK_MIN_MATCH + 0x7fu)
+#define SOLIS_PACK_MAX_LITERAL 0x80u
+#define SOLIS_PACK_MAX_LENGTH 0xffffu
+
+// a representative (unformatted) document, as produced by modbus-solis-broadcast. Anything
+// in here costs 3 bytes to send, however long. Any change needs SOLIS_PACK_VERSION bumping
+// (as well as the copy in mqtt/solar_mqtt_publisher.py)
+static const char SolisPackDictionary[] =
+  "{\"code\":\"0\",\"data\":{\"storageBatteryCurrent\":1,\"dataTimestamp\":\"1700000000000\","
+  "\"eToday\":12.3,\"eTodayStr\":\"kWh\",\"eTotal\":12345,\"eTotalStr\":\"kWh\",\"pac\":1.234,"
+  "\"pacStr\":\"kW\",\"batteryCapacitySoc\":85,\"batteryPower\":-0.5,\"batteryPowerStr\":\"kW\","
+  "\"psum\":0.1,\"psumStr\":\"kW\",\"familyLoadPower\":0.5,\"familyLoadPowerStr\":\"kW\","
+  "\"batteryTotalChargeEnergy\":1234,\"batteryTotalChargeEnergyStr\":\"kWh\","
+  "\"batteryTotalDischargeEnergy\":1234,\"batteryTotalDischargeEnergyStr\":\"kWh\","
+  "\"gridPurchasedTotalEnergy\":1234,\"gridPurchasedTotalEnergyStr\":\"kWh\","
+  "\"gridSellTotalEnergy\":1234,\"gridSellTotalEnergyStr\":\"kWh\"},"
+  "\"msg\":\"success\",\"success\":true,\"loggerFail\":0,\"bus\":1,\"device\":\"/dev/ttyUSB0\"}";
+
+static const uint32_t SolisPackDictionaryLen = sizeof(SolisPackDictionary) - 1;
+
+// decode a packed datagram into 'Out', returns the length of the document or -1 if
+// it's not a packed datagram or is corrupt. The output isn't null terminated
+static inline int SolisPackDecode(const uint8_t *In, uint32_t InLen, char *Out, uint32_t OutSize)
+{
+  uint32_t Length, OutPos = 0, InPos = SOLIS_PACK_HEADER;
+
+  if (InLen < SOLIS_PACK_HEADER || In[0] != SOLIS_PACK_MAGIC || In[1] != SOLIS_PACK_VERSION)
+    return -1;
+  Length = ((uint32_t)In[2] << 8) | In[3];
+  if (Length > OutSize)
+    return -1;
+
+  while (OutPos < Length)
+  {
+    uint32_t Control, Count;
+
+    if (InPos >= InLen)
+      return -1;
+    Control = In[InPos++];
+    if (Control < 0x80u)
+    {
+      Count = Control + 1u;
+      if (InPos + Count > InLen || OutPos + Count > Length)
+        return -1;
+      memcpy(&Out[OutPos], &In[InPos], Count);
+      InPos += Count;
+      OutPos += Count;
+    }
+    else
+    {
+      uint32_t Distance;
+
+      if (InPos + 2u > InLen)
+        return -1;
+      Count = (Control & 0x7fu) + SOLIS_PACK_MIN_MATCH;
+      Distance = ((uint32_t)In[InPos] << 8) | In[InPos + 1];
+      InPos += 2u;
+      if (Distance == 0 || Distance > OutPos + SolisPackDictionaryLen || OutPos + Count > Length)
+        return -1;
+
+      // byte at a time as the source can overlap what's being written
+      while (Count--)
+      {
+        if (Distance > OutPos)
+          Out[OutPos] = SolisPackDictionary[SolisPackDictionaryLen - (Distance - OutPos)];
+        else
+          Out[OutPos] = Out[OutPos - Distance];
+        OutPos++;
+      }
+    }
+  }
+  return InPos == InLen ? (int)Length : -1;
+}
+
+// pack a document, returns false if it's too big
+static inline bool SolisPackEncode(const char *In, uint32_t InLen, std::vector<uint8_t> &Out)
+{
+  const uint32_t HashSize = 1024u, MaxChain = 64u, None = 0xffffffffu;
+  std::vector<uint8_t> Window(SolisPackDictionary, SolisPackDictionary + SolisPackDictionaryLen);
+  std::vector<uint32_t> Head(HashSize, None), Prev;
+  uint32_t Pos, End, Literals = 0;
+
+  if (InLen > SOLIS_PACK_MAX_LENGTH)
+    return false;
+
+  // the dictionary & input form a single search window
+  Window.insert(Window.end(), In, In + InLen);
+  End = (uint32_t)Window.size();
+  Prev.assign(End, None);
+  auto Hash = [&Window](uint32_t At) { return ((Window[At] << 6) ^ (Window[At + 1] << 3) ^ Window[At + 2]) & (HashSize - 1u); };
+  auto Insert = [&](uint32_t At) {
+    if (At + SOLIS_PACK_MIN_MATCH <= End)
+    {
+      uint32_t H = Hash(At);
+      Prev[At] = Head[H];
+      Head[H] = At;
+    }
+  };
+  // pending literals go out in runs of up to SOLIS_PACK_MAX_LITERAL
+  auto FlushLiterals = [&](uint32_t At) {
+    while (Literals)
+    {
+      uint32_t Count = Literals > SOLIS_PACK_MAX_LITERAL ? SOLIS_PACK_MAX_LITERAL : Literals;
+      Out.push_back((uint8_t)(Count - 1u));
+      Out.insert(Out.end(), Window.begin() + (At - Literals), Window.begin() + (At - Literals + Count));
+      Literals -= Count;
+    }
+  };
+
+  Out.clear();
+  Out.push_back(SOLIS_PACK_MAGIC);
+  Out.push_back(SOLIS_PACK_VERSION);
+  Out.push_back((uint8_t)(InLen >> 8));
+  Out.push_back((uint8_t)InLen);
+
+  for (Pos = 0; Pos < SolisPackDictionaryLen; Pos++)
+    Insert(Pos);
+
+  while (Pos < End)
+  {
+    uint32_t BestLen = 0, BestPos = 0, Chain = 0;
+
+    // greedy, take the longest match on offer
+    if (Pos + SOLIS_PACK_MIN_MATCH <= End)
+    {
+      for (uint32_t Candidate = Head[Hash(Pos)]; Candidate != None && Chain < MaxChain; Candidate = Prev[Candidate], Chain++)
+      {
+        uint32_t Len = 0;
+
+        while (Pos + Len < End && Len < SOLIS_PACK_MAX_MATCH && Window[Candidate + Len] == Window[Pos + Len])
+          Len++;
+        if (Len > BestLen)
+        {
+          BestLen = Len;
+          BestPos = Candidate;
+          if (Len == SOLIS_PACK_MAX_MATCH)
+            break;
+        }
+      }
+    }
+
+    if (BestLen >= SOLIS_PACK_MIN_MATCH && Pos - BestPos <= 0xffffu)
+    {
+      uint32_t Distance = Pos - BestPos;
+
+      FlushLiterals(Pos);
+      Out.push_back((uint8_t)(0x80u | (BestLen - SOLIS_PACK_MIN_MATCH)));
+      Out.push_back((uint8_t)(Distance >> 8));
+      Out.push_back((uint8_t)Distance);
+      while (BestLen--)
+        Insert(Pos++);
+    }
+    else
+    {
+      Insert(Pos++);
+      Literals++;
+    }
+  }
+  FlushLiterals(Pos);
+  return true;
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef SOLIS_SHM_H
+#define SOLIS_SHM_H
+
+//
+// Shared memory layout of the latest sample published by modbus-solis-broadcast,
+// along with a header only reader for use by other processes on the same machine
+//
+// Each bus has it's own slot, protected by a seqlock. The writer bumps the slot's
+// 'Sequence' to an odd value, updates the sample, then bumps it to the next even
+// value. A reader copies the sample out and retries if 'Sequence' was odd or changed
+// whilst it was copying, so never blocks the writer and needs no system calls.
+// 'Sequence' also doubles as a futex word so readers can sleep until the next update
+//
+// Example:
+//
+//   SolisShmReader_t Reader;
+//   SolisShmSnapshot_t Snapshot = {};
+//
+//   if (SolisShmOpen(&Reader, SOLIS_SHM_DEFAULT_NAME))
+//   {
+//     while (SolisShmWait(&Reader, 0, Snapshot.Sequence, -1) && SolisShmRead(&Reader, 0, &Snapshot))
+//       printf("%f kW\n", Snapshot.Registers.pac);
+//     SolisShmClose(&Reader);
+//   }
+//
+// Only needs the standard headers, so it can be copied out on it's own
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define SOLIS_SHM_DEFAULT_NAME "/modbus-solis-broadcast"
+#define SOLIS_SHM_MAGIC 0x534f4c53u  // 'SOLS'
+#define SOLIS_SHM_VERSION 1u
+#define SOLIS_SHM_MAX_BUSES 8u
+
+// the readings, laid out exactly as modbus-solis-broadcast holds them
+typedef struct {
+  uint16_t batteryCapacitySoc; // (%)
+  double   batteryPower; // (kW)
+  double   pac;    // generation (kW)
+  double   psum;   // grid in/out (kW)
+  double   familyLoadPower; // load (kW)
+  double   etoday;  // generation today (kWh)
+  uint32_t batteryTotalChargeEnergy; // battery total charge (kWh)
+  uint32_t batteryTotalDischargeEnergy;  // battery total discharge (kWh)
+  uint32_t gridPurchasedTotalEnergy; // grid imported total (kWh)
+  uint32_t gridSellTotalEnergy; // grid exported total (kWh)
+  uint32_t eTotal; // solar generation total (kWh)
+} SolisShmRegisters_t;
+
+typedef struct alignas(64) {
+  std::atomic<uint32_t> Sequence;  // seqlock & futex word, odd whilst an update is in progress
+  uint32_t BusIndex;
+  uint64_t SampleCount;             // number of samples published on this bus
+  uint64_t Timestamp;               // unix time in milliseconds at which the registers were read
+  uint32_t LoggerFail;
+  uint32_t Stale;                   // non zero if this isn't a freshly read sample
+  SolisShmRegisters_t Registers;
+} SolisShmSlot_t;
+
+typedef struct {
+  uint32_t Magic;
+  uint32_t Version;
+  uint32_t SlotSize;   // sizeof(SolisShmSlot_t), as a sanity check between reader & writer
+  uint32_t BusCount;
+  SolisShmSlot_t Slot[SOLIS_SHM_MAX_BUSES];
+} SolisShm_t;
+
+// consistent copy of a single slot
+typedef struct {
+  uint32_t Sequence;
+  uint64_t SampleCount;
+  uint64_t Timestamp;
+  uint32_t LoggerFail;
+  uint32_t Stale;
+  SolisShmRegisters_t Registers;
+} SolisShmSnapshot_t;
+
+typedef struct {
+  SolisShm_t *Shm;
+} SolisShmReader_t;
+
+#ifndef WIN32
+
+static inline bool SolisShmOpen(SolisShmReader_t *Reader, const char *Name)
+{
+  int Fd = shm_open(Name, O_RDONLY, 0);
+  void *Addr;
+
+  Reader->Shm = nullptr;
+  if (Fd < 0)
+    return false;
+  Addr = mmap(NULL, sizeof(SolisShm_t), PROT_READ, MAP_SHARED, Fd, 0);
+  close(Fd);
+  if (Addr == MAP_FAILED)
+    return false;
+
+  Reader->Shm = (SolisShm_t*)Addr;
+  if (Reader->Shm->Magic != SOLIS_SHM_MAGIC || Reader->Shm->Version != SOLIS_SHM_VERSION ||
+      Reader->Shm->SlotSize != sizeof(SolisShmSlot_t))
+  {
+    munmap(Addr, sizeof(SolisShm_t));
+    Reader->Shm = nullptr;
+    return false;
+  }
+  return true;
+}
+
+static inline void SolisShmClose(SolisShmReader_t *Reader)
+{
+  if (Reader->Shm)
+    munmap(Reader->Shm, sizeof(SolisShm_t));
+  Reader->Shm = nullptr;
+}
+
+// take a consistent copy of the latest sample for a bus, returns false if nothing
+// has been published on that bus yet
+static inline bool SolisShmRead(const SolisShmReader_t *Reader, uint32_t Bus, SolisShmSnapshot_t *Snapshot)
+{
+  const SolisShmSlot_t *Slot;
+  uint32_t Before, After;
+
+  if (Bus >= SOLIS_SHM_MAX_BUSES)
+    return false;
+  Slot = &Reader->Shm->Slot[Bus];
+
+  do
+  {
+    Before = Slot->Sequence.load(std::memory_order_acquire);
+    if (Before & 1u)
+      continue;  // writer is part way through, go round again
+    Snapshot->SampleCount = Slot->SampleCount;
+    Snapshot->Timestamp = Slot->Timestamp;
+    Snapshot->LoggerFail = Slot->LoggerFail;
+    Snapshot->Stale = Slot->Stale;
+    memcpy(&Snapshot->Registers, &Slot->Registers, sizeof(SolisShmRegisters_t));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    After = Slot->Sequence.load(std::memory_order_relaxed);
+  } while ((Before & 1u) || Before != After);
+
+  Snapshot->Sequence = Before;
+  return Snapshot->SampleCount != 0;
+}
+
+// block until the slot moves on from 'Sequence' (as returned in a previous snapshot),
+// or the timeout (in milliseconds, negative waits forever) expires. Returns true if there's
+// a new sample to read
+static inline bool SolisShmWait(const SolisShmReader_t *Reader, uint32_t Bus, uint32_t Sequence, int32_t TimeoutMs)
+{
+  const SolisShmSlot_t *Slot;
+  struct timespec TimeOut, *TimeOutPtr = nullptr;
+  uint32_t Current;
+
+  if (Bus >= SOLIS_SHM_MAX_BUSES)
+    return false;
+  Slot = &Reader->Shm->Slot[Bus];
+
+  if (TimeoutMs >= 0)
+  {
+    TimeOut.tv_sec = TimeoutMs / 1000;
+    TimeOut.tv_nsec = (TimeoutMs % 1000) * 1000000L;
+    TimeOutPtr = &TimeOut;
+  }
+
+  // wait whilst the sequence is unchanged or there's an update in progress
+  while ((Current = Slot->Sequence.load(std::memory_order_acquire)) == Sequence || (Current & 1u))
+  {
+    // not a private futex, the writer is in another process
+    if (syscall(SYS_futex, (uint32_t*)&Slot->Sequence, FUTEX_WAIT, Current, TimeOutPtr, NULL, 0) < 0 &&
+        errno == ETIMEDOUT)
+      return false;
+  }
+  return true;
+}
+
+#endif
+
+#endif
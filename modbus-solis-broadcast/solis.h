@@ -0,0 +1,109 @@
+#ifndef SOLIS_H
+#define SOLIS_H
+
+#include <stdint.h>
+#include "regcache.h"
+#include "pollrate.h"
+#include "carrier.h"
+#include "responder.h"
+
+//
+// Types shared between the various parts of modbus-solis-broadcast
+//
+
+// info we're interested in from the inverter - matches JSON names
+// used by the Solis API. Also published as is to shared memory, so any change
+// needs making to SolisShmRegisters_t in solis-shm.h too
+typedef struct {
+  uint16_t batteryCapacitySoc; // (%)
+  double   batteryPower; // (kW)
+  double   pac;    // generation (kW)
+  double   psum;   // grid in/out (kW)
+  double   familyLoadPower; // load (kW)
+  double   etoday;  // generation today (kWh)
+  uint32_t batteryTotalChargeEnergy; // battery total charge (kWh)
+  uint32_t batteryTotalDischargeEnergy;  // battery total discharge (kWh)
+  uint32_t gridPurchasedTotalEnergy; // grid imported total (kWh)
+  uint32_t gridSellTotalEnergy; // grid exported total (kWh)
+  uint32_t eTotal; // solar generation total (kWh)
+} ModbusSolisRegister_t;
+
+// individual fields within a sample, as a bitmask for when only some of them are to be sent
+enum {
+  SolisFieldBatteryCapacitySoc = 1u << 0,
+  SolisFieldBatteryPower = 1u << 1,
+  SolisFieldPac = 1u << 2,
+  SolisFieldPsum = 1u << 3,
+  SolisFieldFamilyLoadPower = 1u << 4,
+  SolisFieldEToday = 1u << 5,
+  SolisFieldBatteryTotalChargeEnergy = 1u << 6,
+  SolisFieldBatteryTotalDischargeEnergy = 1u << 7,
+  SolisFieldGridPurchasedTotalEnergy = 1u << 8,
+  SolisFieldGridSellTotalEnergy = 1u << 9,
+  SolisFieldETotal = 1u << 10,
+  SolisFieldLoggerFail = 1u << 11,
+  SolisFieldLineErrors = 1u << 12,
+  SolisFieldCollisions = 1u << 13,
+  SolisFieldAll = (1u << 14) - 1u
+};
+
+// errors on the serial line, as counted by the driver
+typedef struct {
+  uint32_t Frame;
+  uint32_t Overrun;
+  uint32_t Parity;
+  uint32_t Break;
+} SolisLineErrors_t;
+
+// how often our requests have run into the logger's, see carrier.h
+typedef struct {
+  uint32_t Deferrals;
+  uint32_t Collisions;
+  uint32_t Retries;
+  uint32_t GaveUp;
+  uint32_t EchoChecks;
+  uint32_t EchoCollisions;
+  uint32_t EchoMissing;
+} SolisCollisions_t;
+
+// per bus statistics, only ever updated by the thread servicing that bus
+typedef struct {
+  uint32_t LoggerFail;  // number of times we gave up waiting for logger traffic
+  uint32_t Syncs;       // number of logger cycles we've synced with
+  uint32_t PollOk;      // successful register reads
+  uint32_t PollFail;    // failed register reads
+  uint32_t GroupFail;   // register groups which couldn't be read, whether or not the poll failed
+  SolisLineErrors_t LineErrors;  // seen whilst listening to the logger
+} SolisBusStats_t;
+
+// everything needed to service a single RS485 bus, each of which
+// is driven by it's own thread
+typedef struct {
+  uint32_t Index;
+  const char *Device;
+  uint8_t SlaveId;
+  bool FirstRun;
+  bool LoggerReset;     // set by each sync if the logger looked to be coming out of reset
+  SolisBusStats_t Stats;
+  RegCache_t *Cache;
+  PollRate_t PollRate;
+  Carrier_t Carrier;    // listen before talk
+  Responder_t *Responder;  // answers the logger in the background, nullptr if it's not running
+} SolisBus_t;
+
+// a single set of readings taken from an inverter, as passed to the publisher
+typedef struct {
+  ModbusSolisRegister_t Registers;
+  uint32_t BusIndex;
+  const char *Device;
+  uint32_t LoggerFail;
+  SolisLineErrors_t LineErrors;
+  SolisCollisions_t Collisions;
+  uint64_t Timestamp;  // unix time in milliseconds at which the registers were read
+  uint32_t Sequence;   // per bus, assigned by the publisher to each document sent
+  bool Stale;          // restored from a previous run or served from the cache, rather than freshly read
+} SolisSample_t;
+
+extern bool Verbose;
+
+#endif
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <mutex>
+#include <boost/chrono/chrono.hpp>
+#include "state.h"
+#include "config.h"
+
+// what's saved for each bus
+typedef struct {
+  std::string Device;
+  uint64_t BurstEnd;      // unix time (ms) the last complete logger burst finished, 0 if none seen
+  uint32_t BurstLength;   // how long it lasted (ms), from the first traffic to the bus going idle
+  uint64_t LastReset;     // unix time (ms) the logger was last seen coming out of reset, 0 if never
+  bool SampleValid;
+  SolisSample_t Sample;
+} BusState_t;
+
+static std::vector<BusState_t> States;
+static std::mutex StateLock;
+static std::string Path;
+static uint64_t MaxAge = 900000u;
+static uint64_t SampleMaxAge = 3600000u;
+
+// the logger's daily reset upsets it's timing, so don't rely on the saved
+// cycle within this long (ms) either side of when it last happened
+static const uint64_t ResetWindow = 15u * 60u * 1000u;
+static const uint64_t Day = 24u * 60u * 60u * 1000u;
+// not worth resuming with less than this (ms) left before the logger's next due
+static const uint32_t ResumeThreshold = 10000u;
+
+static uint64_t Now(void)
+{
+  return boost::chrono::duration_cast<boost::chrono::milliseconds>(
+           boost::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static bool StateLoad(void)
+{
+  FILE *Fp = fopen(Path.c_str(), "r");
+  char Line[512];
+  uint32_t Restored = 0u;
+
+  if (!Fp)
+  {
+    // nothing saved yet
+    printf("No saved state in %s\n", Path.c_str());
+    return true;
+  }
+
+  while (fgets(Line, sizeof(Line), Fp))
+  {
+    char Device[256];
+    unsigned long long BurstEnd, LastReset, Timestamp;
+    uint32_t BurstLength, LoggerFail, Soc;
+    ModbusSolisRegister_t Regs;
+
+    if (Line[0] == '#')
+      continue;
+    if (sscanf(Line, "%255s %llu %u %llu %llu %u %u %lf %lf %lf %lf %lf %u %u %u %u %u", Device, &BurstEnd,
+               &BurstLength, &LastReset, &Timestamp, &LoggerFail, &Soc, &Regs.batteryPower, &Regs.pac, &Regs.psum,
+               &Regs.familyLoadPower, &Regs.etoday, &Regs.batteryTotalChargeEnergy, &Regs.batteryTotalDischargeEnergy,
+               &Regs.gridPurchasedTotalEnergy, &Regs.gridSellTotalEnergy, &Regs.eTotal) != 17)
+    {
+      printf("Ignoring malformed line in %s\n", Path.c_str());
+      continue;
+    }
+    Regs.batteryCapacitySoc = (uint16_t)Soc;
+
+    for (auto &State : States)
+    {
+      if (State.Device != Device)
+        continue;
+      State.BurstEnd = BurstEnd;
+      State.BurstLength = BurstLength;
+      State.LastReset = LastReset;
+      State.SampleValid = Timestamp != 0u;
+      State.Sample.Registers = Regs;
+      State.Sample.LoggerFail = LoggerFail;
+      State.Sample.Timestamp = Timestamp;
+      if (BurstEnd || Timestamp)
+        Restored++;
+    }
+  }
+  fclose(Fp);
+
+  printf("Restored saved state for %u bus(es) from %s\n", Restored, Path.c_str());
+  return true;
+}
+
+bool StateInit(const std::vector<SolisBus_t> &Buses)
+{
+  Path = ConfigGetString("state_file", "");
+  MaxAge = ConfigGetUint("state_max_age", 900) * 1000u;
+  SampleMaxAge = ConfigGetUint("state_sample_max_age", 3600) * 1000u;
+
+  States.resize(Buses.size());
+  for (size_t i = 0; i < Buses.size(); i++)
+  {
+    BusState_t *State = &States[i];
+
+    State->Device = Buses[i].Device;
+    State->BurstEnd = 0u;
+    State->BurstLength = 0u;
+    State->LastReset = 0u;
+    State->SampleValid = false;
+    memset(&State->Sample, 0, sizeof(State->Sample));
+    State->Sample.BusIndex = Buses[i].Index;
+    State->Sample.Device = Buses[i].Device;
+  }
+
+  if (Path.empty())
+    return true;
+  return StateLoad();
+}
+
+uint32_t StateResume(uint32_t Bus, uint32_t CycleTime)
+{
+  std::lock_guard<std::mutex> Lock(StateLock);
+  uint64_t Time = Now();
+  uint64_t Phase;
+  BusState_t *State;
+
+  if (Path.empty() || Bus >= States.size() || !States[Bus].BurstEnd || !CycleTime)
+    return 0u;
+  State = &States[Bus];
+
+  if (Time < State->BurstEnd || Time - State->BurstEnd > MaxAge)
+  {
+    if (Verbose)
+      printf("%s: saved logger timing too old to resume from\n", State->Device.c_str());
+    return 0u;
+  }
+  if (State->LastReset)
+  {
+    uint64_t SinceReset = (Time - State->LastReset) % Day;
+
+    if (SinceReset < ResetWindow || Day - SinceReset < ResetWindow)
+    {
+      if (Verbose)
+        printf("%s: logger reset is due, not resuming from saved timing\n", State->Device.c_str());
+      return 0u;
+    }
+  }
+
+  // where we are in the logger's cycle, which may be a few cycles on from the saved one
+  Phase = (Time - (State->BurstEnd - State->BurstLength)) % CycleTime;
+  if (Phase < State->BurstLength || CycleTime - Phase < ResumeThreshold)
+  {
+    if (Verbose)
+      printf("%s: logger is, or is about to be, busy - not resuming from saved timing\n", State->Device.c_str());
+    return 0u;
+  }
+  return (uint32_t)(CycleTime - Phase);
+}
+
+bool StateLastSample(uint32_t Bus, SolisSample_t *Sample)
+{
+  std::lock_guard<std::mutex> Lock(StateLock);
+  uint64_t Time = Now();
+
+  if (Path.empty() || Bus >= States.size() || !States[Bus].SampleValid)
+    return false;
+  if (Time < States[Bus].Sample.Timestamp || Time - States[Bus].Sample.Timestamp > SampleMaxAge)
+    return false;
+  *Sample = States[Bus].Sample;
+  return true;
+}
+
+void StateSetBurst(uint32_t Bus, uint32_t BurstLength, bool Reset)
+{
+  std::lock_guard<std::mutex> Lock(StateLock);
+
+  if (Bus >= States.size())
+    return;
+  States[Bus].BurstEnd = Now();
+  States[Bus].BurstLength = BurstLength;
+  if (Reset)
+    States[Bus].LastReset = States[Bus].BurstEnd;
+}
+
+void StateSetSample(const SolisSample_t *Sample)
+{
+  std::lock_guard<std::mutex> Lock(StateLock);
+
+  if (Sample->BusIndex >= States.size())
+    return;
+  States[Sample->BusIndex].Sample.Registers = Sample->Registers;
+  States[Sample->BusIndex].Sample.LoggerFail = Sample->LoggerFail;
+  States[Sample->BusIndex].Sample.Timestamp = Sample->Timestamp;
+  States[Sample->BusIndex].SampleValid = true;
+}
+
+void StateSave(void)
+{
+  std::lock_guard<std::mutex> Lock(StateLock);
+  std::string Temp = Path + ".tmp";
+  FILE *Fp;
+
+  if (Path.empty())
+    return;
+
+  // write it alongside & swap it in, so a crash part way through can't lose the lot
+  Fp = fopen(Temp.c_str(), "w");
+  if (!Fp)
+  {
+    perror("state file");
+    return;
+  }
+  fprintf(Fp, "# modbus-solis-broadcast saved state - device, burst end, burst length, last reset, sample\n");
+  for (auto &State : States)
+  {
+    const ModbusSolisRegister_t *Regs = &State.Sample.Registers;
+
+    fprintf(Fp, "%s %llu %u %llu %llu %u %u %.17g %.17g %.17g %.17g %.17g %u %u %u %u %u\n", State.Device.c_str(),
+            (unsigned long long)State.BurstEnd, State.BurstLength, (unsigned long long)State.LastReset,
+            State.SampleValid ? (unsigned long long)State.Sample.Timestamp : 0ull, State.Sample.LoggerFail,
+            Regs->batteryCapacitySoc, Regs->batteryPower, Regs->pac, Regs->psum, Regs->familyLoadPower, Regs->etoday,
+            Regs->batteryTotalChargeEnergy, Regs->batteryTotalDischargeEnergy, Regs->gridPurchasedTotalEnergy,
+            Regs->gridSellTotalEnergy, Regs->eTotal);
+  }
+  if (fclose(Fp) != 0)
+  {
+    perror("state file");
+    return;
+  }
+#ifdef WIN32
+  // rename won't replace an existing file
+  remove(Path.c_str());
+#endif
+  if (rename(Temp.c_str(), Path.c_str()) != 0)
+    perror("state file rename");
+}
@@ -0,0 +1,36 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <vector>
+#include "solis.h"
+
+//
+// Persisted state, so a restart doesn't have to sit and wait for the next logger
+// cycle (which can be up to 5 minutes) before the first poll. For each bus, the
+// timing of the last logger burst, when the logger was last seen coming out of
+// reset and the last sample read are saved to a small text file. On startup, if
+// these are recent enough, polling picks up straight away in the remainder of the
+// current cycle and the last sample is republished, flagged as stale
+//
+
+// read any saved state, matched to each bus by it's device
+bool StateInit(const std::vector<SolisBus_t> &Buses);
+
+// how long (ms) is left of the current polling window, going by the saved burst
+// timing, or 0 if there's not enough to go on and it should sync as normal
+uint32_t StateResume(uint32_t Bus, uint32_t CycleTime);
+
+// the last sample saved for a bus, if recent enough to be worth republishing
+bool StateLastSample(uint32_t Bus, SolisSample_t *Sample);
+
+// record a complete logger burst, finishing now, and whether it looked to be
+// coming out of reset
+void StateSetBurst(uint32_t Bus, uint32_t BurstLength, bool Reset);
+
+// record the latest sample read
+void StateSetSample(const SolisSample_t *Sample);
+
+// write it all out
+void StateSave(void);
+
+#endif
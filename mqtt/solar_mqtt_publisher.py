@@ -159,6 +159,39 @@ ha_logger_fails_discover = '''
 }
 '''
 
+# dictionary used by modbus-solis-broadcast when packing the UDP payload
+# (udp_compress=1), must match SolisPackDictionary in solis-pack.h
+solis_pack_dictionary = (
+    b'{"code":"0","data":{"storageBatteryCurrent":1,"dataTimestamp":"1700000000000",'
+    b'"eToday":12.3,"eTodayStr":"kWh","eTotal":12345,"eTotalStr":"kWh","pac":1.234,'
+    b'"pacStr":"kW","batteryCapacitySoc":85,"batteryPower":-0.5,"batteryPowerStr":"kW",'
+    b'"psum":0.1,"psumStr":"kW","familyLoadPower":0.5,"familyLoadPowerStr":"kW",'
+    b'"batteryTotalChargeEnergy":1234,"batteryTotalChargeEnergyStr":"kWh",'
+    b'"batteryTotalDischargeEnergy":1234,"batteryTotalDischargeEnergyStr":"kWh",'
+    b'"gridPurchasedTotalEnergy":1234,"gridPurchasedTotalEnergyStr":"kWh",'
+    b'"gridSellTotalEnergy":1234,"gridSellTotalEnergyStr":"kWh"},'
+    b'"msg":"success","success":true,"loggerFail":0,"bus":1,"device":"/dev/ttyUSB0"}')
+
+# unpack a datagram packed by modbus-solis-broadcast, anything else is passed back untouched
+def solis_unpack(data):
+    if len(data)<4 or data[0]!=0xd5 or data[1]!=1:
+        return data
+    length = (data[2]<<8) | data[3]
+    out = bytearray(solis_pack_dictionary)
+    pos = 4
+    while len(out)-len(solis_pack_dictionary) < length:
+        control = data[pos]
+        if control<0x80:
+            out += data[pos+1:pos+2+control]
+            pos += control+2
+        else:
+            distance = (data[pos+1]<<8) | data[pos+2]
+            pos += 3
+            # byte at a time as the source can overlap what's being written
+            for i in range((control & 0x7f)+3):
+                out.append(out[-distance])
+    return bytes(out[len(solis_pack_dictionary):])
+
 def convert_units(value,actual_units,required_units,as_string=True):
     if actual_units==required_units:
         if as_string:
@@ -219,6 +252,9 @@ solar_sfd = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
 listen_address = ('0.0.0.0',52005)
 solar_sfd.bind(listen_address)
 
+# set to modbus-solis-broadcast's recovery_port to have missed datagrams sent again (0 = don't)
+recovery_port = 0
+
 mqttc.loop_start()
 print("starting loop")
 
@@ -237,10 +273,16 @@ mqttc.publish("homeassistant/sensor/solar/gridSellTotalEnergy/config",ha_grid_se
 mqttc.publish("homeassistant/sensor/solar/solisLoggerFailureCount/config",ha_logger_fails_discover,retain=True)
 
 last_etotal = 0
+# latest full set of data from each bus, change only updates (flagged 'delta') are merged into it
+last_solar_data = {}
 last_batteryTotalChargeEnergy = 0
 last_batteryTotalDischargeEnergy = 0
 last_gridPurchasedTotalEnergy = 0
 last_gridSellTotalEnergy = 0
+# newest sequence number seen from each bus and, per bus, the one each reading was last updated by.
+# Each bus is numbered separately so they're never compared against each other
+last_seq = {}
+field_seq = {}
 
 while True:
     # wait for and fetch next solar UDP packet
@@ -250,7 +292,49 @@ while True:
     # Or from the Solis cloud which has more but is only updated every 5mins
     solar_data, address = solar_sfd.recvfrom(1500)
     try:
-        json_solar_data = json.loads(str(solar_data,encoding='utf-8'))
+        json_solar_data = json.loads(str(solis_unpack(solar_data),encoding='utf-8'))
+
+        # reply to a resend request for datagrams which are no longer held
+        if 'unavailable' in json_solar_data:
+            print("missed data unavailable:",json_solar_data)
+            continue
+
+        # modbus-solis-broadcast numbers each datagram, ask for any missed to be sent again.
+        # Those which come back are older than what's already been seen, so they only fill
+        # in readings which haven't been updated since
+        seq = json_solar_data.get('seq')
+        bus = json_solar_data.get('bus',0)
+        if seq!=None:
+            newest = last_seq.get(bus)
+            bus_field_seq = field_seq.setdefault(bus,{})
+            if newest!=None and seq>newest+1 and recovery_port!=0:
+                solar_sfd.sendto(bytes("resend %d %d %d" % (bus,newest+1,seq-1),'utf-8'),(address[0],recovery_port))
+            # it restarts from 1 should modbus-solis-broadcast be restarted
+            if newest!=None and seq<=newest and seq!=1:
+                if bus in last_solar_data:
+                    for key,value in json_solar_data['data'].items():
+                        if bus_field_seq.get(key,0)<seq:
+                            last_solar_data[bus]['data'][key] = value
+                            bus_field_seq[key] = seq
+                continue
+            last_seq[bus] = seq
+            for key in json_solar_data['data']:
+                bus_field_seq[key] = seq
+
+        # at startup, modbus-solis-broadcast republishes the last sample from it's previous run
+        # flagged as stale, HA would show it as current so wait for a fresh one
+        if json_solar_data.get('stale',False):
+            continue
+
+        # modbus-solis-broadcast can be set to only send what's changed, with a full
+        # update every so often. Until the first full update arrives, there's nothing to merge into
+        if json_solar_data.get('delta',False):
+            if bus not in last_solar_data:
+                continue
+            last_solar_data[bus]['data'].update(json_solar_data['data'])
+            json_solar_data['data'] = last_solar_data[bus]['data']
+        else:
+            last_solar_data[bus] = json_solar_data
 
         # this is ONLY in the data published locally and provides a counter
         # of how many times the modbus app detects that the logger has stopped issuing requests